@@ -127,16 +127,24 @@ typedef struct p9_qid {
 	uint64_t path; /*< Per-server-unique ID for a file system element */
 } p9_qid_t;
 
+struct p9_session;
+
 struct p9_fid {
 	struct p9_handle *p9_handle;
+	struct p9_session *session; /*< user the fid was walked for, NULL for the handle's */
 	uint32_t fid;
 	uint64_t offset;
 	char path[MAXPATHLEN];
 	int pathlen;
 	int openflags;
+	int ioclass;	/*< P9_IOCLASS_*, for reads and writes on the fid */
 	struct p9_qid qid;
 };
 
+/* p9_fid ioclass values */
+#define P9_IOCLASS_BULK 0	/**< default, reads and writes leave meta_reserve credits to other requests */
+#define P9_IOCLASS_META 1	/**< latency-sensitive, may use the reserve like metadata requests */
+
 /* Bit values for getattr valid field. */
 #define P9_GETATTR_MODE		0x00000001ULL
 #define P9_GETATTR_NLINK	0x00000002ULL
@@ -221,6 +229,40 @@ typedef int (*p9p_readdir_cb) (void *arg, struct p9_handle *p9_handle, struct p9
 #define P9_DEBUG_SEND  0x0010
 #define P9_DEBUG_RECV  0x0020
 
+/* stats are kept per 9P T-message type, index is type/2 */
+#define P9_STATS_OPS 64
+/* log-linear latency buckets: 8 per power of two, values are in ns */
+#define P9_STATS_SUB_BITS 3
+#define P9_STATS_BUCKETS 312
+
+/**
+ * \struct p9_op_stats
+ * counters and latency histogram of a single message type
+ */
+struct p9_op_stats {
+	uint64_t ops;		/**< replies received */
+	uint64_t errors;	/**< replies that were R(L)ERROR */
+	uint64_t retries;	/**< requests sent again after a reconnect */
+	uint64_t tx_bytes;
+	uint64_t rx_bytes;
+	uint64_t lat_sum;	/**< ns, from p9c_sendrequest to p9c_getreply */
+	uint64_t lat_min;
+	uint64_t lat_max;
+	uint64_t hist[P9_STATS_BUCKETS];
+};
+
+struct p9_stats {
+	struct p9_op_stats op[P9_STATS_OPS];
+	uint64_t cache_hits;	/**< blocks read from the cache */
+	uint64_t cache_misses;	/**< blocks the cache had to load */
+	uint64_t disk_hits;	/**< of these, blocks found in the disk cache */
+	uint64_t window;	/**< requests allowed in flight, recv_num unless window_min is set */
+	uint64_t throttled;	/**< requests held back by the rate limits */
+	uint64_t throttled_ns;	/**< time they spent waiting */
+	uint64_t spin_hits;	/**< replies getreply got by polling */
+	uint64_t spin_misses;	/**< polls that gave up and parked */
+};
+
 /**
  * \defgroup init init functions
  * @{
@@ -229,6 +271,85 @@ typedef int (*p9p_readdir_cb) (void *arg, struct p9_handle *p9_handle, struct p9
 int p9_init(struct p9_handle **pp9_handle, char *conf_file);
 void p9_destroy(struct p9_handle **pp9_handle);
 
+/**
+ * @brief attach another user over an existing handle
+ *
+ * The session shares the handle's connection, buffers and tags but has
+ * its own root fid and cwd; fids walked from these act as uid. Unless
+ * built with --enable-uid-override, only the effective uid is allowed.
+ *
+ * @param[in]     p9_handle:	connection handle
+ * @param[in]     uid:		user to attach as
+ * @param[out]    psession:	new session
+ * @return 0 on success, errno value on error
+ */
+int p9_session_attach(struct p9_handle *p9_handle, uint32_t uid, struct p9_session **psession);
+
+/**
+ * @brief clunk the session's root and cwd and free it
+ *
+ * Fids walked from the session must have been clunked already. Sessions
+ * still attached are detached by p9_destroy.
+ *
+ * @param[in,out] psession:	session to detach, set to NULL
+ */
+void p9_session_detach(struct p9_session **psession);
+
+
+/**
+ * @}
+ * @defgroup stats statistics functions
+ * @{
+ */
+
+/**
+ * @brief change the handle's rate limits
+ *
+ * Requests are let out in the order they were made, whichever thread
+ * they come from; time spent waiting shows in p9_stats.throttled_ns.
+ *
+ * @param[in]     p9_handle:	connection handle
+ * @param[in]     bytes_per_sec: bandwidth, read payloads included, 0 = unlimited
+ * @param[in]     ops_per_sec:	requests, 0 = unlimited
+ * @return 0 on success, errno value on error
+ */
+int p9_limit_set(struct p9_handle *p9_handle, uint64_t bytes_per_sec, uint64_t ops_per_sec);
+
+/**
+ * @brief copy the handle's statistics
+ *
+ * Counters are read while requests go on, so the copy is not an atomic snapshot.
+ *
+ * @param[in]     p9_handle:	connection handle
+ * @param[out]    stats:	filled with the counters since init or the last reset
+ * @return 0 on success, errno value on error
+ */
+int p9_stats_get(struct p9_handle *p9_handle, struct p9_stats *stats);
+
+/**
+ * @brief zero the handle's statistics
+ *
+ * @param[in]     p9_handle:	connection handle
+ */
+void p9_stats_reset(struct p9_handle *p9_handle);
+
+/**
+ * @brief name of a stats op index
+ *
+ * @param[in]     op:		index in p9_stats.op
+ * @return message name ("walk", "read"...), NULL if not a message the client sends
+ */
+const char *p9_stats_opname(int op);
+
+/**
+ * @brief latency percentile from an op's histogram
+ *
+ * @param[in]     op_stats:	stats of the op
+ * @param[in]     percentile:	0 to 100
+ * @return upper bound in ns of the bucket the percentile falls in, 0 if no op
+ */
+uint64_t p9_stats_percentile(struct p9_op_stats *op_stats, double percentile);
+
 
 /**
  * @}
@@ -264,6 +385,103 @@ int p9c_getbuffer(struct p9_handle *p9_handle, msk_data_t **pdata, uint16_t *pta
  */
 int p9c_sendrequest(struct p9_handle *p9_handle, msk_data_t *data, uint16_t tag);
 
+/**
+ * @brief Hold back the calling thread's requests to send them together
+ *
+ * Until the matching p9c_unplug, p9c_sendrequest queues the thread's
+ * requests on that handle and the transport gets them in batches (one
+ * sendmsg for tcp). The queue is also sent when it fills up and before
+ * the thread waits on a buffer, tag or reply. Plugs nest. Fibers have
+ * their own.
+ *
+ * @param[in]     p9_handle:	connection handle
+ * @return 0 on success, EBUSY if the thread has another handle plugged
+ */
+int p9c_plug(struct p9_handle *p9_handle);
+
+/**
+ * @brief Send what p9c_plug held back, once the outermost plug is undone
+ *
+ * @param[in]     p9_handle:	connection handle
+ * @return 0 on success, EINVAL if the handle wasn't plugged
+ */
+int p9c_unplug(struct p9_handle *p9_handle);
+
+/**
+ * @brief Get a file descriptor that polls readable when replies come in
+ *
+ * Only the tags handed to p9c_notify make it readable, internal and
+ * other threads' requests don't. Use p9c_reap to know which tags are
+ * done, their *_wait or p9c_getreply then won't block. Unplug before
+ * waiting on it. The fd belongs to the handle, don't close it.
+ *
+ * @param[in]     p9_handle:	connection handle
+ * @return the fd (linux eventfd) on success, -errno value on error
+ */
+int p9c_eventfd(struct p9_handle *p9_handle);
+
+/**
+ * @brief Have the event fd signal when the request on that tag is done
+ *
+ * Call it after sending, e.g. with the tag from p9p_read_send. A
+ * disconnect signals every such tag, waiting on them reconnects.
+ *
+ * @param[in]     p9_handle:	connection handle
+ * @param[in]     tag:		tag of a sent request
+ * @return 0 on success, EINVAL if p9c_eventfd wasn't called
+ */
+int p9c_notify(struct p9_handle *p9_handle, uint16_t tag);
+
+/**
+ * @brief Get the tags done since last time, never blocks
+ *
+ * @param[in]     p9_handle:	connection handle
+ * @param[out]    tags:		array filled with the done tags
+ * @param[in]     max:		size of the array, what doesn't fit stays readable
+ * @return number of tags filled in (0 if none), -errno value on error
+ */
+int p9c_reap(struct p9_handle *p9_handle, uint16_t *tags, int max);
+
+struct p9_fibers;
+
+/**
+ * @brief Start threads to run fibers on
+ *
+ * The blocking p9p_* and p9l_* calls made from a fiber switch to another
+ * fiber where they would wait, so many fibers can have requests out on
+ * a handle with only a few threads. A fiber can spawn others. Rate
+ * limits and reconnects still hold up the thread.
+ *
+ * @param[out]    pfibers:	scheduler
+ * @param[in]     thrnum:	number of threads running fibers
+ * @param[in]     stack_size:	per fiber stack, 0 for the default
+ * @return 0 on success, errno value on error
+ */
+int p9_fibers_init(struct p9_fibers **pfibers, int thrnum, size_t stack_size);
+
+/**
+ * @brief Run fn(arg) in a new fiber
+ *
+ * @param[in]     fibers:	scheduler
+ * @param[in]     fn:		fiber body, the fiber ends when it returns
+ * @param[in]     arg:		passed to fn
+ * @return 0 on success, errno value on error
+ */
+int p9_fiber_spawn(struct p9_fibers *fibers, void (*fn)(void *), void *arg);
+
+/**
+ * @brief Let other fibers run, no-op outside of a fiber
+ */
+void p9_fiber_yield(void);
+
+/**
+ * @brief Wait for all fibers to end, then stop the threads and free the scheduler
+ *
+ * @param[in,out] pfibers:	scheduler, set to NULL
+ * @return 0 on success, EDEADLK if called from a fiber
+ */
+int p9_fibers_join(struct p9_fibers **pfibers);
+
 /**
  * @brief Put the buffer back in the list of available buffers for use
  *
@@ -294,6 +512,20 @@ int p9c_getreply(struct p9_handle *p9_handle, msk_data_t **pdata, uint16_t tag);
  */
 int p9c_putreply(struct p9_handle *p9_handle, msk_data_t *data);
 
+/**
+ * @brief Let go of a reply's receive credit while keeping the buffer
+ *
+ * The pool's spare room (loan_spare) backs new requests in its place, so
+ * holding on to the reply no longer holds back other requests. It still
+ * has to be put back with p9c_putreply. Does nothing once the spares are
+ * all lent.
+ * p9pz_read and p9pz_readlink do it for their callers.
+ *
+ * @param[in]     p9_handle:	connection handle
+ * @param[in]     data:		buffer from p9c_getreply
+ */
+void p9c_lendreply(struct p9_handle *p9_handle, msk_data_t *data);
+
 /**
  * @brief Get a fid structure ready to be used
  *
@@ -431,7 +663,8 @@ static inline int p9pz_read_put(struct p9_handle *p9_handle, msk_data_t *data) {
 /**
  * @brief Read from a file.
  * Even if count is > msize, more won't be received
- *
+ * With tcp the payload is received straight into buf, without a copy
+ * or a msize buffer.
  *
  * size[4] Tread tag[2] fid[4] offset[8] count[4]
  * size[4] Rread tag[2] count[4] data[count]
@@ -888,9 +1121,39 @@ struct p9_fid *p9l_getcwd(struct p9_handle *p9_handle);
  */
 struct p9_fid *p9l_getroot(struct p9_handle *p9_handle);
 
+/**
+ * @brief session's cwd, to use as base fid
+ *
+ * @param[in] session: session from p9_session_attach
+ * @return cwd
+ */
+struct p9_fid *p9l_session_getcwd(struct p9_session *session);
+
+/**
+ * @brief session's root fid
+ *
+ * @param[in] session: session from p9_session_attach
+ * @return root fid
+ */
+struct p9_fid *p9l_session_getroot(struct p9_session *session);
+
+/**
+ * @brief change the session's cwd
+ *
+ * Resolved like p9l_cd, but against the session's own cwd and root.
+ *
+ * @param[in] session: session from p9_session_attach
+ * @param[in] path: new directory (relative from the session's cwd, absolute from its root)
+ * @return 0 on success, errno value on error.
+ */
+int p9l_session_cd(struct p9_session *session, char *path);
+
 /**
  * @brief pipeline - change the setting and get old one back
  *
+ * Capped at recv_num - meta_reserve, the most a single reader or writer
+ * can have in flight without waiting on its own replies.
+ *
  * @param[in] p9_handle: connection handle
  * @return cwd
  */
@@ -900,11 +1163,22 @@ uint32_t p9l_pipeline(struct p9_handle *p9_handle, uint32_t pipeline);
 /**
  * @brief clunk
  *
+ * With async_clunk the reply is not waited for, unless the fid was opened
+ * for writing; errors then show up in p9l_clunk_flush.
+ *
  * @param[in,out] pfid:		pointer to fid to clunk. will not clunk rootdir/cwd
  * @return 0 on success, errno value on error.
  */
 int p9l_clunk(struct p9_fid **pfid);
 
+/**
+ * @brief wait for the replies of the clunks deferred so far
+ *
+ * @param[in] p9_handle: connection handle
+ * @return 0 on success, first error of these clunks otherwise.
+ */
+int p9l_clunk_flush(struct p9_handle *p9_handle);
+
 /**
  * @brief walk that follows symlinks unless called with AT_SYMLINK_NOFOLLOW
  *
@@ -1140,6 +1414,40 @@ static inline ssize_t p9l_fxattrlist(struct p9_fid *fid, char *buf, size_t count
  */
 ssize_t p9l_fxattrset(struct p9_fid *fid, char *field, char *buf, size_t count, int flags);
 
+/**
+ * @brief one attribute of an xattrget batch
+ */
+struct p9_xattr {
+	char *name;	/**< attribute name, "" or NULL for the list */
+	char *buf;	/**< buffer where to store it, NUL-terminated as with p9l_fxattrget */
+	size_t count;	/**< buffer size */
+	ssize_t rc;	/**< out: attribute size, or -errno value */
+};
+
+/**
+ * @brief xattrget of several attributes by fid
+ *
+ * The xattrwalk, read and clunk messages of all attributes are pipelined
+ * instead of being done one attribute at a time.
+ *
+ * @param[in]     fid:		fid to use
+ * @param[in,out] attrs:	attributes to get, each gets its own result in rc
+ * @param[in]     n:		number of attributes
+ * @return 0 on success, -errno value on error.
+ */
+int p9l_fxattrget_batch(struct p9_fid *fid, struct p9_xattr *attrs, int n);
+
+/**
+ * @brief xattrget of several attributes by path
+ *
+ * @param[in]     cwd:		base fid for the walk
+ * @param[in]     path:		path of the file
+ * @param[in,out] attrs:	attributes to get, each gets its own result in rc
+ * @param[in]     n:		number of attributes
+ * @return 0 on success, -errno value on error.
+ */
+int p9l_xattrget_batch(struct p9_fid *cwd, char *path, struct p9_xattr *attrs, int n);
+
 
 /**
  * @brief chown by fid
@@ -1218,8 +1526,8 @@ static inline uint64_t p9l_ftell(struct p9_fid *fid) {
 
 /**
  * @brief write stuff!
- * If buffer is small it copies it, if it's big enough register memories and sends it zerocopy
- * It does the looping for you, so if return value < count we got a problem.
+ * Same as p9l_pwrite at fid's offset, which is then moved past what was written.
+ * Two threads must not use it on the same fid at once.
  *
  * @param[in]     fid:		fid to use
  * @param[in]     buffer:	buffer to send
@@ -1230,9 +1538,7 @@ ssize_t p9l_write(struct p9_fid *fid, char *buffer, size_t count);
 
 /**
  * @brief writev
- * iterates around write for each iov.
- * Someday might register small vectors together to have one bigger write,
- * but mem registration is expensive so might not be worth it.
+ * Same as p9l_pwritev at fid's offset, which is then moved past what was written.
  *
  * @param[in]     fid:		fid to use
  * @param[in]     iov:		iov array
@@ -1241,13 +1547,38 @@ ssize_t p9l_write(struct p9_fid *fid, char *buffer, size_t count);
  */
 ssize_t p9l_writev(struct p9_fid *fid, struct iovec *iov, int iovcnt);
 
+/**
+ * @brief write at a given offset
+ * If buffer is small it copies it, if it's big enough register memories and sends it zerocopy
+ * It does the looping for you, so if return value < count we got a problem.
+ * fid's offset is neither used nor changed, so threads can share a fid.
+ *
+ * @param[in]     fid:		fid to use
+ * @param[in]     buffer:	buffer to send
+ * @param[in]     count:	size of buffer
+ * @param[in]     offset:	where to write in the file
+ * @return size written on success, -errno value on error.
+ */
+ssize_t p9l_pwrite(struct p9_fid *fid, char *buffer, size_t count, uint64_t offset);
+
+/**
+ * @brief pwritev
+ * Up to pipeline writes are kept in flight across all the iovs, each iov
+ * being copied or registered as in p9l_pwrite.
+ * fid's offset is neither used nor changed.
+ *
+ * @param[in]     fid:		fid to use
+ * @param[in]     iov:		iov array
+ * @param[in]     iovcnt:	number of iovs
+ * @param[in]     offset:	where to write in the file
+ * @return size written on success, -errno value on error.
+ */
+ssize_t p9l_pwritev(struct p9_fid *fid, struct iovec *iov, int iovcnt, uint64_t offset);
+
 /**
  * @brief read stuff!
- * There is a copy anyway, unfortnately.
- * It does the looping for you, so if return value < count we got eof.
- * Might add a flag later to change that as it's not necessarily what we want
- * (e.g. stop as soon as p9p_read gives us less than the count we asked for)
- * Shouldn't change much given we only consider real files and not sockets/blocking stuff though.
+ * Same as p9l_pread at fid's offset, which is then moved past what was read.
+ * Two threads must not use it on the same fid at once.
  *
  * @param[in]     fid:		fid to use
  * @param[in]     buffer:	buffer to fill
@@ -1258,7 +1589,7 @@ ssize_t p9l_read(struct p9_fid *fid, char *buffer, size_t count);
 
 /**
  * @brief readv
- * just a loop around read really.
+ * Same as p9l_preadv at fid's offset, which is then moved past what was read.
  *
  * @param[in]     fid:		fid to use
  * @param[in]     iov:		iov array
@@ -1267,6 +1598,33 @@ ssize_t p9l_read(struct p9_fid *fid, char *buffer, size_t count);
  */
 ssize_t p9l_readv(struct p9_fid *fid, struct iovec *iov, int iovcnt);
 
+/**
+ * @brief read at a given offset
+ * The payload goes straight to buffer if the transport can, it's copied otherwise.
+ * It does the looping for you, so if return value < count we got eof.
+ * fid's offset is neither used nor changed, so threads can share a fid.
+ *
+ * @param[in]     fid:		fid to use
+ * @param[in]     buffer:	buffer to fill
+ * @param[in]     count:	size of buffer
+ * @param[in]     offset:	where to read in the file
+ * @return size read on success, -errno value on error.
+ */
+ssize_t p9l_pread(struct p9_fid *fid, char *buffer, size_t count, uint64_t offset);
+
+/**
+ * @brief preadv
+ * Up to pipeline reads are kept in flight across all the iovs.
+ * fid's offset is neither used nor changed.
+ *
+ * @param[in]     fid:		fid to use
+ * @param[in]     iov:		iov array
+ * @param[in]     iovcnt:	number of iovs
+ * @param[in]     offset:	where to read in the file
+ * @return size read on success, -errno value on error.
+ */
+ssize_t p9l_preadv(struct p9_fid *fid, struct iovec *iov, int iovcnt, uint64_t offset);
+
 
 /**
  * @}
@@ -1310,6 +1668,7 @@ int p9s_xwrite(struct p9_handle *p9_handle, char *arg);
 int p9s_rm(struct p9_handle *p9_handle, char *arg);
 int p9s_mv(struct p9_handle *p9_handle, char *arg);
 int p9s_ln(struct p9_handle *p9_handle, char *arg);
+int p9s_stats(struct p9_handle *p9_handle, char *arg);
 
 /**
  * @}
@@ -312,6 +312,44 @@ mode is file mode if created, umask is applied") open;
 	void fseek(struct p9_fid *fid, int64_t offset, int whence) {
 		errno = p9l_fseek(fid, offset, whence);
 	}
+%feature("docstring", "per message counters and latencies in ns, since init or the last stats_reset") stats;
+	PyObject *stats() {
+		struct p9_stats *stats = malloc(sizeof(struct p9_stats));
+		struct p9_op_stats *op;
+		PyObject *ret, *val;
+		int i;
+
+		if (stats == NULL) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		errno = p9_stats_get($self, stats);
+		if (errno) {
+			free(stats);
+			return NULL;
+		}
+
+		ret = PyDict_New();
+		for (i = 0; i < P9_STATS_OPS; i++) {
+			op = &stats->op[i];
+			if (op->ops == 0 && op->retries == 0)
+				continue;
+			val = Py_BuildValue("{sKsKsKsKsKsKsKsKsKsKsKsK}",
+				"ops", op->ops, "errors", op->errors, "retries", op->retries,
+				"tx_bytes", op->tx_bytes, "rx_bytes", op->rx_bytes,
+				"lat_min", op->lat_min, "lat_avg", op->ops ? op->lat_sum / op->ops : 0, "lat_max", op->lat_max,
+				"p50", p9_stats_percentile(op, 50), "p90", p9_stats_percentile(op, 90),
+				"p99", p9_stats_percentile(op, 99), "p999", p9_stats_percentile(op, 99.9));
+			PyDict_SetItemString(ret, p9_stats_opname(i) ? p9_stats_opname(i) : "unknown", val);
+			Py_DECREF(val);
+		}
+		free(stats);
+		return ret;
+	}
+%feature("docstring", "zero the counters returned by stats") stats_reset;
+	void stats_reset() {
+		p9_stats_reset($self);
+	}
 	PyObject *readlink(char *path, int size = 100) {
 		ssize_t rc;
 		char *buf = malloc(size);
@@ -0,0 +1,331 @@
+/*
+ * Copyright CEA/DAM/DIF (2013)
+ * Contributor: Dominique Martinet <dominique.martinet@cea.fr>
+ *
+ * This file is part of the space9 9P userspace library.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with space9.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/param.h>	// MIN/MAX
+#include <time.h>
+#include "9p_internals.h"
+#include "utils.h"
+#include "settings.h"
+
+/* from linux/mempolicy.h, numaif.h might not be there */
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+#define P9_HUGEPAGE_SIZE (2*1024*1024)
+#define P9_MAX_NUMA_NODES 1024
+
+static int p9_buf_local_node(void) {
+#ifdef SYS_getcpu
+	unsigned cpu, node;
+
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+		return node;
+#endif
+	return -1;
+}
+
+static void p9_buf_bind(struct p9_handle *p9_handle, void *buf, size_t size) {
+#ifdef SYS_mbind
+	unsigned long nodemask[P9_MAX_NUMA_NODES / (8*sizeof(unsigned long))];
+	int node;
+
+	node = p9_handle->numa_node;
+	if (node == P9_NUMA_LOCAL)
+		node = p9_buf_local_node();
+	if (node < 0 || node >= P9_MAX_NUMA_NODES)
+		return;
+
+	memset(nodemask, 0, sizeof(nodemask));
+	nodemask[node / (8*sizeof(unsigned long))] = 1UL << (node % (8*sizeof(unsigned long)));
+
+	if (syscall(SYS_mbind, buf, size, MPOL_PREFERRED, nodemask, P9_MAX_NUMA_NODES, 0)) {
+		INFO_LOG(p9_handle->debug & P9_DEBUG_SETUP, "mbind to node %d failed: %s (%d)", node, strerror(errno), errno);
+	} else {
+		INFO_LOG(p9_handle->debug & P9_DEBUG_SETUP, "buffers bound to numa node %d", node);
+	}
+#endif
+}
+
+/**
+ * @brief allocate network buffers
+ *
+ * Buffers come straight from mmap, backed by huge pages if asked to,
+ * preferably on the configured numa node and touched once so the first
+ * requests don't pay for the page faults.
+ *
+ * @param[in]     p9_handle:	connection handle, for settings
+ * @param[in,out] psize:	size wanted, rounded up to what has actually been mapped
+ * @return buffer or NULL on error
+ */
+void *p9_buf_alloc(struct p9_handle *p9_handle, size_t *psize) {
+	size_t size, pagesize, i;
+	uint8_t *buf = MAP_FAILED;
+
+	pagesize = sysconf(_SC_PAGESIZE);
+
+#ifdef MAP_HUGETLB
+	if (p9_handle->hugepages == P9_HUGEPAGES_HUGETLB && *psize >= P9_HUGEPAGE_SIZE) {
+		size = (*psize + P9_HUGEPAGE_SIZE - 1) & ~(size_t)(P9_HUGEPAGE_SIZE - 1);
+		buf = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+		if (buf == MAP_FAILED) {
+			INFO_LOG(p9_handle->debug & P9_DEBUG_SETUP, "MAP_HUGETLB failed: %s (%d), falling back to transparent huge pages", strerror(errno), errno);
+		}
+	}
+#endif
+
+	if (buf == MAP_FAILED) {
+		/* a partial huge page would only be wasted memory */
+		if (p9_handle->hugepages != P9_HUGEPAGES_NONE && *psize >= P9_HUGEPAGE_SIZE)
+			size = (*psize + P9_HUGEPAGE_SIZE - 1) & ~(size_t)(P9_HUGEPAGE_SIZE - 1);
+		else
+			size = (*psize + pagesize - 1) & ~(pagesize - 1);
+		buf = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (buf == MAP_FAILED) {
+			ERROR_LOG("Could not map %zu bytes: %s (%d)", size, strerror(errno), errno);
+			return NULL;
+		}
+#ifdef MADV_HUGEPAGE
+		if (p9_handle->hugepages != P9_HUGEPAGES_NONE && size >= P9_HUGEPAGE_SIZE)
+			madvise(buf, size, MADV_HUGEPAGE);
+#endif
+	}
+
+	p9_buf_bind(p9_handle, buf, size);
+
+	if (p9_handle->prefault) {
+		for (i = 0; i < size; i += pagesize)
+			buf[i] = 0;
+	}
+
+	*psize = size;
+	return buf;
+}
+
+void p9_buf_free(void *buf, size_t size) {
+	if (buf)
+		munmap(buf, size);
+}
+
+/**
+ * @brief setup an empty pool
+ *
+ * Slabs are sized to fill a huge page, so small buffers get allocated many
+ * at a time and large ones one or two at a time.
+ *
+ * @param[in]  p9_handle:	connection handle
+ * @param[out] pool:		pool to init
+ * @param[in]  bufsize:	size of each buffer
+ * @param[in]  max:		max number of buffers, can be 0 for a disabled class
+ * @param[in]  send:		send pools track free slots in a bitmap, receive pools per buffer state
+ * @return 0 on success, errno value on error
+ */
+int p9_pool_init(struct p9_handle *p9_handle, struct p9_pool *pool, uint32_t bufsize, uint32_t max, int send) {
+	uint32_t i;
+
+	memset(pool, 0, sizeof(struct p9_pool));
+	pool->bufsize = bufsize;
+	pool->max = max;
+	pool->window = time(NULL);
+
+	if (max == 0)
+		return 0;
+
+	pool->per_slab = MAX(1, MIN(max, P9_HUGEPAGE_SIZE / bufsize));
+	pool->target = max;
+
+	pool->data = calloc(max, sizeof(msk_data_t));
+	pool->slabs = calloc((max + pool->per_slab - 1) / pool->per_slab, sizeof(struct p9_slab));
+	if (send)
+		pool->bitmap = bitmap_init(max);
+	else
+		pool->state = calloc(max, sizeof(uint8_t));
+
+	if (pool->data == NULL || pool->slabs == NULL || (send ? pool->bitmap == NULL : pool->state == NULL)) {
+		p9_pool_destroy(p9_handle, pool);
+		return ENOMEM;
+	}
+
+	/* nothing is backed yet, keep it all out of reach */
+	if (send)
+		for (i = 0; i < max; i++)
+			set_bit(pool->bitmap, i);
+
+	return 0;
+}
+
+void p9_pool_destroy(struct p9_handle *p9_handle, struct p9_pool *pool) {
+	while (pool->count > 0)
+		p9_pool_shrink(p9_handle, pool);
+
+	free(pool->data);
+	free(pool->slabs);
+	free(pool->state);
+	bitmap_destroy(&pool->bitmap);
+	memset(pool, 0, sizeof(struct p9_pool));
+}
+
+/**
+ * @brief back one more slab
+ *
+ * The new buffers are registered if there is a transport, but not posted.
+ * Send pools slots are made available.
+ *
+ * @return 0 on success, errno value on error
+ */
+int p9_pool_grow(struct p9_handle *p9_handle, struct p9_pool *pool) {
+	struct p9_slab *slab;
+	uint32_t i, n;
+
+	if (pool->count >= pool->max)
+		return ENOSPC;
+
+	slab = &pool->slabs[pool->count / pool->per_slab];
+	n = MIN(pool->per_slab, pool->max - pool->count);
+
+	slab->size = (size_t)n * pool->bufsize;
+	slab->buf = p9_buf_alloc(p9_handle, &slab->size);
+	if (slab->buf == NULL)
+		return ENOMEM;
+
+	slab->mr = NULL;
+	if (p9_handle->trans) {
+		slab->mr = p9_handle->net_ops->reg_mr(p9_handle->trans, slab->buf, slab->size, IBV_ACCESS_LOCAL_WRITE);
+#if HAVE_MOOSHIKA
+		if (slab->mr == NULL) {
+			ERROR_LOG("Could not register memory buffer");
+			p9_buf_free(slab->buf, slab->size);
+			slab->buf = NULL;
+			return EIO;
+		}
+#endif
+	}
+
+	for (i = 0; i < n; i++) {
+		pool->data[pool->count + i].data = slab->buf + (size_t)i * pool->bufsize;
+		pool->data[pool->count + i].max_size = pool->bufsize;
+		pool->data[pool->count + i].size = 0;
+		pool->data[pool->count + i].next = NULL;
+		pool->data[pool->count + i].mr = slab->mr;
+		if (pool->state)
+			pool->state[pool->count + i] = P9_BUF_FREE;
+		if (pool->bitmap)
+			clear_bit(pool->bitmap, pool->count + i);
+	}
+	pool->count += n;
+
+	INFO_LOG(p9_handle->debug & P9_DEBUG_SETUP, "pool of %u bytes buffers grown to %u", pool->bufsize, pool->count);
+
+	return 0;
+}
+
+/**
+ * @brief release the last slab
+ *
+ * Caller must make sure none of its buffers is in use or posted.
+ */
+void p9_pool_shrink(struct p9_handle *p9_handle, struct p9_pool *pool) {
+	struct p9_slab *slab;
+	uint32_t i, start;
+
+	if (pool->count == 0)
+		return;
+
+	start = p9_pool_last_slab(pool);
+	slab = &pool->slabs[start / pool->per_slab];
+
+	if (slab->mr)
+		p9_handle->net_ops->dereg_mr(slab->mr);
+	p9_buf_free(slab->buf, slab->size);
+	memset(slab, 0, sizeof(struct p9_slab));
+
+	for (i = start; i < pool->count; i++) {
+		memset(&pool->data[i], 0, sizeof(msk_data_t));
+		if (pool->bitmap)
+			set_bit(pool->bitmap, i);
+	}
+	pool->count = start;
+
+	INFO_LOG(p9_handle->debug & P9_DEBUG_SETUP, "pool of %u bytes buffers shrunk to %u", pool->bufsize, pool->count);
+}
+
+/**
+ * @brief (re-)register all backed slabs with the current transport
+ */
+void p9_pool_reg_mr(struct p9_handle *p9_handle, struct p9_pool *pool) {
+	struct p9_slab *slab;
+	uint32_t i;
+
+	for (i = 0; i < pool->count; i++) {
+		slab = &pool->slabs[i / pool->per_slab];
+		if (i % pool->per_slab == 0)
+			slab->mr = p9_handle->net_ops->reg_mr(p9_handle->trans, slab->buf, slab->size, IBV_ACCESS_LOCAL_WRITE);
+		pool->data[i].mr = slab->mr;
+	}
+}
+
+void p9_pool_dereg_mr(struct p9_handle *p9_handle, struct p9_pool *pool) {
+	uint32_t i;
+
+	for (i = 0; i < pool->count; i += pool->per_slab) {
+		if (pool->slabs[i / pool->per_slab].mr) {
+			p9_handle->net_ops->dereg_mr(pool->slabs[i / pool->per_slab].mr);
+			pool->slabs[i / pool->per_slab].mr = NULL;
+		}
+	}
+}
+
+/**
+ * @brief idle tracking
+ *
+ * Every buf_idle seconds the pool's target becomes what the busiest moment
+ * of the elapsed window needed, rounded to whole slabs.
+ *
+ * @return 1 if the pool has more buffers than its target, 0 otherwise
+ */
+int p9_pool_idle(struct p9_handle *p9_handle, struct p9_pool *pool) {
+	time_t now;
+
+	if (p9_handle->buf_idle == 0 || pool->count <= pool->per_slab)
+		return 0;
+
+	now = time(NULL);
+	if (now - pool->window >= p9_handle->buf_idle) {
+		pool->target = MAX(pool->peak, 1);
+		pool->target = ((pool->target + pool->per_slab - 1) / pool->per_slab) * pool->per_slab;
+		pool->peak = pool->inuse;
+		pool->window = now;
+	}
+
+	return pool->target < pool->count;
+}
@@ -0,0 +1,383 @@
+/*
+ * Copyright CEA/DAM/DIF (2013)
+ * Contributor: Dominique Martinet <dominique.martinet@cea.fr>
+ *
+ * This file is part of the space9 9P userspace library.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with space9.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+/**
+ * \file	9p_cache.c
+ * \brief	client side block cache
+ *
+ * File data read through the libc functions is kept in fixed size blocks
+ * keyed on the file's qid path and block index, shared by every fid of
+ * the handle. The memory budget sets the number of blocks; once they are
+ * all in use, CLOCK picks the one to recycle. Files are checked against
+ * their qid version, mtime and size when opened, and whatever is cached
+ * for them goes away if any of these changed. Writes through the handle
+ * drop the blocks they touch.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>	//malloc
+#include <string.h>	//memset
+#include <inttypes.h>	//uint*_t
+#include <errno.h>	//ENOMEM
+#include <pthread.h>	//pthread_*
+
+#include "9p_internals.h"
+#include "utils.h"
+
+struct p9_cache_file {
+	uint64_t path;
+	uint32_t version;
+	uint64_t mtime;
+	uint64_t size;
+	uint64_t eof_index;	/**< block cached short because of end of file, UINT64_MAX if none */
+	struct p9_cache_file *next;
+};
+
+struct p9_cache {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;		/**< a load ended or a block got released */
+	struct p9_waitq waitq;		/**< fibers waiting on cond */
+	uint32_t block_size;
+	uint32_t nblocks;
+	uint32_t hand;			/**< CLOCK hand */
+	uint32_t hash_mask;
+	struct p9_cache_block *blocks;
+	struct p9_cache_block **hash;
+	struct p9_cache_file **files;
+};
+
+static inline uint32_t p9_cache_hash(struct p9_cache *cache, uint64_t path, uint64_t index) {
+	return (uint32_t)((path * 0x9e3779b97f4a7c15ULL + index) >> 32) & cache->hash_mask;
+}
+
+static struct p9_cache_block *p9_cache_lookup(struct p9_cache *cache, uint64_t path, uint64_t index) {
+	struct p9_cache_block *block;
+
+	for (block = cache->hash[p9_cache_hash(cache, path, index)]; block; block = block->hnext)
+		if (block->path == path && block->index == index)
+			return block;
+
+	return NULL;
+}
+
+static void p9_cache_unhash(struct p9_cache *cache, struct p9_cache_block *block) {
+	struct p9_cache_block **pblock;
+
+	for (pblock = &cache->hash[p9_cache_hash(cache, block->path, block->index)]; *pblock; pblock = &(*pblock)->hnext) {
+		if (*pblock == block) {
+			*pblock = block->hnext;
+			break;
+		}
+	}
+	block->hnext = NULL;
+}
+
+static struct p9_cache_file *p9_cache_file(struct p9_cache *cache, uint64_t path) {
+	struct p9_cache_file *file;
+
+	for (file = cache->files[p9_cache_hash(cache, path, 0)]; file; file = file->next)
+		if (file->path == path)
+			return file;
+
+	return NULL;
+}
+
+/**
+ * p9_cache_drop: forget a block, a load in progress is thrown away when it ends
+ * Must hold the lock.
+ */
+static void p9_cache_drop(struct p9_cache *cache, struct p9_cache_block *block) {
+	if (block->state == P9_CACHE_FREE)
+		return;
+
+	p9_cache_unhash(cache, block);
+	if (block->state == P9_CACHE_LOADING)
+		block->stale = 1;
+	else
+		block->state = P9_CACHE_FREE;
+}
+
+/**
+ * p9_cache_victim: CLOCK over the blocks nobody uses
+ * Must hold the lock.
+ *
+ * @return block to recycle, NULL if all are in use
+ */
+static struct p9_cache_block *p9_cache_victim(struct p9_cache *cache) {
+	struct p9_cache_block *block;
+	uint32_t i;
+
+	for (i = 0; i < 2 * cache->nblocks; i++) {
+		block = &cache->blocks[cache->hand];
+		cache->hand = (cache->hand + 1) % cache->nblocks;
+		if (block->refs > 0 || block->state == P9_CACHE_LOADING)
+			continue;
+		if (block->state == P9_CACHE_VALID && block->referenced) {
+			block->referenced = 0;
+			continue;
+		}
+		return block;
+	}
+
+	return NULL;
+}
+
+int p9_cache_init(struct p9_handle *p9_handle, uint64_t size, uint32_t block_size) {
+	struct p9_cache *cache;
+	uint32_t hash_size;
+
+	if (block_size == 0)
+		return EINVAL;
+
+	cache = calloc(1, sizeof(struct p9_cache));
+	if (cache == NULL)
+		return ENOMEM;
+
+	cache->block_size = block_size;
+	cache->nblocks = MAX(size / block_size, 1);
+	for (hash_size = 1; hash_size < cache->nblocks; hash_size <<= 1);
+	cache->hash_mask = hash_size - 1;
+
+	/* block buffers are allocated on first use */
+	cache->blocks = calloc(cache->nblocks, sizeof(struct p9_cache_block));
+	cache->hash = calloc(hash_size, sizeof(struct p9_cache_block *));
+	cache->files = calloc(hash_size, sizeof(struct p9_cache_file *));
+	if (cache->blocks == NULL || cache->hash == NULL || cache->files == NULL) {
+		free(cache->blocks);
+		free(cache->hash);
+		free(cache->files);
+		free(cache);
+		return ENOMEM;
+	}
+
+	pthread_mutex_init(&cache->lock, NULL);
+	pthread_cond_init(&cache->cond, NULL);
+
+	p9_handle->cache = cache;
+
+	INFO_LOG(p9_handle->debug & P9_DEBUG_SETUP, "block cache: %u blocks of %u bytes", cache->nblocks, block_size);
+
+	return 0;
+}
+
+void p9_cache_destroy(struct p9_handle *p9_handle) {
+	struct p9_cache *cache = p9_handle->cache;
+	struct p9_cache_file *file;
+	uint32_t i;
+
+	if (cache == NULL)
+		return;
+
+	for (i = 0; i < cache->nblocks; i++)
+		free(cache->blocks[i].buf);
+	for (i = 0; i <= cache->hash_mask; i++) {
+		while ((file = cache->files[i])) {
+			cache->files[i] = file->next;
+			free(file);
+		}
+	}
+
+	pthread_cond_destroy(&cache->cond);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->blocks);
+	free(cache->hash);
+	free(cache->files);
+	free(cache);
+	p9_handle->cache = NULL;
+}
+
+int p9_cache_validate(struct p9_handle *p9_handle, uint64_t path, uint32_t version, uint64_t mtime, uint64_t size) {
+	struct p9_cache *cache = p9_handle->cache;
+	struct p9_cache_file *file;
+	uint32_t i;
+	int rc = 0;
+
+	pthread_mutex_lock(&cache->lock);
+	do {
+		file = p9_cache_file(cache, path);
+		if (file == NULL) {
+			file = malloc(sizeof(struct p9_cache_file));
+			if (file == NULL) {
+				rc = ENOMEM;
+				break;
+			}
+			file->path = path;
+			file->next = cache->files[p9_cache_hash(cache, path, 0)];
+			cache->files[p9_cache_hash(cache, path, 0)] = file;
+		} else if (file->version == version && file->mtime == mtime && file->size == size) {
+			break;
+		} else {
+			INFO_LOG(p9_handle->debug & P9_DEBUG_LIBC, "file %"PRIu64" changed, dropping its cached blocks", path);
+			for (i = 0; i < cache->nblocks; i++)
+				if (cache->blocks[i].path == path)
+					p9_cache_drop(cache, &cache->blocks[i]);
+		}
+
+		file->version = version;
+		file->mtime = mtime;
+		file->size = size;
+		file->eof_index = UINT64_MAX;
+	} while (0);
+	pthread_mutex_unlock(&cache->lock);
+
+	if (rc == 0 && p9_handle->dcache)
+		p9_dcache_validate(p9_handle, path, version, mtime, size);
+
+	return rc;
+}
+
+struct p9_cache_block *p9_cache_get(struct p9_handle *p9_handle, uint64_t path, uint64_t index, int wait, int *hit) {
+	struct p9_cache *cache = p9_handle->cache;
+	struct p9_cache_block *block;
+
+	pthread_mutex_lock(&cache->lock);
+	while (1) {
+		block = p9_cache_lookup(cache, path, index);
+		if (block) {
+			if (block->state == P9_CACHE_LOADING && !wait) {
+				block = NULL;
+				break;
+			}
+			block->refs++;
+			while (block->state == P9_CACHE_LOADING)
+				p9c_cond_wait(&cache->cond, &cache->waitq, &cache->lock);
+			if (block->state == P9_CACHE_VALID) {
+				block->referenced = 1;
+				*hit = 1;
+				break;
+			}
+			/* the load failed or got invalidated, try again */
+			block->refs--;
+			continue;
+		}
+
+		block = p9_cache_victim(cache);
+		if (block == NULL) {
+			if (!wait)
+				break;
+			p9c_cond_wait(&cache->cond, &cache->waitq, &cache->lock);
+			continue;
+		}
+
+		if (block->buf == NULL) {
+			block->buf = malloc(cache->block_size);
+			if (block->buf == NULL) {
+				block = NULL;
+				break;
+			}
+		}
+
+		if (block->state == P9_CACHE_VALID)
+			p9_cache_unhash(cache, block);
+		block->path = path;
+		block->index = index;
+		block->size = 0;
+		block->refs = 1;
+		block->state = P9_CACHE_LOADING;
+		block->stale = 0;
+		block->referenced = 1;
+		block->hnext = cache->hash[p9_cache_hash(cache, path, index)];
+		cache->hash[p9_cache_hash(cache, path, index)] = block;
+		*hit = 0;
+		break;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	if (block)
+		p9_stats_cache(p9_handle, *hit);
+
+	return block;
+}
+
+void p9_cache_loaded(struct p9_handle *p9_handle, struct p9_cache_block *block, ssize_t size) {
+	struct p9_cache *cache = p9_handle->cache;
+	struct p9_cache_file *file;
+
+	pthread_mutex_lock(&cache->lock);
+	if (size < 0 || block->stale) {
+		if (!block->stale)
+			p9_cache_unhash(cache, block);
+		block->state = P9_CACHE_FREE;
+	} else {
+		block->size = size;
+		block->state = P9_CACHE_VALID;
+		if (size < cache->block_size) {
+			file = p9_cache_file(cache, block->path);
+			if (file)
+				file->eof_index = block->index;
+		}
+	}
+	p9c_cond_broadcast(&cache->cond, &cache->waitq);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void p9_cache_put(struct p9_handle *p9_handle, struct p9_cache_block *block) {
+	struct p9_cache *cache = p9_handle->cache;
+
+	pthread_mutex_lock(&cache->lock);
+	if (--block->refs == 0)
+		p9c_cond_broadcast(&cache->cond, &cache->waitq);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void p9_cache_invalidate(struct p9_handle *p9_handle, uint64_t path, uint64_t offset, uint64_t count) {
+	struct p9_cache *cache = p9_handle->cache;
+	struct p9_cache_block *block;
+	struct p9_cache_file *file;
+	uint64_t index, last;
+	uint32_t i;
+
+	if (count == 0)
+		return;
+
+	index = offset / cache->block_size;
+	last = (count > UINT64_MAX - offset ? UINT64_MAX : offset + count - 1) / cache->block_size;
+
+	pthread_mutex_lock(&cache->lock);
+	if (last - index >= cache->nblocks) {
+		for (i = 0; i < cache->nblocks; i++)
+			if (cache->blocks[i].path == path && cache->blocks[i].index >= index && cache->blocks[i].index <= last)
+				p9_cache_drop(cache, &cache->blocks[i]);
+	} else {
+		for (; index <= last; index++) {
+			block = p9_cache_lookup(cache, path, index);
+			if (block)
+				p9_cache_drop(cache, block);
+		}
+	}
+
+	/* the file may have grown past the block that saw its end */
+	file = p9_cache_file(cache, path);
+	if (file && file->eof_index != UINT64_MAX) {
+		block = p9_cache_lookup(cache, path, file->eof_index);
+		if (block)
+			p9_cache_drop(cache, block);
+		file->eof_index = UINT64_MAX;
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	if (p9_handle->dcache)
+		p9_dcache_invalidate(p9_handle, path);
+}
@@ -35,12 +35,26 @@
 
 void p9_disconnect_cb(msk_trans_t *trans) {
 	struct p9_handle *p9_handle = trans->private_data;
+	int signal = 0;
+	uint32_t i;
 
 	INFO_LOG(p9_handle->debug & P9_DEBUG_EVENT, "");
 
         pthread_mutex_lock(&p9_handle->recv_lock);
 	pthread_cond_broadcast(&p9_handle->recv_cond);
+	/* their wait will reconnect and send them again */
+	if (p9_handle->events)
+		for (i = 0; i < p9_handle->max_tag; i++)
+			signal |= p9c_event_done(p9_handle, i, 1);
+	for (i = 0; i < p9_handle->max_tag; i++)
+		if (p9_handle->tags[i].fiber) {
+			p9_fiber_wake(p9_handle->tags[i].fiber);
+			p9_handle->tags[i].fiber = NULL;
+		}
         pthread_mutex_unlock(&p9_handle->recv_lock);
+
+	if (signal)
+		p9c_event_signal(p9_handle);
 }
 
 void p9_recv_err_cb(msk_trans_t *trans, msk_data_t *data, void *arg) {
@@ -54,6 +68,7 @@ void p9_recv_err_cb(msk_trans_t *trans, msk_data_t *data, void *arg) {
 void p9_recv_cb(msk_trans_t *trans, msk_data_t *data, void *arg) {
 	struct p9_handle *p9_handle = trans->private_data;
 	uint16_t tag;
+	int signal;
 
 	p9_get_tag(&tag, data->data);
 
@@ -63,14 +78,61 @@ void p9_recv_cb(msk_trans_t *trans, msk_data_t *data, void *arg) {
 	if (tag == P9_NOTAG)
 		tag = p9_handle->max_tag-1;
 
+	if (p9_handle->window.min)
+		p9c_window_reply(p9_handle, tag);
+
 	pthread_mutex_lock(&p9_handle->recv_lock);
-	p9_handle->tags[tag].rdata = data;
-	pthread_cond_broadcast(&p9_handle->recv_cond);
+	__atomic_store_n(&p9_handle->tags[tag].rdata, data, __ATOMIC_RELEASE);
+	if (p9_handle->parked)
+		pthread_cond_broadcast(&p9_handle->recv_cond);
+	if (p9_handle->tags[tag].fiber) {
+		p9_fiber_wake(p9_handle->tags[tag].fiber);
+		p9_handle->tags[tag].fiber = NULL;
+	}
+	signal = p9c_event_done(p9_handle, tag, 0);
 	pthread_mutex_unlock(&p9_handle->recv_lock);
+
+	if (signal)
+		p9c_event_signal(p9_handle);
+}
+
+uint8_t *p9_recv_sink(msk_trans_t *trans, uint16_t tag, uint32_t *psize) {
+	struct p9_handle *p9_handle = trans->private_data;
+
+	/* kludge on P9_NOTAG to have a smaller array */
+	if (tag == P9_NOTAG)
+		tag = p9_handle->max_tag-1;
+	else if (tag >= p9_handle->max_tag)
+		return NULL;
+
+	*psize = p9_handle->tags[tag].rsize;
+	return p9_handle->tags[tag].rbuf;
 }
 
 void p9_send_cb(msk_trans_t *trans, msk_data_t *data, void *arg) {
+	struct p9_handle *p9_handle = trans->private_data;
+	uint16_t tag = (uint16_t)(uint64_t)arg;
+	int signal;
+
 	data->next = NULL;
+
+	/* kludge on P9_NOTAG to have a smaller array */
+	if (tag == P9_NOTAG)
+		tag = p9_handle->max_tag-1;
+
+	pthread_mutex_lock(&p9_handle->recv_lock);
+	__atomic_store_n(&p9_handle->tags[tag].sending, 0, __ATOMIC_RELEASE);
+	if (p9_handle->parked)
+		pthread_cond_broadcast(&p9_handle->recv_cond);
+	if (p9_handle->tags[tag].fiber) {
+		p9_fiber_wake(p9_handle->tags[tag].fiber);
+		p9_handle->tags[tag].fiber = NULL;
+	}
+	signal = p9c_event_done(p9_handle, tag, 0);
+	pthread_mutex_unlock(&p9_handle->recv_lock);
+
+	if (signal)
+		p9c_event_signal(p9_handle);
 }
 
 void p9_send_err_cb(msk_trans_t *trans, msk_data_t *data, void *arg) {
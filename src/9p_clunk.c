@@ -0,0 +1,196 @@
+/*
+ * Copyright CEA/DAM/DIF (2013)
+ * Contributor: Dominique Martinet <dominique.martinet@cea.fr>
+ *
+ * This file is part of the space9 9P userspace library.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with space9.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+/**
+ * \file	9p_clunk.c
+ * \brief	deferred clunks
+ *
+ * TCLUNKs queued here are sent right away but their replies are waited
+ * for by a background thread, which hands the fids back to the pool once
+ * the server is done with them. The ring has max_tag entries. A queued
+ * clunk holds a tag, but the tag is freed before the reaper moves past its
+ * entry, so a push may still find the ring full and waits for that.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>	//malloc
+#include <string.h>	//strerror
+#include <inttypes.h>	//uint*_t
+#include <errno.h>	//ENOMEM
+#include <pthread.h>	//pthread_*
+
+#include "9p_internals.h"
+#include "utils.h"
+
+struct p9_clunk_ent {
+	struct p9_fid *fid;
+	uint16_t tag;
+};
+
+struct p9_clunkq {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;		/**< something was queued, or stop */
+	pthread_cond_t done_cond;	/**< a reply got reaped */
+	struct p9_waitq done_waitq;	/**< fibers waiting on done_cond */
+	pthread_t thrid;
+	struct p9_handle *p9_handle;
+	uint32_t size;
+	uint64_t head;			/**< entry being reaped */
+	uint64_t tail;
+	int err;			/**< first error since the last flush */
+	int stop;
+	struct p9_clunk_ent *ents;
+};
+
+static void *p9_clunkq_thread(void *arg) {
+	struct p9_clunkq *clunkq = arg;
+	struct p9_clunk_ent *ent;
+	int rc;
+
+	pthread_mutex_lock(&clunkq->lock);
+	while (1) {
+		while (clunkq->head == clunkq->tail && !clunkq->stop)
+			pthread_cond_wait(&clunkq->cond, &clunkq->lock);
+		if (clunkq->head == clunkq->tail)
+			break;
+
+		/* leave the entry in until it's done so flush waits for it */
+		ent = &clunkq->ents[clunkq->head % clunkq->size];
+		pthread_mutex_unlock(&clunkq->lock);
+
+		rc = p9p_clunk_wait(clunkq->p9_handle, &ent->fid, ent->tag);
+
+		pthread_mutex_lock(&clunkq->lock);
+		if (rc && !clunkq->err)
+			clunkq->err = rc;
+		clunkq->head++;
+		p9c_cond_broadcast(&clunkq->done_cond, &clunkq->done_waitq);
+	}
+	pthread_mutex_unlock(&clunkq->lock);
+
+	return NULL;
+}
+
+int p9_clunkq_init(struct p9_handle *p9_handle) {
+	struct p9_clunkq *clunkq;
+	int rc;
+
+	clunkq = calloc(1, sizeof(struct p9_clunkq));
+	if (clunkq == NULL)
+		return ENOMEM;
+
+	clunkq->size = p9_handle->max_tag;
+	clunkq->ents = calloc(clunkq->size, sizeof(struct p9_clunk_ent));
+	if (clunkq->ents == NULL) {
+		free(clunkq);
+		return ENOMEM;
+	}
+	clunkq->p9_handle = p9_handle;
+	pthread_mutex_init(&clunkq->lock, NULL);
+	pthread_cond_init(&clunkq->cond, NULL);
+	pthread_cond_init(&clunkq->done_cond, NULL);
+
+	rc = pthread_create(&clunkq->thrid, NULL, p9_clunkq_thread, clunkq);
+	if (rc) {
+		ERROR_LOG("Could not create clunk thread: %s (%d)", strerror(rc), rc);
+		pthread_cond_destroy(&clunkq->done_cond);
+		pthread_cond_destroy(&clunkq->cond);
+		pthread_mutex_destroy(&clunkq->lock);
+		free(clunkq->ents);
+		free(clunkq);
+		return rc;
+	}
+
+	p9_handle->clunkq = clunkq;
+
+	return 0;
+}
+
+void p9_clunkq_destroy(struct p9_handle *p9_handle) {
+	struct p9_clunkq *clunkq = p9_handle->clunkq;
+
+	if (clunkq == NULL)
+		return;
+
+	/* the thread reaps whatever is left before it stops */
+	pthread_mutex_lock(&clunkq->lock);
+	clunkq->stop = 1;
+	pthread_cond_signal(&clunkq->cond);
+	pthread_mutex_unlock(&clunkq->lock);
+	pthread_join(clunkq->thrid, NULL);
+
+	pthread_cond_destroy(&clunkq->done_cond);
+	pthread_cond_destroy(&clunkq->cond);
+	pthread_mutex_destroy(&clunkq->lock);
+	free(clunkq->ents);
+	free(clunkq);
+	p9_handle->clunkq = NULL;
+}
+
+int p9_clunkq_push(struct p9_handle *p9_handle, struct p9_fid **pfid) {
+	struct p9_clunkq *clunkq = p9_handle->clunkq;
+	uint16_t tag;
+	int rc;
+
+	rc = p9p_clunk_send(p9_handle, *pfid, &tag);
+	if (rc) {
+		/* fid is invalid anyway */
+		p9c_putfid(p9_handle, pfid);
+		return rc;
+	}
+
+	pthread_mutex_lock(&clunkq->lock);
+	while (clunkq->tail - clunkq->head == clunkq->size)
+		p9c_cond_wait(&clunkq->done_cond, &clunkq->done_waitq, &clunkq->lock);
+	clunkq->ents[clunkq->tail % clunkq->size].fid = *pfid;
+	clunkq->ents[clunkq->tail % clunkq->size].tag = tag;
+	clunkq->tail++;
+	pthread_cond_signal(&clunkq->cond);
+	pthread_mutex_unlock(&clunkq->lock);
+
+	*pfid = NULL;
+
+	return 0;
+}
+
+int p9_clunkq_flush(struct p9_handle *p9_handle) {
+	struct p9_clunkq *clunkq = p9_handle->clunkq;
+	uint64_t tail;
+	int rc;
+
+	if (clunkq == NULL)
+		return 0;
+
+	/* only wait for what was queued so far, others may keep queueing */
+	pthread_mutex_lock(&clunkq->lock);
+	tail = clunkq->tail;
+	while (clunkq->head < tail)
+		p9c_cond_wait(&clunkq->done_cond, &clunkq->done_waitq, &clunkq->lock);
+	rc = clunkq->err;
+	clunkq->err = 0;
+	pthread_mutex_unlock(&clunkq->lock);
+
+	return rc;
+}
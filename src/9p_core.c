@@ -31,6 +31,8 @@
 #include <unistd.h>     // sleep
 #include <fcntl.h>
 #include <assert.h>
+#include <time.h>       // clock_gettime
+#include <sys/eventfd.h> // eventfd
 #include "9p_internals.h"
 #include "utils.h"
 #include "settings.h"
@@ -44,7 +46,11 @@ static int p9ci_rebuild_fids(void *arg, uint32_t i) {
 	if (i == 0 || fid == NULL)
 		return EINVAL;
 
-	rc = p9p_rewalk(p9_handle, p9_handle->root_fid, fid->path, fid->fid);
+	/* attached again already */
+	if (fid->session && fid == fid->session->root_fid)
+		return 0;
+
+	rc = p9p_rewalk(p9_handle, p9_fid_root(fid), fid->path, fid->fid);
 	if (rc) {
 		printf("rewalk failed on fid %u\n", i);
 		return rc;
@@ -73,11 +79,201 @@ static int p9ci_rebuild_fids(void *arg, uint32_t i) {
 	return rc;
 }
 
+static int p9ci_post(struct p9_handle *p9_handle, struct p9_pool *pool, uint32_t i) {
+	int rc;
+
+	rc = p9_handle->net_ops->post_n_recv(p9_handle->trans, &pool->data[i], 1, p9_recv_cb, p9_recv_err_cb, NULL);
+	if (rc) {
+		ERROR_LOG("Could not post recv buffer %p: %s (%d)", &pool->data[i], strerror(rc), rc);
+		pool->state[i] = P9_BUF_FREE;
+		return EIO;
+	}
+
+	pool->state[i] = P9_BUF_POSTED;
+	return 0;
+}
+
+/**
+ * @brief post everything but loaned buffers on a new connection
+ *
+ * Requests in flight keep their promise, they will be sent again.
+ * Must hold credit_lock.
+ */
+static int p9ci_repost(struct p9_handle *p9_handle, struct p9_pool *pool) {
+	uint32_t i;
+	int rc;
+
+	for (i = 0; i < pool->count; i++) {
+		if (pool->state[i] == P9_BUF_LOANED || pool->state[i] == P9_BUF_LENT)
+			continue;
+		rc = p9ci_post(p9_handle, pool, i);
+		if (rc)
+			return rc;
+	}
+
+	/* any shrink in progress is forgotten */
+	pool->retracted = 0;
+	pool->target = pool->max;
+	pool->credits = (int32_t)pool->count - (int32_t)pool->lent - (int32_t)pool->inuse;
+
+	return 0;
+}
+
+/**
+ * @brief get more receive buffers posted
+ *
+ * Undoes an idle shrink in progress if there is one, or backs a new slab.
+ * Must hold credit_lock.
+ *
+ * @return 0 if at least one buffer got posted, errno value otherwise
+ */
+static int p9ci_rpool_grow(struct p9_handle *p9_handle, struct p9_pool *pool) {
+	uint32_t i, start;
+	int rc = 0, posted = 0;
+
+	if (pool->retracted) {
+		start = p9_pool_last_slab(pool);
+	} else {
+		start = pool->count;
+		rc = p9_pool_grow(p9_handle, pool);
+		if (rc)
+			return rc;
+	}
+
+	for (i = start; i < pool->count && rc == 0; i++) {
+		if (pool->state[i] != P9_BUF_FREE)
+			continue;
+		rc = p9ci_post(p9_handle, pool, i);
+		if (rc == 0) {
+			pool->credits++;
+			posted++;
+		}
+	}
+
+	pool->retracted = 0;
+	pool->target = pool->max;
+	pool->peak = pool->inuse;
+	pool->window = time(NULL);
+
+	return posted ? 0 : (rc ? rc : ENOSPC);
+}
+
+/**
+ * \struct p9_plug
+ * requests a thread holds back to send them together, see p9c_plug
+ */
+struct p9_plug {
+	struct p9_handle *p9_handle;
+	uint32_t depth;
+	uint32_t count;
+	struct p9_send_req reqs[P9_PLUG_MAX];
+};
+
+static __thread struct p9_plug p9_plug;
+
+/**
+ * @brief the calling thread's plug, or its fiber's as they move between threads
+ *
+ * @return the plug, NULL for a fiber that never plugged unless create is set
+ */
+static inline struct p9_plug *p9ci_plug(int create) {
+	struct p9_plug **pplug = p9_fiber_plug();
+
+	if (pplug == NULL)
+		return &p9_plug;
+	if (*pplug == NULL && create)
+		*pplug = calloc(1, sizeof(struct p9_plug));
+	return *pplug;
+}
+
+static inline int p9ci_plugged(struct p9_handle *p9_handle) {
+	struct p9_plug *plug = p9ci_plug(0);
+
+	return plug && plug->count && plug->p9_handle == p9_handle;
+}
+
+static void p9ci_plug_flush(struct p9_handle *p9_handle);
+
+/**
+ * @brief reserve a posted receive buffer for the reply
+ *
+ * Small replies go to the small class, or borrow a large buffer when small
+ * ones cannot be had. Must hold credit_lock.
+ *
+ * @return class reserved, or negative errno value
+ */
+static int p9ci_recv_reserve(struct p9_handle *p9_handle, uint32_t flags) {
+	struct p9_pool *small = &p9_handle->rpool[P9_BUF_SMALL];
+	struct p9_pool *large = &p9_handle->rpool[P9_BUF_LARGE];
+	int rclass, rc;
+
+	while (1) {
+		rclass = -1;
+		rc = 0;
+		if (small->max && !(flags & P9_BUF_LARGE_REPLY)) {
+			if (small->credits > 0)
+				rclass = P9_BUF_SMALL;
+			else if ((small->count < small->max || small->retracted) && p9ci_rpool_grow(p9_handle, small) == 0)
+				continue;
+		}
+		if (rclass == -1) {
+			if (large->credits > 0)
+				rclass = P9_BUF_LARGE;
+			else if (large->count < large->max || large->retracted)
+				rc = p9ci_rpool_grow(p9_handle, large);
+			if (rc == 0 && rclass == -1 && large->credits > 0)
+				continue;
+		}
+
+		if (rclass != -1) {
+			p9_handle->rpool[rclass].credits--;
+			p9_handle->rpool[rclass].inuse++;
+			if (p9_handle->rpool[rclass].inuse > p9_handle->rpool[rclass].peak)
+				p9_handle->rpool[rclass].peak = p9_handle->rpool[rclass].inuse;
+			return rclass;
+		}
+
+		/* nothing will come back if nothing is out */
+		if (rc && small->inuse == 0 && large->inuse == 0)
+			return -rc;
+
+		if (p9ci_plugged(p9_handle)) {
+			pthread_mutex_unlock(&p9_handle->credit_lock);
+			p9ci_plug_flush(p9_handle);
+			pthread_mutex_lock(&p9_handle->credit_lock);
+			continue;
+		}
+
+		INFO_LOG(p9_handle->debug & P9_DEBUG_SEND, "waiting for credit (putreply)");
+		p9c_cond_wait(&p9_handle->credit_cond, &p9_handle->credit_waitq, &p9_handle->credit_lock);
+	}
+}
+
+/**
+ * @brief give back a send slot, shrink the pool if it has been idle
+ */
+static void p9ci_wdata_release(struct p9_handle *p9_handle, uint16_t tag) {
+	struct p9_pool *pool = &p9_handle->wpool[p9_handle->tags[tag].wclass];
+	uint32_t i;
+
+	pthread_mutex_lock(&p9_handle->wdata_lock);
+	clear_bit(pool->bitmap, p9_handle->tags[tag].wdata_i);
+	pool->inuse--;
+	if (p9_pool_idle(p9_handle, pool)) {
+		for (i = p9_pool_last_slab(pool); i < pool->count; i++)
+			if (get_bit(pool->bitmap, i))
+				break;
+		if (i == pool->count)
+			p9_pool_shrink(p9_handle, pool);
+	}
+	p9c_cond_signal(&p9_handle->wdata_cond, &p9_handle->wdata_waitq);
+	pthread_mutex_unlock(&p9_handle->wdata_lock);
+}
+
 int p9c_reconnect(struct p9_handle *p9_handle) {
+	struct p9_session *session;
 	int sleeptime = 0;
 	int rc = 0, i;
-	struct ibv_mr *mr;
-
 
 	pthread_mutex_lock(&p9_handle->connection_lock);
 
@@ -100,6 +296,10 @@ int p9c_reconnect(struct p9_handle *p9_handle) {
 		}
 
 		p9_handle->trans->private_data = p9_handle;
+		if (p9_handle->net_ops->set_recv_sink)
+			p9_handle->net_ops->set_recv_sink(p9_handle->trans, p9_recv_sink);
+		if (p9_handle->zerocopy && p9_handle->net_ops->set_zerocopy)
+			p9_handle->net_ops->set_zerocopy(p9_handle->trans, p9_handle->zerocopy);
 
 		rc = p9_handle->net_ops->connect(p9_handle->trans);
 		if (rc) {
@@ -108,23 +308,15 @@ int p9c_reconnect(struct p9_handle *p9_handle) {
 		}
 
 
-		mr = p9_handle->net_ops->reg_mr(p9_handle->trans, p9_handle->rdmabuf, 2 * p9_handle->recv_num * p9_handle->msize, IBV_ACCESS_LOCAL_WRITE);
-		if (mr == NULL) {
-			ERROR_LOG("Could not register memory buffer");
-			rc = EIO;
-			continue;
+		for (i = 0; i < P9_BUF_CLASSES; i++) {
+			p9_pool_reg_mr(p9_handle, &p9_handle->rpool[i]);
+			p9_pool_reg_mr(p9_handle, &p9_handle->wpool[i]);
 		}
 
-		for (i=0; i < p9_handle->recv_num; i++) {
-			p9_handle->rdata[i].mr = mr;
-			p9_handle->wdata[i].mr = mr;
-			rc = p9_handle->net_ops->post_n_recv(p9_handle->trans, &p9_handle->rdata[i], 1, p9_recv_cb, p9_recv_err_cb, NULL);
-			if (rc) {
-				ERROR_LOG("Could not post recv buffer %i: %s (%d)", i, strerror(rc), rc);
-				rc = EIO;
-				break;
-			}
-		}
+		pthread_mutex_lock(&p9_handle->credit_lock);
+		for (i = 0; i < P9_BUF_CLASSES && rc == 0; i++)
+			rc = p9ci_repost(p9_handle, &p9_handle->rpool[i]);
+		pthread_mutex_unlock(&p9_handle->credit_lock);
 		if (rc)
 			continue;
 
@@ -146,6 +338,16 @@ int p9c_reconnect(struct p9_handle *p9_handle) {
 			break;
 		}
 
+		for (session = p9_handle->sessions; session; session = session->next) {
+			rc = p9p_attach(p9_handle, session->uid, &session->root_fid);
+			if (rc) {
+				ERROR_LOG("attach for uid %u failed: %s (%d)", session->uid, strerror(rc), rc);
+				break;
+			}
+		}
+		if (rc)
+			break;
+
 		for (i=1; i < p9_handle->max_fid; i++) {
 			if (p9_handle->fids[i] != NULL)
 				p9ci_rebuild_fids(p9_handle, i);
@@ -157,136 +359,545 @@ int p9c_reconnect(struct p9_handle *p9_handle) {
 	return rc;
 }
 
-int p9c_getbuffer(struct p9_handle *p9_handle, msk_data_t **pdata, uint16_t *ptag) {
+/**
+ * @brief whether a request of that class can be let out now
+ *
+ * Bulk requests leave meta_reserve credits and window slots to the
+ * others. Must hold credit_lock.
+ */
+static inline int p9ci_may_send(struct p9_handle *p9_handle, uint32_t flags) {
+	uint32_t reserve = (flags & P9_BUF_BULK) ? p9_handle->meta_reserve : 0;
+
+	if (p9_handle->credits <= reserve)
+		return 0;
+	if (p9_handle->window.min && p9_handle->window.inflight + MIN(reserve, p9_handle->window.size / 2) >= p9_handle->window.size)
+		return 0;
+
+	return 1;
+}
+
+int p9c_getbuffer_flags(struct p9_handle *p9_handle, msk_data_t **pdata, uint16_t *ptag, uint32_t flags) {
+	struct p9_pool *pool;
 	msk_data_t *data;
 	uint32_t wdata_i, tag;
+	int rclass, wclass;
 
 	pthread_mutex_lock(&p9_handle->credit_lock);
-	while (p9_handle->credits == 0) {
+	while (!p9ci_may_send(p9_handle, flags)) {
+		if (p9ci_plugged(p9_handle)) {
+			pthread_mutex_unlock(&p9_handle->credit_lock);
+			p9ci_plug_flush(p9_handle);
+			pthread_mutex_lock(&p9_handle->credit_lock);
+			continue;
+		}
 		INFO_LOG(p9_handle->debug & P9_DEBUG_SEND, "waiting for credit (putreply)");
-		pthread_cond_wait(&p9_handle->credit_cond, &p9_handle->credit_lock);
+		p9c_cond_wait(&p9_handle->credit_cond, &p9_handle->credit_waitq, &p9_handle->credit_lock);
+	}
+	rclass = p9ci_recv_reserve(p9_handle, flags);
+	if (rclass >= 0) {
+		p9_handle->credits--;
+		if (p9_handle->window.min)
+			p9_handle->window.inflight++;
 	}
-	p9_handle->credits--;
 	pthread_mutex_unlock(&p9_handle->credit_lock);
 
+	if (rclass < 0)
+		return -rclass;
+
+	wclass = (flags & P9_BUF_LARGE_REQUEST) || p9_handle->wpool[P9_BUF_SMALL].max == 0 ? P9_BUF_LARGE : P9_BUF_SMALL;
+	pool = &p9_handle->wpool[wclass];
+
 	pthread_mutex_lock(&p9_handle->wdata_lock);
-	while ((wdata_i = get_and_set_first_bit(p9_handle->wdata_bitmap, p9_handle->recv_num)) == p9_handle->recv_num) {
+	while ((wdata_i = get_and_set_first_bit(pool->bitmap, pool->max)) == pool->max) {
+		if (pool->count < pool->max && p9_pool_grow(p9_handle, pool) == 0)
+			continue;
+		if (p9ci_plugged(p9_handle)) {
+			pthread_mutex_unlock(&p9_handle->wdata_lock);
+			p9ci_plug_flush(p9_handle);
+			pthread_mutex_lock(&p9_handle->wdata_lock);
+			continue;
+		}
 		INFO_LOG(p9_handle->debug & P9_DEBUG_SEND, "waiting for wdata to free up (sendrequest's acknowledge callback)");
-		pthread_cond_wait(&p9_handle->wdata_cond, &p9_handle->wdata_lock);
+		p9c_cond_wait(&p9_handle->wdata_cond, &p9_handle->wdata_waitq, &p9_handle->wdata_lock);
 	}
+	pool->inuse++;
+	if (pool->inuse > pool->peak)
+		pool->peak = pool->inuse;
 	pthread_mutex_unlock(&p9_handle->wdata_lock);
 
-	data = &p9_handle->wdata[wdata_i];
+	data = &pool->data[wdata_i];
 	data->size = 0;
+	data->next = NULL;
 	*pdata = data;
 
 	pthread_mutex_lock(&p9_handle->tag_lock);
 	/* kludge on P9_NOTAG to have a smaller array */
 	if (*ptag == P9_NOTAG) {
 		tag = p9_handle->max_tag-1;
-		while(get_bit(p9_handle->tags_bitmap, tag))
-			pthread_cond_wait(&p9_handle->tag_cond, &p9_handle->tag_lock);
+		while(get_bit(p9_handle->tags_bitmap, tag)) {
+			if (p9ci_plugged(p9_handle)) {
+				pthread_mutex_unlock(&p9_handle->tag_lock);
+				p9ci_plug_flush(p9_handle);
+				pthread_mutex_lock(&p9_handle->tag_lock);
+				continue;
+			}
+			p9c_cond_wait(&p9_handle->tag_cond, &p9_handle->tag_waitq, &p9_handle->tag_lock);
+		}
 		set_bit(p9_handle->tags_bitmap, tag);
 	} else {
-		while ((tag = get_and_set_first_bit(p9_handle->tags_bitmap, p9_handle->max_tag)) == p9_handle->max_tag)
-			pthread_cond_wait(&p9_handle->tag_cond, &p9_handle->tag_lock);
+		while ((tag = get_and_set_first_bit(p9_handle->tags_bitmap, p9_handle->max_tag)) == p9_handle->max_tag) {
+			if (p9ci_plugged(p9_handle)) {
+				pthread_mutex_unlock(&p9_handle->tag_lock);
+				p9ci_plug_flush(p9_handle);
+				pthread_mutex_lock(&p9_handle->tag_lock);
+				continue;
+			}
+			p9c_cond_wait(&p9_handle->tag_cond, &p9_handle->tag_waitq, &p9_handle->tag_lock);
+		}
 	}
 	pthread_mutex_unlock(&p9_handle->tag_lock);
 
 
 	p9_handle->tags[tag].rdata = NULL;
+	p9_handle->tags[tag].notify = 0;
+	p9_handle->tags[tag].fiber = NULL;
 	p9_handle->tags[tag].wdata_i = wdata_i;
+	p9_handle->tags[tag].rclass = rclass;
+	p9_handle->tags[tag].wclass = wclass;
 
 	*ptag = (uint16_t)tag;
 	return 0;
 }
 
+int p9c_getbuffer(struct p9_handle *p9_handle, msk_data_t **pdata, uint16_t *ptag) {
+	return p9c_getbuffer_flags(p9_handle, pdata, ptag, 0);
+}
 
-int p9c_sendrequest(struct p9_handle *p9_handle, msk_data_t *data, uint16_t tag) {
+uint32_t p9c_bufflags(struct p9_handle *p9_handle, size_t reqsize, size_t replysize) {
+	uint32_t flags = 0;
+
+	if (reqsize > p9_handle->wpool[P9_BUF_SMALL].bufsize)
+		flags |= P9_BUF_LARGE_REQUEST;
+	if (replysize > p9_handle->rpool[P9_BUF_SMALL].bufsize)
+		flags |= P9_BUF_LARGE_REPLY;
+
+	return flags;
+}
+
+
+static int p9ci_send(struct p9_handle *p9_handle, msk_data_t *data, uint16_t tag) {
 	int rc;
 
+	p9_handle->tags[tag].sending = 1;
 	rc = p9_handle->net_ops->post_n_send(p9_handle->trans, data, (data->next != NULL) ? 2 : 1, p9_send_cb, p9_send_err_cb, (void*)(uint64_t)tag);
 	INFO_LOG(p9_handle->debug & P9_DEBUG_SEND, "sent request for tag %u", tag);
 
 	if (rc) {
 		p9c_reconnect(p9_handle);
-		return p9c_sendrequest(p9_handle, data, tag);
+		p9_stats_retry(p9_handle, tag);
+		return p9ci_send(p9_handle, data, tag);
 	}
 
 	return rc;
 }
 
+/**
+ * @brief send what the thread held back
+ *
+ * Anything that waits for a buffer, tag or reply must flush first, what
+ * it waits for could be in there.
+ */
+static void p9ci_plug_flush(struct p9_handle *p9_handle) {
+	struct p9_plug *plug = p9ci_plug(0);
+	struct p9_send_req reqs[P9_PLUG_MAX];
+	uint32_t count, i;
+
+	/* a reconnect while sending plugs its own requests again */
+	count = plug->count;
+	memcpy(reqs, plug->reqs, count * sizeof(struct p9_send_req));
+	plug->count = 0;
+
+	if (count > 1 && p9_handle->net_ops->post_n_send_batch) {
+		for (i = 0; i < count; i++)
+			p9_handle->tags[(uint64_t)reqs[i].callback_arg].sending = 1;
+		if (p9_handle->net_ops->post_n_send_batch(p9_handle->trans, reqs, count, p9_send_cb, p9_send_err_cb) == 0)
+			return;
+	}
+
+	/* one at a time, or again through the reconnect logic of p9ci_send */
+	for (i = 0; i < count; i++)
+		p9ci_send(p9_handle, reqs[i].data, (uint16_t)(uint64_t)reqs[i].callback_arg);
+}
+
+int p9c_plug(struct p9_handle *p9_handle) {
+	struct p9_plug *plug = p9ci_plug(1);
+
+	if (plug == NULL)
+		return ENOMEM;
+
+	if (plug->depth && plug->p9_handle != p9_handle)
+		return EBUSY;
+
+	plug->p9_handle = p9_handle;
+	plug->depth++;
+
+	return 0;
+}
+
+int p9c_unplug(struct p9_handle *p9_handle) {
+	struct p9_plug *plug = p9ci_plug(0);
+
+	if (plug == NULL || plug->depth == 0 || plug->p9_handle != p9_handle)
+		return EINVAL;
+
+	if (--plug->depth == 0 && plug->count)
+		p9ci_plug_flush(p9_handle);
+
+	return 0;
+}
+
+int p9c_sendrequest(struct p9_handle *p9_handle, msk_data_t *data, uint16_t tag) {
+	struct p9_plug *plug;
+	struct p9_send_req *req;
+
+	p9_limit_wait(p9_handle, data);
+	p9_stats_send(p9_handle, tag, data);
+
+	plug = p9ci_plug(0);
+	if (plug && plug->depth && plug->p9_handle == p9_handle) {
+		req = &plug->reqs[plug->count++];
+		req->data = data;
+		req->num_sge = (data->next != NULL) ? 2 : 1;
+		req->callback_arg = (void*)(uint64_t)tag;
+		if (plug->count == P9_PLUG_MAX)
+			p9ci_plug_flush(p9_handle);
+		return 0;
+	}
+
+	return p9ci_send(p9_handle, data, tag);
+}
+
 
 int p9c_abortrequest(struct p9_handle *p9_handle, msk_data_t *data, uint16_t tag) {
-	/* release data and tag, getreply code */
-	pthread_mutex_lock(&p9_handle->wdata_lock);
-	clear_bit(p9_handle->wdata_bitmap, p9_handle->tags[tag].wdata_i);
-	pthread_cond_signal(&p9_handle->wdata_cond);
-	pthread_mutex_unlock(&p9_handle->wdata_lock);
+	struct p9_pool *pool;
 
-	pthread_mutex_lock(&p9_handle->tag_lock);
 	if (tag == P9_NOTAG)
 		tag = p9_handle->max_tag -1;
+
+	/* release data and tag, getreply code */
+	p9ci_wdata_release(p9_handle, tag);
+
+	pool = &p9_handle->rpool[p9_handle->tags[tag].rclass];
+
+	pthread_mutex_lock(&p9_handle->tag_lock);
 	clear_bit(p9_handle->tags_bitmap, tag);
-	pthread_cond_broadcast(&p9_handle->tag_cond);
+	p9c_cond_release(&p9_handle->tag_cond, &p9_handle->tag_waitq);
 	pthread_mutex_unlock(&p9_handle->tag_lock);
 
 	/* ... and credit, putreply code */
 	pthread_mutex_lock(&p9_handle->credit_lock);
+	pool->credits++;
+	pool->inuse--;
 	p9_handle->credits++;
-	pthread_cond_broadcast(&p9_handle->credit_cond);
+	if (p9_handle->window.min && p9_handle->window.inflight)
+		p9_handle->window.inflight--;
+	p9c_cond_release(&p9_handle->credit_cond, &p9_handle->credit_waitq);
 	pthread_mutex_unlock(&p9_handle->credit_lock);
 
 	return 0;
 }
 
 
-int p9c_getreply(struct p9_handle *p9_handle, msk_data_t **pdata, uint16_t tag) {
+void p9c_window_reply(struct p9_handle *p9_handle, uint16_t tag) {
+	struct p9_window *window = &p9_handle->window;
+	uint64_t rtt, *base;
+
+	rtt = p9_stats_rtt(p9_handle, tag);
+	base = &window->base[(p9_handle->tags[tag].msgtype / 2) % P9_STATS_OPS];
+
+	pthread_mutex_lock(&p9_handle->credit_lock);
+	if (window->inflight)
+		window->inflight--;
+
+	if (*base == 0 || rtt < *base)
+		*base = rtt;
+	else if (rtt > *base * P9_WINDOW_SLACK)
+		window->slow++;
+
+	if (++window->acks >= window->size) {
+		if (window->slow * 4 > window->acks)
+			window->size = MAX(window->min, window->size - MAX(1, window->size / 4));
+		else if (window->size < p9_handle->recv_num)
+			window->size++;
+		window->acks = 0;
+		window->slow = 0;
+		/* the server may just have gotten slower for good */
+		if (++window->epochs % P9_WINDOW_REBASE == 0)
+			memset(window->base, 0, sizeof(window->base));
+	}
+
+	p9c_cond_release(&p9_handle->credit_cond, &p9_handle->credit_waitq);
+	pthread_mutex_unlock(&p9_handle->credit_lock);
+}
+
+static inline uint64_t p9ci_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief fold a reply time into spin_rtt, every replying thread does
+ */
+static inline void p9ci_spin_rtt(struct p9_handle *p9_handle, uint64_t rtt) {
+	uint64_t old, new;
+
+	do {
+		old = __atomic_load_n(&p9_handle->spin_rtt, __ATOMIC_RELAXED);
+		new = old + ((int64_t)rtt - (int64_t)old) / 8;
+	} while (!__sync_bool_compare_and_swap(&p9_handle->spin_rtt, old, new));
+}
+
+/**
+ * @brief poll for the reply before parking on recv_cond
+ *
+ * Polls until twice the recent reply time after the request went out,
+ * if that is within spin_max, or for as long as it takes with busy_poll.
+ *
+ * @return 1 if the reply is there
+ */
+static int p9ci_spin(struct p9_handle *p9_handle, uint16_t tag) {
+	struct p9_tag *ptag = &p9_handle->tags[tag];
+	uint64_t budget, deadline = 0;
+	uint32_t i;
+
+	if (!p9_handle->busy_poll) {
+		budget = 2 * __atomic_load_n(&p9_handle->spin_rtt, __ATOMIC_RELAXED);
+		if (budget == 0 || budget > p9_handle->spin_max)
+			return 0;
+		deadline = ptag->sent + budget;
+	}
+
+	for (i = 1; ; i++) {
+		if (__atomic_load_n(&ptag->rdata, __ATOMIC_ACQUIRE) != NULL && !__atomic_load_n(&ptag->sending, __ATOMIC_ACQUIRE)) {
+			p9_stats_spin(p9_handle, 1);
+			return 1;
+		}
+		if (p9_handle->trans->state != MSK_CONNECTED)
+			return 0;
+		/* the clock is cheap but not free */
+		if (deadline && i % 64 == 0 && p9ci_now() > deadline)
+			break;
+		cpu_relax();
+	}
+
+	p9_stats_spin(p9_handle, 0);
+	return 0;
+}
+
+void p9c_event_signal(struct p9_handle *p9_handle) {
+	uint64_t one = 1;
+
+	/* only fails if the counter is about to overflow, it is readable then */
+	if (write(p9_handle->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		ERROR_LOG("eventfd write failed: %s (%d)", strerror(errno), errno);
+}
+
+int p9c_eventfd(struct p9_handle *p9_handle) {
+	uint16_t *events;
+	int fd;
+
+	if (p9_handle == NULL)
+		return -EINVAL;
 
 	pthread_mutex_lock(&p9_handle->recv_lock);
-	while (p9_handle->tags[tag].rdata == NULL && p9_handle->trans->state == MSK_CONNECTED) {
-		pthread_cond_wait(&p9_handle->recv_cond, &p9_handle->recv_lock);
+	if (p9_handle->event_fd < 0) {
+		events = malloc(p9_handle->max_tag * sizeof(uint16_t));
+		fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (events == NULL || fd < 0) {
+			fd = events ? -errno : -ENOMEM;
+			free(events);
+			pthread_mutex_unlock(&p9_handle->recv_lock);
+			return fd;
+		}
+		p9_handle->events = events;
+		p9_handle->event_fd = fd;
 	}
+	fd = p9_handle->event_fd;
+	pthread_mutex_unlock(&p9_handle->recv_lock);
+
+	return fd;
+}
+
+int p9c_notify(struct p9_handle *p9_handle, uint16_t tag) {
+	int signal;
+
+	if (p9_handle == NULL || p9_handle->events == NULL)
+		return EINVAL;
+
+	if (tag == P9_NOTAG)
+		tag = p9_handle->max_tag - 1;
+
+	/* the reply may be there already */
+	pthread_mutex_lock(&p9_handle->recv_lock);
+	p9_handle->tags[tag].notify = 1;
+	signal = p9c_event_done(p9_handle, tag, p9_handle->trans->state != MSK_CONNECTED);
 	pthread_mutex_unlock(&p9_handle->recv_lock);
 
+	if (signal)
+		p9c_event_signal(p9_handle);
+
+	return 0;
+}
+
+int p9c_reap(struct p9_handle *p9_handle, uint16_t *tags, int max) {
+	uint64_t count;
+	int n = 0;
+
+	if (p9_handle == NULL || p9_handle->events == NULL || tags == NULL)
+		return -EINVAL;
+
+	/* reset the fd first, whatever lands after this signals it again */
+	if (read(p9_handle->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return -errno;
+
+	pthread_mutex_lock(&p9_handle->recv_lock);
+	while (n < max && p9_handle->events_head != p9_handle->events_tail)
+		tags[n++] = p9_handle->events[p9_handle->events_head++ % p9_handle->max_tag];
+	/* what is left over keeps the fd readable */
+	if (p9_handle->events_head != p9_handle->events_tail)
+		p9c_event_signal(p9_handle);
+	pthread_mutex_unlock(&p9_handle->recv_lock);
+
+	return n;
+}
+
+int p9c_getreply(struct p9_handle *p9_handle, msk_data_t **pdata, uint16_t tag) {
+	struct p9_pool *pool, *reserved;
+	struct p9_fiber *fiber;
+	msk_data_t *data;
+
+	if (tag == P9_NOTAG)
+		tag = p9_handle->max_tag -1;
+
+	if (p9ci_plugged(p9_handle))
+		p9ci_plug_flush(p9_handle);
+
+	/* with zerocopy the send can complete after the reply */
+	fiber = p9_fiber_current();
+	if (fiber) {
+		/* woken by the callbacks for this very tag, others keep running */
+		pthread_mutex_lock(&p9_handle->recv_lock);
+		while ((p9_handle->tags[tag].rdata == NULL || p9_handle->tags[tag].sending) && p9_handle->trans->state == MSK_CONNECTED) {
+			p9_handle->tags[tag].fiber = fiber;
+			p9_fiber_wait(&p9_handle->recv_lock);
+		}
+		pthread_mutex_unlock(&p9_handle->recv_lock);
+	} else if ((p9_handle->spin_max == 0 && !p9_handle->busy_poll) || !p9ci_spin(p9_handle, tag)) {
+		pthread_mutex_lock(&p9_handle->recv_lock);
+		p9_handle->parked++;
+		while ((p9_handle->tags[tag].rdata == NULL || p9_handle->tags[tag].sending) && p9_handle->trans->state == MSK_CONNECTED) {
+			pthread_cond_wait(&p9_handle->recv_cond, &p9_handle->recv_lock);
+		}
+		p9_handle->parked--;
+		pthread_mutex_unlock(&p9_handle->recv_lock);
+	}
+
 	if (p9_handle->trans->state != MSK_CONNECTED) {
 		p9c_reconnect(p9_handle);
-		p9c_sendrequest(p9_handle, &p9_handle->wdata[p9_handle->tags[tag].wdata_i], tag);
+		p9_stats_retry(p9_handle, tag);
+		p9ci_send(p9_handle, &p9_handle->wpool[p9_handle->tags[tag].wclass].data[p9_handle->tags[tag].wdata_i], tag);
 		return p9c_getreply(p9_handle, pdata, tag);
 	}
 
 	INFO_LOG(p9_handle->debug & P9_DEBUG_RECV, "ack reply for tag %u", tag);
 
-	pthread_mutex_lock(&p9_handle->wdata_lock);
-	clear_bit(p9_handle->wdata_bitmap, p9_handle->tags[tag].wdata_i);
-	pthread_cond_signal(&p9_handle->wdata_cond);
-	pthread_mutex_unlock(&p9_handle->wdata_lock);
+	p9ci_wdata_release(p9_handle, tag);
 
-	*pdata = p9_handle->tags[tag].rdata;
+	data = p9_handle->tags[tag].rdata;
+	p9_stats_reply(p9_handle, tag, data);
+	if (p9_handle->spin_max)
+		p9ci_spin_rtt(p9_handle, p9_stats_rtt(p9_handle, tag));
+	pool = p9_pool_of(p9_handle->rpool, data);
+	pool->state[data - pool->data] = P9_BUF_LOANED;
+
+	/* the reply did not land in the class we counted on, move the promise over */
+	reserved = &p9_handle->rpool[p9_handle->tags[tag].rclass];
+	if (pool != reserved) {
+		pthread_mutex_lock(&p9_handle->credit_lock);
+		reserved->credits++;
+		reserved->inuse--;
+		pool->credits--;
+		pool->inuse++;
+		pthread_mutex_unlock(&p9_handle->credit_lock);
+	}
+
+	*pdata = data;
 	pthread_mutex_lock(&p9_handle->tag_lock);
-	if (tag == P9_NOTAG)
-		tag = p9_handle->max_tag -1;
 	clear_bit(p9_handle->tags_bitmap, tag);
-	pthread_cond_broadcast(&p9_handle->tag_cond);
+	p9c_cond_release(&p9_handle->tag_cond, &p9_handle->tag_waitq);
 	pthread_mutex_unlock(&p9_handle->tag_lock);
 
 	return 0;
 }
 
 
+void p9c_lendreply(struct p9_handle *p9_handle, msk_data_t *data) {
+	struct p9_pool *pool;
+	uint32_t i;
+
+	pool = p9_pool_of(p9_handle->rpool, data);
+	i = data - pool->data;
+
+	pthread_mutex_lock(&p9_handle->credit_lock);
+	/* past recv_num, the pool can still back every credit there is */
+	if (pool->state[i] == P9_BUF_LOANED && pool->lent + p9_handle->recv_num < pool->max) {
+		pool->state[i] = P9_BUF_LENT;
+		pool->lent++;
+		pool->inuse--;
+		p9_handle->credits++;
+		p9c_cond_release(&p9_handle->credit_cond, &p9_handle->credit_waitq);
+	}
+	pthread_mutex_unlock(&p9_handle->credit_lock);
+}
+
 int p9c_putreply(struct p9_handle *p9_handle, msk_data_t *data) {
-	int rc;
+	struct p9_pool *pool;
+	uint32_t i;
+	int lent, rc = 0;
 
-	rc = p9_handle->net_ops->post_n_recv(p9_handle->trans, data, 1, p9_recv_cb, p9_recv_err_cb, NULL);
-	if (rc) {
-		ERROR_LOG("Could not post recv buffer %p: %s (%d)", data, strerror(rc), rc);
-		rc = EIO;
+	pool = p9_pool_of(p9_handle->rpool, data);
+	i = data - pool->data;
+
+	/* zero-copy readers moved data past the header */
+	data->data = p9_pool_buf(pool, i);
+
+	pthread_mutex_lock(&p9_handle->credit_lock);
+	/* a lent buffer gave its credit back already */
+	lent = pool->state[i] == P9_BUF_LENT;
+	if (lent)
+		pool->lent--;
+	else
+		pool->inuse--;
+	if (p9_pool_idle(p9_handle, pool) && i >= p9_pool_last_slab(pool)) {
+		/* keep it, and let go of the slab once all of it is back */
+		pool->state[i] = P9_BUF_FREE;
+		pool->retracted++;
+		if (pool->retracted == pool->count - p9_pool_last_slab(pool)) {
+			p9_pool_shrink(p9_handle, pool);
+			pool->retracted = 0;
+		}
 	} else {
-		pthread_mutex_lock(&p9_handle->credit_lock);
+		rc = p9ci_post(p9_handle, pool, i);
+		if (rc == 0)
+			pool->credits++;
+	}
+	if (!lent) {
 		p9_handle->credits++;
-		pthread_cond_broadcast(&p9_handle->credit_cond);
-		pthread_mutex_unlock(&p9_handle->credit_lock);
+		p9c_cond_release(&p9_handle->credit_cond, &p9_handle->credit_waitq);
 	}
+	pthread_mutex_unlock(&p9_handle->credit_lock);
 
 	return rc;
 }
@@ -300,6 +911,14 @@ int p9c_getfid(struct p9_handle *p9_handle, struct p9_fid **pfid) {
 	fid_i = get_and_set_first_bit(p9_handle->fids_bitmap, p9_handle->max_fid);
 	pthread_mutex_unlock(&p9_handle->fid_lock);
 
+	/* deferred clunks may be sitting on fids */
+	if (fid_i == p9_handle->max_fid && p9_handle->clunkq) {
+		p9_clunkq_flush(p9_handle);
+		pthread_mutex_lock(&p9_handle->fid_lock);
+		fid_i = get_and_set_first_bit(p9_handle->fids_bitmap, p9_handle->max_fid);
+		pthread_mutex_unlock(&p9_handle->fid_lock);
+	}
+
 	if (fid_i == p9_handle->max_fid)
 		return ERANGE;
 
@@ -312,6 +931,8 @@ int p9c_getfid(struct p9_handle *p9_handle, struct p9_fid **pfid) {
 	}
 
 	fid->p9_handle = p9_handle;
+	fid->session = NULL;
+	fid->ioclass = P9_IOCLASS_BULK;
 	fid->fid = fid_i;
 	fid->openflags = 0;
 	fid->offset = 0L;
@@ -0,0 +1,674 @@
+/*
+ * Copyright CEA/DAM/DIF (2013)
+ * Contributor: Dominique Martinet <dominique.martinet@cea.fr>
+ *
+ * This file is part of the space9 9P userspace library.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with space9.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+/**
+ * \file	9p_dcache.c
+ * \brief	persistent block cache on local disk
+ *
+ * Second tier behind the memory block cache: blocks read from the server
+ * are also written to a local directory, and blocks missing from memory
+ * are looked for there before sending any TREAD. Each block is a file
+ * whose name holds the qid path, the qid version, the mtime and the size
+ * the file had when the block was read, followed by the block index, so
+ * there is no metadata to keep consistent: a block is written to a
+ * temporary file, synced and renamed into place by a background thread,
+ * so readers never wait on the disk, and a block found with the wrong
+ * length is thrown away. Blocks are evicted least recently used
+ * first past the size cap, the order surviving restarts through the
+ * block files' mtime.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>	//malloc
+#include <stdio.h>	//snprintf, sscanf
+#include <string.h>	//memset
+#include <inttypes.h>	//uint*_t
+#include <errno.h>	//ENOMEM, ENAMETOOLONG
+#include <pthread.h>	//pthread_*
+#include <unistd.h>	//unlink, getpid, fsync
+#include <fcntl.h>	//open
+#include <dirent.h>	//opendir
+#include <time.h>	//time
+#include <sys/stat.h>	//fstat, futimens
+
+#include "9p_internals.h"
+#include "utils.h"
+
+/* leftover temporary files older than that are from a dead process */
+#define P9_DCACHE_TMP_AGE 60
+
+/* longest block file name after the directory:
+ * "/" path "." version "." mtime "." size "." index */
+#define P9_DCACHE_NAME_LEN (1 + 16 + 1 + 8 + 1 + 16 + 1 + 16 + 1 + 20)
+
+/* blocks waiting for the writer past that are not stored */
+#define P9_DCACHE_QUEUE_MAX 64
+
+struct p9_dcache_entry {
+	uint64_t path;
+	uint32_t version;
+	uint64_t mtime;
+	uint64_t size;
+	uint64_t index;
+	uint32_t bytes;
+	time_t used;
+	struct p9_dcache_entry *hnext;
+	struct p9_dcache_entry *fnext;	/**< other blocks of the same path */
+	struct p9_dcache_entry *prev;	/**< LRU list, oldest first */
+	struct p9_dcache_entry *next;
+};
+
+/** a block copied out of the read path, for the writer thread */
+struct p9_dcache_job {
+	struct p9_dcache_entry *entry;
+	struct p9_dcache_job *next;
+	uint8_t buf[];
+};
+
+/** what blocks of a path must match to be used, set when the file is opened */
+struct p9_dcache_file {
+	uint64_t path;
+	uint32_t version;
+	uint64_t mtime;
+	uint64_t size;		/**< P9_DCACHE_UNKNOWN until opened */
+	struct p9_dcache_entry *entries;
+	struct p9_dcache_file *next;
+};
+
+#define P9_DCACHE_UNKNOWN UINT64_MAX
+
+struct p9_dcache {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;		/**< a job was queued, or stop */
+	pthread_t thrid;
+	int running;
+	int stop;
+	struct p9_dcache_job *jobs_head;
+	struct p9_dcache_job *jobs_tail;
+	uint32_t jobs;
+	char dir[MAXPATHLEN];
+	uint64_t cap;
+	uint64_t used;
+	uint32_t block_size;
+	uint32_t hash_mask;
+	uint32_t tmp_seq;
+	struct p9_dcache_entry **hash;
+	struct p9_dcache_file **files;
+	struct p9_dcache_entry *head;
+	struct p9_dcache_entry *tail;
+};
+
+#define P9_DCACHE_HASH_SIZE 4096
+
+static inline uint32_t p9_dcache_hash(struct p9_dcache *dcache, uint64_t path, uint64_t index) {
+	return (uint32_t)((path * 0x9e3779b97f4a7c15ULL + index) >> 32) & dcache->hash_mask;
+}
+
+/**
+ * p9_dcache_name: block file name of an entry
+ * A name cut short could be another block's, so it is not used.
+ *
+ * @return 0 on success, ENAMETOOLONG if it does not fit
+ */
+static int p9_dcache_name(struct p9_dcache *dcache, struct p9_dcache_entry *entry, char *name) {
+	int len;
+
+	len = snprintf(name, MAXPATHLEN, "%s/%016"PRIx64".%08"PRIx32".%016"PRIx64".%016"PRIx64".%"PRIu64,
+	               dcache->dir, entry->path, entry->version, entry->mtime, entry->size, entry->index);
+
+	return len < 0 || len >= MAXPATHLEN ? ENAMETOOLONG : 0;
+}
+
+/** bytes a block of that file must have */
+static uint32_t p9_dcache_bytes(struct p9_dcache *dcache, uint64_t size, uint64_t index) {
+	uint64_t start = index * dcache->block_size;
+
+	if (start >= size)
+		return 0;
+
+	return MIN(size - start, dcache->block_size);
+}
+
+static struct p9_dcache_file *p9_dcache_file(struct p9_dcache *dcache, uint64_t path, int create) {
+	struct p9_dcache_file *file;
+
+	for (file = dcache->files[p9_dcache_hash(dcache, path, 0)]; file; file = file->next)
+		if (file->path == path)
+			return file;
+
+	if (!create)
+		return NULL;
+
+	file = calloc(1, sizeof(struct p9_dcache_file));
+	if (file == NULL)
+		return NULL;
+	file->path = path;
+	file->size = P9_DCACHE_UNKNOWN;
+	file->next = dcache->files[p9_dcache_hash(dcache, path, 0)];
+	dcache->files[p9_dcache_hash(dcache, path, 0)] = file;
+
+	return file;
+}
+
+static inline int p9_dcache_current(struct p9_dcache_file *file, struct p9_dcache_entry *entry) {
+	return entry->version == file->version && entry->mtime == file->mtime && entry->size == file->size;
+}
+
+static struct p9_dcache_entry *p9_dcache_lookup(struct p9_dcache *dcache, struct p9_dcache_file *file, uint64_t index) {
+	struct p9_dcache_entry *entry;
+
+	if (file == NULL || file->size == P9_DCACHE_UNKNOWN)
+		return NULL;
+
+	for (entry = dcache->hash[p9_dcache_hash(dcache, file->path, index)]; entry; entry = entry->hnext)
+		if (entry->path == file->path && entry->index == index && p9_dcache_current(file, entry))
+			return entry;
+
+	return NULL;
+}
+
+static void p9_dcache_lru_unlink(struct p9_dcache *dcache, struct p9_dcache_entry *entry) {
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		dcache->head = entry->next;
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		dcache->tail = entry->prev;
+	entry->prev = entry->next = NULL;
+}
+
+static void p9_dcache_lru_append(struct p9_dcache *dcache, struct p9_dcache_entry *entry) {
+	entry->prev = dcache->tail;
+	entry->next = NULL;
+	if (dcache->tail)
+		dcache->tail->next = entry;
+	else
+		dcache->head = entry;
+	dcache->tail = entry;
+}
+
+static void p9_dcache_insert(struct p9_dcache *dcache, struct p9_dcache_file *file, struct p9_dcache_entry *entry) {
+	uint32_t h = p9_dcache_hash(dcache, entry->path, entry->index);
+
+	entry->hnext = dcache->hash[h];
+	dcache->hash[h] = entry;
+	entry->fnext = file->entries;
+	file->entries = entry;
+	dcache->used += entry->bytes;
+}
+
+/**
+ * p9_dcache_remove: forget an entry and delete its file
+ * Must hold the lock.
+ */
+static void p9_dcache_remove(struct p9_dcache *dcache, struct p9_dcache_entry *entry) {
+	struct p9_dcache_entry **pentry;
+	char name[MAXPATHLEN];
+
+	struct p9_dcache_file *file;
+
+	for (pentry = &dcache->hash[p9_dcache_hash(dcache, entry->path, entry->index)]; *pentry; pentry = &(*pentry)->hnext) {
+		if (*pentry == entry) {
+			*pentry = entry->hnext;
+			break;
+		}
+	}
+	file = p9_dcache_file(dcache, entry->path, 0);
+	for (pentry = &file->entries; *pentry; pentry = &(*pentry)->fnext) {
+		if (*pentry == entry) {
+			*pentry = entry->fnext;
+			break;
+		}
+	}
+	p9_dcache_lru_unlink(dcache, entry);
+	dcache->used -= entry->bytes;
+
+	if (p9_dcache_name(dcache, entry, name) == 0)
+		unlink(name);
+	free(entry);
+}
+
+/**
+ * p9_dcache_remove_stale: drop the entries of file that don't match it
+ * Must hold the lock.
+ */
+static void p9_dcache_remove_stale(struct p9_dcache *dcache, struct p9_dcache_file *file) {
+	struct p9_dcache_entry *entry, *next;
+
+	for (entry = file->entries; entry; entry = next) {
+		next = entry->fnext;
+		if (!p9_dcache_current(file, entry))
+			p9_dcache_remove(dcache, entry);
+	}
+}
+
+static int p9_dcache_cmp_used(const void *a, const void *b) {
+	const struct p9_dcache_entry *ea = *(struct p9_dcache_entry * const *)a;
+	const struct p9_dcache_entry *eb = *(struct p9_dcache_entry * const *)b;
+
+	return (ea->used > eb->used) - (ea->used < eb->used);
+}
+
+/**
+ * p9_dcache_scan: rebuild the index from the directory
+ */
+static int p9_dcache_scan(struct p9_dcache *dcache) {
+	DIR *dir;
+	struct dirent *dirent;
+	struct stat st;
+	struct p9_dcache_entry *entry, **entries = NULL, **tmp;
+	struct p9_dcache_file *file;
+	size_t n = 0, max = 0, i;
+	char name[MAXPATHLEN];
+	time_t now = time(NULL);
+	int len, rc = 0;
+
+	dir = opendir(dcache->dir);
+	if (dir == NULL)
+		return errno;
+
+	while ((dirent = readdir(dir))) {
+		if (dirent->d_name[0] == '.')
+			continue;
+
+		len = snprintf(name, MAXPATHLEN, "%s/%s", dcache->dir, dirent->d_name);
+		/* too long to be one of ours */
+		if (len < 0 || len >= MAXPATHLEN)
+			continue;
+		if (stat(name, &st) || !S_ISREG(st.st_mode))
+			continue;
+
+		if (strncmp(dirent->d_name, "tmp.", 4) == 0) {
+			if (now - st.st_mtime > P9_DCACHE_TMP_AGE)
+				unlink(name);
+			continue;
+		}
+
+		entry = calloc(1, sizeof(struct p9_dcache_entry));
+		if (entry == NULL) {
+			rc = ENOMEM;
+			break;
+		}
+		if (sscanf(dirent->d_name, "%16"SCNx64".%8"SCNx32".%16"SCNx64".%16"SCNx64".%"SCNu64,
+		           &entry->path, &entry->version, &entry->mtime, &entry->size, &entry->index) != 5
+		    || st.st_size != p9_dcache_bytes(dcache, entry->size, entry->index)) {
+			/* not ours, or cut short by a crash */
+			free(entry);
+			unlink(name);
+			continue;
+		}
+		entry->bytes = st.st_size;
+		entry->used = st.st_mtime;
+
+		if (n == max) {
+			max = max ? 2 * max : 1024;
+			tmp = realloc(entries, max * sizeof(struct p9_dcache_entry *));
+			if (tmp == NULL) {
+				free(entry);
+				rc = ENOMEM;
+				break;
+			}
+			entries = tmp;
+		}
+		entries[n++] = entry;
+	}
+	closedir(dir);
+
+	if (n)
+		qsort(entries, n, sizeof(struct p9_dcache_entry *), p9_dcache_cmp_used);
+	for (i = 0; i < n; i++) {
+		file = rc ? NULL : p9_dcache_file(dcache, entries[i]->path, 1);
+		if (file == NULL) {
+			rc = ENOMEM;
+			free(entries[i]);
+			continue;
+		}
+		p9_dcache_insert(dcache, file, entries[i]);
+		p9_dcache_lru_append(dcache, entries[i]);
+	}
+	free(entries);
+
+	while (dcache->used > dcache->cap && dcache->head)
+		p9_dcache_remove(dcache, dcache->head);
+
+	return rc;
+}
+
+/**
+ * p9_dcache_store: write a block file and index it
+ * Runs in the writer thread, without the lock.
+ *
+ * @return 1 if a block file got renamed into place, 0 otherwise
+ */
+static int p9_dcache_store(struct p9_dcache *dcache, struct p9_dcache_entry *entry, uint8_t *buf) {
+	struct p9_dcache_file *file;
+	char tmpname[MAXPATHLEN], name[MAXPATHLEN];
+	ssize_t rc;
+	int len, fd;
+
+	pthread_mutex_lock(&dcache->lock);
+	len = snprintf(tmpname, MAXPATHLEN, "%s/tmp.%d.%u", dcache->dir, getpid(), dcache->tmp_seq++);
+	pthread_mutex_unlock(&dcache->lock);
+	if (len < 0 || len >= MAXPATHLEN || p9_dcache_name(dcache, entry, name)) {
+		free(entry);
+		return 0;
+	}
+
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		free(entry);
+		return 0;
+	}
+	rc = pwrite(fd, buf, entry->bytes, 0);
+	if (rc != entry->bytes || fdatasync(fd)) {
+		close(fd);
+		unlink(tmpname);
+		free(entry);
+		return 0;
+	}
+	close(fd);
+
+	if (rename(tmpname, name)) {
+		unlink(tmpname);
+		free(entry);
+		return 0;
+	}
+
+	pthread_mutex_lock(&dcache->lock);
+	file = p9_dcache_file(dcache, entry->path, 0);
+	if (file == NULL || !p9_dcache_current(file, entry)) {
+		/* the file changed meanwhile */
+		unlink(name);
+		free(entry);
+	} else if (p9_dcache_lookup(dcache, file, entry->index)) {
+		/* someone else stored the same block */
+		free(entry);
+	} else {
+		entry->used = time(NULL);
+		while (dcache->used + entry->bytes > dcache->cap && dcache->head)
+			p9_dcache_remove(dcache, dcache->head);
+		p9_dcache_insert(dcache, file, entry);
+		p9_dcache_lru_append(dcache, entry);
+	}
+	pthread_mutex_unlock(&dcache->lock);
+
+	return 1;
+}
+
+static void *p9_dcache_thread(void *arg) {
+	struct p9_dcache *dcache = arg;
+	struct p9_dcache_job *job;
+	int renamed = 0, fd;
+
+	pthread_mutex_lock(&dcache->lock);
+	while (1) {
+		if (dcache->jobs_head == NULL && renamed) {
+			/* the renames survive a crash once the directory is synced too */
+			pthread_mutex_unlock(&dcache->lock);
+			fd = open(dcache->dir, O_RDONLY | O_DIRECTORY);
+			if (fd >= 0) {
+				fsync(fd);
+				close(fd);
+			}
+			renamed = 0;
+			pthread_mutex_lock(&dcache->lock);
+			continue;
+		}
+		while (dcache->jobs_head == NULL && !dcache->stop)
+			pthread_cond_wait(&dcache->cond, &dcache->lock);
+		if (dcache->jobs_head == NULL)
+			break;
+
+		job = dcache->jobs_head;
+		dcache->jobs_head = job->next;
+		if (dcache->jobs_head == NULL)
+			dcache->jobs_tail = NULL;
+		dcache->jobs--;
+		pthread_mutex_unlock(&dcache->lock);
+
+		renamed |= p9_dcache_store(dcache, job->entry, job->buf);
+		free(job);
+
+		pthread_mutex_lock(&dcache->lock);
+	}
+	pthread_mutex_unlock(&dcache->lock);
+
+	return NULL;
+}
+
+int p9_dcache_init(struct p9_handle *p9_handle, char *dir, uint64_t cap, uint32_t block_size) {
+	struct p9_dcache *dcache;
+	int rc;
+
+	if (block_size == 0)
+		return EINVAL;
+	if (strlen(dir) + P9_DCACHE_NAME_LEN >= MAXPATHLEN)
+		return ENAMETOOLONG;
+
+	dcache = calloc(1, sizeof(struct p9_dcache));
+	if (dcache == NULL)
+		return ENOMEM;
+
+	strcpy(dcache->dir, dir);
+	dcache->cap = cap;
+	dcache->block_size = block_size;
+	dcache->hash_mask = P9_DCACHE_HASH_SIZE - 1;
+	dcache->hash = calloc(P9_DCACHE_HASH_SIZE, sizeof(struct p9_dcache_entry *));
+	dcache->files = calloc(P9_DCACHE_HASH_SIZE, sizeof(struct p9_dcache_file *));
+	if (dcache->hash == NULL || dcache->files == NULL) {
+		free(dcache->hash);
+		free(dcache->files);
+		free(dcache);
+		return ENOMEM;
+	}
+	pthread_mutex_init(&dcache->lock, NULL);
+	pthread_cond_init(&dcache->cond, NULL);
+	/* so the handle can be torn down if the scan fails */
+	p9_handle->dcache = dcache;
+
+	if (mkdir(dir, 0700) && errno != EEXIST) {
+		rc = errno;
+		ERROR_LOG("Could not create disk cache directory %s: %s (%d)", dir, strerror(rc), rc);
+		return rc;
+	}
+
+	rc = p9_dcache_scan(dcache);
+	if (rc) {
+		ERROR_LOG("Could not read disk cache directory %s: %s (%d)", dir, strerror(rc), rc);
+		return rc;
+	}
+
+	rc = pthread_create(&dcache->thrid, NULL, p9_dcache_thread, dcache);
+	if (rc) {
+		ERROR_LOG("Could not create disk cache thread: %s (%d)", strerror(rc), rc);
+		return rc;
+	}
+	dcache->running = 1;
+
+	INFO_LOG(p9_handle->debug & P9_DEBUG_SETUP, "disk cache in %s: %"PRIu64" of %"PRIu64" bytes used",
+	         dir, dcache->used, cap);
+
+	return 0;
+}
+
+void p9_dcache_destroy(struct p9_handle *p9_handle) {
+	struct p9_dcache *dcache = p9_handle->dcache;
+	struct p9_dcache_entry *entry;
+	struct p9_dcache_file *file;
+	uint32_t i;
+
+	if (dcache == NULL)
+		return;
+
+	/* the thread writes whatever is queued before it stops */
+	if (dcache->running) {
+		pthread_mutex_lock(&dcache->lock);
+		dcache->stop = 1;
+		pthread_cond_signal(&dcache->cond);
+		pthread_mutex_unlock(&dcache->lock);
+		pthread_join(dcache->thrid, NULL);
+	}
+
+	/* the block files stay for the next run */
+	while ((entry = dcache->head)) {
+		dcache->head = entry->next;
+		free(entry);
+	}
+	for (i = 0; i <= dcache->hash_mask; i++) {
+		while ((file = dcache->files[i])) {
+			dcache->files[i] = file->next;
+			free(file);
+		}
+	}
+
+	pthread_cond_destroy(&dcache->cond);
+	pthread_mutex_destroy(&dcache->lock);
+	free(dcache->hash);
+	free(dcache->files);
+	free(dcache);
+	p9_handle->dcache = NULL;
+}
+
+void p9_dcache_validate(struct p9_handle *p9_handle, uint64_t path, uint32_t version, uint64_t mtime, uint64_t size) {
+	struct p9_dcache *dcache = p9_handle->dcache;
+	struct p9_dcache_file *file;
+
+	pthread_mutex_lock(&dcache->lock);
+	file = p9_dcache_file(dcache, path, 1);
+	if (file) {
+		file->version = version;
+		file->mtime = mtime;
+		file->size = size;
+		p9_dcache_remove_stale(dcache, file);
+	}
+	pthread_mutex_unlock(&dcache->lock);
+}
+
+void p9_dcache_invalidate(struct p9_handle *p9_handle, uint64_t path) {
+	struct p9_dcache *dcache = p9_handle->dcache;
+	struct p9_dcache_file *file;
+
+	pthread_mutex_lock(&dcache->lock);
+	/* nothing matches until the file is opened again */
+	file = p9_dcache_file(dcache, path, 0);
+	if (file) {
+		file->size = P9_DCACHE_UNKNOWN;
+		p9_dcache_remove_stale(dcache, file);
+	}
+	pthread_mutex_unlock(&dcache->lock);
+}
+
+ssize_t p9_dcache_read(struct p9_handle *p9_handle, uint64_t path, uint64_t index, uint8_t *buf) {
+	struct p9_dcache *dcache = p9_handle->dcache;
+	struct p9_dcache_file *file;
+	struct p9_dcache_entry *entry;
+	char name[MAXPATHLEN];
+	uint32_t bytes;
+	ssize_t rc = -1;
+	int fd;
+
+	pthread_mutex_lock(&dcache->lock);
+	file = p9_dcache_file(dcache, path, 0);
+	entry = p9_dcache_lookup(dcache, file, index);
+	if (entry) {
+		p9_dcache_lru_unlink(dcache, entry);
+		p9_dcache_lru_append(dcache, entry);
+		entry->used = time(NULL);
+		bytes = entry->bytes;
+		if (p9_dcache_name(dcache, entry, name))
+			entry = NULL;
+	}
+	pthread_mutex_unlock(&dcache->lock);
+
+	if (entry == NULL)
+		return -1;
+
+	fd = open(name, O_RDONLY);
+	if (fd >= 0) {
+		rc = pread(fd, buf, bytes, 0);
+		/* keep the LRU order for the next run */
+		futimens(fd, NULL);
+		close(fd);
+	}
+
+	if (rc == bytes) {
+		p9_stats_disk_hit(p9_handle);
+		return rc;
+	}
+
+	INFO_LOG(p9_handle->debug & P9_DEBUG_LIBC, "disk cache block %s unreadable, dropping it", name);
+	pthread_mutex_lock(&dcache->lock);
+	file = p9_dcache_file(dcache, path, 0);
+	entry = p9_dcache_lookup(dcache, file, index);
+	if (entry)
+		p9_dcache_remove(dcache, entry);
+	pthread_mutex_unlock(&dcache->lock);
+
+	return -1;
+}
+
+void p9_dcache_write(struct p9_handle *p9_handle, uint64_t path, uint64_t index, uint8_t *buf, uint32_t bytes) {
+	struct p9_dcache *dcache = p9_handle->dcache;
+	struct p9_dcache_file *file;
+	struct p9_dcache_job *job;
+
+	job = malloc(sizeof(struct p9_dcache_job) + bytes);
+	if (job == NULL)
+		return;
+	job->entry = calloc(1, sizeof(struct p9_dcache_entry));
+	if (job->entry == NULL) {
+		free(job);
+		return;
+	}
+	memcpy(job->buf, buf, bytes);
+
+	pthread_mutex_lock(&dcache->lock);
+	file = p9_dcache_file(dcache, path, 0);
+	/* only whole blocks of a file we know, at most once, and not past what the writer can keep up with */
+	if (file == NULL || file->size == P9_DCACHE_UNKNOWN || bytes == 0 || bytes != p9_dcache_bytes(dcache, file->size, index)
+	    || bytes > dcache->cap || p9_dcache_lookup(dcache, file, index) || dcache->jobs >= P9_DCACHE_QUEUE_MAX) {
+		pthread_mutex_unlock(&dcache->lock);
+		free(job->entry);
+		free(job);
+		return;
+	}
+	job->entry->path = path;
+	job->entry->version = file->version;
+	job->entry->mtime = file->mtime;
+	job->entry->size = file->size;
+	job->entry->index = index;
+	job->entry->bytes = bytes;
+	job->next = NULL;
+	if (dcache->jobs_tail)
+		dcache->jobs_tail->next = job;
+	else
+		dcache->jobs_head = job;
+	dcache->jobs_tail = job;
+	dcache->jobs++;
+	pthread_cond_signal(&dcache->cond);
+	pthread_mutex_unlock(&dcache->lock);
+}
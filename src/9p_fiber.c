@@ -0,0 +1,372 @@
+/*
+ * Copyright CEA/DAM/DIF (2013)
+ * Contributor: Dominique Martinet <dominique.martinet@cea.fr>
+ *
+ * This file is part of the space9 9P userspace library.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with space9.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+/**
+ * \file	9p_fiber.c
+ * \brief	run the blocking API in user-space fibers
+ *
+ * A few threads take turns running many fibers (ucontext). Where the
+ * library would put a fiber's thread to sleep (reply, credit, tag, send
+ * buffer, cache block, clunk flush) the fiber is parked instead and the
+ * thread runs the next one. The lock a fiber waits with is only let go
+ * once the fiber is off its stack, so whoever wakes it holds that lock
+ * and cannot miss it nor have it run twice.
+ *
+ * Fibers move between threads: thread-locals are read again through
+ * p9_fiber_current after any wait, never kept in a register over it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>	//calloc
+#include <inttypes.h>	//uint*_t
+#include <errno.h>	//ENOMEM
+#include <pthread.h>	//pthread_*
+#include <ucontext.h>	//makecontext, swapcontext
+#include <unistd.h>	//sysconf
+#include <sys/mman.h>	//mmap
+
+#include "9p_internals.h"
+#include "utils.h"
+#include "settings.h"
+
+struct p9_fiber {
+	ucontext_t ctx;
+	void (*fn)(void *);
+	void *arg;
+	struct p9_fibers *fibers;
+	struct p9_fiber *next;		/**< run queue, or a waitq */
+	struct p9_waitq *baton;		/**< woken for one unit, to hand on if unused */
+	uint32_t hops;			/**< waiters the baton can still go through */
+	pthread_mutex_t *unlock;	/**< let go once the fiber switched out */
+	uint8_t requeue;		/**< yielded, ready again once switched out */
+	uint8_t done;
+	char *stack;
+	size_t stack_size;
+	struct p9_plug *plug;		/**< see p9c_plug, allocated by 9p_core.c */
+};
+
+struct p9_fibers {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;		/**< something to run, or stop */
+	pthread_cond_t done_cond;	/**< the last fiber ended */
+	struct p9_fiber *head;		/**< ready to run */
+	struct p9_fiber *tail;
+	uint32_t live;
+	uint32_t stop;
+	size_t stack_size;
+	int thrnum;
+	pthread_t *thrid;
+};
+
+static __thread struct p9_fiber *p9_fiber_self;
+static __thread ucontext_t p9_fiber_sched;
+
+/* the barrier keeps the compiler from reusing a thread-local's address across a switch */
+struct p9_fiber *p9_fiber_current(void) {
+	__asm__ __volatile__("" ::: "memory");
+	return p9_fiber_self;
+}
+
+static __attribute__((noinline)) ucontext_t *p9fi_sched(void) {
+	__asm__ __volatile__("" ::: "memory");
+	return &p9_fiber_sched;
+}
+
+struct p9_plug **p9_fiber_plug(void) {
+	struct p9_fiber *fiber = p9_fiber_current();
+
+	return fiber ? &fiber->plug : NULL;
+}
+
+static void p9fi_ready(struct p9_fiber *fiber) {
+	struct p9_fibers *fibers = fiber->fibers;
+
+	fiber->next = NULL;
+	pthread_mutex_lock(&fibers->lock);
+	if (fibers->tail)
+		fibers->tail->next = fiber;
+	else
+		fibers->head = fiber;
+	fibers->tail = fiber;
+	pthread_cond_signal(&fibers->cond);
+	pthread_mutex_unlock(&fibers->lock);
+}
+
+static void p9fi_start(void) {
+	struct p9_fiber *fiber = p9_fiber_current();
+
+	fiber->fn(fiber->arg);
+
+	fiber = p9_fiber_current();
+	fiber->done = 1;
+	setcontext(p9fi_sched());
+}
+
+static void *p9fi_thread(void *arg) {
+	struct p9_fibers *fibers = arg;
+	struct p9_fiber *fiber;
+	pthread_mutex_t *lock;
+
+	pthread_mutex_lock(&fibers->lock);
+	while (1) {
+		while (fibers->head == NULL && !fibers->stop)
+			pthread_cond_wait(&fibers->cond, &fibers->lock);
+		if (fibers->head == NULL)
+			break;
+
+		fiber = fibers->head;
+		fibers->head = fiber->next;
+		if (fibers->head == NULL)
+			fibers->tail = NULL;
+		pthread_mutex_unlock(&fibers->lock);
+
+		p9_fiber_self = fiber;
+		swapcontext(&p9_fiber_sched, &fiber->ctx);
+		p9_fiber_self = NULL;
+
+		/* off its stack now, whoever it waits for may have it */
+		if (fiber->done) {
+			munmap(fiber->stack, fiber->stack_size);
+			free(fiber->plug);
+			free(fiber);
+			pthread_mutex_lock(&fibers->lock);
+			if (--fibers->live == 0)
+				pthread_cond_broadcast(&fibers->done_cond);
+			continue;
+		}
+		if (fiber->requeue) {
+			fiber->requeue = 0;
+			p9fi_ready(fiber);
+		} else if (fiber->unlock) {
+			lock = fiber->unlock;
+			fiber->unlock = NULL;
+			pthread_mutex_unlock(lock);
+		}
+		pthread_mutex_lock(&fibers->lock);
+	}
+	pthread_mutex_unlock(&fibers->lock);
+
+	return NULL;
+}
+
+int p9_fibers_init(struct p9_fibers **pfibers, int thrnum, size_t stack_size) {
+	struct p9_fibers *fibers;
+	int i, rc;
+
+	if (pfibers == NULL || thrnum <= 0)
+		return EINVAL;
+
+	fibers = calloc(1, sizeof(struct p9_fibers));
+	if (fibers == NULL)
+		return ENOMEM;
+
+	fibers->thrid = calloc(thrnum, sizeof(pthread_t));
+	if (fibers->thrid == NULL) {
+		free(fibers);
+		return ENOMEM;
+	}
+
+	fibers->stack_size = stack_size ? stack_size : P9_FIBER_STACK;
+	pthread_mutex_init(&fibers->lock, NULL);
+	pthread_cond_init(&fibers->cond, NULL);
+	pthread_cond_init(&fibers->done_cond, NULL);
+
+	for (i = 0; i < thrnum; i++) {
+		rc = pthread_create(&fibers->thrid[i], NULL, p9fi_thread, fibers);
+		if (rc)
+			break;
+		fibers->thrnum++;
+	}
+
+	if (fibers->thrnum == 0) {
+		pthread_cond_destroy(&fibers->done_cond);
+		pthread_cond_destroy(&fibers->cond);
+		pthread_mutex_destroy(&fibers->lock);
+		free(fibers->thrid);
+		free(fibers);
+		return rc;
+	}
+
+	*pfibers = fibers;
+	return 0;
+}
+
+int p9_fiber_spawn(struct p9_fibers *fibers, void (*fn)(void *), void *arg) {
+	struct p9_fiber *fiber;
+	long pagesize = sysconf(_SC_PAGESIZE);
+
+	if (fibers == NULL || fn == NULL)
+		return EINVAL;
+
+	fiber = calloc(1, sizeof(struct p9_fiber));
+	if (fiber == NULL)
+		return ENOMEM;
+
+	/* only what gets touched is backed, the first page catches overflows */
+	fiber->stack_size = (fibers->stack_size + pagesize - 1) / pagesize * pagesize + pagesize;
+	fiber->stack = mmap(NULL, fiber->stack_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+	if (fiber->stack == MAP_FAILED) {
+		free(fiber);
+		return ENOMEM;
+	}
+	mprotect(fiber->stack, pagesize, PROT_NONE);
+
+	getcontext(&fiber->ctx);
+	fiber->ctx.uc_stack.ss_sp = fiber->stack;
+	fiber->ctx.uc_stack.ss_size = fiber->stack_size;
+	fiber->ctx.uc_link = NULL;
+	makecontext(&fiber->ctx, p9fi_start, 0);
+
+	fiber->fn = fn;
+	fiber->arg = arg;
+	fiber->fibers = fibers;
+
+	pthread_mutex_lock(&fibers->lock);
+	fibers->live++;
+	pthread_mutex_unlock(&fibers->lock);
+
+	p9fi_ready(fiber);
+
+	return 0;
+}
+
+int p9_fibers_join(struct p9_fibers **pfibers) {
+	struct p9_fibers *fibers;
+	int i;
+
+	if (pfibers == NULL || *pfibers == NULL)
+		return EINVAL;
+
+	/* its own thread would never come back to it */
+	if (p9_fiber_current())
+		return EDEADLK;
+
+	fibers = *pfibers;
+
+	pthread_mutex_lock(&fibers->lock);
+	while (fibers->live)
+		pthread_cond_wait(&fibers->done_cond, &fibers->lock);
+	fibers->stop = 1;
+	pthread_cond_broadcast(&fibers->cond);
+	pthread_mutex_unlock(&fibers->lock);
+
+	for (i = 0; i < fibers->thrnum; i++)
+		pthread_join(fibers->thrid[i], NULL);
+
+	pthread_cond_destroy(&fibers->done_cond);
+	pthread_cond_destroy(&fibers->cond);
+	pthread_mutex_destroy(&fibers->lock);
+	free(fibers->thrid);
+	free(fibers);
+	*pfibers = NULL;
+
+	return 0;
+}
+
+void p9_fiber_yield(void) {
+	struct p9_fiber *fiber = p9_fiber_current();
+
+	if (fiber == NULL)
+		return;
+
+	fiber->requeue = 1;
+	swapcontext(&fiber->ctx, p9fi_sched());
+}
+
+void p9_fiber_wait(pthread_mutex_t *lock) {
+	struct p9_fiber *fiber = p9_fiber_current();
+
+	fiber->unlock = lock;
+	swapcontext(&fiber->ctx, p9fi_sched());
+	pthread_mutex_lock(lock);
+}
+
+void p9_fiber_wake(struct p9_fiber *fiber) {
+	p9fi_ready(fiber);
+}
+
+/**
+ * @brief wake up to max fibers of waitq, oldest first
+ *
+ * With hops, the fibers woken hand the wakeup on to the next one if
+ * they have to wait again, through at most hops waiters: one unit freed
+ * wakes one fiber rather than all of them. A fiber that took the unit
+ * without waiting has a request out, its reply wakes the next one.
+ */
+static void p9fi_wake(struct p9_waitq *waitq, uint32_t max, uint32_t hops) {
+	struct p9_fiber *fiber;
+
+	if (hops > waitq->count)
+		hops = waitq->count;
+
+	while ((fiber = waitq->head) != NULL && max--) {
+		waitq->head = fiber->next;
+		if (waitq->head == NULL)
+			waitq->tail = NULL;
+		waitq->count--;
+		fiber->baton = hops ? waitq : NULL;
+		fiber->hops = hops;
+		p9fi_ready(fiber);
+	}
+}
+
+void p9c_cond_wait(pthread_cond_t *cond, struct p9_waitq *waitq, pthread_mutex_t *lock) {
+	struct p9_fiber *fiber = p9_fiber_current();
+
+	if (fiber == NULL) {
+		pthread_cond_wait(cond, lock);
+		return;
+	}
+
+	/* back already, what woke it was not for it */
+	if (fiber->baton == waitq && fiber->hops > 1)
+		p9fi_wake(waitq, 1, fiber->hops - 1);
+	fiber->baton = NULL;
+
+	fiber->next = NULL;
+	if (waitq->tail)
+		waitq->tail->next = fiber;
+	else
+		waitq->head = fiber;
+	waitq->tail = fiber;
+	waitq->count++;
+
+	p9_fiber_wait(lock);
+}
+
+void p9c_cond_broadcast(pthread_cond_t *cond, struct p9_waitq *waitq) {
+	pthread_cond_broadcast(cond);
+	p9fi_wake(waitq, UINT32_MAX, 0);
+}
+
+void p9c_cond_signal(pthread_cond_t *cond, struct p9_waitq *waitq) {
+	pthread_cond_signal(cond);
+	p9fi_wake(waitq, 1, P9_FIBER_HOPS);
+}
+
+void p9c_cond_release(pthread_cond_t *cond, struct p9_waitq *waitq) {
+	pthread_cond_broadcast(cond);
+	p9fi_wake(waitq, 1, P9_FIBER_HOPS);
+}
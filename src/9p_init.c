@@ -32,6 +32,7 @@
 #include <unistd.h>     // gethostname
 #include "9p_internals.h"
 #include "9p_tcp.h"
+#include "9p_null.h"
 #include "utils.h"
 #include "settings.h"
 
@@ -44,6 +45,29 @@ struct p9_conf {
 	uint32_t msize;
 	uint32_t pipeline;
 	uint32_t debug;
+	uint32_t hugepages;
+	int32_t numa_node;
+	uint32_t prefault;
+	uint32_t small_msize;
+	uint32_t buf_idle;
+	uint32_t net_delay;
+	uint32_t net_jitter;
+	uint32_t net_rate;
+	uint32_t net_reorder;
+	uint32_t zerocopy;
+	uint32_t cache_mb;
+	uint32_t cache_block;
+	char disk_cache_dir[MAXPATHLEN];
+	uint32_t disk_cache_mb;
+	uint32_t xattr_cache;
+	uint32_t async_clunk;
+	uint32_t window_min;
+	uint32_t meta_reserve;
+	uint32_t loan_spare;
+	uint32_t bw_limit;
+	uint32_t iops_limit;
+	uint32_t spin_us;
+	uint32_t busy_poll;
 	struct p9_net_ops *net_ops;
 	struct msk_trans_attr trans_attr;
 };
@@ -92,6 +116,21 @@ static struct p9_net_ops p9_tcp_ops = {
 	.dereg_mr = msk_tcp_dereg_mr,
 	.post_n_send = msk_tcp_post_n_send,
 	.post_n_recv = msk_tcp_post_n_recv,
+	.set_recv_sink = msk_tcp_set_recv_sink,
+	.set_zerocopy = msk_tcp_set_zerocopy,
+	.post_n_send_batch = msk_tcp_post_n_send_batch,
+};
+
+static char *p9_net_null_s = "null";
+static struct p9_net_ops p9_null_ops = {
+	.init = msk_null_init,
+	.destroy_trans = msk_null_destroy_trans,
+	.connect = msk_null_connect,
+	.finalize_connect = msk_null_finalize_connect,
+	.reg_mr = msk_null_reg_mr,
+	.dereg_mr = msk_null_dereg_mr,
+	.post_n_send = msk_null_post_n_send,
+	.post_n_recv = msk_null_post_n_recv,
 };
 
 static struct conf conf_array[] = {
@@ -111,6 +150,29 @@ static struct conf conf_array[] = {
 	{ "max_tag", UINT, offsetof(struct p9_conf, max_tag) },
 	{ "pipeline", UINT, offsetof(struct p9_conf, pipeline) },
 	{ "net_type", NET_TYPE, 0 },
+	{ "hugepages", UINT, offsetof(struct p9_conf, hugepages) },
+	{ "numa_node", INT, offsetof(struct p9_conf, numa_node) },
+	{ "prefault", UINT, offsetof(struct p9_conf, prefault) },
+	{ "small_msize", SIZE, offsetof(struct p9_conf, small_msize) },
+	{ "buf_idle", UINT, offsetof(struct p9_conf, buf_idle) },
+	{ "net_delay", UINT, offsetof(struct p9_conf, net_delay) },
+	{ "net_jitter", UINT, offsetof(struct p9_conf, net_jitter) },
+	{ "net_rate", SIZE, offsetof(struct p9_conf, net_rate) },
+	{ "net_reorder", UINT, offsetof(struct p9_conf, net_reorder) },
+	{ "zerocopy", SIZE, offsetof(struct p9_conf, zerocopy) },
+	{ "cache_mb", UINT, offsetof(struct p9_conf, cache_mb) },
+	{ "cache_block", SIZE, offsetof(struct p9_conf, cache_block) },
+	{ "disk_cache_dir", STRING, offsetof(struct p9_conf, disk_cache_dir) },
+	{ "disk_cache_mb", UINT, offsetof(struct p9_conf, disk_cache_mb) },
+	{ "xattr_cache", UINT, offsetof(struct p9_conf, xattr_cache) },
+	{ "async_clunk", UINT, offsetof(struct p9_conf, async_clunk) },
+	{ "window_min", UINT, offsetof(struct p9_conf, window_min) },
+	{ "meta_reserve", UINT, offsetof(struct p9_conf, meta_reserve) },
+	{ "loan_spare", UINT, offsetof(struct p9_conf, loan_spare) },
+	{ "bw_limit", SIZE, offsetof(struct p9_conf, bw_limit) },
+	{ "iops_limit", UINT, offsetof(struct p9_conf, iops_limit) },
+	{ "spin_us", UINT, offsetof(struct p9_conf, spin_us) },
+	{ "busy_poll", UINT, offsetof(struct p9_conf, busy_poll) },
 	{ NULL, 0, 0 }
 };
 
@@ -145,6 +207,20 @@ int parser(char *conf_file, struct p9_conf *p9_conf) {
 	p9_conf->debug = DEFAULT_DEBUG;
 	p9_conf->pipeline = DEFAULT_PIPELINE;
 	p9_conf->trans_attr.debug = DEFAULT_RDMA_DEBUG;
+	p9_conf->hugepages = DEFAULT_HUGEPAGES;
+	p9_conf->numa_node = DEFAULT_NUMA_NODE;
+	p9_conf->prefault = DEFAULT_PREFAULT;
+	p9_conf->small_msize = DEFAULT_SMALL_MSIZE;
+	p9_conf->buf_idle = DEFAULT_BUF_IDLE;
+	p9_conf->cache_block = DEFAULT_CACHE_BLOCK;
+	p9_conf->async_clunk = DEFAULT_ASYNC_CLUNK;
+	p9_conf->window_min = DEFAULT_WINDOW_MIN;
+	p9_conf->meta_reserve = DEFAULT_META_RESERVE;
+	p9_conf->loan_spare = DEFAULT_LOAN_SPARE;
+	p9_conf->bw_limit = DEFAULT_BW_LIMIT;
+	p9_conf->iops_limit = DEFAULT_IOPS_LIMIT;
+	p9_conf->spin_us = DEFAULT_SPIN_US;
+	p9_conf->busy_poll = DEFAULT_BUSY_POLL;
 #if HAVE_MOOSHIKA
 	p9_conf->net_ops = &p9_rdma_ops;
 #else
@@ -162,6 +238,7 @@ int parser(char *conf_file, struct p9_conf *p9_conf) {
 
 			// we have a match
 			switch(conf_array[i].type) {
+				case INT:
 				case UINT:
 					ptr = (char*)p9_conf + conf_array[i].offset;
 					if (sscanf(line, "%*s = %i", (int*)ptr) != 1) {
@@ -230,6 +307,10 @@ int parser(char *conf_file, struct p9_conf *p9_conf) {
 					}
 					if (strncasecmp(buf_s, p9_net_tcp_s, strlen(p9_net_tcp_s)) == 0) {
 						p9_conf->net_ops = &p9_tcp_ops;
+					} else if (strncasecmp(buf_s, p9_net_null_s, strlen(p9_net_null_s)) == 0) {
+						p9_conf->net_ops = &p9_null_ops;
+						/* nothing to connect to */
+						p9_conf->trans_attr.server = 0;
 #if HAVE_MOOSHIKA
 					} else if (strncasecmp(buf_s, p9_net_rdma_s, strlen(p9_net_rdma_s)) == 0) {
 						p9_conf->net_ops = &p9_rdma_ops;
@@ -258,7 +339,7 @@ int parser(char *conf_file, struct p9_conf *p9_conf) {
 		else if(p9_conf->net_ops == &p9_rdma_ops)
 			p9_conf->trans_attr.port = strdup(DEFAULT_PORT_RDMA);
 #endif
-		else
+		else if (p9_conf->net_ops != &p9_null_ops)
 			ERROR_LOG("ops neither tcp nor rdma?");
 	} else {
 		p9_conf->trans_attr.port = port;
@@ -271,14 +352,17 @@ out:
 
 void p9_destroy(struct p9_handle **pp9_handle) {
 	struct p9_handle *p9_handle = *pp9_handle;
+	int i;
+
 	if (p9_handle) {
+		p9_session_destroy_all(p9_handle);
+		p9_clunkq_destroy(p9_handle);
 		if (p9_handle->cwd) {
 			p9p_clunk(p9_handle, &p9_handle->cwd);
 		}
 		if (p9_handle->root_fid) {
 			p9p_clunk(p9_handle, &p9_handle->root_fid);
 		}
-		bitmap_destroy(&p9_handle->wdata_bitmap);
 		bitmap_destroy(&p9_handle->fids_bitmap);
 		bitmap_destroy(&p9_handle->tags_bitmap);
 		bucket_destroy(&p9_handle->fids_bucket);
@@ -286,22 +370,28 @@ void p9_destroy(struct p9_handle **pp9_handle) {
 			free(p9_handle->tags);
 			p9_handle->tags = NULL;
 		}
-		if (p9_handle->wdata) {
-			free(p9_handle->wdata);
-			p9_handle->wdata = NULL;
-		}
-		if (p9_handle->rdata) {
-			p9_handle->net_ops->dereg_mr(p9_handle->rdata[0].mr);
-			free(p9_handle->rdata);
-			p9_handle->rdata = NULL;
-		}
-		if (p9_handle->rdmabuf) {
-			free(p9_handle->rdmabuf);
-			p9_handle->rdmabuf = NULL;
+		/* stop the transport before its buffers go away */
+		for (i = 0; i < P9_BUF_CLASSES; i++) {
+			p9_pool_dereg_mr(p9_handle, &p9_handle->rpool[i]);
+			p9_pool_dereg_mr(p9_handle, &p9_handle->wpool[i]);
 		}
 		if (p9_handle->trans) {
 			p9_handle->net_ops->destroy_trans(&p9_handle->trans);
 		}
+		if (p9_handle->event_fd >= 0) {
+			close(p9_handle->event_fd);
+			free(p9_handle->events);
+			p9_handle->events = NULL;
+		}
+		p9_netem_destroy(p9_handle);
+		p9_cache_destroy(p9_handle);
+		p9_dcache_destroy(p9_handle);
+		p9_xcache_destroy(p9_handle);
+		p9_limit_destroy(p9_handle);
+		for (i = 0; i < P9_BUF_CLASSES; i++) {
+			p9_pool_destroy(p9_handle, &p9_handle->rpool[i]);
+			p9_pool_destroy(p9_handle, &p9_handle->wpool[i]);
+		}
 		if (p9_handle->trans_attr.node) {
 			free(p9_handle->trans_attr.node);
 			p9_handle->trans_attr.node = NULL;
@@ -310,6 +400,10 @@ void p9_destroy(struct p9_handle **pp9_handle) {
 			free(p9_handle->trans_attr.port);
 			p9_handle->trans_attr.port = NULL;
 		}
+		if (p9_handle->stats) {
+			free(p9_handle->stats);
+			p9_handle->stats = NULL;
+		}
 		free(p9_handle);
 		*pp9_handle = NULL;
 	}
@@ -319,7 +413,7 @@ int p9_init(struct p9_handle **pp9_handle, char *conf_file) {
 	struct addrinfo hints, *info;
 	struct p9_conf p9_conf;
 	struct p9_handle *p9_handle;
-	int rc, i;
+	int rc;
 
 	rc = parser(conf_file, &p9_conf);
 	if (rc) {
@@ -344,6 +438,21 @@ int p9_init(struct p9_handle **pp9_handle, char *conf_file) {
 
 		p9_handle->debug = p9_conf.debug;
 		p9_handle->pipeline = p9_conf.pipeline;
+		p9_handle->hugepages = p9_conf.hugepages;
+		p9_handle->numa_node = p9_conf.numa_node;
+		p9_handle->prefault = p9_conf.prefault;
+		p9_handle->buf_idle = p9_conf.buf_idle;
+		p9_handle->zerocopy = p9_conf.zerocopy;
+		p9_handle->cache_block = p9_conf.cache_block;
+		p9_handle->spin_max = (uint64_t)p9_conf.spin_us * 1000;
+		p9_handle->busy_poll = p9_conf.busy_poll;
+		/* polling would only hold off whoever is to deliver the reply */
+		if ((p9_handle->spin_max || p9_handle->busy_poll) && sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+			INFO_LOG(p9_handle->debug & P9_DEBUG_SETUP, "single cpu, not polling for replies");
+			p9_handle->spin_max = 0;
+			p9_handle->busy_poll = 0;
+		}
+		p9_handle->event_fd = -1;
 		p9_handle->uid = p9_conf.uid;
 		p9_handle->recv_num = p9_conf.trans_attr.rq_depth;
 		p9_handle->msize = p9_conf.msize;
@@ -370,36 +479,53 @@ int p9_init(struct p9_handle **pp9_handle, char *conf_file) {
 		strncpy(p9_handle->hostname, info->ai_canonname, MAX_CANON);
 		freeaddrinfo(info);
 
-		/* alloc buffers */
-		p9_handle->rdmabuf = malloc(2 * p9_handle->recv_num * p9_conf.msize);
-		p9_handle->rdata = malloc(p9_handle->recv_num * sizeof(msk_data_t));
-		p9_handle->wdata = malloc(p9_handle->recv_num * sizeof(msk_data_t));
-		if (p9_handle->rdmabuf == NULL || p9_handle->rdata == NULL || p9_handle->wdata == NULL) {
-			ERROR_LOG("Could not allocate data buffer (%luMB)",
-			          2 * p9_handle->recv_num * (p9_conf.msize + sizeof(msk_data_t)) / 1024 / 1024);
-			rc = ENOMEM;
+		/* Buffer pools. Only the transport can pick receive buffers by
+		 * size (tcp reads the length first, null builds the reply), rdma
+		 * replies land in whatever is posted next so they all have to be
+		 * large there */
+		p9_handle->small_msize = p9_conf.small_msize;
+		if (p9_handle->small_msize && p9_handle->small_msize < P9_SMALL_MSIZE_MIN)
+			p9_handle->small_msize = P9_SMALL_MSIZE_MIN;
+		if (p9_handle->small_msize >= p9_handle->msize)
+			p9_handle->small_msize = 0;
+
+		/* receive pools have room for spares to swap loaned replies with */
+		rc = p9_pool_init(p9_handle, &p9_handle->rpool[P9_BUF_SMALL], p9_handle->small_msize,
+		                  (p9_handle->small_msize && (p9_handle->net_ops == &p9_tcp_ops || p9_handle->net_ops == &p9_null_ops))
+		                  ? p9_handle->recv_num + p9_conf.loan_spare : 0, 0);
+		if (!rc)
+			rc = p9_pool_init(p9_handle, &p9_handle->rpool[P9_BUF_LARGE], p9_handle->msize, p9_handle->recv_num + p9_conf.loan_spare, 0);
+		if (!rc)
+			rc = p9_pool_init(p9_handle, &p9_handle->wpool[P9_BUF_SMALL], p9_handle->small_msize,
+			                  p9_handle->small_msize ? p9_handle->recv_num : 0, 1);
+		if (!rc)
+			rc = p9_pool_init(p9_handle, &p9_handle->wpool[P9_BUF_LARGE], p9_handle->msize, p9_handle->recv_num, 1);
+		if (rc) {
+			ERROR_LOG("Could not allocate buffer pools");
 			break;
 		}
-		memset(p9_handle->rdata, 0, p9_handle->recv_num * sizeof(msk_data_t));
-		memset(p9_handle->wdata, 0, p9_handle->recv_num * sizeof(msk_data_t));
 
-		for (i=0; i < p9_handle->recv_num; i++) {
-			p9_handle->rdata[i].data = p9_handle->rdmabuf + i * p9_handle->msize;
-			p9_handle->wdata[i].data = p9_handle->rdata[i].data + p9_handle->recv_num * p9_handle->msize;
-			p9_handle->rdata[i].size = p9_handle->rdata[i].max_size = p9_handle->wdata[i].max_size = p9_handle->msize;
-		}
+		/* tcp needs a recv context for each buffer of either class */
+		p9_handle->trans_attr.rq_depth = p9_handle->rpool[P9_BUF_SMALL].max + p9_handle->rpool[P9_BUF_LARGE].max;
 		p9_handle->credits = p9_handle->recv_num;
+		/* bulk transfers always keep at least half */
+		p9_handle->meta_reserve = MIN(p9_conf.meta_reserve, p9_handle->recv_num / 2);
+		if (p9_conf.window_min) {
+			p9_handle->window.min = MIN(p9_conf.window_min, p9_handle->recv_num);
+			p9_handle->window.size = p9_handle->recv_num;
+		}
 
 		 /* bitmaps, divide by /8 (=/64*8)*/
-		p9_handle->wdata_bitmap = bitmap_init(p9_handle->recv_num);
 		p9_handle->fids_bitmap = bitmap_init(p9_handle->max_fid);
 		p9_handle->tags_bitmap = bitmap_init(p9_handle->max_tag);
 		p9_handle->fids_bucket = bucket_init(p9_handle->max_fid/8, sizeof(struct p9_fid));
 		p9_handle->tags = calloc(1, p9_handle->max_tag * sizeof(struct p9_tag));
 		p9_handle->fids = calloc(1, p9_handle->max_fid * sizeof(void*));
-		if (p9_handle->wdata_bitmap == NULL || p9_handle->fids_bitmap == NULL ||
+		p9_handle->stats = calloc(1, sizeof(struct p9_stats));
+		if (p9_handle->fids_bitmap == NULL ||
 		    p9_handle->tags_bitmap == NULL || p9_handle->fids_bucket == NULL ||
-		    p9_handle->tags == NULL || p9_handle->fids == NULL) {
+		    p9_handle->tags == NULL || p9_handle->fids == NULL ||
+		    p9_handle->stats == NULL) {
 			rc = ENOMEM;
 			break;
 		}
@@ -415,6 +541,41 @@ int p9_init(struct p9_handle **pp9_handle, char *conf_file) {
 		pthread_mutex_init(&p9_handle->credit_lock, NULL);
 		pthread_cond_init(&p9_handle->credit_cond, NULL);
 
+		if (p9_conf.net_delay || p9_conf.net_jitter || p9_conf.net_rate || p9_conf.net_reorder) {
+			rc = p9_netem_init(p9_handle, p9_conf.net_delay, p9_conf.net_jitter, p9_conf.net_rate, p9_conf.net_reorder);
+			if (rc)
+				break;
+		}
+
+		/* the disk cache sits behind a memory cache, give it a small one if needed */
+		if (p9_conf.disk_cache_dir[0] && p9_conf.disk_cache_mb) {
+			rc = p9_dcache_init(p9_handle, p9_conf.disk_cache_dir, (uint64_t)p9_conf.disk_cache_mb * 1024 * 1024, p9_conf.cache_block);
+			if (rc)
+				break;
+			if (p9_conf.cache_mb == 0)
+				rc = p9_cache_init(p9_handle, (uint64_t)P9_DCACHE_MEM_BLOCKS * p9_conf.cache_block, p9_conf.cache_block);
+		}
+		if (rc == 0 && p9_conf.cache_mb)
+			rc = p9_cache_init(p9_handle, (uint64_t)p9_conf.cache_mb * 1024 * 1024, p9_conf.cache_block);
+		if (rc)
+			break;
+
+		if (p9_conf.xattr_cache) {
+			rc = p9_xcache_init(p9_handle, p9_conf.xattr_cache);
+			if (rc)
+				break;
+		}
+
+		rc = p9_limit_init(p9_handle, p9_conf.bw_limit, p9_conf.iops_limit);
+		if (rc)
+			break;
+
+		if (p9_conf.async_clunk) {
+			rc = p9_clunkq_init(p9_handle);
+			if (rc)
+				break;
+		}
+
 		rc = p9c_reconnect(p9_handle);
 		if (rc)
 			break;
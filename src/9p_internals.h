@@ -60,6 +60,8 @@ struct ibv_qp_init_attr	{
 	int			sq_sig_all;
 };
 
+#define MSK_SERVER_CHILD -1
+
 /**
  * \struct msk_trans
  * RDMA transport instance
@@ -158,9 +160,44 @@ static inline void p9_get_tag(uint16_t *ptag, uint8_t *data) {
 	memcpy(ptag, data + sizeof(uint32_t) /* msg len */ + sizeof(uint8_t) /* msg type */, sizeof(uint16_t));
 }
 
+/**
+ * \struct p9_waitq
+ * fibers waiting on the cond it goes with, under that cond's lock
+ */
+struct p9_waitq {
+	struct p9_fiber *head;
+	struct p9_fiber *tail;
+	uint32_t count;
+};
+
 struct p9_tag {
 	msk_data_t *rdata;
 	uint32_t wdata_i;
+	uint8_t rclass;		/**< receive buffer class reserved for the reply */
+	uint8_t wclass;		/**< send buffer class wdata_i belongs to */
+	uint8_t msgtype;	/**< request type, for stats */
+	uint64_t sent;		/**< monotonic ns at p9c_sendrequest, for stats */
+	uint8_t *rbuf;		/**< where the payload of a RREAD goes, NULL to keep it in rdata */
+	uint32_t rsize;
+	uint8_t sending;	/**< request buffers still in the transport's hands */
+	uint8_t notify;		/**< queue for p9c_reap when done, under recv_lock */
+	struct p9_fiber *fiber;	/**< fiber parked in p9c_getreply, under recv_lock */
+};
+
+/**
+ * Returns the buffer the payload of the RREAD with that tag should be
+ * read into, and its size in psize, or NULL to receive it as usual.
+ */
+typedef uint8_t *(*p9_recv_sink_t)(msk_trans_t *trans, uint16_t tag, uint32_t *psize);
+
+/**
+ * \struct p9_send_req
+ * one message of a batch send
+ */
+struct p9_send_req {
+	msk_data_t *data;
+	int num_sge;
+	void *callback_arg;
 };
 
 struct p9_net_ops {
@@ -175,6 +212,96 @@ struct p9_net_ops {
 
 	int (*post_n_recv)(msk_trans_t *trans, msk_data_t *data, int num_sge, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg);
 	int (*post_n_send)(msk_trans_t *trans, msk_data_t *data, int num_sge, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg);
+
+	/* optional, transports that can receive read payloads in place */
+	void (*set_recv_sink)(msk_trans_t *trans, p9_recv_sink_t sink);
+	/* optional, transports that can send big segments without copying them */
+	void (*set_zerocopy)(msk_trans_t *trans, uint32_t min_size);
+	/* optional, transports that can send several messages at once; an error
+	 * means the connection is lost, every message got one of its callbacks */
+	int (*post_n_send_batch)(msk_trans_t *trans, struct p9_send_req *reqs, int count, ctx_callback_t callback, ctx_callback_t err_callback);
+};
+
+/* values for p9_handle->hugepages */
+#define P9_HUGEPAGES_NONE    0
+#define P9_HUGEPAGES_THP     1
+#define P9_HUGEPAGES_HUGETLB 2
+
+/* p9_handle->numa_node: node of the thread calling p9_init */
+#define P9_NUMA_LOCAL -1
+/* p9_handle->numa_node: leave placement to the kernel */
+#define P9_NUMA_NONE  -2
+
+/* buffer classes */
+#define P9_BUF_SMALL   0
+#define P9_BUF_LARGE   1
+#define P9_BUF_CLASSES 2
+
+/* small buffers must fit any request or reply but read, write and readdir */
+#define P9_SMALL_MSIZE_MIN (8*1024)
+
+/* receive buffer states */
+#define P9_BUF_FREE    0	/**< not posted: new, or retracted by an idle shrink */
+#define P9_BUF_POSTED  1	/**< posted to the transport */
+#define P9_BUF_LOANED  2	/**< holding a reply, until putreply */
+#define P9_BUF_LENT    3	/**< same, but its credit is back and a spare takes its place */
+
+/* flags for p9c_getbuffer_flags */
+#define P9_BUF_LARGE_REQUEST 0x01
+#define P9_BUF_LARGE_REPLY   0x02
+#define P9_BUF_BULK          0x04	/**< bulk data, must leave meta_reserve credits alone */
+
+/**
+ * \struct p9_slab
+ * one mapping backing per_slab consecutive buffers of a pool
+ */
+struct p9_slab {
+	uint8_t *buf;
+	size_t size;
+	struct ibv_mr *mr;
+};
+
+/**
+ * \struct p9_pool
+ * Buffers of a single size, backed one slab at a time as they are needed.
+ * Only the first count entries of data are usable, and pools only ever
+ * shrink by their last slab so the backed entries stay contiguous.
+ *
+ * Receive pools are protected by credit_lock, send pools by wdata_lock.
+ */
+struct p9_pool {
+	msk_data_t *data;	/**< max entries */
+	struct p9_slab *slabs;
+	uint8_t *state;		/**< receive pools: P9_BUF_* state of each buffer */
+	bitmap_t *bitmap;	/**< send pools: slots in use, unbacked slots are kept set */
+	uint32_t bufsize;
+	uint32_t max;
+	uint32_t per_slab;
+	uint32_t count;		/**< number of backed buffers */
+	int32_t credits;	/**< receive pools: posted buffers no request counts on yet */
+	uint32_t inuse;		/**< buffers promised to requests */
+	uint32_t peak;		/**< max inuse since the start of the window */
+	uint32_t target;	/**< count to shrink to, from the last window's peak */
+	uint32_t retracted;	/**< receive pools: buffers of the last slab already taken back */
+	uint32_t lent;		/**< receive pools: P9_BUF_LENT buffers */
+	time_t window;
+};
+
+/**
+ * adaptive limit on requests in flight, under credit_lock
+ *
+ * AIMD on reply latency: once per window worth of replies it grows by one,
+ * or shrinks by a quarter if too many replies were slow compared to the
+ * fastest seen for their message type.
+ */
+struct p9_window {
+	uint32_t min;		/**< floor, 0 if the window is fixed at recv_num */
+	uint32_t size;
+	uint32_t inflight;	/**< requests given a buffer and not answered yet */
+	uint32_t acks;		/**< replies since the window last moved */
+	uint32_t slow;		/**< of these, replies past P9_WINDOW_SLACK times their base */
+	uint32_t epochs;
+	uint64_t base[P9_STATS_OPS];	/**< fastest rtt per op since the last rebase, ns */
 };
 
 struct p9_handle {
@@ -182,40 +309,326 @@ struct p9_handle {
 	uint16_t aname_len;
 	char aname[MAXPATHLEN];
 	char hostname[MAX_CANON+1];
-	uint8_t *rdmabuf;
 	struct p9_net_ops *net_ops;
 	msk_trans_t *trans;
-	msk_data_t *rdata;
-	msk_data_t *wdata;
+	struct p9_pool rpool[P9_BUF_CLASSES];
+	struct p9_pool wpool[P9_BUF_CLASSES];
 	pthread_mutex_t wdata_lock;
 	pthread_cond_t wdata_cond;
+	struct p9_waitq wdata_waitq;
 	pthread_mutex_t recv_lock;
 	pthread_cond_t recv_cond;
+	uint32_t parked;	/**< getreply callers waiting on recv_cond, under recv_lock */
+	uint32_t busy_poll;	/**< getreply never parks */
+	uint64_t spin_max;	/**< ns getreply may poll before parking, 0 = never */
+	uint64_t spin_rtt;	/**< recent reply time, ns, to size the polling */
+	int event_fd;		/**< eventfd from p9c_eventfd, -1 until asked for */
+	uint16_t *events;	/**< max_tag ring of done tags for p9c_reap, under recv_lock */
+	uint32_t events_head;
+	uint32_t events_tail;
 	pthread_mutex_t tag_lock;
 	pthread_cond_t tag_cond;
+	struct p9_waitq tag_waitq;
 	pthread_mutex_t fid_lock;
 	pthread_mutex_t connection_lock;
 	pthread_mutex_t credit_lock;
 	pthread_cond_t credit_cond;
+	struct p9_waitq credit_waitq;
 	uint32_t credits;
+	struct p9_window window;
+	uint32_t meta_reserve;	/**< credits and window slots bulk requests leave to the others */
 	uint32_t max_fid;
-	bitmap_t *wdata_bitmap;
 	bitmap_t *tags_bitmap;
 	struct p9_tag *tags;
 	bitmap_t *fids_bitmap;
 	bucket_t *fids_bucket;
 	struct p9_fid **fids;
 	uint32_t uid;
+	struct p9_session *sessions;	/**< other users attached, under connection_lock */
 	uint32_t recv_num;
 	uint32_t msize;
 	uint32_t debug;
 	uint32_t umask;
 	uint32_t pipeline;
+	uint32_t hugepages;
+	int32_t numa_node;
+	uint32_t prefault;
+	uint32_t small_msize;
+	uint32_t buf_idle;
+	uint32_t zerocopy;
+	uint32_t cache_block;
 	struct p9_fid *root_fid;
 	struct p9_fid *cwd;
 	struct msk_trans_attr trans_attr;
+	struct p9_stats *stats;
+	struct p9_netem *netem;
+	struct p9_cache *cache;
+	struct p9_dcache *dcache;
+	struct p9_xcache *xcache;
+	struct p9_clunkq *clunkq;
+	struct p9_limit *limit;
+};
+
+
+// 9p_buffers.c
+
+void *p9_buf_alloc(struct p9_handle *p9_handle, size_t *psize);
+void p9_buf_free(void *buf, size_t size);
+
+int p9_pool_init(struct p9_handle *p9_handle, struct p9_pool *pool, uint32_t bufsize, uint32_t max, int send);
+void p9_pool_destroy(struct p9_handle *p9_handle, struct p9_pool *pool);
+int p9_pool_grow(struct p9_handle *p9_handle, struct p9_pool *pool);
+void p9_pool_shrink(struct p9_handle *p9_handle, struct p9_pool *pool);
+void p9_pool_reg_mr(struct p9_handle *p9_handle, struct p9_pool *pool);
+void p9_pool_dereg_mr(struct p9_handle *p9_handle, struct p9_pool *pool);
+int p9_pool_idle(struct p9_handle *p9_handle, struct p9_pool *pool);
+
+/** first index of the last backed slab */
+static inline uint32_t p9_pool_last_slab(struct p9_pool *pool) {
+	return ((pool->count - 1) / pool->per_slab) * pool->per_slab;
+}
+
+/** start of the i-th buffer of the pool */
+static inline uint8_t *p9_pool_buf(struct p9_pool *pool, uint32_t i) {
+	return pool->slabs[i / pool->per_slab].buf + (size_t)(i % pool->per_slab) * pool->bufsize;
+}
+
+/** pool data belongs to, NULL if none */
+static inline struct p9_pool *p9_pool_of(struct p9_pool *pools, msk_data_t *data) {
+	int i;
+
+	for (i = 0; i < P9_BUF_CLASSES; i++)
+		if (data >= pools[i].data && data < pools[i].data + pools[i].max)
+			return &pools[i];
+
+	return NULL;
+}
+
+// 9p_core.c
+
+/**
+ * @brief p9c_getbuffer with buffer class hints
+ *
+ * @param[in]     p9_handle:	connection handle
+ * @param[out]    pdata:	filled with appropriate buffer
+ * @param[out]    ptag:		available tag to use in the reply. If set to P9_NOTAG, this is taken instead.
+ * @param[in]     flags:	P9_BUF_LARGE_REQUEST/P9_BUF_LARGE_REPLY if either can outgrow small buffers
+ * @return 0 on success, errno value on error
+ */
+int p9c_getbuffer_flags(struct p9_handle *p9_handle, msk_data_t **pdata, uint16_t *ptag, uint32_t flags);
+
+/**
+ * @brief flags for p9c_getbuffer_flags given maximum request and reply sizes
+ */
+uint32_t p9c_bufflags(struct p9_handle *p9_handle, size_t reqsize, size_t replysize);
+
+/**
+ * @brief P9_BUF_BULK unless the fid asked for P9_IOCLASS_META, for its data requests
+ */
+static inline uint32_t p9c_ioflags(struct p9_fid *fid) {
+	return fid->ioclass == P9_IOCLASS_META ? 0 : P9_BUF_BULK;
+}
+
+/**
+ * @brief queue a tag asked for with p9c_notify if it is done
+ *
+ * Must hold recv_lock, and signal event_fd after it if it returned 1.
+ */
+static inline int p9c_event_done(struct p9_handle *p9_handle, uint16_t tag, int force) {
+	struct p9_tag *ptag = &p9_handle->tags[tag];
+
+	if (!ptag->notify || (!force && (ptag->rdata == NULL || ptag->sending)))
+		return 0;
+
+	ptag->notify = 0;
+	p9_handle->events[p9_handle->events_tail++ % p9_handle->max_tag] = tag;
+	return 1;
+}
+
+void p9c_event_signal(struct p9_handle *p9_handle);
+
+/**
+ * @brief account a reply arriving in the adaptive window, from the recv callback
+ */
+void p9c_window_reply(struct p9_handle *p9_handle, uint16_t tag);
+
+// 9p_stats.c
+
+void p9_stats_send(struct p9_handle *p9_handle, uint16_t tag, msk_data_t *data);
+void p9_stats_retry(struct p9_handle *p9_handle, uint16_t tag);
+uint64_t p9_stats_rtt(struct p9_handle *p9_handle, uint16_t tag);
+void p9_stats_reply(struct p9_handle *p9_handle, uint16_t tag, msk_data_t *data);
+void p9_stats_cache(struct p9_handle *p9_handle, int hit);
+void p9_stats_disk_hit(struct p9_handle *p9_handle);
+void p9_stats_throttled(struct p9_handle *p9_handle, uint64_t ns);
+void p9_stats_spin(struct p9_handle *p9_handle, int hit);
+
+// 9p_limit.c
+
+int p9_limit_init(struct p9_handle *p9_handle, uint64_t bytes_per_sec, uint64_t ops_per_sec);
+void p9_limit_destroy(struct p9_handle *p9_handle);
+/* sleep until the request fits in the handle's rate limits */
+void p9_limit_wait(struct p9_handle *p9_handle, msk_data_t *data);
+
+// 9p_fiber.c
+
+/* NULL outside of a fiber; only call it again after a wait, fibers move between threads */
+struct p9_fiber *p9_fiber_current(void);
+/* the fiber's own plug, for 9p_core.c to fill; NULL outside of a fiber */
+struct p9_plug **p9_fiber_plug(void);
+/* like pthread_cond_wait for the caller's fiber, woken by p9_fiber_wake */
+void p9_fiber_wait(pthread_mutex_t *lock);
+void p9_fiber_wake(struct p9_fiber *fiber);
+/* pthread_cond_* that also park or wake fibers in waitq, broadcast/signal with lock held */
+void p9c_cond_wait(pthread_cond_t *cond, struct p9_waitq *waitq, pthread_mutex_t *lock);
+void p9c_cond_broadcast(pthread_cond_t *cond, struct p9_waitq *waitq);
+void p9c_cond_signal(pthread_cond_t *cond, struct p9_waitq *waitq);
+/* one unit of what waiters want was freed: all threads, but fibers one at a time */
+void p9c_cond_release(pthread_cond_t *cond, struct p9_waitq *waitq);
+
+// 9p_netem.c
+
+int p9_netem_init(struct p9_handle *p9_handle, uint32_t delay, uint32_t jitter, uint32_t rate, uint32_t reorder);
+void p9_netem_destroy(struct p9_handle *p9_handle);
+
+// 9p_cache.c
+
+#define P9_CACHE_FREE		0
+#define P9_CACHE_LOADING	1
+#define P9_CACHE_VALID		2
+
+struct p9_cache_block {
+	uint64_t path;		/**< qid path of the file */
+	uint64_t index;		/**< offset in the file / block size */
+	uint32_t size;		/**< bytes cached, less than the block size at end of file */
+	uint32_t refs;		/**< never recycled while in use */
+	uint8_t state;
+	uint8_t stale;		/**< invalidated while loading */
+	uint8_t referenced;	/**< CLOCK bit */
+	uint8_t *buf;
+	struct p9_cache_block *hnext;
+};
+
+int p9_cache_init(struct p9_handle *p9_handle, uint64_t size, uint32_t block_size);
+void p9_cache_destroy(struct p9_handle *p9_handle);
+
+/**
+ * @brief check a file being opened against what was cached for it
+ *
+ * @return 0 on success, errno value if the file cannot be tracked
+ */
+int p9_cache_validate(struct p9_handle *p9_handle, uint64_t path, uint32_t version, uint64_t mtime, uint64_t size);
+
+/**
+ * @brief get a block of a file
+ *
+ * On a hit the block is valid. On a miss it is handed over in the loading
+ * state: the caller fills buf and calls p9_cache_loaded, other users of
+ * that block wait meanwhile. Either way it must be given back with
+ * p9_cache_put.
+ *
+ * @param[in]     wait:		wait for the block being loaded or for a block to recycle,
+ *				instead of failing
+ * @param[out]    hit:		set if the block was cached
+ * @return the block, NULL if none could be had
+ */
+struct p9_cache_block *p9_cache_get(struct p9_handle *p9_handle, uint64_t path, uint64_t index, int wait, int *hit);
+
+/**
+ * @brief end the load of a block
+ *
+ * @param[in]     size:		bytes read into it, -errno value if the read failed
+ */
+void p9_cache_loaded(struct p9_handle *p9_handle, struct p9_cache_block *block, ssize_t size);
+void p9_cache_put(struct p9_handle *p9_handle, struct p9_cache_block *block);
+
+/**
+ * @brief drop the blocks a write went over
+ */
+void p9_cache_invalidate(struct p9_handle *p9_handle, uint64_t path, uint64_t offset, uint64_t count);
+
+// 9p_dcache.c
+
+int p9_dcache_init(struct p9_handle *p9_handle, char *dir, uint64_t cap, uint32_t block_size);
+void p9_dcache_destroy(struct p9_handle *p9_handle);
+void p9_dcache_validate(struct p9_handle *p9_handle, uint64_t path, uint32_t version, uint64_t mtime, uint64_t size);
+
+/**
+ * @brief forget all blocks of a file, until it is validated again
+ */
+void p9_dcache_invalidate(struct p9_handle *p9_handle, uint64_t path);
+
+/**
+ * @brief read a block from disk
+ *
+ * @return size of the block, -1 if it is not there
+ */
+ssize_t p9_dcache_read(struct p9_handle *p9_handle, uint64_t path, uint64_t index, uint8_t *buf);
+
+/**
+ * @brief store a block just read from the server, best effort
+ *
+ * buf is copied and written out by a background thread, dropped if too
+ * many blocks are already waiting.
+ */
+void p9_dcache_write(struct p9_handle *p9_handle, uint64_t path, uint64_t index, uint8_t *buf, uint32_t bytes);
+
+// 9p_session.c
+
+/**
+ * another user attached over the handle's connection
+ */
+struct p9_session {
+	struct p9_handle *p9_handle;
+	uint32_t uid;
+	struct p9_fid *root_fid;
+	struct p9_fid *cwd;
+	struct p9_session *next;
 };
 
+/* root and cwd of the user a fid belongs to */
+static inline struct p9_fid *p9_fid_root(struct p9_fid *fid) {
+	return fid->session ? fid->session->root_fid : fid->p9_handle->root_fid;
+}
+
+static inline struct p9_fid *p9_fid_cwd(struct p9_fid *fid) {
+	return fid->session ? fid->session->cwd : fid->p9_handle->cwd;
+}
+
+static inline uint32_t p9_fid_uid(struct p9_fid *fid) {
+	return fid->session ? fid->session->uid : fid->p9_handle->uid;
+}
+
+/* detach whatever sessions the application left behind */
+void p9_session_destroy_all(struct p9_handle *p9_handle);
+
+// 9p_clunk.c
+int p9_clunkq_init(struct p9_handle *p9_handle);
+/* reaps what is still queued, the transport must still be up */
+void p9_clunkq_destroy(struct p9_handle *p9_handle);
+/* send a TCLUNK, the reply and the fid are taken care of in the background */
+int p9_clunkq_push(struct p9_handle *p9_handle, struct p9_fid **pfid);
+int p9_clunkq_flush(struct p9_handle *p9_handle);
+
+// 9p_xcache.c
+int p9_xcache_init(struct p9_handle *p9_handle, uint32_t entries);
+void p9_xcache_destroy(struct p9_handle *p9_handle);
+
+/**
+ * @brief look an xattr up, copying it to buf the way p9l_fxattrget does
+ *
+ * @param[out]    prc:		cached xattr size or -errno on a hit
+ * @param[out]    pgen:		on a miss, to give back to p9_xcache_put
+ * @return 1 on a hit, 0 on a miss
+ */
+int p9_xcache_get(struct p9_handle *p9_handle, uint64_t path, uint32_t uid, const char *name, char *buf, size_t count, ssize_t *prc, uint64_t *pgen);
+
+/**
+ * @brief remember a whole xattr value (rc bytes) or an error (rc < 0)
+ * nothing is kept if the file was invalidated since gen was handed out
+ */
+void p9_xcache_put(struct p9_handle *p9_handle, uint64_t path, uint32_t uid, const char *name, ssize_t rc, const char *value, uint64_t gen);
+void p9_xcache_invalidate(struct p9_handle *p9_handle, uint64_t path);
 
 // 9p_callbacks.c
 
@@ -223,6 +636,7 @@ void p9_disconnect_cb(msk_trans_t *trans);
 
 void p9_recv_err_cb(msk_trans_t *trans, msk_data_t *data, void *arg);
 void p9_recv_cb(msk_trans_t *trans, msk_data_t *data, void *arg);
+uint8_t *p9_recv_sink(msk_trans_t *trans, uint16_t tag, uint32_t *psize);
 void p9_send_cb(msk_trans_t *trans, msk_data_t *data, void *arg);
 void p9_send_err_cb(msk_trans_t *trans, msk_data_t *data, void *arg);
 
@@ -230,6 +644,8 @@ void p9_send_err_cb(msk_trans_t *trans, msk_data_t *data, void *arg);
 /* utility flags - kernel O_RDONLY sucks for being 0 */
 #define RDFLAG 1
 #define WRFLAG 2
+/* reads may go through the block cache */
+#define CACHEFLAG 4
 
 
 
@@ -251,6 +667,14 @@ ssize_t p9p_write_send(struct p9_handle *p9_handle, struct p9_fid *fid, char *bu
 ssize_t p9p_write_wait(struct p9_handle *p9_handle, uint16_t tag);
 ssize_t p9pz_read_send(struct p9_handle *p9_handle, struct p9_fid *fid, size_t count, uint64_t offset, uint16_t *ptag);
 ssize_t p9pz_read_wait(struct p9_handle *p9_handle, msk_data_t **pdata, uint16_t tag);
+ssize_t p9p_read_send(struct p9_handle *p9_handle, struct p9_fid *fid, char *buf, size_t count, uint64_t offset, uint16_t *ptag);
+ssize_t p9p_read_wait(struct p9_handle *p9_handle, uint16_t tag);
+int p9p_xattrwalk_send(struct p9_handle *p9_handle, struct p9_fid *fid, struct p9_fid **pnewfid, char *name, uint16_t *ptag);
+/* on error the new fid is released and *pnewfid set to NULL */
+int p9p_xattrwalk_wait(struct p9_handle *p9_handle, struct p9_fid **pnewfid, uint64_t *psize, uint16_t tag);
+int p9p_clunk_send(struct p9_handle *p9_handle, struct p9_fid *fid, uint16_t *ptag);
+/* the fid is released whatever the outcome */
+int p9p_clunk_wait(struct p9_handle *p9_handle, struct p9_fid **pfid, uint16_t tag);
 
 static inline uint32_t p9p_write_len(struct p9_handle *p9_handle, uint32_t count) {
 	if (count > p9_handle->msize - P9_ROOM_TWRITE)
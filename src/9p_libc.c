@@ -31,6 +31,19 @@
 #include "9p_internals.h"
 #include "utils.h"
 
+/**
+ * p9li_clunk: clunk without waiting for the reply when possible
+ *
+ * Servers may only report errors of buffered writes when the file is
+ * closed, so fids opened for writing are still clunked synchronously.
+ */
+static int p9li_clunk(struct p9_handle *p9_handle, struct p9_fid **pfid) {
+	if (p9_handle->clunkq && ((*pfid)->openflags & WRFLAG) == 0)
+		return p9_clunkq_push(p9_handle, pfid);
+
+	return p9p_clunk(p9_handle, pfid);
+}
+
 int p9l_walk(struct p9_fid *dfid, char *path, struct p9_fid **pfid, int flags) {
 	struct p9_handle *p9_handle;
 	int rc;
@@ -51,7 +64,7 @@ int p9l_walk(struct p9_fid *dfid, char *path, struct p9_fid **pfid, int flags) {
 				data = NULL;
 			}
 			if (tmp_fid) {
-				p9p_clunk(p9_handle, &tmp_fid);
+				p9li_clunk(p9_handle, &tmp_fid);
 				tmp_fid = NULL;
 			}
 			tmp_fid = fid;
@@ -66,12 +79,12 @@ int p9l_walk(struct p9_fid *dfid, char *path, struct p9_fid **pfid, int flags) {
 				if (path != basename) {
 					basename--;
 					basename[0] = '\0';
-					rc = p9p_walk(p9_handle, (path[0] == '/' ? p9_handle->root_fid : dfid), path, &tmp_dfid);
+					rc = p9p_walk(p9_handle, (path[0] == '/' ? p9_fid_root(dfid) : dfid), path, &tmp_dfid);
 					basename[0] = '/';
 					if (rc)
 						break;
 					if (clunkdir)
-						p9p_clunk(p9_handle, &dfid);
+						p9li_clunk(p9_handle, &dfid);
 					dfid = tmp_dfid;
 					clunkdir = 1;
 				}
@@ -85,7 +98,7 @@ int p9l_walk(struct p9_fid *dfid, char *path, struct p9_fid **pfid, int flags) {
 		}
 		if (!strncmp(path, p9_handle->aname, p9_handle->aname_len))
 			path += p9_handle->aname_len;
-		rc = p9p_walk(p9_handle, (path[0] != '/' ? dfid : p9_handle->root_fid), path, &fid);
+		rc = p9p_walk(p9_handle, (path[0] != '/' ? dfid : p9_fid_root(dfid)), path, &fid);
 		if (rc)
 			break;
 
@@ -97,18 +110,18 @@ int p9l_walk(struct p9_fid *dfid, char *path, struct p9_fid **pfid, int flags) {
 
 	/* cleanup */
 	if (clunkdir) {
-		p9p_clunk(p9_handle, &dfid);
+		p9li_clunk(p9_handle, &dfid);
 	}
 	if (data) {
 		p9pz_readlink_put(p9_handle, data);
 	}
 	if (tmp_fid) {
-		p9p_clunk(p9_handle, &tmp_fid);
+		p9li_clunk(p9_handle, &tmp_fid);
 	}
 
 	if (rec == MAXSYMLINKS) {
 		rc = EMLINK;
-		p9p_clunk(p9_handle, &fid);
+		p9li_clunk(p9_handle, &fid);
 	}
 
 	if (!rc)
@@ -131,10 +144,32 @@ int p9l_clunk(struct p9_fid **pfid) {
 	if (!pfid || !*pfid)
 		return EINVAL;
 
-	if ((*pfid)->fid == (*pfid)->p9_handle->root_fid->fid || (*pfid)->fid == (*pfid)->p9_handle->cwd->fid)
+	if ((*pfid)->fid == p9_fid_root(*pfid)->fid || (*pfid)->fid == p9_fid_cwd(*pfid)->fid)
 		return 0;
 
-	return p9p_clunk((*pfid)->p9_handle, pfid);
+	return p9li_clunk((*pfid)->p9_handle, pfid);
+}
+
+int p9l_clunk_flush(struct p9_handle *p9_handle) {
+	if (p9_handle == NULL)
+		return EINVAL;
+
+	return p9_clunkq_flush(p9_handle);
+}
+
+/**
+ * @brief make a freshly walked fid the new cwd, if it is a directory
+ */
+static int p9li_setcwd(struct p9_fid **pcwd, struct p9_fid *fid) {
+	if (fid->qid.type != P9_QTDIR) {
+		p9p_clunk(fid->p9_handle, &fid);
+		return ENOTDIR;
+	}
+
+	p9p_clunk(fid->p9_handle, pcwd);
+	*pcwd = fid;
+
+	return 0;
 }
 
 int p9l_cd(struct p9_handle *p9_handle, char *path) {
@@ -146,15 +181,32 @@ int p9l_cd(struct p9_handle *p9_handle, char *path) {
 		return EINVAL;
 
 	rc = p9l_rootwalk(p9_handle, path, &fid, 0);
-	if (!rc) {
-		if (fid->qid.type != P9_QTDIR) {
-			rc = ENOTDIR;
-			p9p_clunk(p9_handle, &fid);
-		} else {
-			p9p_clunk(p9_handle, &p9_handle->cwd);
-			p9_handle->cwd = fid;
-		}
-	}
+	if (!rc)
+		rc = p9li_setcwd(&p9_handle->cwd, fid);
+
+	return rc;
+}
+
+struct p9_fid *p9l_session_getcwd(struct p9_session *session) {
+	return session->cwd;
+}
+
+struct p9_fid *p9l_session_getroot(struct p9_session *session) {
+	return session->root_fid;
+}
+
+int p9l_session_cd(struct p9_session *session, char *path) {
+	struct p9_fid *fid;
+	int rc;
+
+	/* sanity checks */
+	if (session == NULL || path == NULL)
+		return EINVAL;
+
+	/* same as p9l_cd: relative from the cwd, absolute from the session's root */
+	rc = p9l_walk(session->cwd, path, &fid, 0);
+	if (!rc)
+		rc = p9li_setcwd(&session->cwd, fid);
 
 	return rc;
 }
@@ -185,7 +237,7 @@ int p9l_rm(struct p9_fid *fid, char *path) {
 			p9l_clunk(&dfid);
 		}
 	} else {
-		rc = p9p_unlinkat(p9_handle, (relative ? fid : p9_handle->root_fid), basename, 0);
+		rc = p9p_unlinkat(p9_handle, (relative ? fid : p9_fid_root(fid)), basename, 0);
 	}
 
 	free(canon_path);
@@ -198,9 +250,19 @@ int p9l_umask(struct p9_handle *p9_handle, uint32_t mask) {
 	return old_mask;
 }
 
+/**
+ * p9li_pipeline: how many reads or writes one caller may keep in flight
+ *
+ * Bulk requests leave meta_reserve credits alone and the replies we have
+ * yet to read hold theirs, so a deeper pipeline would wait on itself.
+ */
+static inline uint32_t p9li_pipeline(struct p9_handle *p9_handle, uint32_t pipeline) {
+	return MAX(MIN(pipeline, p9_handle->recv_num - p9_handle->meta_reserve), 1);
+}
+
 uint32_t p9l_pipeline(struct p9_handle *p9_handle, uint32_t pipeline) {
 	uint32_t old_pipeline = p9_handle->pipeline;
-	p9_handle->pipeline = pipeline;
+	p9_handle->pipeline = p9li_pipeline(p9_handle, pipeline);
 	return old_pipeline;
 }
 
@@ -232,7 +294,7 @@ int p9l_mkdir(struct p9_fid *fid, char *path, uint32_t mode) {
 			p9l_clunk(&dfid);
 		}
 	} else {
-		rc = p9p_mkdir(p9_handle, (relative ? fid : p9_handle->root_fid), basename, (mode ? mode : 0777) & ~p9_handle->umask, 0, NULL);
+		rc = p9p_mkdir(p9_handle, (relative ? fid : p9_fid_root(fid)), basename, (mode ? mode : 0777) & ~p9_handle->umask, 0, NULL);
 	}
 
 	free(canon_path);
@@ -272,7 +334,7 @@ int p9l_symlink(struct p9_fid *cwd, char *target, char *linkname) {
 			p9l_clunk(&dfid);
 		}
 	} else {
-		rc = p9p_symlink(p9_handle, (relative ? cwd : p9_handle->root_fid), basename, target, getegid(), NULL);
+		rc = p9p_symlink(p9_handle, (relative ? cwd : p9_fid_root(cwd)), basename, target, getegid(), NULL);
 	}
 
 	free(canon_path);
@@ -327,7 +389,7 @@ int p9l_link(struct p9_fid *cwd, char *target, char *linkname) {
 					break;
 				}
 			} else {
-				linkname_fid = linkname_relative ? p9_handle->root_fid : cwd;
+				linkname_fid = linkname_relative ? p9_fid_root(cwd) : cwd;
 			}
 		} else {
 			/* is a directory, use it. */
@@ -382,7 +444,7 @@ int p9l_mv(struct p9_fid *cwd, char *src, char *dst) {
 				break;
 			}
 		} else {
-			src_fid = src_relative ? cwd : p9_handle->root_fid;
+			src_fid = src_relative ? cwd : p9_fid_root(cwd);
 		}
 
 		strcpy(dst_canon_path, dst);
@@ -403,7 +465,7 @@ int p9l_mv(struct p9_fid *cwd, char *src, char *dst) {
 					break;
 				}
 			} else {
-				dst_fid = dst_relative ? p9_handle->root_fid : cwd;
+				dst_fid = dst_relative ? p9_fid_root(cwd) : cwd;
 			}
 		} else {
 			/* is a directory, use it. */
@@ -528,6 +590,22 @@ int p9l_cp(struct p9_fid *cwd, char *src, char *dst) {
 	return rc;
 }
 
+/**
+ * p9li_cache_open: let reads of a freshly opened file use the cache, once
+ * what the cache holds for it is known to be current
+ */
+static void p9li_cache_open(struct p9_fid *fid) {
+	struct p9_getattr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.valid = P9_GETATTR_MTIME | P9_GETATTR_SIZE;
+	if (p9p_getattr(fid->p9_handle, fid, &attr))
+		return;
+
+	if (p9_cache_validate(fid->p9_handle, fid->qid.path, fid->qid.version, attr.mtime_sec, attr.size) == 0)
+		fid->openflags |= CACHEFLAG;
+}
+
 int p9l_open(struct p9_fid *cwd, char *path, struct p9_fid **pfid, uint32_t flags, uint32_t mode, uint32_t gid) {
 	struct p9_handle *p9_handle;
 	char *canon_path, *dirname, *basename;
@@ -557,7 +635,7 @@ int p9l_open(struct p9_fid *cwd, char *path, struct p9_fid **pfid, uint32_t flag
 				return EINVAL;
 			}
 
-			rc = p9p_walk(p9_handle, relative ? cwd : p9_handle->root_fid, dirname, &fid);
+			rc = p9p_walk(p9_handle, relative ? cwd : p9_fid_root(cwd), dirname, &fid);
 			if (rc) {
 				INFO_LOG(p9_handle->debug & P9_DEBUG_LIBC, "cannot walk into parent dir '%s', %s (%d)", dirname, strerror(rc), rc);
 				break;
@@ -581,9 +659,11 @@ int p9l_open(struct p9_fid *cwd, char *path, struct p9_fid **pfid, uint32_t flag
 				memset(&attr, 0, sizeof(attr));
 				attr.valid = P9_SETATTR_SIZE;
 				attr.size = 0;
-				p9p_setattr(p9_handle, fid, &attr);				
+				p9p_setattr(p9_handle, fid, &attr);
 			}
 		}
+		if (p9_handle->cache && (fid->openflags & RDFLAG) && fid->qid.type == P9_QTFILE)
+			p9li_cache_open(fid);
 		if (flags & O_APPEND) {
 			p9l_fseek(fid, 0, SEEK_END);
 		} else {
@@ -675,136 +755,184 @@ int p9l_fseek(struct p9_fid *fid, int64_t offset, int whence) {
 	return rc;
 }
 
+/* below that size, copying is cheaper than registering the buffer */
+#define P9_ZC_WRITE_MIN (512*1024)
+
 struct p9_wrpipe {
 	uint16_t tag;
 	msk_data_t data;
 	uint64_t offset;
 };
 
-ssize_t p9l_write(struct p9_fid *fid, char *buffer, size_t count) {
-	ssize_t rc = 0;
-	size_t sent = 0, subsize;
-	struct p9_wrpipe *pipeline;
-	int tag_first, tag_last;
-	const uint32_t n_pipeline = fid->p9_handle->pipeline;
-	const uint32_t chunksize = p9p_write_len(fid->p9_handle, count);
+/**
+ * p9li_pwritev: write iov at offset, keeping up to pipeline TWRITE in
+ * flight across all the segments
+ *
+ * Big segments are registered whole and sent zero-copy, small ones are
+ * copied. fid->offset is not used.
+ *
+ * @return size written on success, -errno value on error.
+ */
+static ssize_t p9li_pwritev(struct p9_fid *fid, const struct iovec *iov, int iovcnt, uint64_t offset) {
+	struct p9_handle *p9_handle = fid->p9_handle;
+	const uint32_t n_pipeline = p9li_pipeline(p9_handle, p9_handle->pipeline);
+	struct p9_wrpipe *pipeline, *pipe;
+	msk_data_t *reg;
+	uint32_t head = 0, tail = 0;
+	size_t issued = 0, total = 0, segoff = 0, subsize;
+	ssize_t rc, err = 0;
+	int seg = 0, stop = 0;
+
+	pipeline = malloc(n_pipeline * sizeof(struct p9_wrpipe));
+	/* reg[i].data is only set if segment i got registered */
+	reg = calloc(iovcnt, sizeof(msk_data_t));
+	if (!pipeline || !reg) {
+		free(pipeline);
+		free(reg);
+		return -ENOMEM;
+	}
 
-	/* sanity checks */
-	if (fid == NULL || buffer == NULL || (fid->openflags & WRFLAG) == 0)
-		return -EINVAL;
+	while (1) {
+		p9c_plug(p9_handle);
+		while (!stop && tail - head < n_pipeline && seg < iovcnt) {
+			if (segoff == iov[seg].iov_len) {
+				seg++;
+				segoff = 0;
+				continue;
+			}
 
-	if (count < 512*1024) { /* copy the buffer if it's less than 500k */
-		do {
-			rc = p9p_write(fid->p9_handle, fid, buffer + sent, count - sent, fid->offset);
-			if (rc <= 0)
+			if (segoff == 0 && iov[seg].iov_len >= P9_ZC_WRITE_MIN && iov[seg].iov_len <= UINT32_MAX) {
+				reg[seg].data = iov[seg].iov_base;
+				reg[seg].max_size = iov[seg].iov_len;
+				if (p9c_reg_mr(p9_handle, &reg[seg]))
+					reg[seg].data = NULL;
+			}
+
+			pipe = &pipeline[tail % n_pipeline];
+			pipe->data.data = (uint8_t*)iov[seg].iov_base + segoff;
+			pipe->data.size = p9p_write_len(p9_handle, MIN(iov[seg].iov_len - segoff, UINT32_MAX));
+			pipe->data.max_size = pipe->data.size;
+			pipe->data.next = NULL;
+			pipe->offset = offset + issued;
+			if (reg[seg].data) {
+				pipe->data.mr = reg[seg].mr;
+				rc = p9pz_write_send(p9_handle, fid, &pipe->data, pipe->offset, &pipe->tag);
+			} else {
+				rc = p9p_write_send(p9_handle, fid, (char*)pipe->data.data, pipe->data.size, pipe->offset, &pipe->tag);
+			}
+			if (rc < 0) {
+				err = rc;
+				stop = 1;
 				break;
-			fid->offset += rc;
-			sent += rc;
-		} while (sent < count);
-	} else { /* register the whole buffer and send it */
-		pipeline = malloc(fid->p9_handle->pipeline * sizeof(struct p9_wrpipe));
-		if (!pipeline) {
-			rc = -ENOMEM;
-		}
-		pipeline[0].data.data = buffer;
-		pipeline[0].data.size = count;
-		pipeline[0].data.max_size = count;
-		p9c_reg_mr(fid->p9_handle, &pipeline[0].data);
-		for (tag_first = 0; tag_first < fid->p9_handle->pipeline; tag_first++) {
-			pipeline[tag_first].data.mr = pipeline[0].data.mr;
-			pipeline[tag_first].data.size = chunksize;
-			pipeline[tag_first].data.max_size = chunksize;
+			}
+			segoff += pipe->data.size;
+			issued += pipe->data.size;
+			tail++;
 		}
+		p9c_unplug(p9_handle);
 
-		tag_first = 1 - fid->p9_handle->pipeline;
-		tag_last = 0;
-		while (rc >= 0) {
-			if (count - sent < chunksize)
-				pipeline[tag_last % n_pipeline].data.size = count - sent;
+		if (head == tail)
+			break;
 
-			pipeline[tag_last % n_pipeline].data.data = buffer + sent;
-			pipeline[tag_last % n_pipeline].offset = fid->offset + sent;
-			rc = p9pz_write_send(fid->p9_handle, fid, &pipeline[tag_last % n_pipeline].data, fid->offset + sent, &pipeline[tag_last % n_pipeline].tag);
-			if (rc < 0)
-				break;
-			sent += pipeline[tag_last % n_pipeline].data.size;
-			tag_last++;
-			if (sent >= count)
-				break;
-			if (tag_first >= 0) {
-				rc = p9pz_write_wait(fid->p9_handle, pipeline[tag_first % n_pipeline].tag);
-				if (rc < 0) {
-					INFO_LOG(fid->p9_handle->debug & P9_DEBUG_LIBC, "write failed: %s (%zd)\n", strerror(-rc), -rc);
-					break;
-				}
-				if (rc != pipeline[tag_first % n_pipeline].data.size) {
-					INFO_LOG(fid->p9_handle->debug & P9_DEBUG_LIBC, "not a full write!!! wrote %zu, expected %u\n", rc, pipeline[tag_first % n_pipeline].data.size);
-					/* fall back to regular write /!\ NEEDS TESTING /!\ */
-					subsize = rc;
-					while (subsize < pipeline[tag_first % n_pipeline].data.size) {
-						rc = p9p_write(fid->p9_handle, fid, pipeline[tag_first % n_pipeline].data.data + subsize, pipeline[tag_first % n_pipeline].data.size - subsize, pipeline[tag_first % n_pipeline].offset + subsize);
-						if (rc < 0)
-							break;
-						subsize += rc;
-					}
-				}
-			}
-			tag_first++;
+		/* RWRITE is parsed the same for both kinds of send */
+		pipe = &pipeline[head % n_pipeline];
+		head++;
+		rc = p9pz_write_wait(p9_handle, pipe->tag);
+		/* past an error or a short write, only drain what's in flight */
+		if (stop)
+			continue;
+		if (rc < 0) {
+			err = rc;
+			stop = 1;
+			continue;
 		}
-		/** FIXME wait for writes even if rc < 0, keep rc for return value - first one matters */
-		if (tag_first < 0)
-			tag_first = 0;
-		while (rc >= 0 && tag_first < tag_last) {
-			rc = p9pz_write_wait(fid->p9_handle, pipeline[tag_first % n_pipeline].tag);
-			if (rc < 0) {
-				INFO_LOG(fid->p9_handle->debug & P9_DEBUG_LIBC, "write failed: %s (%zd)\n", strerror(-rc), -rc);
+
+		subsize = rc;
+		while (subsize < pipe->data.size) {
+			INFO_LOG(p9_handle->debug & P9_DEBUG_LIBC, "not a full write, wrote %zu, expected %u", subsize, pipe->data.size);
+			rc = p9p_write(p9_handle, fid, (char*)pipe->data.data + subsize, pipe->data.size - subsize, pipe->offset + subsize);
+			if (rc <= 0)
 				break;
-			}
-			if (rc != pipeline[tag_first % n_pipeline].data.size) {
-				INFO_LOG(fid->p9_handle->debug & P9_DEBUG_LIBC, "not a full write!!! wrote %zu, expected %u\n", rc, pipeline[tag_first % n_pipeline].data.size);
-				/* fall back to regular write /!\ NEEDS TESTING /!\ */
-				subsize = rc;
-				while (subsize < pipeline[tag_first % n_pipeline].data.size) {
-					rc = p9p_write(fid->p9_handle, fid, pipeline[tag_first % n_pipeline].data.data + subsize, pipeline[tag_first % n_pipeline].data.size - subsize, pipeline[tag_first % n_pipeline].offset + subsize);
-					if (rc < 0)
-						break;
-					subsize += rc;
-				}
-			}
-			tag_first++;
+			subsize += rc;
 		}
+		total += subsize;
+		if (rc < 0)
+			err = rc;
+		if (subsize < pipe->data.size)
+			stop = 1;
+	}
 
-		p9c_dereg_mr(fid->p9_handle, &pipeline[0].data);
-		free(pipeline);
-		fid->offset += sent;
+	for (seg = 0; seg < iovcnt; seg++) {
+		if (reg[seg].data)
+			p9c_dereg_mr(p9_handle, &reg[seg]);
 	}
-	if (rc < 0) {
-		INFO_LOG(fid->p9_handle->debug & P9_DEBUG_LIBC, "write failed on file %s at offset %"PRIu64", error: %s (%zu)", fid->path, fid->offset, strerror(-rc), -rc);
-	} else {
-		rc = sent;
+	free(reg);
+	free(pipeline);
+
+	if (err) {
+		INFO_LOG(p9_handle->debug & P9_DEBUG_LIBC, "write failed on file %s at offset %"PRIu64", error: %s (%zd)", fid->path, offset + total, strerror(-err), -err);
+		return err;
 	}
 
-	return rc;	
+	return total;
 }
 
-ssize_t p9l_writev(struct p9_fid *fid, struct iovec *iov, int iovcnt) {
-	ssize_t rc = 0, total = 0;
+ssize_t p9l_pwritev(struct p9_fid *fid, struct iovec *iov, int iovcnt, uint64_t offset) {
+	ssize_t rc;
+	size_t count = 0;
 	int i;
 
-	if (iovcnt < 0) {
-		return EINVAL;
-	}
+	/* sanity checks */
+	if (fid == NULL || (iov == NULL && iovcnt > 0) || iovcnt < 0 || (fid->openflags & WRFLAG) == 0)
+		return -EINVAL;
 
-	for (i = 0; i < iovcnt; i++) {
-		rc = p9l_write(fid, iov[i].iov_base, iov[i].iov_len);
-		if (rc < 0)
-			break;
-		if (rc < iov[i].iov_len) {
-			rc += total;
-			break;
-		}
-		total += rc;
+	rc = p9li_pwritev(fid, iov, iovcnt, offset);
+
+	/* even a failed write may have gone through in part */
+	if (fid->p9_handle->cache) {
+		for (i = 0; i < iovcnt; i++)
+			count += iov[i].iov_len;
+		p9_cache_invalidate(fid->p9_handle, fid->qid.path, offset, count);
 	}
+
+	return rc;
+}
+
+ssize_t p9l_pwrite(struct p9_fid *fid, char *buffer, size_t count, uint64_t offset) {
+	struct iovec iov;
+
+	if (buffer == NULL)
+		return -EINVAL;
+
+	iov.iov_base = buffer;
+	iov.iov_len = count;
+
+	return p9l_pwritev(fid, &iov, 1, offset);
+}
+
+ssize_t p9l_write(struct p9_fid *fid, char *buffer, size_t count) {
+	ssize_t rc;
+
+	if (fid == NULL)
+		return -EINVAL;
+
+	rc = p9l_pwrite(fid, buffer, count, fid->offset);
+	if (rc > 0)
+		fid->offset += rc;
+
+	return rc;
+}
+
+ssize_t p9l_writev(struct p9_fid *fid, struct iovec *iov, int iovcnt) {
+	ssize_t rc;
+
+	if (fid == NULL)
+		return -EINVAL;
+
+	rc = p9l_pwritev(fid, iov, iovcnt, fid->offset);
+	if (rc > 0)
+		fid->offset += rc;
+
 	return rc;
 }
 
@@ -813,120 +941,256 @@ struct p9_rdpipe {
 	uint32_t size;
 	uint64_t offset;
 	char       *buf;
-	msk_data_t *data;
 };
 
+/**
+ * p9li_preadv: read iov from offset, keeping up to pipeline TREAD in
+ * flight across all the segments
+ *
+ * Stops at end of file. fid->offset is not used.
+ *
+ * @return size read on success, -errno value on error.
+ */
+static ssize_t p9li_preadv(struct p9_fid *fid, const struct iovec *iov, int iovcnt, uint64_t offset) {
+	struct p9_handle *p9_handle = fid->p9_handle;
+	const uint32_t n_pipeline = p9li_pipeline(p9_handle, p9_handle->pipeline);
+	struct p9_rdpipe *pipeline, *pipe;
+	uint32_t head = 0, tail = 0;
+	size_t issued = 0, total = 0, segoff = 0, subsize;
+	ssize_t rc, err = 0;
+	int seg = 0, stop = 0;
+
+	pipeline = malloc(n_pipeline * sizeof(struct p9_rdpipe));
+	if (!pipeline)
+		return -ENOMEM;
+
+	while (1) {
+		p9c_plug(p9_handle);
+		while (!stop && tail - head < n_pipeline && seg < iovcnt) {
+			if (segoff == iov[seg].iov_len) {
+				seg++;
+				segoff = 0;
+				continue;
+			}
 
-ssize_t p9l_read(struct p9_fid *fid, char *buffer, size_t count) {
-	ssize_t rc = 0;
-	size_t total = 0, subsize;
-	struct p9_rdpipe *pipeline;
-	int tag_first, tag_last;
-	const uint32_t n_pipeline = fid->p9_handle->pipeline;
-	const uint32_t chunksize = p9p_read_len(fid->p9_handle, count);
+			pipe = &pipeline[tail % n_pipeline];
+			pipe->buf = (char*)iov[seg].iov_base + segoff;
+			pipe->size = p9p_read_len(p9_handle, MIN(iov[seg].iov_len - segoff, UINT32_MAX));
+			pipe->offset = offset + issued;
+			rc = p9p_read_send(p9_handle, fid, pipe->buf, pipe->size, pipe->offset, &pipe->tag);
+			if (rc < 0) {
+				err = rc;
+				stop = 1;
+				break;
+			}
+			segoff += pipe->size;
+			issued += pipe->size;
+			tail++;
+		}
+		p9c_unplug(p9_handle);
 
-	/* sanity checks */
-	if (fid == NULL || buffer == NULL || (fid->openflags & RDFLAG) == 0 )
-		return -EINVAL;
+		if (head == tail)
+			break;
+
+		pipe = &pipeline[head % n_pipeline];
+		head++;
+		rc = p9p_read_wait(p9_handle, pipe->tag);
+		/* past an error or end of file, only drain what's in flight */
+		if (stop)
+			continue;
+		if (rc < 0) {
+			err = rc;
+			stop = 1;
+			continue;
+		}
+
+		subsize = rc;
+		while (subsize < pipe->size) {
+			INFO_LOG(p9_handle->debug & P9_DEBUG_LIBC, "not a full read, read %zu, expected %u", subsize, pipe->size);
+			rc = p9p_read(p9_handle, fid, pipe->buf + subsize, pipe->size - subsize, pipe->offset + subsize);
+			if (rc <= 0)
+				break;
+			subsize += rc;
+		}
+		total += subsize;
+		if (rc < 0)
+			err = rc;
+		if (subsize < pipe->size)
+			stop = 1;
+	}
 
-	pipeline = malloc(fid->p9_handle->pipeline * sizeof(struct p9_rdpipe));
+	free(pipeline);
 
-	for (tag_first = 0; tag_first < fid->p9_handle->pipeline; tag_first++) {
-		pipeline[tag_first].size = chunksize;
+	if (err) {
+		INFO_LOG(p9_handle->debug & P9_DEBUG_LIBC, "read failed on file %s at offset %"PRIu64", error: %s (%zd)", fid->path, offset + total, strerror(-err), -err);
+		return err;
 	}
 
-	tag_first = 1 - fid->p9_handle->pipeline;
-	tag_last = 0;
-	do {
-		if (count - total < chunksize)
-			pipeline[tag_last % n_pipeline].size = count - total;
+	return total;
+}
 
-		pipeline[tag_last % n_pipeline].buf = buffer + total;
-		pipeline[tag_last % n_pipeline].offset = fid->offset + total;
-		rc = p9pz_read_send(fid->p9_handle, fid, pipeline[tag_last % n_pipeline].size, fid->offset + total, &pipeline[tag_last % n_pipeline].tag);
-		if (rc < 0)
-			break;
-		total += pipeline[tag_last % n_pipeline].size;
-		tag_last++;
-		if (total >= count)
-			break;
-		if (tag_first >= 0) {
-			rc = p9pz_read_wait(fid->p9_handle, &pipeline[tag_first % n_pipeline].data, pipeline[tag_first % n_pipeline].tag);
-			if (rc < 0) {
-				INFO_LOG(fid->p9_handle->debug & P9_DEBUG_LIBC, "write failed: %s (%zd)\n", strerror(-rc), -rc);
+/* cache blocks taken per round, missing ones are read in one pipeline */
+#define P9_CACHE_BATCH 16
+
+/**
+ * p9li_iov_copy: copy len bytes to position pos of the iov stream
+ */
+static void p9li_iov_copy(const struct iovec *iov, int iovcnt, size_t pos, uint8_t *src, size_t len) {
+	size_t n;
+	int i;
+
+	for (i = 0; i < iovcnt && len > 0; i++) {
+		if (pos >= iov[i].iov_len) {
+			pos -= iov[i].iov_len;
+			continue;
+		}
+		n = MIN(len, iov[i].iov_len - pos);
+		memcpy((uint8_t*)iov[i].iov_base + pos, src, n);
+		src += n;
+		len -= n;
+		pos = 0;
+	}
+}
+
+/**
+ * p9li_cache_preadv: p9li_preadv through the block cache
+ *
+ * Hits are copied out without any TREAD. Each run of missing blocks is
+ * read straight into the cache with a single pipelined p9li_preadv.
+ *
+ * @return size read on success, -errno value on error.
+ */
+static ssize_t p9li_cache_preadv(struct p9_fid *fid, const struct iovec *iov, int iovcnt, uint64_t offset) {
+	struct p9_handle *p9_handle = fid->p9_handle;
+	const uint64_t bsize = p9_handle->cache_block;
+	struct p9_cache_block *batch[P9_CACHE_BATCH];
+	struct iovec load[P9_CACHE_BATCH];
+	int hit[P9_CACHE_BATCH];
+	uint64_t first, start, end, skip;
+	size_t count = 0, total = 0;
+	ssize_t rc = 0, got, size;
+	int i, j, k, n, eof = 0;
+
+	for (i = 0; i < iovcnt; i++)
+		count += iov[i].iov_len;
+
+	while (total < count && !eof && rc >= 0) {
+		first = (offset + total) / bsize;
+		n = MIN((offset + count - 1) / bsize - first + 1, P9_CACHE_BATCH);
+		/* only wait while holding nothing, others may wait on what we hold */
+		for (i = 0; i < n; i++) {
+			batch[i] = p9_cache_get(p9_handle, fid->qid.path, first + i, i == 0, &hit[i]);
+			if (batch[i] == NULL)
 				break;
-			}
-			memcpy(pipeline[tag_first % n_pipeline].buf, pipeline[tag_first % n_pipeline].data->data, rc);
-			p9pz_read_put(fid->p9_handle, pipeline[tag_first % n_pipeline].data);
-			if (rc != pipeline[tag_first % n_pipeline].size) {
-				INFO_LOG(fid->p9_handle->debug & P9_DEBUG_LIBC, "not a full read!!! read %zu, expected %u\n", rc, pipeline[tag_first % n_pipeline].size);
-				/* fall back to regular read /!\ NEEDS TESTING /!\ */
-				subsize = rc;
-				while (subsize < pipeline[tag_first % n_pipeline].size) {
-					rc = p9p_read(fid->p9_handle, fid, pipeline[tag_first % n_pipeline].buf + subsize, pipeline[tag_first % n_pipeline].size - subsize, pipeline[tag_first % n_pipeline].offset + subsize);
-					if (rc < 0)
-						break;
-					subsize += rc;
-				}
-			}
 		}
-		tag_first++;
-	} while (count > total);
-	/** FIXME wait for reads even if rc < 0, keep rc for return value - first one matters */
-	if (tag_first < 0)
-		tag_first = 0;
-	while (rc >= 0 && tag_first < tag_last) {
-		rc = p9pz_read_wait(fid->p9_handle, &pipeline[tag_first % n_pipeline].data, pipeline[tag_first % n_pipeline].tag);
-		if (rc < 0) {
-			INFO_LOG(fid->p9_handle->debug & P9_DEBUG_LIBC, "write failed: %s (%zd)\n", strerror(-rc), -rc);
+		n = i;
+		if (n == 0) {
+			rc = -ENOMEM;
 			break;
 		}
-		memcpy(pipeline[tag_first % n_pipeline].buf, pipeline[tag_first % n_pipeline].data->data, rc);
-		p9pz_read_put(fid->p9_handle, pipeline[tag_first % n_pipeline].data);
-		if (rc != pipeline[tag_first % n_pipeline].size) {
-			INFO_LOG(fid->p9_handle->debug & P9_DEBUG_LIBC, "not a full read!!! read %zu, expected %u\n", rc, pipeline[tag_first % n_pipeline].size);
-			/* fall back to regular read /!\ NEEDS TESTING /!\ */
-			subsize = rc;
-			while (subsize < pipeline[tag_first % n_pipeline].size) {
-				rc = p9p_read(fid->p9_handle, fid, pipeline[tag_first % n_pipeline].buf + subsize, pipeline[tag_first % n_pipeline].size - subsize, pipeline[tag_first % n_pipeline].offset + subsize);
-				if (rc < 0)
-					break;
-				subsize += rc;
+
+		if (p9_handle->dcache) {
+			for (i = 0; i < n; i++) {
+				if (hit[i])
+					continue;
+				got = p9_dcache_read(p9_handle, fid->qid.path, first + i, batch[i]->buf);
+				if (got < 0)
+					continue;
+				p9_cache_loaded(p9_handle, batch[i], got);
+				hit[i] = 1;
 			}
 		}
-		tag_first++;
-	}
 
-	if (rc < 0) {
-		INFO_LOG(fid->p9_handle->debug & P9_DEBUG_LIBC, "read failed on file %s at offset %"PRIu64", error: %s (%zu)", fid->path, fid->offset, strerror(-rc), -rc);
-	} else {
-		fid->offset += total;
-		rc = total;
+		for (i = 0; i < n; i = j) {
+			for (j = i; j < n && !hit[j]; j++) {
+				load[j - i].iov_base = batch[j]->buf;
+				load[j - i].iov_len = bsize;
+			}
+			if (j == i) {
+				j++;
+				continue;
+			}
+
+			got = p9li_preadv(fid, load, j - i, (first + i) * bsize);
+			if (got < 0)
+				rc = got;
+			for (k = i; k < j; k++) {
+				skip = (k - i) * bsize;
+				size = got < 0 ? got : (got > skip ? MIN(got - skip, bsize) : 0);
+				p9_cache_loaded(p9_handle, batch[k], size);
+				/* the block is still ours until p9_cache_put */
+				if (size > 0 && p9_handle->dcache)
+					p9_dcache_write(p9_handle, fid->qid.path, first + k, batch[k]->buf, size);
+			}
+		}
+
+		for (i = 0; i < n && rc >= 0 && !eof; i++) {
+			start = MAX((first + i) * bsize, offset + total);
+			end = MIN((first + i) * bsize + batch[i]->size, offset + count);
+			if (end > start) {
+				p9li_iov_copy(iov, iovcnt, start - offset, batch[i]->buf + start - (first + i) * bsize, end - start);
+				total += end - start;
+			}
+			if (batch[i]->size < bsize)
+				eof = 1;
+		}
+
+		for (i = 0; i < n; i++)
+			p9_cache_put(p9_handle, batch[i]);
 	}
 
-	free(pipeline);
+	if (rc < 0)
+		return rc;
+
+	return total;
+}
+
+ssize_t p9l_preadv(struct p9_fid *fid, struct iovec *iov, int iovcnt, uint64_t offset) {
+	/* sanity checks */
+	if (fid == NULL || (iov == NULL && iovcnt > 0) || iovcnt < 0 || (fid->openflags & RDFLAG) == 0)
+		return -EINVAL;
+
+	if (fid->p9_handle->cache && (fid->openflags & CACHEFLAG))
+		return p9li_cache_preadv(fid, iov, iovcnt, offset);
+
+	return p9li_preadv(fid, iov, iovcnt, offset);
+}
+
+ssize_t p9l_pread(struct p9_fid *fid, char *buffer, size_t count, uint64_t offset) {
+	struct iovec iov;
+
+	if (buffer == NULL)
+		return -EINVAL;
+
+	iov.iov_base = buffer;
+	iov.iov_len = count;
+
+	return p9l_preadv(fid, &iov, 1, offset);
+}
+
+ssize_t p9l_read(struct p9_fid *fid, char *buffer, size_t count) {
+	ssize_t rc;
+
+	if (fid == NULL)
+		return -EINVAL;
+
+	rc = p9l_pread(fid, buffer, count, fid->offset);
+	if (rc > 0)
+		fid->offset += rc;
 
 	return rc;
 }
 
 ssize_t p9l_readv(struct p9_fid *fid, struct iovec *iov, int iovcnt) {
-	ssize_t rc = 0, total = 0;
-	int i;
+	ssize_t rc;
 
-	if (iovcnt < 0) {
+	if (fid == NULL)
 		return -EINVAL;
-	}
 
-	for (i = 0; i < iovcnt; i++) {
-		rc = p9l_read(fid, iov[i].iov_base, iov[i].iov_len);
-		if (rc < 0)
-			break;
-		if (rc < iov[i].iov_len) {
-			rc += total;
-			break;
-		}
-		total += rc;
-	}
+	rc = p9l_preadv(fid, iov, iovcnt, fid->offset);
+	if (rc > 0)
+		fid->offset += rc;
+
 	return rc;
 }
 
@@ -963,7 +1227,7 @@ ssize_t p9l_ls(struct p9_fid *cwd, char *path, p9p_readdir_cb cb, void *cb_arg)
 		rc = -ENOTDIR;
 	}
 
-	p9p_clunk(p9_handle, &fid);
+	p9li_clunk(p9_handle, &fid);
 	return rc;
 }
 
@@ -1004,46 +1268,181 @@ ssize_t p9l_xattrset(struct p9_fid *cwd, char *path, char *field, char *buf, siz
 	return rc;
 }
 
-ssize_t p9l_fxattrget(struct p9_fid *fid, char *field, char *buf, size_t count) {
-	ssize_t rc;
+/* attributes in flight at once in p9l_fxattrget_batch, also capped by pipeline */
+#define P9_XATTR_WINDOW 32
+
+struct p9_xattr_state {
+	struct p9_fid *attrfid;
 	uint64_t size;
-	size_t realcount;
-	struct p9_handle *p9_handle;
-	struct p9_fid *attrfid = NULL;
+	uint64_t gen;
+	uint16_t tag;
+	uint8_t todo;
+	uint8_t sent;
+};
 
-	if (fid == NULL || buf == NULL || count == 0)
-		return -EINVAL;
+/**
+ * p9li_fxattrget_window: fetch up to P9_XATTR_WINDOW attributes
+ *
+ * Cache hits are answered right away; for the others the xattrwalks go
+ * out together, then the reads on the fids that came back, then the
+ * clunks, so the whole window costs three round trips.
+ */
+static void p9li_fxattrget_window(struct p9_fid *fid, struct p9_xattr *attrs, int n) {
+	struct p9_handle *p9_handle = fid->p9_handle;
+	struct p9_xattr_state st[P9_XATTR_WINDOW];
+	struct p9_xattr *attr;
+	size_t realcount;
+	ssize_t got, rc;
+	int i;
 
-	p9_handle = fid->p9_handle;
+	for (i = 0; i < n; i++) {
+		attr = &attrs[i];
+		st[i].attrfid = NULL;
+		st[i].sent = 0;
+		st[i].todo = 0;
+		if (attr->buf == NULL || attr->count == 0) {
+			attr->rc = -EINVAL;
+			continue;
+		}
+		if (p9_handle->xcache && p9_xcache_get(p9_handle, fid->qid.path, p9_fid_uid(fid), attr->name, attr->buf, attr->count, &attr->rc, &st[i].gen))
+			continue;
+		st[i].todo = 1;
+	}
 
-	do {
-		rc = p9p_xattrwalk(p9_handle, fid, &attrfid, field, &size);
+	/* xattrwalk */
+	p9c_plug(p9_handle);
+	for (i = 0; i < n; i++) {
+		if (!st[i].todo)
+			continue;
+		rc = p9p_xattrwalk_send(p9_handle, fid, &st[i].attrfid, attrs[i].name, &st[i].tag);
 		if (rc) {
 			INFO_LOG(p9_handle->debug & P9_DEBUG_LIBC, "xattrwalk failed: %s (%zd)", strerror(rc), rc);
-			rc = -rc;
-			break;
+			attrs[i].rc = -rc;
+			continue;
 		}
+		st[i].sent = 1;
+	}
+	p9c_unplug(p9_handle);
+	for (i = 0; i < n; i++) {
+		if (!st[i].sent)
+			continue;
+		st[i].sent = 0;
+		rc = p9p_xattrwalk_wait(p9_handle, &st[i].attrfid, &st[i].size, st[i].tag);
+		if (rc) {
+			INFO_LOG(p9_handle->debug & P9_DEBUG_LIBC, "xattrwalk failed: %s (%zd)", strerror(rc), rc);
+			attrs[i].rc = -rc;
+			/* a missing attribute is worth remembering, other errors are not */
+			if (rc == ENODATA && p9_handle->xcache)
+				p9_xcache_put(p9_handle, fid->qid.path, p9_fid_uid(fid), attrs[i].name, -rc, NULL, st[i].gen);
+		}
+	}
 
-		realcount = MIN(size, count-1);
-
-		rc = p9l_read(attrfid, buf, realcount);
+	/* read */
+	p9c_plug(p9_handle);
+	for (i = 0; i < n; i++) {
+		if (st[i].attrfid == NULL)
+			continue;
+		attrs[i].rc = st[i].size;
+		realcount = MIN(st[i].size, attrs[i].count - 1);
+		attrs[i].buf[0] = '\0';
+		if (realcount == 0)
+			continue;
+		rc = p9p_read_send(p9_handle, st[i].attrfid, attrs[i].buf, realcount, 0, &st[i].tag);
 		if (rc < 0) {
 			INFO_LOG(p9_handle->debug & P9_DEBUG_LIBC, "read failed: %s (%zd)", strerror(-rc), -rc);
-			break;
-		} else if (rc != realcount) {
-			INFO_LOG(p9_handle->debug & P9_DEBUG_LIBC, "read screwup, didn't read everything (expected %zu, got %zu)", realcount, rc);
-			buf[rc] = '\0';
-			//rc = -EIO;
-			break;
+			attrs[i].rc = rc;
+			continue;
+		}
+		st[i].sent = 1;
+	}
+	p9c_unplug(p9_handle);
+	for (i = 0; i < n; i++) {
+		if (!st[i].sent)
+			continue;
+		st[i].sent = 0;
+		attr = &attrs[i];
+		realcount = MIN(st[i].size, attr->count - 1);
+		got = p9p_read_wait(p9_handle, st[i].tag);
+		/* values bigger than msize take more reads */
+		while (got > 0 && got < realcount) {
+			rc = p9p_read(p9_handle, st[i].attrfid, attr->buf + got, realcount - got, got);
+			if (rc <= 0)
+				break;
+			got += rc;
+		}
+		if (got < 0) {
+			INFO_LOG(p9_handle->debug & P9_DEBUG_LIBC, "read failed: %s (%zd)", strerror(-got), -got);
+			attr->rc = got;
+		} else if (got != realcount) {
+			INFO_LOG(p9_handle->debug & P9_DEBUG_LIBC, "read screwup, didn't read everything (expected %zu, got %zu)", realcount, got);
+			attr->buf[got] = '\0';
+		} else {
+			attr->buf[realcount] = '\0';
+			if (realcount == st[i].size && p9_handle->xcache)
+				p9_xcache_put(p9_handle, fid->qid.path, p9_fid_uid(fid), attr->name, attr->rc, attr->buf, st[i].gen);
 		}
+	}
 
-		buf[realcount] = '\0';
-	} while (0);
+	/* clunk */
+	p9c_plug(p9_handle);
+	for (i = 0; i < n; i++) {
+		if (st[i].attrfid == NULL)
+			continue;
+		if (p9p_clunk_send(p9_handle, st[i].attrfid, &st[i].tag))
+			p9c_putfid(p9_handle, &st[i].attrfid);
+		else
+			st[i].sent = 1;
+	}
+	p9c_unplug(p9_handle);
+	for (i = 0; i < n; i++) {
+		if (st[i].sent)
+			p9p_clunk_wait(p9_handle, &st[i].attrfid, st[i].tag);
+	}
+}
 
-	p9p_clunk(p9_handle, &attrfid);
+int p9l_fxattrget_batch(struct p9_fid *fid, struct p9_xattr *attrs, int n) {
+	int window, i;
 
-	return (rc < 0 ? rc : size);
+	if (fid == NULL || n < 0 || (attrs == NULL && n > 0))
+		return -EINVAL;
+
+	window = MAX(MIN(fid->p9_handle->pipeline, P9_XATTR_WINDOW), 1);
+	for (i = 0; i < n; i += window)
+		p9li_fxattrget_window(fid, attrs + i, MIN(window, n - i));
+
+	return 0;
 }
+
+int p9l_xattrget_batch(struct p9_fid *cwd, char *path, struct p9_xattr *attrs, int n) {
+	int rc;
+	struct p9_fid *fid = NULL;
+
+	if (!cwd || !path)
+		return -EINVAL;
+
+	rc = p9l_walk(cwd, path, &fid, 0);
+	if (!rc) {
+		rc = p9l_fxattrget_batch(fid, attrs, n);
+		p9l_clunk(&fid);
+	}
+
+	return rc;
+}
+
+ssize_t p9l_fxattrget(struct p9_fid *fid, char *field, char *buf, size_t count) {
+	struct p9_xattr attr;
+
+	if (fid == NULL || buf == NULL || count == 0)
+		return -EINVAL;
+
+	attr.name = field;
+	attr.buf = buf;
+	attr.count = count;
+	p9li_fxattrget_window(fid, &attr, 1);
+
+	return attr.rc;
+}
+
 ssize_t p9l_fxattrset(struct p9_fid *fid, char *field, char *buf, size_t count, int flags) {
 	ssize_t rc;
 	struct p9_handle *p9_handle;
@@ -1084,6 +1483,10 @@ ssize_t p9l_fxattrset(struct p9_fid *fid, char *field, char *buf, size_t count,
 
 	p9p_clunk(p9_handle, &attrfid);
 
+	/* even a failed set may have changed something */
+	if (p9_handle->xcache)
+		p9_xcache_invalidate(p9_handle, fid->qid.path);
+
 	return rc;
 };
 
@@ -1309,9 +1712,9 @@ ssize_t p9l_rmrf(struct p9_fid *cwd, char *path) {
 
 		if (rc == 2) {
 			rc = 0;
-			p9l_rm(p9_handle->root_fid, fid->path);
+			p9l_rm(p9_fid_root(fid), fid->path);
 			cb_arg.count++;
-			p9p_clunk(p9_handle, &fid);
+			p9li_clunk(p9_handle, &fid);
 			nlist = cb_arg.tail;
 			cb_arg.tail = cb_arg.tail->next;
 			bucket_put(buck, (void **)&nlist);
@@ -1327,5 +1730,12 @@ ssize_t p9l_rmrf(struct p9_fid *cwd, char *path) {
 		}
 	}
 
+	while (cb_arg.tail != NULL) {
+		nlist = cb_arg.tail;
+		cb_arg.tail = cb_arg.tail->next;
+		bucket_put(buck, (void **)&nlist);
+	}
+	bucket_destroy(&buck);
+
 	return (rc ? -rc : cb_arg.count);
 }
@@ -0,0 +1,175 @@
+/*
+ * Copyright CEA/DAM/DIF (2013)
+ * Contributor: Dominique Martinet <dominique.martinet@cea.fr>
+ *
+ * This file is part of the space9 9P userspace library.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with space9.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+/**
+ * \file	9p_limit.c
+ * \brief	bandwidth and request rate limits of a handle
+ *
+ * Two token buckets, bytes and requests, kept as theoretical arrival
+ * times: each request books the time its cost is paid off, so threads
+ * are let out in the order they asked and none can jump the queue. The
+ * buckets allow a burst of P9_LIMIT_BURST worth of traffic.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>	//calloc
+#include <inttypes.h>	//uint*_t
+#include <errno.h>	//ENOMEM
+#include <pthread.h>	//pthread_*
+#include <time.h>	//clock_gettime
+#include <sys/param.h>	//MAX
+
+#include "9p_internals.h"
+#include "9p_proto_internals.h"
+#include "utils.h"
+#include "settings.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+
+struct p9_limit {
+	pthread_mutex_t lock;
+	uint64_t bps;		/**< bytes per second, 0 = unlimited */
+	uint64_t iops;		/**< requests per second, 0 = unlimited */
+	uint64_t bytes_tat;	/**< time the bytes bucket is paid off, ns */
+	uint64_t ops_tat;	/**< same for requests */
+};
+
+static uint64_t p9_limit_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * @brief book cost in a bucket
+ *
+ * Must hold limit->lock.
+ *
+ * @return time the request can go at
+ */
+static uint64_t p9_limit_book(uint64_t *ptat, uint64_t now, uint64_t cost, uint64_t rate) {
+	uint64_t when;
+
+	*ptat = MAX(*ptat, now);
+	when = *ptat > now + P9_LIMIT_BURST ? *ptat - P9_LIMIT_BURST : now;
+	*ptat += cost * NSEC_PER_SEC / rate;
+
+	return when;
+}
+
+/**
+ * @brief bytes a request moves: a read's payload comes in the reply
+ */
+static uint64_t p9_limit_bytes(msk_data_t *data) {
+	uint64_t size = 0;
+	uint8_t *cursor;
+	uint32_t count;
+
+	if (data->data[sizeof(uint32_t)] == P9_TREAD) {
+		cursor = data->data + P9_STD_HDR_SIZE + sizeof(uint32_t) + sizeof(uint64_t);
+		p9_getvalue(cursor, count, uint32_t);
+		size += count;
+	}
+
+	for (; data != NULL; data = data->next)
+		size += data->size;
+
+	return size;
+}
+
+void p9_limit_wait(struct p9_handle *p9_handle, msk_data_t *data) {
+	struct p9_limit *limit = p9_handle->limit;
+	uint64_t now, when = 0, ops_when;
+	struct timespec ts;
+
+	if (limit->bps == 0 && limit->iops == 0)
+		return;
+
+	pthread_mutex_lock(&limit->lock);
+	now = p9_limit_now();
+	if (limit->bps)
+		when = p9_limit_book(&limit->bytes_tat, now, p9_limit_bytes(data), limit->bps);
+	if (limit->iops) {
+		/* MAX would book twice */
+		ops_when = p9_limit_book(&limit->ops_tat, now, 1, limit->iops);
+		when = MAX(when, ops_when);
+	}
+	pthread_mutex_unlock(&limit->lock);
+
+	if (when <= now)
+		return;
+
+	ts.tv_sec = when / NSEC_PER_SEC;
+	ts.tv_nsec = when % NSEC_PER_SEC;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+
+	p9_stats_throttled(p9_handle, when - now);
+}
+
+int p9_limit_set(struct p9_handle *p9_handle, uint64_t bytes_per_sec, uint64_t ops_per_sec) {
+	struct p9_limit *limit;
+
+	if (p9_handle == NULL || p9_handle->limit == NULL)
+		return EINVAL;
+
+	limit = p9_handle->limit;
+
+	pthread_mutex_lock(&limit->lock);
+	limit->bps = bytes_per_sec;
+	limit->iops = ops_per_sec;
+	/* whatever was booked at the old rates is forgotten */
+	limit->bytes_tat = 0;
+	limit->ops_tat = 0;
+	pthread_mutex_unlock(&limit->lock);
+
+	INFO_LOG(p9_handle->debug & P9_DEBUG_SETUP, "rate limits: %"PRIu64"B/s, %"PRIu64" requests/s", bytes_per_sec, ops_per_sec);
+
+	return 0;
+}
+
+int p9_limit_init(struct p9_handle *p9_handle, uint64_t bytes_per_sec, uint64_t ops_per_sec) {
+	struct p9_limit *limit;
+
+	limit = calloc(1, sizeof(struct p9_limit));
+	if (limit == NULL)
+		return ENOMEM;
+
+	pthread_mutex_init(&limit->lock, NULL);
+	p9_handle->limit = limit;
+
+	return p9_limit_set(p9_handle, bytes_per_sec, ops_per_sec);
+}
+
+void p9_limit_destroy(struct p9_handle *p9_handle) {
+	struct p9_limit *limit = p9_handle->limit;
+
+	if (limit == NULL)
+		return;
+
+	pthread_mutex_destroy(&limit->lock);
+	free(limit);
+	p9_handle->limit = NULL;
+}
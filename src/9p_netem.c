@@ -0,0 +1,416 @@
+/*
+ * Copyright CEA/DAM/DIF (2013)
+ * Contributor: Dominique Martinet <dominique.martinet@cea.fr>
+ *
+ * This file is part of the space9 9P userspace library.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with space9.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+/**
+ * \file	9p_netem.c
+ * \brief	network emulation on top of any transport
+ *
+ * Stacks over the configured net_ops and holds every message back before
+ * passing it on: requests before the real post_n_send, replies before the
+ * client's receive callback. Each direction gets the one-way delay give or
+ * take the jitter, and a rate cap that queues messages behind each other
+ * like a link would. Messages keep their order unless reordering is asked
+ * for, in which case that share of them skips the delay and overtakes the
+ * others.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>	//malloc
+#include <string.h>	//memset
+#include <inttypes.h>	//uint*_t
+#include <errno.h>	//ENOMEM
+#include <pthread.h>	//pthread_*
+#include <time.h>	//clock_gettime
+#include <sys/param.h>	//MAX
+
+#include "9p_internals.h"
+#include "utils.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+
+struct p9_netem_ev {
+	uint64_t when;
+	msk_trans_t *trans;
+	msk_data_t *data;
+	int num_sge;
+	int send;
+	ctx_callback_t callback;
+	ctx_callback_t err_callback;
+	void *callback_arg;
+	struct p9_netem_ev *next;
+};
+
+/* one direction of the link */
+struct p9_netem_link {
+	uint64_t busy;	/**< time the link is done with what was already queued */
+	uint64_t last;	/**< delivery time of the last message, to keep order */
+};
+
+struct p9_netem {
+	struct p9_net_ops ops;
+	struct p9_net_ops *lower;
+	uint64_t delay;		/**< ns */
+	uint64_t jitter;	/**< ns */
+	uint64_t rate;		/**< bytes per second, 0 = unlimited */
+	uint32_t reorder;	/**< percent */
+	unsigned int seed;
+	struct p9_netem_link tx;
+	struct p9_netem_link rx;
+	/* the client posts all its receive buffers with the same callbacks */
+	ctx_callback_t recv_callback;
+	ctx_callback_t recv_err_callback;
+	void *recv_arg;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;		/**< new first event or stop, for the thread */
+	pthread_cond_t idle_cond;	/**< running event done */
+	pthread_t thrid;
+	int stop;
+	msk_trans_t *closing;		/**< transport being destroyed, its messages are dropped */
+	struct p9_netem_ev *running;	/**< event handled outside of the lock */
+	struct p9_netem_ev *head;	/**< pending events, by delivery time */
+	struct p9_netem_ev *free;
+};
+
+static inline struct p9_netem *p9_netem_of(msk_trans_t *trans) {
+	return ((struct p9_handle *)trans->private_data)->netem;
+}
+
+static uint64_t p9_netem_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * @brief time at which a message of size bytes comes out of the link
+ *
+ * Must hold netem->lock.
+ */
+static uint64_t p9_netem_when(struct p9_netem *netem, struct p9_netem_link *link, uint32_t size) {
+	uint64_t when;
+	int64_t jitter;
+
+	when = p9_netem_now();
+	if (netem->rate) {
+		link->busy = MAX(link->busy, when) + (uint64_t)size * NSEC_PER_SEC / netem->rate;
+		when = link->busy;
+	}
+
+	if (netem->reorder && (uint32_t)rand_r(&netem->seed) % 100 < netem->reorder)
+		return when;
+
+	when += netem->delay;
+	if (netem->jitter) {
+		jitter = (int64_t)(rand_r(&netem->seed) % (2 * netem->jitter + 1)) - (int64_t)netem->jitter;
+		when = (jitter < 0 && (uint64_t)-jitter > when) ? 0 : when + jitter;
+	}
+
+	/* jitter alone does not reorder, like a real link */
+	if (!netem->reorder)
+		when = MAX(when, link->last);
+	link->last = when;
+
+	return when;
+}
+
+/** must hold netem->lock */
+static struct p9_netem_ev *p9_netem_ev_get(struct p9_netem *netem) {
+	struct p9_netem_ev *ev;
+
+	ev = netem->free;
+	if (ev)
+		netem->free = ev->next;
+	else
+		ev = malloc(sizeof(struct p9_netem_ev));
+
+	return ev;
+}
+
+/** must hold netem->lock */
+static void p9_netem_queue(struct p9_netem *netem, struct p9_netem_ev *ev) {
+	struct p9_netem_ev **pcur;
+
+	pcur = &netem->head;
+	while (*pcur && (*pcur)->when <= ev->when)
+		pcur = &(*pcur)->next;
+	ev->next = *pcur;
+	*pcur = ev;
+
+	if (netem->head == ev)
+		pthread_cond_signal(&netem->cond);
+}
+
+/** drop everything pending on trans, must hold netem->lock */
+static void p9_netem_flush(struct p9_netem *netem, msk_trans_t *trans) {
+	struct p9_netem_ev **pcur, *ev;
+
+	pcur = &netem->head;
+	while (*pcur) {
+		ev = *pcur;
+		if (ev->trans != trans) {
+			pcur = &ev->next;
+			continue;
+		}
+		*pcur = ev->next;
+		ev->next = netem->free;
+		netem->free = ev;
+	}
+}
+
+static void *p9_netem_thread(void *arg) {
+	struct p9_netem *netem = arg;
+	struct p9_netem_ev *ev;
+	struct timespec ts;
+
+	pthread_mutex_lock(&netem->lock);
+	while (!netem->stop) {
+		ev = netem->head;
+		if (ev == NULL) {
+			pthread_cond_wait(&netem->cond, &netem->lock);
+			continue;
+		}
+		if (ev->when > p9_netem_now()) {
+			ts.tv_sec = ev->when / NSEC_PER_SEC;
+			ts.tv_nsec = ev->when % NSEC_PER_SEC;
+			pthread_cond_timedwait(&netem->cond, &netem->lock, &ts);
+			continue;
+		}
+
+		netem->head = ev->next;
+		netem->running = ev;
+		pthread_mutex_unlock(&netem->lock);
+
+		/* the real transport calls the error callback itself if it fails */
+		if (ev->send)
+			netem->lower->post_n_send(ev->trans, ev->data, ev->num_sge, ev->callback, ev->err_callback, ev->callback_arg);
+		else
+			ev->callback(ev->trans, ev->data, ev->callback_arg);
+
+		pthread_mutex_lock(&netem->lock);
+		netem->running = NULL;
+		ev->next = netem->free;
+		netem->free = ev;
+		pthread_cond_broadcast(&netem->idle_cond);
+	}
+	pthread_mutex_unlock(&netem->lock);
+
+	pthread_exit(NULL);
+}
+
+static void p9_netem_recv_cb(msk_trans_t *trans, msk_data_t *data, void *arg) {
+	struct p9_netem *netem = arg;
+	struct p9_netem_ev *ev;
+
+	pthread_mutex_lock(&netem->lock);
+	if (trans == netem->closing) {
+		pthread_mutex_unlock(&netem->lock);
+		return;
+	}
+
+	ev = p9_netem_ev_get(netem);
+	if (ev == NULL) {
+		/* better late than never: deliver it now */
+		pthread_mutex_unlock(&netem->lock);
+		netem->recv_callback(trans, data, netem->recv_arg);
+		return;
+	}
+
+	ev->trans = trans;
+	ev->data = data;
+	ev->num_sge = 1;
+	ev->send = 0;
+	ev->callback = netem->recv_callback;
+	ev->err_callback = netem->recv_err_callback;
+	ev->callback_arg = netem->recv_arg;
+	ev->when = p9_netem_when(netem, &netem->rx, data->size);
+	p9_netem_queue(netem, ev);
+	pthread_mutex_unlock(&netem->lock);
+}
+
+static void p9_netem_recv_err_cb(msk_trans_t *trans, msk_data_t *data, void *arg) {
+	struct p9_netem *netem = arg;
+
+	netem->recv_err_callback(trans, data, netem->recv_arg);
+}
+
+static int p9_netem_post_n_recv(msk_trans_t *trans, msk_data_t *data, int num_sge, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg) {
+	struct p9_netem *netem = p9_netem_of(trans);
+
+	pthread_mutex_lock(&netem->lock);
+	netem->recv_callback = callback;
+	netem->recv_err_callback = err_callback;
+	netem->recv_arg = callback_arg;
+	pthread_mutex_unlock(&netem->lock);
+
+	return netem->lower->post_n_recv(trans, data, num_sge, p9_netem_recv_cb, p9_netem_recv_err_cb, netem);
+}
+
+static int p9_netem_post_n_send(msk_trans_t *trans, msk_data_t *data, int num_sge, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg) {
+	struct p9_netem *netem = p9_netem_of(trans);
+	struct p9_netem_ev *ev;
+	msk_data_t *cur;
+	uint32_t size;
+	int i;
+
+	size = 0;
+	for (i = 0, cur = data; i < num_sge && cur; i++, cur = cur->next)
+		size += cur->size;
+
+	pthread_mutex_lock(&netem->lock);
+	if (trans == netem->closing) {
+		pthread_mutex_unlock(&netem->lock);
+		return ENOTCONN;
+	}
+
+	ev = p9_netem_ev_get(netem);
+	if (ev == NULL) {
+		pthread_mutex_unlock(&netem->lock);
+		return ENOMEM;
+	}
+
+	ev->trans = trans;
+	ev->data = data;
+	ev->num_sge = num_sge;
+	ev->send = 1;
+	ev->callback = callback;
+	ev->err_callback = err_callback;
+	ev->callback_arg = callback_arg;
+	ev->when = p9_netem_when(netem, &netem->tx, size);
+	p9_netem_queue(netem, ev);
+	pthread_mutex_unlock(&netem->lock);
+
+	return 0;
+}
+
+static void p9_netem_destroy_trans(msk_trans_t **ptrans) {
+	struct p9_netem *netem = p9_netem_of(*ptrans);
+
+	/* messages still on the wire are lost, the client sends again after reconnecting */
+	pthread_mutex_lock(&netem->lock);
+	netem->closing = *ptrans;
+	p9_netem_flush(netem, *ptrans);
+	while (netem->running && netem->running->trans == *ptrans)
+		pthread_cond_wait(&netem->idle_cond, &netem->lock);
+	pthread_mutex_unlock(&netem->lock);
+
+	netem->lower->destroy_trans(ptrans);
+
+	pthread_mutex_lock(&netem->lock);
+	netem->closing = NULL;
+	pthread_mutex_unlock(&netem->lock);
+}
+
+/**
+ * @brief stack the emulation over p9_handle->net_ops
+ *
+ * @param[in] delay:   one-way delay, in microseconds
+ * @param[in] jitter:  delay variation either way, in microseconds
+ * @param[in] rate:    bytes per second in each direction, 0 = unlimited
+ * @param[in] reorder: percentage of messages sent without delay
+ *
+ * @return 0 on success, errno value on error
+ */
+int p9_netem_init(struct p9_handle *p9_handle, uint32_t delay, uint32_t jitter, uint32_t rate, uint32_t reorder) {
+	struct p9_netem *netem;
+	pthread_condattr_t attr;
+	int rc;
+
+	netem = calloc(1, sizeof(struct p9_netem));
+	if (netem == NULL)
+		return ENOMEM;
+
+	netem->lower = p9_handle->net_ops;
+	netem->ops = *netem->lower;
+	netem->ops.destroy_trans = p9_netem_destroy_trans;
+	netem->ops.post_n_recv = p9_netem_post_n_recv;
+	netem->ops.post_n_send = p9_netem_post_n_send;
+	/* every message has to go through the emulated link */
+	netem->ops.post_n_send_batch = NULL;
+	netem->delay = (uint64_t)delay * 1000;
+	netem->jitter = (uint64_t)jitter * 1000;
+	netem->rate = rate;
+	netem->reorder = MIN(reorder, 100);
+	netem->seed = (unsigned int)p9_netem_now();
+
+	pthread_mutex_init(&netem->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&netem->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&netem->idle_cond, NULL);
+
+	rc = pthread_create(&netem->thrid, NULL, p9_netem_thread, netem);
+	if (rc) {
+		ERROR_LOG("Could not create netem thread: %s (%d)", strerror(rc), rc);
+		pthread_cond_destroy(&netem->idle_cond);
+		pthread_cond_destroy(&netem->cond);
+		pthread_mutex_destroy(&netem->lock);
+		free(netem);
+		return rc;
+	}
+
+	p9_handle->netem = netem;
+	p9_handle->net_ops = &netem->ops;
+
+	INFO_LOG(p9_handle->debug & P9_DEBUG_SETUP, "network emulation: delay %uus, jitter %uus, rate %uB/s, reorder %u%%",
+	         delay, jitter, rate, netem->reorder);
+
+	return 0;
+}
+
+/**
+ * @brief stop the emulation, the transport must be gone already
+ */
+void p9_netem_destroy(struct p9_handle *p9_handle) {
+	struct p9_netem *netem = p9_handle->netem;
+	struct p9_netem_ev *ev;
+
+	if (netem == NULL)
+		return;
+
+	pthread_mutex_lock(&netem->lock);
+	netem->stop = 1;
+	pthread_cond_signal(&netem->cond);
+	pthread_mutex_unlock(&netem->lock);
+	pthread_join(netem->thrid, NULL);
+
+	while ((ev = netem->head)) {
+		netem->head = ev->next;
+		free(ev);
+	}
+	while ((ev = netem->free)) {
+		netem->free = ev->next;
+		free(ev);
+	}
+
+	pthread_cond_destroy(&netem->idle_cond);
+	pthread_cond_destroy(&netem->cond);
+	pthread_mutex_destroy(&netem->lock);
+
+	p9_handle->net_ops = netem->lower;
+	p9_handle->netem = NULL;
+	free(netem);
+}
@@ -0,0 +1,492 @@
+/*
+ * Copyright CEA/DAM/DIF (2013)
+ * Contributor: Dominique Martinet <dominique.martinet@cea.fr>
+ *
+ * This file is part of the space9 9P userspace library.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with space9.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+/**
+ * \file	9p_null.c
+ * \brief	loopback transport with no server behind it
+ *
+ * post_n_send builds the reply a trivial server would give straight into a
+ * posted receive buffer, and a completion thread hands it to the receive
+ * callback like the tcp receive thread would. Every walk succeeds, files
+ * are empty of data but reads return what was asked for, and directories
+ * always hold the same few entries. Only good to measure the client's own
+ * cost.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>	//printf
+#include <stdlib.h>	//malloc
+#include <string.h>	//memcpy
+#include <inttypes.h>	//uint*_t
+#include <errno.h>	//ENOMEM
+#include <pthread.h>	//pthread_*
+#include <fcntl.h>	//F_UNLCK
+#include <sys/stat.h>	//S_IFREG
+#include <sys/param.h>	//MIN
+
+#include "9p_internals.h"
+#include "9p_proto_internals.h"
+#include "9p_null.h"
+#include "utils.h"
+
+/* entries every directory pretends to have, . and .. included */
+#define MSK_NULL_DIRENTS 16
+
+struct msk_null_ctx {
+	enum {
+		MSK_NULL_CTX_FREE = 0,
+		MSK_NULL_CTX_PENDING,
+		MSK_NULL_CTX_PROCESSING
+	} used;
+	uint32_t seq;			/**< post order, oldest buffers are used first */
+	msk_data_t *data;
+	ctx_callback_t callback;
+	ctx_callback_t err_callback;
+	void *callback_arg;
+	struct msk_null_ctx *next;	/**< completion queue */
+};
+
+struct msk_null_trans {
+	struct msk_null_ctx *ctx;	/**< qp_attr.cap.max_recv_wr of them */
+	struct msk_null_ctx *head;	/**< replies waiting for the completion thread */
+	struct msk_null_ctx *tail;
+	pthread_cond_t cq_cond;
+	pthread_t cq_thrid;
+	uint32_t recv_seq;
+};
+
+#define nullt(trans) ((struct msk_null_trans*)trans->cm_id)
+
+/**
+ * msk_null_recv_ctx: pick the posted buffer for a reply of the given size
+ *
+ * Same policy as tcp: smallest buffer that fits, oldest first.
+ * Must hold ctx_lock.
+ */
+static struct msk_null_ctx *msk_null_recv_ctx(msk_trans_t *trans, uint32_t size) {
+	struct msk_null_ctx *ctx, *best = NULL, *biggest = NULL;
+	int i;
+
+	for (i = 0; i < trans->qp_attr.cap.max_recv_wr; i++) {
+		ctx = &nullt(trans)->ctx[i];
+		if (ctx->used != MSK_NULL_CTX_PENDING)
+			continue;
+		if (ctx->data->max_size >= size && (!best || ctx->data->max_size < best->data->max_size
+		    || (ctx->data->max_size == best->data->max_size && (int32_t)(ctx->seq - best->seq) < 0)))
+			best = ctx;
+		if (!biggest || ctx->data->max_size > biggest->data->max_size
+		    || (ctx->data->max_size == biggest->data->max_size && (int32_t)(ctx->seq - biggest->seq) < 0))
+			biggest = ctx;
+	}
+
+	return best ? best : biggest;
+}
+
+/** size of the reply to the request in data, bounded by nothing */
+static uint32_t msk_null_reply_size(msk_data_t *data) {
+	uint8_t *cursor = data->data + P9_STD_HDR_SIZE;
+	uint32_t count;
+
+	switch (data->data[P9_HDR_SIZE]) {
+	case P9_TREAD:
+		/* fid, offset, count */
+		cursor += sizeof(uint32_t) + sizeof(uint64_t);
+		p9_getvalue(cursor, count, uint32_t);
+		return P9_ROOM_RREAD + count;
+	case P9_TREADDIR:
+		cursor += sizeof(uint32_t) + sizeof(uint64_t);
+		p9_getvalue(cursor, count, uint32_t);
+		return P9_ROOM_RREADDIR + count;
+	default:
+		/* the biggest other replies are walk and readlink */
+		return 1024;
+	}
+}
+
+/**
+ * msk_null_reply: write the reply to req in reply
+ */
+static void msk_null_reply(msk_data_t *req, msk_data_t *reply) {
+	uint8_t *cursor, *rcursor, *savepos;
+	uint8_t msgtype;
+	uint16_t tag, nwname, i;
+	uint32_t count;
+	uint64_t offset, start, length;
+	struct p9_qid qid;
+	char name[16];
+
+	cursor = req->data + P9_HDR_SIZE;
+	p9_getvalue(cursor, msgtype, uint8_t);
+	p9_getvalue(cursor, tag, uint16_t);
+
+	qid.type = P9_QTFILE;
+	qid.version = 0;
+	qid.path = 1;
+
+	p9_initcursor(rcursor, reply->data, msgtype + 1, tag);
+
+	switch (msgtype) {
+	case P9_TVERSION:
+		p9_getvalue(cursor, count, uint32_t);
+		p9_setvalue(rcursor, count, uint32_t);
+		p9_setstr(rcursor, 8, "9P2000.L");
+		break;
+
+	case P9_TATTACH:
+	case P9_TMKDIR:
+		qid.type = P9_QTDIR;
+		p9_setqid(rcursor, qid);
+		break;
+
+	case P9_TSYMLINK:
+		qid.type = P9_QTSYMLINK;
+		p9_setqid(rcursor, qid);
+		break;
+
+	case P9_TMKNOD:
+		p9_setqid(rcursor, qid);
+		break;
+
+	case P9_TLOPEN:
+	case P9_TLCREATE:
+		p9_setqid(rcursor, qid);
+		p9_setvalue(rcursor, 0, uint32_t);
+		break;
+
+	case P9_TWALK:
+		/* fid, newfid, nwname: every element exists */
+		cursor += 2*sizeof(uint32_t);
+		p9_getvalue(cursor, nwname, uint16_t);
+		p9_setvalue(rcursor, nwname, uint16_t);
+		for (i = 0; i < nwname; i++) {
+			qid.path = i + 2;
+			p9_setqid(rcursor, qid);
+		}
+		break;
+
+	case P9_TREAD:
+		cursor += sizeof(uint32_t) + sizeof(uint64_t);
+		p9_getvalue(cursor, count, uint32_t);
+		count = MIN(count, reply->max_size - P9_ROOM_RREAD);
+		p9_setvalue(rcursor, count, uint32_t);
+		/* content is whatever the buffer held */
+		rcursor += count;
+		break;
+
+	case P9_TWRITE:
+		cursor += sizeof(uint32_t) + sizeof(uint64_t);
+		p9_getvalue(cursor, count, uint32_t);
+		p9_setvalue(rcursor, count, uint32_t);
+		break;
+
+	case P9_TREADDIR:
+		cursor += sizeof(uint32_t);
+		p9_getvalue(cursor, offset, uint64_t);
+		p9_getvalue(cursor, count, uint32_t);
+		count = MIN(count, reply->max_size - P9_ROOM_RREADDIR);
+		p9_savepos(rcursor, savepos, uint32_t);
+		for (; offset < MSK_NULL_DIRENTS; offset++) {
+			if (offset == 0)
+				strcpy(name, ".");
+			else if (offset == 1)
+				strcpy(name, "..");
+			else
+				snprintf(name, sizeof(name), "file%u", (uint32_t)offset - 2);
+			/* qid, offset, type, name */
+			if (rcursor + 13 + 8 + 1 + 2 + strlen(name) > savepos + sizeof(uint32_t) + count)
+				break;
+			qid.type = offset < 2 ? P9_QTDIR : P9_QTFILE;
+			qid.path = offset + 1;
+			p9_setqid(rcursor, qid);
+			p9_setvalue(rcursor, offset + 1, uint64_t);
+			p9_setvalue(rcursor, offset < 2 ? DT_DIR : DT_REG, uint8_t);
+			p9_setstr(rcursor, strlen(name), name);
+		}
+		p9_setvalue(savepos, (uint32_t)(rcursor - savepos - sizeof(uint32_t)), uint32_t);
+		break;
+
+	case P9_TGETATTR:
+		p9_setvalue(rcursor, P9_GETATTR_BASIC, uint64_t);
+		p9_setqid(rcursor, qid);
+		p9_setvalue(rcursor, S_IFREG | 0644, uint32_t);
+		p9_setvalue(rcursor, 0, uint32_t); /* uid */
+		p9_setvalue(rcursor, 0, uint32_t); /* gid */
+		p9_setvalue(rcursor, 1LL, uint64_t); /* nlink */
+		p9_setvalue(rcursor, 0LL, uint64_t); /* rdev */
+		p9_setvalue(rcursor, 1LL<<30, uint64_t); /* size */
+		p9_setvalue(rcursor, 4096LL, uint64_t); /* blksize */
+		p9_setvalue(rcursor, (1LL<<30)/512, uint64_t); /* blocks */
+		for (i = 0; i < 10; i++) /* [amcb]time, gen, data_version */
+			p9_setvalue(rcursor, 0LL, uint64_t);
+		break;
+
+	case P9_TREADLINK:
+		p9_setstr(rcursor, 6, "target");
+		break;
+
+	case P9_TXATTRWALK:
+		p9_setvalue(rcursor, 0LL, uint64_t);
+		break;
+
+	case P9_TLOCK:
+		p9_setvalue(rcursor, P9_LOCK_SUCCESS, uint8_t);
+		break;
+
+	case P9_TGETLOCK:
+		/* fid, type */
+		cursor += sizeof(uint32_t) + sizeof(uint8_t);
+		p9_getvalue(cursor, start, uint64_t);
+		p9_getvalue(cursor, length, uint64_t);
+		p9_getvalue(cursor, count, uint32_t);
+		p9_setvalue(rcursor, F_UNLCK, uint8_t);
+		p9_setvalue(rcursor, start, uint64_t);
+		p9_setvalue(rcursor, length, uint64_t);
+		p9_setvalue(rcursor, count, uint32_t);
+		p9_setstr(rcursor, 0, "");
+		break;
+
+	case P9_TSTATFS:
+		p9_setvalue(rcursor, 0x01021994, uint32_t); /* TMPFS_MAGIC */
+		p9_setvalue(rcursor, 4096, uint32_t);
+		for (i = 0; i < 6; i++) /* blocks, bfree, bavail, files, ffree, fsid */
+			p9_setvalue(rcursor, 1LL<<30, uint64_t);
+		p9_setvalue(rcursor, MAXNAMLEN, uint32_t);
+		break;
+
+	case P9_TCLUNK:
+	case P9_TREMOVE:
+	case P9_TFLUSH:
+	case P9_TRENAME:
+	case P9_TRENAMEAT:
+	case P9_TUNLINKAT:
+	case P9_TSETATTR:
+	case P9_TFSYNC:
+	case P9_TLINK:
+	case P9_TXATTRCREATE:
+		break;
+
+	default:
+		p9_initcursor(rcursor, reply->data, P9_RERROR, tag);
+		p9_setvalue(rcursor, EOPNOTSUPP, uint32_t);
+	}
+
+	p9_setmsglen(rcursor, reply);
+}
+
+static void *msk_null_cq_thread(void *arg) {
+	msk_trans_t *trans = arg;
+	struct msk_null_ctx *ctx;
+
+	pthread_mutex_lock(&trans->ctx_lock);
+	while (trans->state == MSK_CONNECTED) {
+		ctx = nullt(trans)->head;
+		if (!ctx) {
+			pthread_cond_wait(&nullt(trans)->cq_cond, &trans->ctx_lock);
+			continue;
+		}
+		nullt(trans)->head = ctx->next;
+		if (!ctx->next)
+			nullt(trans)->tail = NULL;
+		pthread_mutex_unlock(&trans->ctx_lock);
+
+		ctx->callback(trans, ctx->data, ctx->callback_arg);
+
+		pthread_mutex_lock(&trans->ctx_lock);
+		ctx->used = MSK_NULL_CTX_FREE;
+		pthread_cond_broadcast(&trans->ctx_cond);
+	}
+	pthread_mutex_unlock(&trans->ctx_lock);
+
+	pthread_exit(NULL);
+}
+
+void msk_null_destroy_trans(msk_trans_t **ptrans) {
+	msk_trans_t *trans = *ptrans;
+
+	if (!trans)
+		return;
+
+	if (nullt(trans)) {
+		pthread_mutex_lock(&trans->ctx_lock);
+		trans->state = MSK_CLOSING;
+		pthread_cond_broadcast(&nullt(trans)->cq_cond);
+		pthread_cond_broadcast(&trans->ctx_cond);
+		pthread_mutex_unlock(&trans->ctx_lock);
+
+		if (nullt(trans)->cq_thrid)
+			pthread_join(nullt(trans)->cq_thrid, NULL);
+
+		pthread_cond_destroy(&nullt(trans)->cq_cond);
+		if (nullt(trans)->ctx)
+			free(nullt(trans)->ctx);
+		free(nullt(trans));
+	}
+
+	pthread_mutex_destroy(&trans->ctx_lock);
+	pthread_cond_destroy(&trans->ctx_cond);
+	free(trans);
+	*ptrans = NULL;
+}
+
+int msk_null_init(msk_trans_t **ptrans, msk_trans_attr_t *attr) {
+	msk_trans_t *trans;
+	int ret = 0;
+
+	if (!ptrans || !attr) {
+		ERROR_LOG("Invalid argument");
+		return EINVAL;
+	}
+
+	trans = malloc(sizeof(msk_trans_t));
+	if (!trans)
+		return ENOMEM;
+
+	do {
+		memset(trans, 0, sizeof(msk_trans_t));
+
+		trans->state = MSK_INIT;
+		trans->qp_attr.cap.max_recv_wr = attr->rq_depth ? attr->rq_depth : 50;
+		trans->disconnect_callback = attr->disconnect_callback;
+		pthread_mutex_init(&trans->ctx_lock, NULL);
+		pthread_cond_init(&trans->ctx_cond, NULL);
+
+		trans->cm_id /* nullt(trans) */ = malloc(sizeof(struct msk_null_trans));
+		if (!nullt(trans)) {
+			ret = ENOMEM;
+			break;
+		}
+		memset(trans->cm_id, 0, sizeof(struct msk_null_trans));
+		pthread_cond_init(&nullt(trans)->cq_cond, NULL);
+
+		nullt(trans)->ctx = calloc(trans->qp_attr.cap.max_recv_wr, sizeof(struct msk_null_ctx));
+		if (!nullt(trans)->ctx) {
+			ret = ENOMEM;
+			break;
+		}
+	} while (0);
+
+	if (ret) {
+		msk_null_destroy_trans(&trans);
+		return ret;
+	}
+
+	*ptrans = trans;
+
+	return 0;
+}
+
+int msk_null_connect(msk_trans_t *trans) {
+	trans->state = MSK_CONNECT_REQUEST;
+	return 0;
+}
+
+int msk_null_finalize_connect(msk_trans_t *trans) {
+	int rc;
+
+	if (trans->state != MSK_CONNECT_REQUEST)
+		return EINVAL;
+
+	trans->state = MSK_CONNECTED;
+	rc = pthread_create(&nullt(trans)->cq_thrid, NULL, msk_null_cq_thread, trans);
+	if (rc) {
+		nullt(trans)->cq_thrid = 0;
+		trans->state = MSK_ERROR;
+	}
+
+	return rc;
+}
+
+struct ibv_mr *msk_null_reg_mr(msk_trans_t *trans, void *memaddr, size_t size, int access) {
+	return memaddr;
+}
+
+int msk_null_dereg_mr(struct ibv_mr *mr) {
+	return 0;
+}
+
+int msk_null_post_n_recv(msk_trans_t *trans, msk_data_t *data, int num_sge, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg) {
+	struct msk_null_ctx *ctx;
+	int i;
+
+	pthread_mutex_lock(&trans->ctx_lock);
+	while (1) {
+		for (i = 0; i < trans->qp_attr.cap.max_recv_wr; i++)
+			if (nullt(trans)->ctx[i].used == MSK_NULL_CTX_FREE)
+				break;
+		if (i < trans->qp_attr.cap.max_recv_wr)
+			break;
+		if (trans->state == MSK_CLOSING || trans->state == MSK_CLOSED) {
+			pthread_mutex_unlock(&trans->ctx_lock);
+			return ENOTCONN;
+		}
+		pthread_cond_wait(&trans->ctx_cond, &trans->ctx_lock);
+	}
+
+	ctx = &nullt(trans)->ctx[i];
+	ctx->data = data;
+	ctx->callback = callback;
+	ctx->err_callback = err_callback;
+	ctx->callback_arg = callback_arg;
+	ctx->seq = nullt(trans)->recv_seq++;
+	ctx->used = MSK_NULL_CTX_PENDING;
+	pthread_cond_broadcast(&trans->ctx_cond);
+	pthread_mutex_unlock(&trans->ctx_lock);
+
+	return 0;
+}
+
+int msk_null_post_n_send(msk_trans_t *trans, msk_data_t *data, int num_sge, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg) {
+	struct msk_null_ctx *ctx;
+	uint32_t size;
+
+	size = msk_null_reply_size(data);
+
+	pthread_mutex_lock(&trans->ctx_lock);
+	while ((ctx = msk_null_recv_ctx(trans, size)) == NULL && trans->state == MSK_CONNECTED)
+		pthread_cond_wait(&trans->ctx_cond, &trans->ctx_lock);
+	if (ctx == NULL) {
+		pthread_mutex_unlock(&trans->ctx_lock);
+		err_callback(trans, data, callback_arg);
+		return ENOTCONN;
+	}
+	ctx->used = MSK_NULL_CTX_PROCESSING;
+	pthread_mutex_unlock(&trans->ctx_lock);
+
+	msk_null_reply(data, ctx->data);
+
+	callback(trans, data, callback_arg);
+
+	pthread_mutex_lock(&trans->ctx_lock);
+	ctx->next = NULL;
+	if (nullt(trans)->tail)
+		nullt(trans)->tail->next = ctx;
+	else
+		nullt(trans)->head = ctx;
+	nullt(trans)->tail = ctx;
+	pthread_cond_signal(&nullt(trans)->cq_cond);
+	pthread_mutex_unlock(&trans->ctx_lock);
+
+	return 0;
+}
@@ -291,63 +291,92 @@ int p9p_flush(struct p9_handle *p9_handle, uint16_t oldtag) {
 	return rc;
 }
 
-int p9p_rewalk(struct p9_handle *p9_handle, struct p9_fid *fid, char *path, uint32_t newfid_i) {
+/* hops of a deep walk sent before waiting for the first reply */
+#define P9_WALK_WINDOW 8
+/* a path can't have more names than this */
+#define P9_WALK_MAXHOPS ((MAXPATHLEN / 2 + P9_MAXWELEM - 1) / P9_MAXWELEM)
+
+struct p9_walk_hop {
+	char *path;		/**< where the names of this hop start */
+	struct p9_fid *fid;	/**< fid the hop walks to, NULL for the last one */
+	uint16_t nwname;
+	uint16_t tag;
+	uint8_t done;		/**< the server has the hop's fid */
+	uint8_t rerror;		/**< failed with RERROR, not a short walk */
+};
+
+/**
+ * p9pi_walk_names: take the next P9_MAXWELEM names at most out of *ppath
+ *
+ * Names are copied to the message if pcursor is set, *ppath is left at the
+ * first name not taken.
+ *
+ * @return number of names taken
+ */
+static uint16_t p9pi_walk_names(uint8_t **pcursor, char **ppath) {
+	uint8_t *cursor = pcursor ? *pcursor : NULL;
+	char *curpath = *ppath, *subpath;
+	uint16_t nwname = 0;
+	size_t len;
+
+	while (curpath[0] == '/')
+		curpath++;
+	while (curpath[0] != '\0' && nwname < P9_MAXWELEM) {
+		subpath = strchr(curpath, '/');
+		len = subpath ? subpath - curpath : strnlen(curpath, MAXNAMLEN);
+		if (cursor)
+			p9_setstr(cursor, len, curpath);
+		nwname++;
+		curpath += subpath ? len : strlen(curpath);
+		while (curpath[0] == '/')
+			curpath++;
+	}
+
+	if (pcursor)
+		*pcursor = cursor;
+	*ppath = curpath;
+	return nwname;
+}
+
+static int p9pi_walk_send(struct p9_handle *p9_handle, struct p9_fid *fid, struct p9_walk_hop *hop, uint32_t newfid_i) {
 	int rc;
 	msk_data_t *data;
-	uint16_t tag;
-	uint16_t nwname;
-	uint8_t msgtype;
 	uint8_t *cursor, *pnwname;
-	char *subpath, *curpath;
-
-	/* Sanity check */
-	if (p9_handle == NULL || fid == NULL || path == NULL)
-		return EINVAL;
+	char *curpath = hop->path;
+	uint16_t nwname;
 
-	tag = 0;
-	rc = p9c_getbuffer(p9_handle, &data, &tag);
+	hop->tag = 0;
+	rc = p9c_getbuffer(p9_handle, &data, &hop->tag);
 	if (rc != 0 || data == NULL)
 		return rc;
 
-	p9_initcursor(cursor, data->data, P9_TWALK, tag);
+	p9_initcursor(cursor, data->data, P9_TWALK, hop->tag);
 	p9_setvalue(cursor, fid->fid, uint32_t);
 	p9_setvalue(cursor, newfid_i, uint32_t);
+	p9_savepos(cursor, pnwname, uint16_t);
+	nwname = p9pi_walk_names(&cursor, &curpath);
+	p9_setvalue(pnwname, nwname, uint16_t);
+	p9_setmsglen(cursor, data);
 
-	/* clone or lookup ? */
-	if (!path || path[0] == '\0') {
+	if (nwname == 0) {
 		INFO_LOG(p9_handle->debug & P9_DEBUG_PROTO, "walk clone fid %u (%s), newfid %u", fid->fid, fid->path, newfid_i);
-		p9_setvalue(cursor, 0, uint16_t);
-		nwname = 0;
 	} else {
-		INFO_LOG(p9_handle->debug & P9_DEBUG_PROTO, "walk from fid %u (%s) to %s, newfid %u", fid->fid, fid->path, path, newfid_i);
-
-		nwname = 0;
-		p9_savepos(cursor, pnwname, uint16_t);
-		curpath = path;
-		while ((subpath = strchr(curpath, '/')) != NULL) {
-			subpath[0] = '\0';
-			if (curpath != subpath) {
-				p9_setstr(cursor, subpath-curpath, curpath);
-				nwname += 1;
-			}
-			subpath[0] = '/';
-			curpath = subpath+1;
-		}
-
-		if (strnlen(curpath,MAXNAMLEN) > 0) {
-			p9_setstr(cursor, strnlen(curpath, MAXNAMLEN), curpath);
-			nwname += 1;
-		}
-		p9_setvalue(pnwname, nwname, uint16_t);
+		INFO_LOG(p9_handle->debug & P9_DEBUG_PROTO, "walk from fid %u (%s) to %.*s, newfid %u", fid->fid, fid->path,
+		         (int)(curpath - hop->path), hop->path, newfid_i);
 	}
 
-	p9_setmsglen(cursor, data);
+	return p9c_sendrequest(p9_handle, data, hop->tag);
+}
 
-	rc = p9c_sendrequest(p9_handle, data, tag);
-	if (rc != 0)
-		return rc;
+static int p9pi_walk_wait(struct p9_handle *p9_handle, struct p9_walk_hop *hop, struct p9_qid *pqid) {
+	int rc;
+	msk_data_t *data;
+	uint16_t nwqid;
+	uint8_t msgtype;
+	uint8_t *cursor;
 
-	rc = p9c_getreply(p9_handle, &data, tag);
+	hop->rerror = 0;
+	rc = p9c_getreply(p9_handle, &data, hop->tag);
 	if (rc != 0 || data == NULL)
 		return rc;
 
@@ -355,14 +384,28 @@ int p9p_rewalk(struct p9_handle *p9_handle, struct p9_fid *fid, char *path, uint
 	p9_getheader(cursor, msgtype);
 	switch(msgtype) {
 		case P9_RWALK:
+			p9_getvalue(cursor, nwqid, uint16_t);
+			/* the server stops at the first name it could not walk */
+			if (nwqid != hop->nwname) {
+				rc = ENOENT;
+				break;
+			}
+			if (nwqid != 0 && pqid) {
+				while (nwqid > 1) {
+					p9_skipqid(cursor);
+					nwqid--;
+				}
+				p9_getqid(cursor, *pqid);
+			}
 			break;
 
 		case P9_RERROR:
 			p9_getvalue(cursor, rc, uint32_t);
+			hop->rerror = 1;
 			break;
 
 		default:
-			ERROR_LOG("Wrong reply type %u to msg %u/tag %u", msgtype, P9_TWALK, tag);
+			ERROR_LOG("Wrong reply type %u to msg %u/tag %u", msgtype, P9_TWALK, hop->tag);
 			rc = EIO;
 	}
 
@@ -371,128 +414,140 @@ int p9p_rewalk(struct p9_handle *p9_handle, struct p9_fid *fid, char *path, uint
 	return rc;
 }
 
+/**
+ * p9pi_walk: walk path from fid into newfid_i
+ *
+ * TWALK takes P9_MAXWELEM names at most, so longer paths are walked in
+ * hops through intermediate fids. These are all taken beforehand so the
+ * hops can be sent back to back; a hop that fails right after one that
+ * went through is sent again on its own, in case the server ran it before
+ * the previous hop. Intermediate fids are clunked afterwards, without
+ * waiting for the replies if defer is set and the handle allows it.
+ *
+ * @param[out]    pqid:		qid of the last name walked, NULL if not needed
+ * @return 0 on success, errno value on error.
+ */
+static int p9pi_walk(struct p9_handle *p9_handle, struct p9_fid *fid, char *path, uint32_t newfid_i, struct p9_qid *pqid, int defer) {
+	struct p9_walk_hop hops[P9_WALK_MAXHOPS];
+	struct p9_fid *from;
+	char *curpath = path ? path : "";
+	int nhops, window, i, j, k, rc = 0, hoprc;
+
+	nhops = 0;
+	do {
+		hops[nhops].path = curpath;
+		hops[nhops].nwname = p9pi_walk_names(NULL, &curpath);
+		hops[nhops].fid = NULL;
+		hops[nhops].done = 0;
+		nhops++;
+	} while (curpath[0] != '\0' && nhops < P9_WALK_MAXHOPS);
+	if (curpath[0] != '\0')
+		return ENAMETOOLONG;
+
+	if (hops[0].nwname == 0 && pqid)
+		memcpy(pqid, &fid->qid, sizeof(struct p9_qid));
+
+	for (i = 0; i < nhops - 1; i++) {
+		rc = p9c_getfid(p9_handle, &hops[i].fid);
+		if (rc) {
+			ERROR_LOG("not enough fids - failing walk");
+			break;
+		}
+	}
+
+	/* the replies hold their tags until we get to them */
+	window = MAX(MIN(P9_WALK_WINDOW, p9_handle->max_tag / 2), 1);
+	for (i = 0; i < nhops && rc == 0; i = j) {
+		p9c_plug(p9_handle);
+		for (j = i; j < nhops && j < i + window; j++) {
+			from = j ? hops[j-1].fid : fid;
+			hoprc = p9pi_walk_send(p9_handle, from, &hops[j], hops[j].fid ? hops[j].fid->fid : newfid_i);
+			if (hoprc) {
+				rc = hoprc;
+				break;
+			}
+		}
+		p9c_unplug(p9_handle);
+		for (k = i; k < j; k++) {
+			hoprc = p9pi_walk_wait(p9_handle, &hops[k], k == nhops - 1 ? pqid : NULL);
+			if (hoprc && hops[k].rerror && k > 0 && hops[k-1].done) {
+				from = hops[k-1].fid;
+				hoprc = p9pi_walk_send(p9_handle, from, &hops[k], hops[k].fid ? hops[k].fid->fid : newfid_i);
+				if (hoprc == 0)
+					hoprc = p9pi_walk_wait(p9_handle, &hops[k], k == nhops - 1 ? pqid : NULL);
+			}
+			if (hoprc == 0)
+				hops[k].done = 1;
+			else if (rc == 0)
+				rc = hoprc;
+		}
+	}
+
+	/* intermediate fids only exist on the server if their hop went through */
+	for (i = 0; i < nhops - 1 && hops[i].fid; i++) {
+		if (!hops[i].done)
+			p9c_putfid(p9_handle, &hops[i].fid);
+		else if (defer && p9_handle->clunkq)
+			p9_clunkq_push(p9_handle, &hops[i].fid);
+		else
+			p9p_clunk(p9_handle, &hops[i].fid);
+	}
+
+	return rc;
+}
+
+int p9p_rewalk(struct p9_handle *p9_handle, struct p9_fid *fid, char *path, uint32_t newfid_i) {
+	/* Sanity check */
+	if (p9_handle == NULL || fid == NULL || path == NULL)
+		return EINVAL;
+
+	return p9pi_walk(p9_handle, fid, path, newfid_i, NULL, 0);
+}
+
 int p9p_walk(struct p9_handle *p9_handle, struct p9_fid *fid, char *path, struct p9_fid **pnewfid) {
 	int rc;
-	msk_data_t *data;
-	uint16_t tag;
-	uint16_t nwname, nwqid;
-	uint8_t msgtype;
-	uint8_t *cursor, *pnwname;
-	char *subpath, *curpath;
 	struct p9_fid *newfid;
 
 	/* Sanity check */
 	if (p9_handle == NULL || fid == NULL || pnewfid == NULL)
 		return EINVAL;
 
-	tag = 0;
-	rc = p9c_getbuffer(p9_handle, &data, &tag);
-	if (rc != 0 || data == NULL)
-		return rc;
-
 	rc = p9c_getfid(p9_handle, &newfid);
 	if (rc) {
-		p9c_abortrequest(p9_handle, data, tag);
 		ERROR_LOG("not enough fids - failing walk");
 		return rc;
 	}
 
-	p9_initcursor(cursor, data->data, P9_TWALK, tag);
-	p9_setvalue(cursor, fid->fid, uint32_t);
-	p9_setvalue(cursor, newfid->fid, uint32_t);
-
-	/* clone or lookup ? */
-	if (!path || path[0] == '\0') {
-		INFO_LOG(p9_handle->debug & P9_DEBUG_PROTO, "walk clone fid %u (%s), newfid %u", fid->fid, fid->path, newfid->fid);
-		p9_setvalue(cursor, 0, uint16_t);
-		nwname = 0;
-	} else {
-		INFO_LOG(p9_handle->debug & P9_DEBUG_PROTO, "walk from fid %u (%s) to %s, newfid %u", fid->fid, fid->path, path, newfid->fid);
-
-		nwname = 0;
-		p9_savepos(cursor, pnwname, uint16_t);
-		curpath = path;
-		while ((subpath = strchr(curpath, '/')) != NULL) {
-			subpath[0] = '\0';
-			if (curpath != subpath) {
-				p9_setstr(cursor, subpath-curpath, curpath);
-				nwname += 1;
-			}
-			subpath[0] = '/';
-			curpath = subpath+1;
-		}
-
-		if (strnlen(curpath,MAXNAMLEN) > 0) {
-			p9_setstr(cursor, strnlen(curpath, MAXNAMLEN), curpath);
-			nwname += 1;
-		}
-		p9_setvalue(pnwname, nwname, uint16_t);
-	}
-
-	p9_setmsglen(cursor, data);
-
-	rc = p9c_sendrequest(p9_handle, data, tag);
-	if (rc != 0)
-		return rc;
-
-	rc = p9c_getreply(p9_handle, &data, tag);
-	if (rc != 0 || data == NULL)
+	rc = p9pi_walk(p9_handle, fid, path, newfid->fid, &newfid->qid, 1);
+	if (rc) {
+		p9c_putfid(p9_handle, &newfid);
 		return rc;
+	}
 
-	cursor = data->data;
-	p9_getheader(cursor, msgtype);
-	switch(msgtype) {
-		case P9_RWALK:
-			p9_getvalue(cursor, nwqid, uint16_t);
-			if (nwqid != nwname) {
-				return EIO;
-			}
-			if (nwqid != 0) {
-				while (nwqid > 1) {
-					p9_skipqid(cursor);
-					nwqid--;
-				}
-				p9_getqid(cursor, newfid->qid);
-			} else {
-				memcpy(&newfid->qid, &fid->qid, sizeof(struct p9_qid));
-			}
-			if (path && path[0] != '\0' && fid->pathlen < MAXPATHLEN-2) {
-				snprintf(newfid->path, MAXPATHLEN, "%s/%s", fid->path, path);
-				newfid->pathlen = path_canonicalizer(newfid->path);
-			} else {
-				memcpy(newfid->path, fid->path, fid->pathlen+1);
-				newfid->pathlen = fid->pathlen;
-			}
-
-			*pnewfid = newfid;
-			break;
+	newfid->session = fid->session;
 
-		case P9_RERROR:
-			p9c_putfid(p9_handle, &newfid);
-			p9_getvalue(cursor, rc, uint32_t);
-			break;
-
-		default:
-			ERROR_LOG("Wrong reply type %u to msg %u/tag %u", msgtype, P9_TWALK, tag);
-			p9c_putfid(p9_handle, &newfid);
-			rc = EIO;
+	if (path && path[0] != '\0' && fid->pathlen < MAXPATHLEN-2) {
+		snprintf(newfid->path, MAXPATHLEN, "%s/%s", fid->path, path);
+		newfid->pathlen = path_canonicalizer(newfid->path);
+	} else {
+		memcpy(newfid->path, fid->path, fid->pathlen+1);
+		newfid->pathlen = fid->pathlen;
 	}
 
-	p9c_putreply(p9_handle, data);
+	*pnewfid = newfid;
 
-	return rc;
+	return 0;
 }
 
 
-int p9p_clunk(struct p9_handle *p9_handle, struct p9_fid **pfid) {
+int p9p_clunk_send(struct p9_handle *p9_handle, struct p9_fid *fid, uint16_t *ptag) {
 	int rc;
 	msk_data_t *data;
 	uint16_t tag;
-	uint8_t msgtype;
 	uint8_t *cursor;
 
 	/* Sanity check */
-	if (p9_handle == NULL || pfid == NULL || *pfid == NULL)
+	if (p9_handle == NULL || fid == NULL || ptag == NULL)
 		return EINVAL;
 
 
@@ -502,15 +557,25 @@ int p9p_clunk(struct p9_handle *p9_handle, struct p9_fid **pfid) {
 		return rc;
 
 	p9_initcursor(cursor, data->data, P9_TCLUNK, tag);
-	p9_setvalue(cursor, (*pfid)->fid, uint32_t);
+	p9_setvalue(cursor, fid->fid, uint32_t);
 	p9_setmsglen(cursor, data);
 
-	INFO_LOG(p9_handle->debug & P9_DEBUG_PROTO, "clunk on fid %u (%s)", (*pfid)->fid, (*pfid)->path);
+	INFO_LOG(p9_handle->debug & P9_DEBUG_PROTO, "clunk on fid %u (%s)", fid->fid, fid->path);
 
 	rc = p9c_sendrequest(p9_handle, data, tag);
 	if (rc != 0)
 		return rc;
 
+	*ptag = tag;
+	return 0;
+}
+
+int p9p_clunk_wait(struct p9_handle *p9_handle, struct p9_fid **pfid, uint16_t tag) {
+	int rc;
+	msk_data_t *data;
+	uint8_t msgtype;
+	uint8_t *cursor;
+
 	rc = p9c_getreply(p9_handle, &data, tag);
 
 	if (rc == 0 && data != NULL) {
@@ -539,6 +604,21 @@ int p9p_clunk(struct p9_handle *p9_handle, struct p9_fid **pfid) {
 	return rc;
 }
 
+int p9p_clunk(struct p9_handle *p9_handle, struct p9_fid **pfid) {
+	int rc;
+	uint16_t tag;
+
+	/* Sanity check */
+	if (p9_handle == NULL || pfid == NULL || *pfid == NULL)
+		return EINVAL;
+
+	rc = p9p_clunk_send(p9_handle, *pfid, &tag);
+	if (rc != 0)
+		return rc;
+
+	return p9p_clunk_wait(p9_handle, pfid, tag);
+}
+
 
 int p9p_remove(struct p9_handle *p9_handle, struct p9_fid **pfid) {
 	int rc;
@@ -742,7 +822,7 @@ int p9p_symlink(struct p9_handle *p9_handle, struct p9_fid *dfid, char *name, ch
 		return ERANGE;
 
 	tag = 0;
-	rc = p9c_getbuffer(p9_handle, &data, &tag);
+	rc = p9c_getbuffer_flags(p9_handle, &data, &tag, p9c_bufflags(p9_handle, P9_ROOM_TSYMLINK + strlen(name) + strlen(symtgt), 0));
 	if (rc != 0 || data == NULL)
 		return rc;
 
@@ -931,6 +1011,7 @@ int p9pz_readlink(struct p9_handle *p9_handle, struct p9_fid *fid, char **ztarge
 			*pdata = data;
 			p9_getstr(cursor, rc, *ztarget);
 			cursor[0] = '\0';
+			p9c_lendreply(p9_handle, data);
 			break;
 
 		case P9_RERROR:
@@ -1047,7 +1128,7 @@ int p9p_readdir(struct p9_handle *p9_handle, struct p9_fid *fid, uint64_t *poffs
 		return -EINVAL;
 
 	tag = 0;
-	rc = p9c_getbuffer(p9_handle, &data, &tag);
+	rc = p9c_getbuffer_flags(p9_handle, &data, &tag, P9_BUF_LARGE_REPLY);
 	if (rc != 0 || data == NULL)
 		return -rc;
 
@@ -1114,23 +1195,32 @@ int p9p_readdir(struct p9_handle *p9_handle, struct p9_fid *fid, uint64_t *poffs
 }
 
 
-ssize_t p9pz_read_send(struct p9_handle *p9_handle, struct p9_fid *fid, size_t count, uint64_t offset, uint16_t *ptag) {
+static ssize_t p9pi_read_send(struct p9_handle *p9_handle, struct p9_fid *fid, char *buf, size_t count, uint64_t offset, uint16_t *ptag) {
 	ssize_t rc;
 	msk_data_t *data;
 	uint16_t tag;
 	uint8_t *cursor;
+	size_t replysize;
 
 	/* Sanity check */
 	if (p9_handle == NULL || fid == NULL || count == 0 || (fid->openflags & RDFLAG) == 0)
 		return -EINVAL;
 
 
+	count = p9p_read_len(p9_handle, count);
+
+	/* if the transport can put the payload in buf, only the header needs room */
+	replysize = P9_ROOM_RREAD;
+	if (buf == NULL || p9_handle->net_ops->set_recv_sink == NULL)
+		replysize += count;
+
 	tag = 0;
-	rc = p9c_getbuffer(p9_handle, &data, &tag);
+	rc = p9c_getbuffer_flags(p9_handle, &data, &tag, p9c_bufflags(p9_handle, 0, replysize) | p9c_ioflags(fid));
 	if (rc != 0 || data == NULL)
 		return -rc;
 
-	count = p9p_read_len(p9_handle, count);
+	p9_handle->tags[tag].rbuf = (uint8_t*)buf;
+	p9_handle->tags[tag].rsize = count;
 
 	p9_initcursor(cursor, data->data, P9_TREAD, tag);
 	p9_setvalue(cursor, fid->fid, uint32_t);
@@ -1148,7 +1238,11 @@ ssize_t p9pz_read_send(struct p9_handle *p9_handle, struct p9_fid *fid, size_t c
 	return 0;
 }
 
-ssize_t p9pz_read_wait(struct p9_handle *p9_handle, msk_data_t **pdata, uint16_t tag) {
+ssize_t p9pz_read_send(struct p9_handle *p9_handle, struct p9_fid *fid, size_t count, uint64_t offset, uint16_t *ptag) {
+	return p9pi_read_send(p9_handle, fid, NULL, count, offset, ptag);
+}
+
+static ssize_t p9pi_read_wait(struct p9_handle *p9_handle, msk_data_t **pdata, uint16_t tag) {
 	ssize_t rc;
 	msk_data_t *data;
 	uint8_t msgtype;
@@ -1183,6 +1277,17 @@ ssize_t p9pz_read_wait(struct p9_handle *p9_handle, msk_data_t **pdata, uint16_t
 	return rc;
 }
 
+ssize_t p9pz_read_wait(struct p9_handle *p9_handle, msk_data_t **pdata, uint16_t tag) {
+	ssize_t rc;
+
+	/* the caller may hold it for long */
+	rc = p9pi_read_wait(p9_handle, pdata, tag);
+	if (rc >= 0)
+		p9c_lendreply(p9_handle, *pdata);
+
+	return rc;
+}
+
 ssize_t p9pz_read(struct p9_handle *p9_handle, struct p9_fid *fid, size_t count, uint64_t offset, msk_data_t **pdata) {
 	ssize_t rc;
 	uint16_t tag;
@@ -1197,24 +1302,44 @@ ssize_t p9pz_read(struct p9_handle *p9_handle, struct p9_fid *fid, size_t count,
 	return p9pz_read_wait(p9_handle, pdata, tag);
 }
 
-ssize_t p9p_read(struct p9_handle *p9_handle, struct p9_fid *fid, char *buf, size_t count, uint64_t offset) {
-	msk_data_t *data;
+ssize_t p9p_read_send(struct p9_handle *p9_handle, struct p9_fid *fid, char *buf, size_t count, uint64_t offset, uint16_t *ptag) {
+	if (buf == NULL)
+		return -EINVAL;
+
+	return p9pi_read_send(p9_handle, fid, buf, count, offset, ptag);
+}
+
+ssize_t p9p_read_wait(struct p9_handle *p9_handle, uint16_t tag) {
 	ssize_t rc;
+	msk_data_t *data;
+	uint8_t *buf;
 
-	/* Sanity check */
-	if (p9_handle == NULL || fid == NULL || buf == NULL)
-		return -EINVAL;
+	/* the tag is ours until the reply is in */
+	buf = p9_handle->tags[tag == P9_NOTAG ? p9_handle->max_tag-1 : tag].rbuf;
 
-	rc = p9pz_read(p9_handle, fid, count, offset, &data);
+	rc = p9pi_read_wait(p9_handle, &data, tag);
+	if (rc < 0)
+		return rc;
 
-	if (rc >= 0) {
-		memcpy(buf, data->data, MIN(count, rc+1));
-		p9c_putreply(p9_handle, data);
-	}
+	/* copy unless the transport already put the payload in place */
+	if (data->size >= rc)
+		memcpy(buf, data->data, rc);
+	p9c_putreply(p9_handle, data);
 
 	return rc;
 }
 
+ssize_t p9p_read(struct p9_handle *p9_handle, struct p9_fid *fid, char *buf, size_t count, uint64_t offset) {
+	ssize_t rc;
+	uint16_t tag;
+
+	rc = p9p_read_send(p9_handle, fid, buf, count, offset, &tag);
+	if (rc)
+		return rc;
+
+	return p9p_read_wait(p9_handle, tag);
+}
+
 
 ssize_t p9pz_write_send(struct p9_handle *p9_handle, struct p9_fid *fid, msk_data_t *data, uint64_t offset, uint16_t *ptag) {
 	ssize_t rc;
@@ -1227,7 +1352,7 @@ ssize_t p9pz_write_send(struct p9_handle *p9_handle, struct p9_fid *fid, msk_dat
 		return -EINVAL;
 
 	tag = 0;
-	rc = p9c_getbuffer(p9_handle, &header_data, &tag);
+	rc = p9c_getbuffer_flags(p9_handle, &header_data, &tag, p9c_ioflags(fid));
 	if (rc != 0 || header_data == NULL)
 		return -rc;
 
@@ -1307,13 +1432,13 @@ ssize_t p9p_write_send(struct p9_handle *p9_handle, struct p9_fid *fid, char *bu
 	if (p9_handle == NULL || fid == NULL || buf == NULL || count == 0 || (fid->openflags & WRFLAG) == 0)
 		return -EINVAL;
 
+	count = p9p_write_len(p9_handle, count);
+
 	tag = 0;
-	rc = p9c_getbuffer(p9_handle, &data, &tag);
+	rc = p9c_getbuffer_flags(p9_handle, &data, &tag, p9c_bufflags(p9_handle, P9_ROOM_TWRITE + count, 0) | p9c_ioflags(fid));
 	if (rc != 0 || data == NULL)
 		return -rc;
 
-	count = p9p_write_len(p9_handle, count);
-
 	p9_initcursor(cursor, data->data, P9_TWRITE, tag);
 	p9_setvalue(cursor, fid->fid, uint32_t);
 	p9_setvalue(cursor, offset, uint64_t);
@@ -1376,16 +1501,15 @@ ssize_t p9p_write(struct p9_handle *p9_handle, struct p9_fid *fid, char *buf, si
 	return p9p_write_wait(p9_handle, tag);
 }
 
-int p9p_xattrwalk(struct p9_handle *p9_handle, struct p9_fid *fid, struct p9_fid **pnewfid, char *name, uint64_t *psize) {
+int p9p_xattrwalk_send(struct p9_handle *p9_handle, struct p9_fid *fid, struct p9_fid **pnewfid, char *name, uint16_t *ptag) {
 	int rc;
 	msk_data_t *data;
 	uint16_t tag;
-	uint8_t msgtype;
 	uint8_t *cursor;
 	struct p9_fid *newfid;
 
 	/* Sanity check */
-	if (p9_handle == NULL || fid == NULL || pnewfid == NULL || psize == NULL)
+	if (p9_handle == NULL || fid == NULL || pnewfid == NULL || ptag == NULL)
 		return EINVAL;
 
 	tag = 0;
@@ -1411,30 +1535,45 @@ int p9p_xattrwalk(struct p9_handle *p9_handle, struct p9_fid *fid, struct p9_fid
 	p9_setmsglen(cursor, data);
 
 	rc = p9c_sendrequest(p9_handle, data, tag);
-	if (rc != 0)
+	if (rc != 0) {
+		p9c_putfid(p9_handle, &newfid);
 		return rc;
+	}
+
+	newfid->session = fid->session;
+	*pnewfid = newfid;
+	*ptag = tag;
+	return 0;
+}
+
+int p9p_xattrwalk_wait(struct p9_handle *p9_handle, struct p9_fid **pnewfid, uint64_t *psize, uint16_t tag) {
+	int rc;
+	msk_data_t *data;
+	uint8_t msgtype;
+	uint8_t *cursor;
 
 	rc = p9c_getreply(p9_handle, &data, tag);
-	if (rc != 0 || data == NULL)
+	if (rc != 0 || data == NULL) {
+		p9c_putfid(p9_handle, pnewfid);
 		return rc;
+	}
 
 	cursor = data->data;
 	p9_getheader(cursor, msgtype);
 	switch(msgtype) {
 		case P9_RXATTRWALK:
 			p9_getvalue(cursor, *psize, uint64_t);
-			newfid->openflags = RDFLAG;
-			*pnewfid = newfid;
+			(*pnewfid)->openflags = RDFLAG;
 			break;
 
 		case P9_RERROR:
-			p9c_putfid(p9_handle, &newfid);
+			p9c_putfid(p9_handle, pnewfid);
 			p9_getvalue(cursor, rc, uint32_t);
 			break;
 
 		default:
 			ERROR_LOG("Wrong reply type %u to msg %u/tag %u", msgtype, P9_TXATTRWALK, tag);
-			p9c_putfid(p9_handle, &newfid);
+			p9c_putfid(p9_handle, pnewfid);
 			rc = EIO;
 	}
 
@@ -1443,6 +1582,26 @@ int p9p_xattrwalk(struct p9_handle *p9_handle, struct p9_fid *fid, struct p9_fid
 	return rc;
 }
 
+int p9p_xattrwalk(struct p9_handle *p9_handle, struct p9_fid *fid, struct p9_fid **pnewfid, char *name, uint64_t *psize) {
+	int rc;
+	uint16_t tag;
+	struct p9_fid *newfid;
+
+	/* Sanity check */
+	if (p9_handle == NULL || fid == NULL || pnewfid == NULL || psize == NULL)
+		return EINVAL;
+
+	rc = p9p_xattrwalk_send(p9_handle, fid, &newfid, name, &tag);
+	if (rc)
+		return rc;
+
+	rc = p9p_xattrwalk_wait(p9_handle, &newfid, psize, tag);
+	if (rc == 0)
+		*pnewfid = newfid;
+
+	return rc;
+}
+
 
 int p9p_xattrcreate(struct p9_handle *p9_handle, struct p9_fid *fid, char *name, uint64_t size, uint32_t flags) {
 	int rc;
@@ -1745,6 +1904,10 @@ int p9p_setattr(struct p9_handle *p9_handle, struct p9_fid *fid, struct p9_setat
 
 	p9c_putreply(p9_handle, data);
 
+	/* a truncate may have gone through even if we can't tell */
+	if (p9_handle->cache && (attr->valid & P9_SETATTR_SIZE))
+		p9_cache_invalidate(p9_handle, fid->qid.path, 0, UINT64_MAX);
+
 	return rc;
 }
 
@@ -0,0 +1,127 @@
+/*
+ * Copyright CEA/DAM/DIF (2013)
+ * Contributor: Dominique Martinet <dominique.martinet@cea.fr>
+ *
+ * This file is part of the space9 9P userspace library.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with space9.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+/**
+ * \file	9p_session.c
+ * \brief	more users over one connection
+ *
+ * A session is an extra attach on the handle's connection: it shares
+ * buffers, tags and fids with the handle but has its own root fid and
+ * cwd, and every fid walked from these acts as its user.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>	//calloc
+#include <inttypes.h>	//uint*_t
+#include <errno.h>	//EINVAL
+#include <unistd.h>	//geteuid
+#include <pthread.h>	//pthread_*
+
+#include "9p_internals.h"
+#include "utils.h"
+
+int p9_session_attach(struct p9_handle *p9_handle, uint32_t uid, struct p9_session **psession) {
+	struct p9_session *session;
+	int rc;
+
+	if (p9_handle == NULL || psession == NULL)
+		return EINVAL;
+
+#ifndef ALLOW_UID_OVERRIDE
+	/* the server would only ever see our effective uid */
+	if (uid != geteuid())
+		return EPERM;
+#endif
+
+	session = calloc(1, sizeof(struct p9_session));
+	if (session == NULL)
+		return ENOMEM;
+
+	session->p9_handle = p9_handle;
+	session->uid = uid;
+
+	do {
+		rc = p9p_attach(p9_handle, uid, &session->root_fid);
+		if (rc) {
+			ERROR_LOG("attach for uid %u failed: %s (%d)", uid, strerror(rc), rc);
+			break;
+		}
+		session->root_fid->session = session;
+
+		rc = p9p_walk(p9_handle, session->root_fid, NULL, &session->cwd);
+		if (rc) {
+			ERROR_LOG("cwd for uid %u failed: %s (%d)", uid, strerror(rc), rc);
+			p9p_clunk(p9_handle, &session->root_fid);
+			break;
+		}
+	} while (0);
+
+	if (rc) {
+		free(session);
+		return rc;
+	}
+
+	/* reconnect attaches sessions again, under the same lock */
+	pthread_mutex_lock(&p9_handle->connection_lock);
+	session->next = p9_handle->sessions;
+	p9_handle->sessions = session;
+	pthread_mutex_unlock(&p9_handle->connection_lock);
+
+	*psession = session;
+
+	return 0;
+}
+
+void p9_session_detach(struct p9_session **psession) {
+	struct p9_session *session, **pnext;
+	struct p9_handle *p9_handle;
+
+	if (psession == NULL || *psession == NULL)
+		return;
+
+	session = *psession;
+	p9_handle = session->p9_handle;
+
+	pthread_mutex_lock(&p9_handle->connection_lock);
+	for (pnext = &p9_handle->sessions; *pnext; pnext = &(*pnext)->next) {
+		if (*pnext == session) {
+			*pnext = session->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&p9_handle->connection_lock);
+
+	p9p_clunk(p9_handle, &session->cwd);
+	p9p_clunk(p9_handle, &session->root_fid);
+	free(session);
+	*psession = NULL;
+}
+
+void p9_session_destroy_all(struct p9_handle *p9_handle) {
+	struct p9_session *session;
+
+	while ((session = p9_handle->sessions) != NULL)
+		p9_session_detach(&session);
+}
@@ -61,6 +61,7 @@ static struct functions functions[] = {
 	{ "mv", "mv <from> <to>: moves from to to, only cwd/no slash allowed atm", p9s_mv },
 	{ "rmdir", "rm <dir>: removes a dir. Actually rm.", p9s_rm },
 	{ "ln", "ln [-s] target [linkname]: links or symlinks", p9s_ln },
+	{ "stats", "stats [reset]: per message counters and latencies, or zero them", p9s_stats },
 	{ NULL, NULL, NULL }
 };
 
@@ -310,3 +310,48 @@ int p9s_mv(struct p9_handle *p9_handle, char *arg) {
 	return p9l_mv(p9_handle->cwd, arg, dest);
 }
 
+
+int p9s_stats(struct p9_handle *p9_handle, char *arg) {
+	struct p9_stats *stats;
+	struct p9_op_stats *op;
+	int i, rc;
+
+	if (strncmp(arg, "reset", 5) == 0) {
+		p9_stats_reset(p9_handle);
+		return 0;
+	}
+
+	stats = malloc(sizeof(struct p9_stats));
+	if (!stats)
+		return ENOMEM;
+
+	rc = p9_stats_get(p9_handle, stats);
+	if (rc) {
+		free(stats);
+		return rc;
+	}
+
+	printf("%-12s %10s %8s %8s %12s %12s %10s %10s %10s %10s\n", "op", "count", "errors", "retries",
+	       "tx_bytes", "rx_bytes", "avg(us)", "p50(us)", "p99(us)", "max(us)");
+	for (i = 0; i < P9_STATS_OPS; i++) {
+		op = &stats->op[i];
+		if (op->ops == 0 && op->retries == 0)
+			continue;
+		printf("%-12s %10"PRIu64" %8"PRIu64" %8"PRIu64" %12"PRIu64" %12"PRIu64" %10.1f %10.1f %10.1f %10.1f\n",
+		       p9_stats_opname(i) ? p9_stats_opname(i) : "unknown", op->ops, op->errors, op->retries,
+		       op->tx_bytes, op->rx_bytes, op->ops ? op->lat_sum / op->ops / 1000.0 : 0.0,
+		       p9_stats_percentile(op, 50) / 1000.0, p9_stats_percentile(op, 99) / 1000.0,
+		       op->lat_max / 1000.0);
+	}
+	if (stats->cache_hits || stats->cache_misses)
+		printf("cache: %"PRIu64" block hits, %"PRIu64" misses, %"PRIu64" of them from disk\n",
+		       stats->cache_hits, stats->cache_misses, stats->disk_hits);
+	printf("window: %"PRIu64" requests in flight\n", stats->window);
+	if (stats->spin_hits || stats->spin_misses)
+		printf("spin: %"PRIu64" replies polled, %"PRIu64" parked\n", stats->spin_hits, stats->spin_misses);
+	if (stats->throttled)
+		printf("throttled: %"PRIu64" requests, %.1f ms\n", stats->throttled, stats->throttled_ns / 1000000.0);
+
+	free(stats);
+	return 0;
+}
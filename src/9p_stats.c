@@ -0,0 +1,235 @@
+/*
+ * Copyright CEA/DAM/DIF (2013)
+ * Contributor: Dominique Martinet <dominique.martinet@cea.fr>
+ *
+ * This file is part of the space9 9P userspace library.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with space9.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/param.h>	// MIN
+#include "9p_internals.h"
+#include "9p_proto_internals.h"
+#include "utils.h"
+#include "settings.h"
+
+/* bucket boundaries are exact up to 2^(P9_STATS_SUB_BITS+1), then keep P9_STATS_SUB_BITS significant bits */
+#define P9_STATS_SUB (1 << P9_STATS_SUB_BITS)
+#define P9_STATS_MAX_EXP (P9_STATS_BUCKETS / P9_STATS_SUB + P9_STATS_SUB_BITS - 2)
+
+static const char *p9_stats_names[P9_STATS_OPS] = {
+	[P9_TSTATFS/2] = "statfs",
+	[P9_TLOPEN/2] = "lopen",
+	[P9_TLCREATE/2] = "lcreate",
+	[P9_TSYMLINK/2] = "symlink",
+	[P9_TMKNOD/2] = "mknod",
+	[P9_TRENAME/2] = "rename",
+	[P9_TREADLINK/2] = "readlink",
+	[P9_TGETATTR/2] = "getattr",
+	[P9_TSETATTR/2] = "setattr",
+	[P9_TXATTRWALK/2] = "xattrwalk",
+	[P9_TXATTRCREATE/2] = "xattrcreate",
+	[P9_TREADDIR/2] = "readdir",
+	[P9_TFSYNC/2] = "fsync",
+	[P9_TLOCK/2] = "lock",
+	[P9_TGETLOCK/2] = "getlock",
+	[P9_TLINK/2] = "link",
+	[P9_TMKDIR/2] = "mkdir",
+	[P9_TRENAMEAT/2] = "renameat",
+	[P9_TUNLINKAT/2] = "unlinkat",
+	[P9_TVERSION/2] = "version",
+	[P9_TAUTH/2] = "auth",
+	[P9_TATTACH/2] = "attach",
+	[P9_TFLUSH/2] = "flush",
+	[P9_TWALK/2] = "walk",
+	[P9_TREAD/2] = "read",
+	[P9_TWRITE/2] = "write",
+	[P9_TCLUNK/2] = "clunk",
+	[P9_TREMOVE/2] = "remove",
+};
+
+static inline uint64_t p9_stats_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint16_t p9_stats_tag(struct p9_handle *p9_handle, uint16_t tag) {
+	/* kludge on P9_NOTAG to have a smaller array */
+	return tag == P9_NOTAG ? p9_handle->max_tag - 1 : tag;
+}
+
+static inline struct p9_op_stats *p9_stats_op(struct p9_handle *p9_handle, uint16_t tag) {
+	return &p9_handle->stats->op[(p9_handle->tags[tag].msgtype / 2) % P9_STATS_OPS];
+}
+
+static int p9_stats_bucket(uint64_t val) {
+	int exp;
+
+	if (val < 2*P9_STATS_SUB)
+		return val;
+
+	exp = 63 - __builtin_clzll(val);
+	if (exp > P9_STATS_MAX_EXP)
+		return P9_STATS_BUCKETS - 1;
+
+	return (exp - P9_STATS_SUB_BITS + 1) * P9_STATS_SUB + ((val >> (exp - P9_STATS_SUB_BITS)) & (P9_STATS_SUB - 1));
+}
+
+/** highest value falling in bucket i */
+static uint64_t p9_stats_bucket_max(int i) {
+	int exp;
+
+	if (i < 2*P9_STATS_SUB)
+		return i;
+
+	exp = i / P9_STATS_SUB + P9_STATS_SUB_BITS - 1;
+	return ((uint64_t)(P9_STATS_SUB + i % P9_STATS_SUB + 1) << (exp - P9_STATS_SUB_BITS)) - 1;
+}
+
+void p9_stats_send(struct p9_handle *p9_handle, uint16_t tag, msk_data_t *data) {
+	struct p9_tag *ptag;
+	uint64_t size = 0;
+
+	tag = p9_stats_tag(p9_handle, tag);
+	ptag = &p9_handle->tags[tag];
+
+	ptag->msgtype = data->data[sizeof(uint32_t)];
+	ptag->sent = p9_stats_now();
+
+	for (; data != NULL; data = data->next)
+		size += data->size;
+	__sync_fetch_and_add(&p9_stats_op(p9_handle, tag)->tx_bytes, size);
+}
+
+void p9_stats_cache(struct p9_handle *p9_handle, int hit) {
+	if (hit)
+		atomic_inc(p9_handle->stats->cache_hits);
+	else
+		atomic_inc(p9_handle->stats->cache_misses);
+}
+
+void p9_stats_disk_hit(struct p9_handle *p9_handle) {
+	atomic_inc(p9_handle->stats->disk_hits);
+}
+
+void p9_stats_throttled(struct p9_handle *p9_handle, uint64_t ns) {
+	atomic_inc(p9_handle->stats->throttled);
+	__sync_fetch_and_add(&p9_handle->stats->throttled_ns, ns);
+}
+
+void p9_stats_spin(struct p9_handle *p9_handle, int hit) {
+	if (hit)
+		atomic_inc(p9_handle->stats->spin_hits);
+	else
+		atomic_inc(p9_handle->stats->spin_misses);
+}
+
+void p9_stats_retry(struct p9_handle *p9_handle, uint16_t tag) {
+	tag = p9_stats_tag(p9_handle, tag);
+	atomic_inc(p9_stats_op(p9_handle, tag)->retries);
+}
+
+uint64_t p9_stats_rtt(struct p9_handle *p9_handle, uint16_t tag) {
+	tag = p9_stats_tag(p9_handle, tag);
+	return p9_stats_now() - p9_handle->tags[tag].sent;
+}
+
+void p9_stats_reply(struct p9_handle *p9_handle, uint16_t tag, msk_data_t *data) {
+	struct p9_op_stats *op;
+	uint64_t lat, old;
+	uint8_t msgtype;
+
+	tag = p9_stats_tag(p9_handle, tag);
+	op = p9_stats_op(p9_handle, tag);
+	lat = p9_stats_now() - p9_handle->tags[tag].sent;
+
+	atomic_inc(op->ops);
+	/* wire size: a read payload may have gone straight to the caller */
+	__sync_fetch_and_add(&op->rx_bytes, *(uint32_t *)data->data);
+	msgtype = data->data[sizeof(uint32_t)];
+	if (msgtype == P9_RERROR || msgtype == P9_RLERROR)
+		atomic_inc(op->errors);
+
+	__sync_fetch_and_add(&op->lat_sum, lat);
+	atomic_inc(op->hist[p9_stats_bucket(lat)]);
+
+	do {
+		old = op->lat_max;
+	} while (lat > old && !__sync_bool_compare_and_swap(&op->lat_max, old, lat));
+	do {
+		old = op->lat_min;
+	} while ((old == 0 || lat < old) && !__sync_bool_compare_and_swap(&op->lat_min, old, lat));
+}
+
+int p9_stats_get(struct p9_handle *p9_handle, struct p9_stats *stats) {
+	if (p9_handle == NULL || stats == NULL)
+		return EINVAL;
+
+	memcpy(stats, p9_handle->stats, sizeof(struct p9_stats));
+	stats->window = p9_handle->window.min ? p9_handle->window.size : p9_handle->recv_num;
+
+	return 0;
+}
+
+void p9_stats_reset(struct p9_handle *p9_handle) {
+	if (p9_handle == NULL)
+		return;
+
+	memset(p9_handle->stats, 0, sizeof(struct p9_stats));
+}
+
+const char *p9_stats_opname(int op) {
+	if (op < 0 || op >= P9_STATS_OPS)
+		return NULL;
+
+	return p9_stats_names[op];
+}
+
+uint64_t p9_stats_percentile(struct p9_op_stats *op_stats, double percentile) {
+	uint64_t count = 0, total = 0, rank;
+	int i;
+
+	for (i = 0; i < P9_STATS_BUCKETS; i++)
+		total += op_stats->hist[i];
+
+	if (total == 0)
+		return 0;
+
+	rank = (uint64_t)(percentile * total / 100.0 + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank > total)
+		rank = total;
+
+	for (i = 0; i < P9_STATS_BUCKETS; i++) {
+		count += op_stats->hist[i];
+		if (count >= rank)
+			break;
+	}
+
+	return MIN(p9_stats_bucket_max(i), op_stats->lat_max);
+}
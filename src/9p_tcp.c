@@ -33,13 +33,23 @@
 #include <semaphore.h>  //sem_* (is it a good idea to mix sem and pthread_cond/mutex?)
 #include <arpa/inet.h>  //inet_ntop
 #include <netinet/in.h> //sock_addr_in
+#include <netinet/tcp.h> //TCP_NODELAY
 #include <unistd.h>	//fcntl
 #include <fcntl.h>	//fcntl
 #include <sys/epoll.h>	//epoll
+#include <sys/param.h>	//MIN
+#include <poll.h>	//poll
+#include <linux/errqueue.h>	//sock_extended_err
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define MSK_TCP_ZEROCOPY 1
+#endif
 #define MAX_EVENTS 10
 
 #include "9p_internals.h"
+#include "9p_proto_internals.h"
 #include "utils.h"
+#include "settings.h"
 
 /**
  * \file	9p_tcp.c
@@ -61,6 +71,7 @@ struct msk_ctx {
 		MSK_CTX_PROCESSING
 	} used;				/**< 0 if we can use it for a new recv/send */
 	uint32_t pos;			/**< current position inside our own buffer. 0 <= pos <= len */
+	uint32_t seq;			/**< post order, recv buffers are used oldest first */
 	int num_sge;
 	struct rdmactx *next;		/**< next context */
 	msk_data_t *data;
@@ -74,11 +85,33 @@ struct msk_ctx {
 #define MSK_DEBUG_SEND 0x0004
 #define MSK_DEBUG_RECV 0x0008
 
+/**
+ * \struct msk_tcp_zc
+ * Message sent with MSG_ZEROCOPY whose send callback waits for the kernel
+ * to be done with its buffers
+ */
+struct msk_tcp_zc {
+	uint32_t seq;			/**< last zerocopy send of the message */
+	msk_data_t *data;
+	ctx_callback_t callback;
+	ctx_callback_t err_callback;
+	void *callback_arg;
+	struct msk_tcp_zc *next;
+};
+
 struct msk_tcp_trans {
 	int sockfd;
 	sockaddr_union_t peer_sa;
 	pthread_t cq_thrid;
 	pthread_mutex_t lock;
+	uint32_t recv_seq;
+	p9_recv_sink_t recv_sink;
+	uint32_t zc_min;		/**< segments that big are sent with MSG_ZEROCOPY, 0 = never */
+	uint32_t zc_seq;		/**< zerocopy sends so far, the kernel numbers them the same way */
+	uint32_t zc_done;		/**< zerocopy sends the kernel is done with */
+	pthread_mutex_t zc_lock;
+	struct msk_tcp_zc *zc_head;	/**< messages waiting for zc_done, in send order */
+	struct msk_tcp_zc *zc_tail;
 };
 
 #define tcpt(trans) ((struct msk_tcp_trans*)trans->cm_id)
@@ -155,74 +188,243 @@ static inline int msk_tcp_create_thread(pthread_t *thrid, void *(*start_routine)
 	return pthread_create(thrid, &attr, start_routine, arg);
 }
 
+/**
+ * msk_tcp_zc_reap: read zerocopy completions off the error queue
+ *
+ * Send callbacks of the messages the kernel is done with are called.
+ *
+ * @return number of completions read
+ */
+static int msk_tcp_zc_reap(msk_trans_t *trans) {
+#ifdef MSK_TCP_ZEROCOPY
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *serr;
+	char control[128];
+	struct msk_tcp_zc *zc, *done, **pdone;
+	int n = 0;
+
+	pthread_mutex_lock(&tcpt(trans)->zc_lock);
+	while (1) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(tcpt(trans)->sockfd, &msg, MSG_ERRQUEUE) < 0)
+			break;
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+			      || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+				continue;
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			/* [ee_info, ee_data] are done, tcp completes them in order */
+			if ((int32_t)(serr->ee_data + 1 - tcpt(trans)->zc_done) > 0)
+				tcpt(trans)->zc_done = serr->ee_data + 1;
+			n++;
+		}
+	}
+
+	/* detach what is done, callbacks are called without the lock */
+	done = NULL;
+	pdone = &done;
+	while ((zc = tcpt(trans)->zc_head) && (int32_t)(zc->seq - tcpt(trans)->zc_done) < 0) {
+		tcpt(trans)->zc_head = zc->next;
+		*pdone = zc;
+		pdone = &zc->next;
+	}
+	*pdone = NULL;
+	if (!tcpt(trans)->zc_head)
+		tcpt(trans)->zc_tail = NULL;
+	pthread_mutex_unlock(&tcpt(trans)->zc_lock);
+
+	while ((zc = done)) {
+		done = zc->next;
+		zc->callback(trans, zc->data, zc->callback_arg);
+		free(zc);
+	}
+
+	return n;
+#else
+	return 0;
+#endif
+}
+
+/**
+ * msk_tcp_recv_read: read exactly size bytes
+ *
+ * @return 0 on success, errno value on error or if the peer went away
+ */
+static int msk_tcp_recv_read(msk_trans_t *trans, void *buf, uint32_t size) {
+	ssize_t n;
+	struct pollfd pfd;
+
+	while (size > 0) {
+		/* zerocopy completions show up as POLLERR, reap them while waiting */
+		if (tcpt(trans)->zc_min) {
+			pfd.fd = tcpt(trans)->sockfd;
+			pfd.events = POLLIN;
+			n = poll(&pfd, 1, -1);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n > 0 && (pfd.revents & POLLERR) && msk_tcp_zc_reap(trans) > 0
+			    && !(pfd.revents & (POLLIN | POLLHUP)))
+				continue;
+		}
+		n = read(tcpt(trans)->sockfd, buf, size);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0) {
+			return errno;
+		} else if (n == 0) {
+			return ECONNRESET;
+		}
+		buf = (uint8_t*)buf + n;
+		size -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * msk_tcp_recv_ctx: pick the posted buffer for a packet of the given size
+ *
+ * The smallest buffer the packet fits in is taken, so callers can post
+ * buffers of different sizes and keep the big ones for big replies.
+ * If none is big enough, the biggest one gets the truncated packet.
+ * Among buffers of the same size the oldest post wins, like a rdma queue.
+ * Must hold ctx_lock.
+ */
+static struct msk_ctx *msk_tcp_recv_ctx(msk_trans_t *trans, uint32_t packet_size) {
+	struct msk_ctx *ctx, *best = NULL, *biggest = NULL;
+	int i;
+
+	for (i = 0, ctx = trans->recv_buf;
+	     i < trans->qp_attr.cap.max_recv_wr;
+	     i++, ctx = (struct msk_ctx*)((uint8_t*)ctx + sizeof(struct msk_ctx))) {
+		if (ctx->used != MSK_CTX_PENDING)
+			continue;
+		if (ctx->data->max_size >= packet_size && (!best || ctx->data->max_size < best->data->max_size
+		    || (ctx->data->max_size == best->data->max_size && (int32_t)(ctx->seq - best->seq) < 0)))
+			best = ctx;
+		if (!biggest || ctx->data->max_size > biggest->data->max_size
+		    || (ctx->data->max_size == biggest->data->max_size && (int32_t)(ctx->seq - biggest->seq) < 0))
+			biggest = ctx;
+	}
+
+	return best ? best : biggest;
+}
+
+/**
+ * msk_tcp_recv_skip: read and throw away size bytes
+ */
+static int msk_tcp_recv_skip(msk_trans_t *trans, uint32_t size) {
+	char junk[1024];
+	uint32_t n;
+	int rc = 0;
+
+	while (rc == 0 && size > 0) {
+		n = (size > sizeof(junk) ? sizeof(junk) : size);
+		rc = msk_tcp_recv_read(trans, junk, n);
+		size -= n;
+	}
+
+	return rc;
+}
+
 static void *msk_tcp_recv_thread(void *arg) {
 	msk_trans_t *trans = arg;
-	char *junk;
-	int rc, i;
+	int rc;
 	msk_data_t *data;
 	struct msk_ctx *ctx;
-	uint32_t n, packet_size, read_size;
+	uint8_t hdr[P9_ROOM_RREAD];
+	uint32_t packet_size, hdr_size, read_size, sink_size, count;
+	uint16_t tag;
+	uint8_t *sink;
 
 	while (trans->state == MSK_CONNECTED) {
-		pthread_mutex_lock(&trans->ctx_lock);
-		do {
-			for (i = 0, ctx = trans->recv_buf;
-			     i < trans->qp_attr.cap.max_recv_wr;
-			     i++, ctx = (struct msk_ctx*)((uint8_t*)ctx + sizeof(struct msk_ctx)))
-				if (!ctx->used != MSK_CTX_PENDING)
+		/* the size tells which buffer to use */
+		rc = msk_tcp_recv_read(trans, hdr, P9_HDR_SIZE);
+		if (rc)
+			break;
+		memcpy(&packet_size, hdr, sizeof(packet_size));
+		hdr_size = P9_HDR_SIZE;
+
+		/* read payloads can go straight where the caller wants them,
+		 * then only the header needs a buffer */
+		sink = NULL;
+		if (tcpt(trans)->recv_sink && packet_size >= P9_ROOM_RREAD) {
+			rc = msk_tcp_recv_read(trans, hdr + hdr_size, P9_STD_HDR_SIZE - hdr_size);
+			if (rc)
+				break;
+			hdr_size = P9_STD_HDR_SIZE;
+			if (hdr[P9_HDR_SIZE] == P9_RREAD) {
+				p9_get_tag(&tag, hdr);
+				sink = tcpt(trans)->recv_sink(trans, tag, &sink_size);
+			}
+			if (sink) {
+				rc = msk_tcp_recv_read(trans, hdr + hdr_size, P9_ROOM_RREAD - hdr_size);
+				if (rc)
 					break;
-
-			if (i == trans->qp_attr.cap.max_recv_wr) {
-				INFO_LOG(internals->debug & MSK_DEBUG_RECV, "Waiting for cond");
-				pthread_cond_wait(&trans->ctx_cond, &trans->ctx_lock);
+				hdr_size = P9_ROOM_RREAD;
 			}
+		}
 
-		} while ( i == trans->qp_attr.cap.max_recv_wr );
+		pthread_mutex_lock(&trans->ctx_lock);
+		while ((ctx = msk_tcp_recv_ctx(trans, sink ? hdr_size : packet_size)) == NULL && trans->state == MSK_CONNECTED) {
+			INFO_LOG(internals->debug & MSK_DEBUG_RECV, "Waiting for cond");
+			pthread_cond_wait(&trans->ctx_cond, &trans->ctx_lock);
+		}
+		if (ctx == NULL) {
+			pthread_mutex_unlock(&trans->ctx_lock);
+			break;
+		}
 		ctx->used = MSK_CTX_PROCESSING;
 		pthread_mutex_unlock(&trans->ctx_lock);
 
 		data = ctx->data;
 
-		data->size = 0;
-		while (data->size < 4) {
-			n = read(tcpt(trans)->sockfd, data->data + data->size, 4 - data->size);
-			data->size += n;
-		}
-		packet_size = *((uint32_t*)data->data);
-		read_size = packet_size;
-		if (packet_size > data->max_size) {
-			INFO_LOG(internals->debug & MSK_DEBUG_EVENT, "packet bigger than data maxsize? (resp. %u and %u)", packet_size, data->max_size);
-			read_size = data->max_size;
-		}
+		memcpy(data->data, hdr, hdr_size);
+		data->size = hdr_size;
 
-		do {
-			n = read(tcpt(trans)->sockfd, data->data + data->size, read_size - data->size);
-			if (n < 0 && errno == EINTR) {
-				continue;
-			} else if (n < 0) {
-				rc = errno;
-				INFO_LOG(internals->debug & MSK_DEBUG_EVENT, "recv error! %s (%d)", strerror(rc), rc);
-				break;
+		if (sink) {
+			memcpy(&count, hdr + P9_STD_HDR_SIZE, sizeof(count));
+			read_size = packet_size - hdr_size;
+			if (read_size > sink_size) {
+				INFO_LOG(internals->debug & MSK_DEBUG_EVENT, "read payload bigger than asked for (resp. %u and %u), throwing the rest out", read_size, sink_size);
+				read_size = sink_size;
 			}
-			data->size += n;
-		} while(data->size < read_size);
-
-		if (packet_size > read_size) {
-			INFO_LOG(internals->debug & MSK_DEBUG_EVENT, "packet too big for buffer, throwing %u bytes out", packet_size - read_size);
-			read_size = packet_size - read_size;
-			junk = malloc(1024);
-			while (read_size > 0) {
-				n = read(tcpt(trans)->sockfd, junk, (read_size > 1024 ? 1024 : read_size));
-				if (n < 0 && errno == EINTR) {
-					continue;
-				} else if (n < 0) {
-					rc = errno;
-					INFO_LOG(internals->debug & MSK_DEBUG_EVENT, "recv error! %s (%d)", strerror(rc), rc);
-					break;
-				}
-				read_size -= n;
+			rc = msk_tcp_recv_read(trans, sink, read_size);
+			if (rc == 0 && packet_size - hdr_size > read_size)
+				rc = msk_tcp_recv_skip(trans, packet_size - hdr_size - read_size);
+			/* count as it landed */
+			count = MIN(count, read_size);
+			memcpy(data->data + P9_STD_HDR_SIZE, &count, sizeof(count));
+		} else {
+			read_size = packet_size;
+			if (packet_size > data->max_size) {
+				INFO_LOG(internals->debug & MSK_DEBUG_EVENT, "packet bigger than data maxsize? (resp. %u and %u)", packet_size, data->max_size);
+				read_size = data->max_size;
+			}
+
+			if (read_size > data->size) {
+				rc = msk_tcp_recv_read(trans, data->data + data->size, read_size - data->size);
+				data->size = read_size;
+			}
+
+			if (rc == 0 && packet_size > read_size) {
+				INFO_LOG(internals->debug & MSK_DEBUG_EVENT, "packet too big for buffer, throwing %u bytes out", packet_size - read_size);
+				rc = msk_tcp_recv_skip(trans, packet_size - read_size);
 			}
-			free(junk);
+		}
+
+		if (rc) {
+			/* give the buffer back as it was */
+			pthread_mutex_lock(&trans->ctx_lock);
+			ctx->used = MSK_CTX_PENDING;
+			pthread_mutex_unlock(&trans->ctx_lock);
+			break;
 		}
 
 		ctx->callback(trans, data, ctx->callback_arg);
@@ -232,10 +434,79 @@ static void *msk_tcp_recv_thread(void *arg) {
 		pthread_cond_broadcast(&trans->ctx_cond);
 		pthread_mutex_unlock(&trans->ctx_lock);
 	}
+
+	if (trans->state == MSK_CONNECTED) {
+		INFO_LOG(internals->debug & MSK_DEBUG_EVENT, "recv error! %s (%d)", strerror(rc), rc);
+		pthread_mutex_lock(&trans->ctx_lock);
+		trans->state = MSK_CLOSED;
+		pthread_cond_broadcast(&trans->ctx_cond);
+		pthread_mutex_unlock(&trans->ctx_lock);
+
+		if (trans->disconnect_callback)
+			trans->disconnect_callback(trans);
+	}
+
 	pthread_exit(NULL);
 }
 
 void msk_tcp_destroy_trans(msk_trans_t **ptrans) {
+	msk_trans_t *trans = *ptrans;
+	struct msk_tcp_zc *zc;
+
+	if (!trans)
+		return;
+
+	if (tcpt(trans)) {
+		/* wake up the receive thread and anyone waiting on a context */
+		pthread_mutex_lock(&trans->ctx_lock);
+		trans->state = MSK_CLOSING;
+		pthread_cond_broadcast(&trans->ctx_cond);
+		pthread_mutex_unlock(&trans->ctx_lock);
+
+		if (tcpt(trans)->sockfd >= 0)
+			shutdown(tcpt(trans)->sockfd, SHUT_RDWR);
+
+		if (tcpt(trans)->cq_thrid) {
+			/* last reference can be dropped from a callback */
+			if (pthread_equal(tcpt(trans)->cq_thrid, pthread_self()))
+				pthread_detach(tcpt(trans)->cq_thrid);
+			else
+				pthread_join(tcpt(trans)->cq_thrid, NULL);
+		}
+
+		if (tcpt(trans)->sockfd >= 0)
+			close(tcpt(trans)->sockfd);
+
+		/* the socket is gone, nothing will complete anymore */
+		while ((zc = tcpt(trans)->zc_head)) {
+			tcpt(trans)->zc_head = zc->next;
+			zc->err_callback(trans, zc->data, zc->callback_arg);
+			free(zc);
+		}
+
+		pthread_mutex_destroy(&tcpt(trans)->zc_lock);
+		pthread_mutex_destroy(&tcpt(trans)->lock);
+		free(tcpt(trans));
+	}
+
+	pthread_mutex_destroy(&trans->cm_lock);
+	pthread_cond_destroy(&trans->cm_cond);
+	pthread_mutex_destroy(&trans->ctx_lock);
+	pthread_cond_destroy(&trans->ctx_cond);
+
+	if (trans->recv_buf)
+		free(trans->recv_buf);
+
+	/* accepted connections share node and port with the listening trans */
+	if (trans->server != MSK_SERVER_CHILD) {
+		if (trans->node)
+			free(trans->node);
+		if (trans->port)
+			free(trans->port);
+	}
+
+	free(trans);
+	*ptrans = NULL;
 }
 
 int msk_tcp_setup_buffers(msk_trans_t *trans) {
@@ -277,6 +548,7 @@ int msk_tcp_init(msk_trans_t **ptrans, msk_trans_attr_t *attr) {
 			break;
 		}
 		memset(trans->cm_id, 0, sizeof(struct msk_tcp_trans));
+		tcpt(trans)->sockfd = -1;
 
 		trans->state = MSK_INIT;
 
@@ -325,6 +597,11 @@ int msk_tcp_init(msk_trans_t **ptrans, msk_trans_attr_t *attr) {
 			INFO_LOG(internals->debug & MSK_DEBUG_EVENT, "pthread_mutex_init failed: %s (%d)", strerror(ret), ret);
 			break;
 		}
+		ret = pthread_mutex_init(&tcpt(trans)->zc_lock, NULL);
+		if (ret) {
+			INFO_LOG(internals->debug & MSK_DEBUG_EVENT, "pthread_mutex_init failed: %s (%d)", strerror(ret), ret);
+			break;
+		}
 
 	} while (0);
 
@@ -340,7 +617,7 @@ int msk_tcp_init(msk_trans_t **ptrans, msk_trans_attr_t *attr) {
 
 // server specific:
 int msk_tcp_bind_server(msk_trans_t *trans) {
-	int rc;
+	int rc, one = 1;
 	struct addrinfo *res;
 
 	do {
@@ -351,6 +628,14 @@ int msk_tcp_bind_server(msk_trans_t *trans) {
 			break;
 		}
 
+		/* restarting a server must not wait for TIME_WAIT to clear */
+		rc = setsockopt(tcpt(trans)->sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (rc) {
+			rc = errno;
+			INFO_LOG(internals->debug & MSK_DEBUG_EVENT, "setsockopt failed: %s (%d)", strerror(rc), rc);
+			break;
+		}
+
 		rc = getaddrinfo(trans->node, trans->port, NULL, &res);
 		if (rc) {
 			INFO_LOG(internals->debug & MSK_DEBUG_EVENT, "getaddrinfo failed: %s (%d)", strerror(rc), rc);
@@ -388,9 +673,13 @@ static msk_trans_t *clone_trans(msk_trans_t *listening_trans) {
 	}
 
 	memcpy(trans, listening_trans, sizeof(msk_trans_t));
+	memset(tcpt, 0, sizeof(struct msk_tcp_trans));
+	tcpt->sockfd = -1;
 
 	trans->cm_id = (void*)tcpt;
 	trans->state = MSK_CONNECT_REQUEST;
+	trans->server = MSK_SERVER_CHILD;
+	trans->recv_buf = NULL;
 
 	memset(&trans->cm_lock, 0, sizeof(pthread_mutex_t));
 	memset(&trans->cm_cond, 0, sizeof(pthread_cond_t));
@@ -423,6 +712,16 @@ static msk_trans_t *clone_trans(msk_trans_t *listening_trans) {
 			INFO_LOG(internals->debug & MSK_DEBUG_EVENT, "pthread_cond_init failed: %s (%d)", strerror(rc), rc);
 			break;
 		}
+		rc = pthread_mutex_init(&tcpt->lock, NULL);
+		if (rc) {
+			INFO_LOG(internals->debug & MSK_DEBUG_EVENT, "pthread_mutex_init failed: %s (%d)", strerror(rc), rc);
+			break;
+		}
+		rc = pthread_mutex_init(&tcpt->zc_lock, NULL);
+		if (rc) {
+			INFO_LOG(internals->debug & MSK_DEBUG_EVENT, "pthread_mutex_init failed: %s (%d)", strerror(rc), rc);
+			break;
+		}
 	} while (0);
 
 	if (rc) {
@@ -457,15 +756,34 @@ msk_trans_t *msk_tcp_accept_one_timedwait(msk_trans_t *trans, struct timespec *a
 	return msk_tcp_accept_one_wait(trans, 0);
 }
 
+/**
+ * msk_tcp_nodelay: send small messages right away
+ *
+ * Requests are pipelined, so Nagle would hold the second one back until
+ * the first is acked, which the peer delays since it has nothing to send yet.
+ */
+static void msk_tcp_nodelay(msk_trans_t *trans) {
+	int one = 1, rc;
+
+	if (setsockopt(tcpt(trans)->sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one))) {
+		rc = errno;
+		INFO_LOG(internals->debug & MSK_DEBUG_EVENT, "setsockopt TCP_NODELAY failed: %s (%d)", strerror(rc), rc);
+	}
+}
+
 int msk_tcp_finalize_accept(msk_trans_t *trans) {
 	int rc;
 
 	if (trans->state != MSK_CONNECT_REQUEST)
 		return EINVAL;
 
+	msk_tcp_nodelay(trans);
+
+	/* the receive thread stops as soon as it sees another state */
+	trans->state = MSK_CONNECTED;
 	rc = msk_tcp_create_thread(&tcpt(trans)->cq_thrid, msk_tcp_recv_thread, trans);
-	if (!rc)
-		trans->state = MSK_CONNECTED;
+	if (rc)
+		trans->state = MSK_CONNECT_REQUEST;
 
 	return rc;
 }
@@ -515,9 +833,24 @@ int msk_tcp_finalize_connect(msk_trans_t *trans) {
 	if (trans->state != MSK_CONNECT_REQUEST)
 		return EINVAL;
 
+	msk_tcp_nodelay(trans);
+
+#ifdef MSK_TCP_ZEROCOPY
+	if (tcpt(trans)->zc_min) {
+		rc = 1;
+		if (setsockopt(tcpt(trans)->sockfd, SOL_SOCKET, SO_ZEROCOPY, &rc, sizeof(rc))) {
+			rc = errno;
+			INFO_LOG(internals->debug & MSK_DEBUG_EVENT, "SO_ZEROCOPY not available, copying: %s (%d)", strerror(rc), rc);
+			tcpt(trans)->zc_min = 0;
+		}
+	}
+#endif
+
+	/* the receive thread stops as soon as it sees another state */
+	trans->state = MSK_CONNECTED;
 	rc = msk_tcp_create_thread(&tcpt(trans)->cq_thrid, msk_tcp_recv_thread, trans);
-	if (!rc)
-		trans->state = MSK_CONNECTED;
+	if (rc)
+		trans->state = MSK_CONNECT_REQUEST;
 
 	return rc;
 }
@@ -536,6 +869,34 @@ msk_rloc_t *msk_tcp_make_rloc(struct ibv_mr *mr, uint64_t addr, uint32_t size) {
 	return NULL;
 }
 
+/**
+ * msk_tcp_set_recv_sink: let the client place read payloads itself
+ *
+ * For every RREAD, sink is asked for a buffer for the given tag. If it
+ * gives one, the payload is read into it and the posted buffer only gets
+ * the header, with count trimmed to what was actually stored.
+ */
+void msk_tcp_set_recv_sink(msk_trans_t *trans, p9_recv_sink_t sink) {
+	tcpt(trans)->recv_sink = sink;
+}
+
+/**
+ * msk_tcp_set_zerocopy: send segments of at least min_size bytes with
+ * MSG_ZEROCOPY, 0 to always copy
+ *
+ * The send callback of such a message is only called once the kernel is
+ * done with all of its buffers, the caller must not reuse them before.
+ * Must be called before finalize_connect.
+ */
+void msk_tcp_set_zerocopy(msk_trans_t *trans, uint32_t min_size) {
+#ifdef MSK_TCP_ZEROCOPY
+	tcpt(trans)->zc_min = min_size;
+#else
+	if (min_size)
+		INFO_LOG(internals->debug & MSK_DEBUG_EVENT, "MSG_ZEROCOPY not supported, copying");
+#endif
+}
+
 int msk_tcp_post_n_recv(msk_trans_t *trans, msk_data_t *data, int num_sge, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg) {
 	struct msk_ctx *ctx;
 	int i;
@@ -545,10 +906,14 @@ int msk_tcp_post_n_recv(msk_trans_t *trans, msk_data_t *data, int num_sge, ctx_c
 		for (i = 0, ctx = trans->recv_buf;
 		     i < trans->qp_attr.cap.max_recv_wr;
 		     i++, ctx = (struct msk_ctx*)((uint8_t*)ctx + sizeof(struct msk_ctx)))
-			if (!ctx->used != MSK_CTX_FREE)
+			if (ctx->used == MSK_CTX_FREE)
 				break;
 
 		if (i == trans->qp_attr.cap.max_recv_wr) {
+			if (trans->state == MSK_CLOSING || trans->state == MSK_CLOSED) {
+				pthread_mutex_unlock(&trans->ctx_lock);
+				return ENOTCONN;
+			}
 			INFO_LOG(internals->debug & MSK_DEBUG_RECV, "Waiting for cond");
 			pthread_cond_wait(&trans->ctx_cond, &trans->ctx_lock);
 		}
@@ -559,6 +924,7 @@ int msk_tcp_post_n_recv(msk_trans_t *trans, msk_data_t *data, int num_sge, ctx_c
 	ctx->callback = callback;
 	ctx->err_callback = err_callback;
 	ctx->callback_arg = callback_arg;
+	ctx->seq = tcpt(trans)->recv_seq++;
 	ctx->used = MSK_CTX_PENDING;
 	pthread_cond_broadcast(&trans->ctx_cond);
 	pthread_mutex_unlock(&trans->ctx_lock);
@@ -567,28 +933,48 @@ int msk_tcp_post_n_recv(msk_trans_t *trans, msk_data_t *data, int num_sge, ctx_c
 }
 
 int msk_tcp_post_n_send(msk_trans_t *trans, msk_data_t *data_arg, int num_sge, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg) {
-	int rc, i;
-	uint32_t cur;
+	int rc, i, flags, zerocopy;
+	uint32_t cur, last = 0;
 	msk_data_t *data = data_arg;
+	struct msk_tcp_zc *zc = NULL;
+
 	pthread_mutex_lock(&tcpt(trans)->lock);
 
 	rc = 0;
+	zerocopy = 0;
 	for (i=0; i < num_sge; i++) {
 		if (!data) {
 			rc = EINVAL;
 			break;
 		}
+		flags = MSG_NOSIGNAL;
+#ifdef MSK_TCP_ZEROCOPY
+		if (tcpt(trans)->zc_min && data->size >= tcpt(trans)->zc_min)
+			flags |= MSG_ZEROCOPY;
+#endif
 		cur = 0;
 		while (rc == 0 && cur < data->size) {
-			rc = write(tcpt(trans)->sockfd, data->data, data->size - cur);
+			rc = send(tcpt(trans)->sockfd, data->data + cur, data->size - cur, flags);
 			if (rc < 0 && errno == EINTR) {
 				continue;
+#ifdef MSK_TCP_ZEROCOPY
+			} else if (rc < 0 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+				/* out of optmem for notifications, copy this one */
+				flags &= ~MSG_ZEROCOPY;
+				rc = 0;
+#endif
 			} else if (rc < 0) {
 				rc = errno;
 				INFO_LOG(internals->debug & MSK_DEBUG_EVENT, "write failed: %s (%d)", strerror(rc), rc);
 			} else {
 				cur += rc;
 				rc = 0;
+#ifdef MSK_TCP_ZEROCOPY
+				if (flags & MSG_ZEROCOPY) {
+					tcpt(trans)->zc_seq++;
+					zerocopy = 1;
+				}
+#endif
 			}
 		}
 
@@ -596,12 +982,126 @@ int msk_tcp_post_n_send(msk_trans_t *trans, msk_data_t *data_arg, int num_sge, c
 			break;
 		data = data->next;
 	}
+
+	if (rc == 0 && zerocopy) {
+		last = tcpt(trans)->zc_seq - 1;
+		zc = malloc(sizeof(struct msk_tcp_zc));
+		if (zc) {
+			zc->seq = last;
+			zc->data = data_arg;
+			zc->callback = callback;
+			zc->err_callback = err_callback;
+			zc->callback_arg = callback_arg;
+			zc->next = NULL;
+			pthread_mutex_lock(&tcpt(trans)->zc_lock);
+			if (tcpt(trans)->zc_tail)
+				tcpt(trans)->zc_tail->next = zc;
+			else
+				tcpt(trans)->zc_head = zc;
+			tcpt(trans)->zc_tail = zc;
+			pthread_mutex_unlock(&tcpt(trans)->zc_lock);
+		}
+	}
 	pthread_mutex_unlock(&tcpt(trans)->lock);
 
-	if (rc)
+	if (rc) {
 		err_callback(trans, data_arg, callback_arg);
-	else
-		callback(trans, data_arg, callback_arg);
+		return rc;
+	}
+
+	if (zc) {
+		/* the receive thread may have reaped it before it was queued */
+		msk_tcp_zc_reap(trans);
+		return 0;
+	}
+
+	/* no memory to track it, wait for the kernel right here */
+	while (zerocopy && (int32_t)(last - tcpt(trans)->zc_done) >= 0) {
+		if (msk_tcp_zc_reap(trans) == 0)
+			usleep(100);
+	}
+
+	callback(trans, data_arg, callback_arg);
+
+	return 0;
+}
+
+/**
+ * @brief send several messages with as few syscalls as the socket allows
+ *
+ * Messages with a segment big enough for MSG_ZEROCOPY are sent one by one
+ * as usual.
+ */
+int msk_tcp_post_n_send_batch(msk_trans_t *trans, struct p9_send_req *reqs, int count, ctx_callback_t callback, ctx_callback_t err_callback) {
+	struct iovec iov[2*P9_PLUG_MAX], *cur_iov;
+	struct msghdr msg;
+	msk_data_t *data;
+	ssize_t sent;
+	int i, j, niov, rc;
+
+	niov = 0;
+	for (i = 0; i < count; i++) {
+		for (j = 0, data = reqs[i].data; j < reqs[i].num_sge && data; j++, data = data->next) {
+			if ((tcpt(trans)->zc_min && data->size >= tcpt(trans)->zc_min) || niov == 2*P9_PLUG_MAX)
+				niov = -1;
+			if (niov < 0)
+				break;
+			iov[niov].iov_base = data->data;
+			iov[niov].iov_len = data->size;
+			niov++;
+		}
+		if (niov < 0)
+			break;
+	}
+
+	if (niov < 0) {
+		for (i = 0; i < count; i++) {
+			rc = msk_tcp_post_n_send(trans, reqs[i].data, reqs[i].num_sge, callback, err_callback, reqs[i].callback_arg);
+			if (rc) {
+				/* the connection is gone, so are the others */
+				for (i++; i < count; i++)
+					err_callback(trans, reqs[i].data, reqs[i].callback_arg);
+				return rc;
+			}
+		}
+		return 0;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	cur_iov = iov;
+
+	pthread_mutex_lock(&tcpt(trans)->lock);
+	rc = 0;
+	while (niov > 0) {
+		msg.msg_iov = cur_iov;
+		msg.msg_iovlen = niov;
+		sent = sendmsg(tcpt(trans)->sockfd, &msg, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR)
+			continue;
+		if (sent < 0) {
+			rc = errno;
+			INFO_LOG(internals->debug & MSK_DEBUG_EVENT, "write failed: %s (%d)", strerror(rc), rc);
+			break;
+		}
+		/* partial write, skip what went out */
+		while (niov > 0 && (size_t)sent >= cur_iov->iov_len) {
+			sent -= cur_iov->iov_len;
+			cur_iov++;
+			niov--;
+		}
+		if (niov > 0) {
+			cur_iov->iov_base = (uint8_t*)cur_iov->iov_base + sent;
+			cur_iov->iov_len -= sent;
+		}
+	}
+	pthread_mutex_unlock(&tcpt(trans)->lock);
+
+	for (i = 0; i < count; i++) {
+		if (rc)
+			err_callback(trans, reqs[i].data, reqs[i].callback_arg);
+		else
+			callback(trans, reqs[i].data, reqs[i].callback_arg);
+	}
 
 	return rc;
 }
@@ -28,10 +28,18 @@ int msk_tcp_init(msk_trans_t **ptrans, msk_trans_attr_t *attr);
 int msk_tcp_connect(msk_trans_t *trans);
 int msk_tcp_finalize_connect(msk_trans_t *trans);
 
+int msk_tcp_bind_server(msk_trans_t *trans);
+msk_trans_t *msk_tcp_accept_one_wait(msk_trans_t *trans, int msleep);
+int msk_tcp_finalize_accept(msk_trans_t *trans);
+
 struct ibv_mr *msk_tcp_reg_mr(msk_trans_t *trans, void *memaddr, size_t size, int access);
 int msk_tcp_dereg_mr(struct ibv_mr *mr);
 
+void msk_tcp_set_recv_sink(msk_trans_t *trans, p9_recv_sink_t sink);
+void msk_tcp_set_zerocopy(msk_trans_t *trans, uint32_t min_size);
+
 int msk_tcp_post_n_recv(msk_trans_t *trans, msk_data_t *data, int num_sge, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg);
 int msk_tcp_post_n_send(msk_trans_t *trans, msk_data_t *data_arg, int num_sge, ctx_callback_t callback, ctx_callback_t err_callback, void *callback_arg);
+int msk_tcp_post_n_send_batch(msk_trans_t *trans, struct p9_send_req *reqs, int count, ctx_callback_t callback, ctx_callback_t err_callback);
 
 #endif
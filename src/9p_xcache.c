@@ -0,0 +1,253 @@
+/*
+ * Copyright CEA/DAM/DIF (2013)
+ * Contributor: Dominique Martinet <dominique.martinet@cea.fr>
+ *
+ * This file is part of the space9 9P userspace library.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with space9.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+/**
+ * \file	9p_xcache.c
+ * \brief	client side xattr cache
+ *
+ * Values (and errors such as ENODATA) returned by xattrwalk+read are kept
+ * per qid path, attribute name and uid, the list being stored under "".
+ * Sessions attached as other users see only what the server told them,
+ * with their own permissions. The
+ * number of entries is capped and the least recently used goes first.
+ * Only changes made through this handle's p9l_fxattrset are seen: they
+ * drop everything cached for the file.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>	//malloc
+#include <string.h>	//memcpy
+#include <inttypes.h>	//uint*_t
+#include <errno.h>	//ENOMEM
+#include <pthread.h>	//pthread_*
+
+#include "9p_internals.h"
+#include "utils.h"
+
+struct p9_xcache_entry {
+	uint64_t path;
+	uint32_t uid;		/**< user the server answered */
+	ssize_t rc;		/**< xattr size or -errno */
+	char *value;		/**< rc bytes, NULL on error */
+	struct p9_xcache_entry *hnext;
+	struct p9_xcache_entry *prev;	/**< LRU, most recent at the tail */
+	struct p9_xcache_entry *next;
+	char name[];
+};
+
+struct p9_xcache {
+	pthread_mutex_t lock;
+	uint32_t max_entries;
+	uint32_t nentries;
+	uint32_t hash_mask;
+	uint64_t gen;		/**< bumped by every invalidation */
+	struct p9_xcache_entry *head;
+	struct p9_xcache_entry *tail;
+	struct p9_xcache_entry **hash;
+};
+
+/* all names of a file share a bucket so invalidation only looks at one */
+static inline uint32_t p9_xcache_hash(struct p9_xcache *xcache, uint64_t path) {
+	return (uint32_t)((path * 0x9e3779b97f4a7c15ULL) >> 32) & xcache->hash_mask;
+}
+
+static void p9_xcache_unlink(struct p9_xcache *xcache, struct p9_xcache_entry *entry) {
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		xcache->head = entry->next;
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		xcache->tail = entry->prev;
+	entry->prev = entry->next = NULL;
+}
+
+static void p9_xcache_link(struct p9_xcache *xcache, struct p9_xcache_entry *entry) {
+	entry->prev = xcache->tail;
+	entry->next = NULL;
+	if (xcache->tail)
+		xcache->tail->next = entry;
+	else
+		xcache->head = entry;
+	xcache->tail = entry;
+}
+
+/**
+ * p9_xcache_remove: unhash, unlink and free an entry
+ * Must hold the lock.
+ */
+static void p9_xcache_remove(struct p9_xcache *xcache, struct p9_xcache_entry *entry) {
+	struct p9_xcache_entry **pentry;
+
+	for (pentry = &xcache->hash[p9_xcache_hash(xcache, entry->path)]; *pentry; pentry = &(*pentry)->hnext) {
+		if (*pentry == entry) {
+			*pentry = entry->hnext;
+			break;
+		}
+	}
+	p9_xcache_unlink(xcache, entry);
+	xcache->nentries--;
+	free(entry);
+}
+
+static struct p9_xcache_entry *p9_xcache_lookup(struct p9_xcache *xcache, uint64_t path, uint32_t uid, const char *name) {
+	struct p9_xcache_entry *entry;
+
+	for (entry = xcache->hash[p9_xcache_hash(xcache, path)]; entry; entry = entry->hnext)
+		if (entry->path == path && entry->uid == uid && strcmp(entry->name, name) == 0)
+			return entry;
+
+	return NULL;
+}
+
+int p9_xcache_init(struct p9_handle *p9_handle, uint32_t entries) {
+	struct p9_xcache *xcache;
+	uint32_t nbuckets;
+
+	if (entries == 0)
+		return EINVAL;
+
+	xcache = calloc(1, sizeof(struct p9_xcache));
+	if (xcache == NULL)
+		return ENOMEM;
+
+	for (nbuckets = 1; nbuckets < entries; nbuckets <<= 1);
+	xcache->hash = calloc(nbuckets, sizeof(struct p9_xcache_entry *));
+	if (xcache->hash == NULL) {
+		free(xcache);
+		return ENOMEM;
+	}
+
+	pthread_mutex_init(&xcache->lock, NULL);
+	xcache->max_entries = entries;
+	xcache->hash_mask = nbuckets - 1;
+	p9_handle->xcache = xcache;
+
+	return 0;
+}
+
+void p9_xcache_destroy(struct p9_handle *p9_handle) {
+	struct p9_xcache *xcache = p9_handle->xcache;
+	struct p9_xcache_entry *entry;
+
+	if (xcache == NULL)
+		return;
+
+	while ((entry = xcache->head) != NULL) {
+		xcache->head = entry->next;
+		free(entry);
+	}
+	pthread_mutex_destroy(&xcache->lock);
+	free(xcache->hash);
+	free(xcache);
+	p9_handle->xcache = NULL;
+}
+
+int p9_xcache_get(struct p9_handle *p9_handle, uint64_t path, uint32_t uid, const char *name, char *buf, size_t count, ssize_t *prc, uint64_t *pgen) {
+	struct p9_xcache *xcache = p9_handle->xcache;
+	struct p9_xcache_entry *entry;
+	size_t realcount;
+
+	pthread_mutex_lock(&xcache->lock);
+	entry = p9_xcache_lookup(xcache, path, uid, name ? name : "");
+	if (entry == NULL) {
+		*pgen = xcache->gen;
+		pthread_mutex_unlock(&xcache->lock);
+		return 0;
+	}
+
+	p9_xcache_unlink(xcache, entry);
+	p9_xcache_link(xcache, entry);
+
+	*prc = entry->rc;
+	if (entry->rc >= 0) {
+		realcount = MIN((size_t)entry->rc, count - 1);
+		memcpy(buf, entry->value, realcount);
+		buf[realcount] = '\0';
+	}
+	pthread_mutex_unlock(&xcache->lock);
+
+	return 1;
+}
+
+void p9_xcache_put(struct p9_handle *p9_handle, uint64_t path, uint32_t uid, const char *name, ssize_t rc, const char *value, uint64_t gen) {
+	struct p9_xcache *xcache = p9_handle->xcache;
+	struct p9_xcache_entry *entry, *old;
+	size_t namelen, valuelen;
+
+	if (name == NULL)
+		name = "";
+	namelen = strlen(name) + 1;
+	valuelen = rc > 0 ? rc : 0;
+
+	entry = malloc(sizeof(struct p9_xcache_entry) + namelen + valuelen);
+	if (entry == NULL)
+		return;
+
+	entry->path = path;
+	entry->uid = uid;
+	entry->rc = rc;
+	memcpy(entry->name, name, namelen);
+	entry->value = NULL;
+	if (rc >= 0) {
+		entry->value = entry->name + namelen;
+		memcpy(entry->value, value, valuelen);
+	}
+
+	pthread_mutex_lock(&xcache->lock);
+	/* the file changed since the value was fetched, it may be stale already */
+	if (gen != xcache->gen) {
+		pthread_mutex_unlock(&xcache->lock);
+		free(entry);
+		return;
+	}
+
+	old = p9_xcache_lookup(xcache, path, uid, name);
+	if (old)
+		p9_xcache_remove(xcache, old);
+	else if (xcache->nentries == xcache->max_entries)
+		p9_xcache_remove(xcache, xcache->head);
+
+	entry->hnext = xcache->hash[p9_xcache_hash(xcache, path)];
+	xcache->hash[p9_xcache_hash(xcache, path)] = entry;
+	p9_xcache_link(xcache, entry);
+	xcache->nentries++;
+	pthread_mutex_unlock(&xcache->lock);
+}
+
+void p9_xcache_invalidate(struct p9_handle *p9_handle, uint64_t path) {
+	struct p9_xcache *xcache = p9_handle->xcache;
+	struct p9_xcache_entry *entry, *hnext;
+
+	pthread_mutex_lock(&xcache->lock);
+	xcache->gen++;
+	for (entry = xcache->hash[p9_xcache_hash(xcache, path)]; entry; entry = hnext) {
+		hnext = entry->hnext;
+		if (entry->path == path)
+			p9_xcache_remove(xcache, entry);
+	}
+	pthread_mutex_unlock(&xcache->lock);
+}
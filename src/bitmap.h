@@ -19,20 +19,81 @@
  *
  */
 
+
 #ifndef BITMAP_H
 #define BITMAP_H
 
 #define ffsll __builtin_ffsll
 #define popcountll __builtin_popcountll
 
-typedef uint64_t bitmap_t;
+/* Two level bitmap: on top of the bits themselves, summary keeps one bit
+ * per data word telling whether that word still has a free (zero) bit,
+ * so a first-free search looks at one summary word per 64 data words.
+ * The search starts from the summary word of the last allocation (hint)
+ * and wraps around, so a mostly-full map does not rescan its full head.
+ *
+ * The max given to the functions below must be the size given to
+ * bitmap_init. Callers are expected to provide their own locking.
+ */
+typedef struct bitmap {
+	uint32_t size;     /* number of bits */
+	uint32_t words;    /* number of data words */
+	uint32_t swords;   /* number of summary words */
+	uint32_t hint;     /* summary word to start searching from */
+	uint64_t *summary; /* bit i set if map[i] has a free bit */
+	uint64_t map[0];
+} bitmap_t;
+
 #define BITS_PER_WORD  64
 #define WORD_OFFSET(b) ((b) / BITS_PER_WORD)
 #define BIT_OFFSET(b)  ((b) % BITS_PER_WORD)
-#define BITMAP_SIZE(s)  (
+#define BITMAP_WORDS(s) ((s)/BITS_PER_WORD + ((s) % BITS_PER_WORD == 0 ? 0 : 1))
+
+/* bits past the end of the bitmap in word i, that must never be handed out */
+static inline uint64_t bitmap_padmask(bitmap_t *map, uint32_t i) {
+	if (i == map->words - 1 && BIT_OFFSET(map->size) != 0)
+		return ~((1ULL << BIT_OFFSET(map->size)) - 1);
+	return 0ULL;
+}
+
+static inline int bitmap_word_full(bitmap_t *map, uint32_t i) {
+	return (map->map[i] | bitmap_padmask(map, i)) == ~0ULL;
+}
+
+static inline void bitmap_update_summary(bitmap_t *map, uint32_t i) {
+	if (bitmap_word_full(map, i))
+		map->summary[WORD_OFFSET(i)] &= ~(1ULL << BIT_OFFSET(i));
+	else
+		map->summary[WORD_OFFSET(i)] |= (1ULL << BIT_OFFSET(i));
+}
+
+static inline void bitmap_clear(bitmap_t *map, uint32_t max) {
+	uint32_t i;
+
+	memset(map->map, 0, map->words * sizeof(uint64_t));
+	memset(map->summary, 0, map->swords * sizeof(uint64_t));
+	for (i = 0; i < map->words; i++)
+		bitmap_update_summary(map, i);
+	map->hint = 0;
+}
 
 static inline bitmap_t *bitmap_init(int size) {
-	return calloc(size/BITS_PER_WORD + ((size % BITS_PER_WORD) == 0 ? 0 : 1), sizeof(bitmap_t));
+	bitmap_t *map;
+	uint32_t words, swords;
+
+	words = BITMAP_WORDS(size);
+	swords = BITMAP_WORDS(words);
+
+	map = calloc(1, sizeof(bitmap_t) + (words + swords) * sizeof(uint64_t));
+	if (map) {
+		map->size = size;
+		map->words = words;
+		map->swords = swords;
+		map->summary = map->map + words;
+		bitmap_clear(map, size);
+	}
+
+	return map;
 }
 
 static inline void bitmap_destroy(bitmap_t **pmap) {
@@ -40,111 +101,82 @@ static inline void bitmap_destroy(bitmap_t **pmap) {
 	*pmap = NULL;
 }
 
-static inline void bitmap_clear(bitmap_t *map, uint32_t max) {
-	memset(map, 0, (max/BITS_PER_WORD + ((max % BITS_PER_WORD) == 0 ? 0 : 1)) * sizeof(bitmap_t));
-}
-
 static inline void bitmap_foreach(bitmap_t *map, uint32_t max, int (*callback)(void *, uint32_t), void *cb_arg) {
-	uint32_t maxw, i, j;
-
-	maxw = max / BITS_PER_WORD + 1;
+	uint32_t i, j;
 
-	for (i=0; i < maxw; i++) {
-		if (map[i] == 0LL)
+	for (i=0; i < map->words; i++) {
+		if (map->map[i] == 0LL)
 			continue;
 
-		for (j=0; j < BITS_PER_WORD; j++) {
-			if (map[i] & (1 << j))
+		for (j=0; j < BITS_PER_WORD && i*BITS_PER_WORD+j < max; j++) {
+			if (map->map[i] & (1ULL << j))
 				callback(cb_arg, i*BITS_PER_WORD+j);
 		}
 	}
-
-	for (j=0; j < BIT_OFFSET(max); j++) {
-		if (map[i] & (1 << j))
-			callback(cb_arg, i*BITS_PER_WORD+j);
-	}
 }
 
-static inline void set_bit(bitmap_t *map, int n) { 
-	map[WORD_OFFSET(n)] |= (1ULL << BIT_OFFSET(n));
+static inline void set_bit(bitmap_t *map, int n) {
+	map->map[WORD_OFFSET(n)] |= (1ULL << BIT_OFFSET(n));
+	if (bitmap_word_full(map, WORD_OFFSET(n)))
+		map->summary[WORD_OFFSET(WORD_OFFSET(n))] &= ~(1ULL << BIT_OFFSET(WORD_OFFSET(n)));
 }
 
 static inline void clear_bit(bitmap_t *map, int n) {
-	map[WORD_OFFSET(n)] &= ~(1ULL << BIT_OFFSET(n)); 
+	map->map[WORD_OFFSET(n)] &= ~(1ULL << BIT_OFFSET(n));
+	map->summary[WORD_OFFSET(WORD_OFFSET(n))] |= (1ULL << BIT_OFFSET(WORD_OFFSET(n)));
 }
 
 static inline int get_bit(bitmap_t *map, int n) {
-	bitmap_t bit = map[WORD_OFFSET(n)] & (1ULL << BIT_OFFSET(n));
-	return bit != 0; 
+	uint64_t bit = map->map[WORD_OFFSET(n)] & (1ULL << BIT_OFFSET(n));
+	return bit != 0;
 }
 
 static inline uint32_t get_and_set_first_bit(bitmap_t *map, uint32_t max) {
-	uint32_t maxw, i;
-
-	maxw = max / BITS_PER_WORD;
-	i = 0;
-
-	while (i < maxw && map[i] == ~0LL)
-		i++;
-
-	if (i == maxw) {
-		if (BIT_OFFSET(max) != 0 && map[i] != ~0LL) {
-			i = maxw*BITS_PER_WORD + ffsll(~map[maxw]) - 1;
-			if (i < max)
-				set_bit(map, i);
-			else
-				i = max;
-		} else {
-			i = max;
+	uint32_t s, k, i;
+
+	s = map->hint;
+	for (k = 0; k < map->swords; k++) {
+		if (map->summary[s] != 0LL) {
+			i = s*BITS_PER_WORD + ffsll(map->summary[s]) - 1;
+			i = i*BITS_PER_WORD + ffsll(~map->map[i]) - 1;
+			if (i >= max)
+				break;
+			set_bit(map, i);
+			map->hint = s;
+			return i;
 		}
-	} else {
-		i = i*BITS_PER_WORD + ffsll(~map[i]) - 1;
-		set_bit(map, i);
+		if (++s == map->swords)
+			s = 0;
 	}
 
-	return i;
+	return max;
 }
 
 static inline uint32_t get_and_clear_first_bit(bitmap_t *map, uint32_t max) {
-	uint32_t maxw, i;
-
-	maxw = max / BITS_PER_WORD;
-	i = 0;
-
-	while (i < maxw && map[i] == 0LL)
-		i++;
-
-	if (i == maxw) {
-		if (BIT_OFFSET(max) != 0 && map[i] != 0LL) {
-			i = maxw*BITS_PER_WORD + ffsll(map[maxw]) - 1;
-			if (i < max)
-				clear_bit(map, i);
-			else
-				i = max;
-		} else {
-			i = max;
-		}
-	} else {
-		i = i*BITS_PER_WORD + ffsll(map[i]) - 1;
+	uint32_t i;
+
+	for (i = 0; i < map->words; i++) {
+		if (map->map[i] == 0LL)
+			continue;
+
+		i = i*BITS_PER_WORD + ffsll(map->map[i]) - 1;
+		if (i >= max)
+			break;
 		clear_bit(map, i);
+		return i;
 	}
 
-	return i;
+	return max;
 }
 
 static inline uint32_t bitcount(bitmap_t *map, uint32_t max) {
-	uint32_t count, maxw, i;
+	uint32_t count, i;
 
 	count = 0;
-	maxw = max / BITS_PER_WORD;
-	i = 0;
-
-	for (i=0; i < maxw; i++)
-		count += popcountll(map[i]);
 
 	// Assume the end of the bitmap is padded with 0
-	if (BIT_OFFSET(max) != 0)
-		count += popcountll(map[maxw]);
+	for (i=0; i < map->words; i++)
+		count += popcountll(map->map[i]);
 
 	return count;
 }
@@ -19,29 +19,176 @@
  *
  */
 
+
 #ifndef BUCKET_H
 #define BUCKET_H
 
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Object cache.
+ *
+ * Each thread keeps a small magazine of free items so get/put usually
+ * never leave the thread. Magazines spill into and refill from a shared
+ * depot, which is a pair of lock-free Treiber stacks over a fixed slot
+ * array: 'full' links slots holding a cached item, 'empty' links unused
+ * slots. Stack heads pack a 32 bits slot index with a 32 bits tag that is
+ * bumped on every update to avoid ABA.
+ *
+ * The depot holds at most 'max' items, on top of which each thread can
+ * cache up to min(max, BUCKET_MAG_SIZE) items in its magazine.
+ */
+
+#define BUCKET_MAG_SIZE 32
+#define BUCKET_NIL UINT32_MAX
+
+struct bucket_slot {
+	uint32_t next;
+	void *item;
+};
+
+struct bucket_mag {
+	struct bucket_mag *next;
+	struct bucket *bucket;
+	size_t count;
+	void *items[0];
+};
+
 typedef struct bucket {
 	size_t size;
-	size_t first;
-	size_t last;
-	size_t count;
 	size_t alloc_size;
-	pthread_mutex_t lock;
-	void * array[0];
+	size_t mag_size;
+	uint64_t full;
+	uint64_t empty;
+	int has_key;
+	pthread_key_t key;
+	pthread_mutex_t lock; /* protects mags list only */
+	struct bucket_mag *mags;
+	struct bucket_slot slots[0];
 } bucket_t;
 
+static inline uint32_t bucket_pop(bucket_t *bucket, uint64_t *head) {
+	uint64_t old, new;
+	uint32_t idx;
+
+	old = __atomic_load_n(head, __ATOMIC_ACQUIRE);
+	do {
+		idx = (uint32_t)old;
+		if (idx == BUCKET_NIL)
+			return BUCKET_NIL;
+		new = (((old >> 32) + 1) << 32) | __atomic_load_n(&bucket->slots[idx].next, __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(head, &old, new, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+	return idx;
+}
+
+static inline void bucket_push(bucket_t *bucket, uint64_t *head, uint32_t idx) {
+	uint64_t old, new;
+
+	old = __atomic_load_n(head, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(&bucket->slots[idx].next, (uint32_t)old, __ATOMIC_RELAXED);
+		new = (((old >> 32) + 1) << 32) | idx;
+	} while (!__atomic_compare_exchange_n(head, &old, new, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* returns 0 if the depot was full and the item was not stored */
+static inline int bucket_depot_put(bucket_t *bucket, void *item) {
+	uint32_t idx;
+
+	idx = bucket_pop(bucket, &bucket->empty);
+	if (idx == BUCKET_NIL)
+		return 0;
+
+	bucket->slots[idx].item = item;
+	bucket_push(bucket, &bucket->full, idx);
+	return 1;
+}
+
+static inline void *bucket_depot_get(bucket_t *bucket) {
+	uint32_t idx;
+	void *item;
+
+	idx = bucket_pop(bucket, &bucket->full);
+	if (idx == BUCKET_NIL)
+		return NULL;
+
+	item = bucket->slots[idx].item;
+	bucket_push(bucket, &bucket->empty, idx);
+	return item;
+}
+
+/* thread exit: give the magazine content back to the depot */
+static inline void bucket_mag_release(void *arg) {
+	struct bucket_mag *mag = arg, **pmag;
+	bucket_t *bucket = mag->bucket;
+
+	while (mag->count > 0) {
+		mag->count--;
+		if (!bucket_depot_put(bucket, mag->items[mag->count]))
+			free(mag->items[mag->count]);
+	}
+
+	pthread_mutex_lock(&bucket->lock);
+	for (pmag = &bucket->mags; *pmag; pmag = &(*pmag)->next) {
+		if (*pmag == mag) {
+			*pmag = mag->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&bucket->lock);
+	free(mag);
+}
+
+static inline struct bucket_mag *bucket_mag_get(bucket_t *bucket) {
+	struct bucket_mag *mag;
+
+	if (!bucket->has_key)
+		return NULL;
+
+	mag = pthread_getspecific(bucket->key);
+	if (mag)
+		return mag;
+
+	mag = calloc(1, sizeof(struct bucket_mag) + bucket->mag_size*sizeof(void*));
+	if (!mag)
+		return NULL;
+
+	mag->bucket = bucket;
+	if (pthread_setspecific(bucket->key, mag)) {
+		free(mag);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&bucket->lock);
+	mag->next = bucket->mags;
+	bucket->mags = mag;
+	pthread_mutex_unlock(&bucket->lock);
+
+	return mag;
+}
+
 static inline bucket_t *bucket_init(size_t max, size_t alloc_size) {
 	bucket_t *bucket;
-	bucket = calloc(1, sizeof(bucket_t)+max*sizeof(void*));
+	size_t i;
+
+	if (max >= BUCKET_NIL)
+		max = BUCKET_NIL - 1;
+
+	bucket = calloc(1, sizeof(bucket_t)+max*sizeof(struct bucket_slot));
 	if (bucket) {
 		bucket->size = max;
-		bucket->first = 0;
-		bucket->last = 0;
-		bucket->count = 0;
 		bucket->alloc_size = alloc_size;
+		bucket->mag_size = max < BUCKET_MAG_SIZE ? max : BUCKET_MAG_SIZE;
+		bucket->full = BUCKET_NIL;
+		bucket->empty = BUCKET_NIL;
+		for (i = 0; i < max; i++)
+			bucket_push(bucket, &bucket->empty, i);
 		pthread_mutex_init(&bucket->lock, NULL);
+		if (bucket->mag_size > 0 && pthread_key_create(&bucket->key, bucket_mag_release) == 0)
+			bucket->has_key = 1;
 	}
 
 	return bucket;
@@ -49,55 +196,75 @@ static inline bucket_t *bucket_init(size_t max, size_t alloc_size) {
 
 static inline void bucket_destroy(bucket_t **pbucket) {
 	bucket_t *bucket = *pbucket;
+	struct bucket_mag *mag;
+	void *item;
 
 	if (*pbucket == NULL)
 		return;
 
-	while (bucket->count > 0) {
-		free(bucket->array[bucket->first]);
-		bucket->first++;
-		bucket->count--;
-		if (bucket->first == bucket->size)
-			bucket->first = 0;
+	if (bucket->has_key)
+		pthread_key_delete(bucket->key);
+
+	while ((mag = bucket->mags) != NULL) {
+		bucket->mags = mag->next;
+		while (mag->count > 0)
+			free(mag->items[--mag->count]);
+		free(mag);
 	}
+
+	while ((item = bucket_depot_get(bucket)) != NULL)
+		free(item);
+
 	pthread_mutex_destroy(&bucket->lock);
 	free(bucket);
 	*pbucket = NULL;
 }
 
 static inline void bucket_put(bucket_t *bucket, void **pitem) {
+	struct bucket_mag *mag;
+	size_t n;
+
 	if (!pitem)
 		return;
 
-	pthread_mutex_lock(&bucket->lock);
-	if (bucket->count >= bucket->size) {
+	mag = bucket_mag_get(bucket);
+	if (mag) {
+		if (mag->count == bucket->mag_size) {
+			/* spill half the magazine so the next few puts stay local */
+			for (n = (bucket->mag_size + 1) / 2; n > 0; n--) {
+				mag->count--;
+				if (!bucket_depot_put(bucket, mag->items[mag->count]))
+					free(mag->items[mag->count]);
+			}
+		}
+		mag->items[mag->count++] = *pitem;
+	} else if (!bucket_depot_put(bucket, *pitem)) {
 		free(*pitem);
-	} else {
-		bucket->array[bucket->last] = *pitem;
-		bucket->last++;
-		bucket->count++;
-		if (bucket->last == bucket->size)
-			bucket->last = 0;
 	}
-	pthread_mutex_unlock(&bucket->lock);
+
 	memset(pitem, 0, sizeof(void*));
 }
 
 
 static inline void * bucket_get(bucket_t *bucket) {
-	void * item;
-	pthread_mutex_lock(&bucket->lock);
+	struct bucket_mag *mag;
+	void *item;
 
-	if (bucket->count == 0) {
-		item = malloc(bucket->alloc_size);
-	} else {
-		item = bucket->array[bucket->first];
-		bucket->first++;
-		bucket->count--;
-		if (bucket->first == bucket->size)
-			bucket->first = 0;
+	mag = bucket_mag_get(bucket);
+	if (mag && mag->count > 0)
+		return mag->items[--mag->count];
+
+	item = bucket_depot_get(bucket);
+	if (item == NULL)
+		return malloc(bucket->alloc_size);
+
+	/* refill half the magazine while we are at it */
+	while (mag && mag->count < bucket->mag_size / 2) {
+		void *extra = bucket_depot_get(bucket);
+		if (extra == NULL)
+			break;
+		mag->items[mag->count++] = extra;
 	}
-	pthread_mutex_unlock(&bucket->lock);
 
 	return item;
 }
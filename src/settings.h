@@ -36,6 +36,34 @@
 #define DEFAULT_PIPELINE   2
 #define DEFAULT_DEBUG      0x01
 #define DEFAULT_RDMA_DEBUG 0x01
+#define DEFAULT_HUGEPAGES  P9_HUGEPAGES_THP
+#define DEFAULT_NUMA_NODE  P9_NUMA_LOCAL
+#define DEFAULT_PREFAULT   1
+#define DEFAULT_SMALL_MSIZE 8*1024
+#define DEFAULT_BUF_IDLE   60
+#define DEFAULT_CACHE_BLOCK 1024*1024
+#define DEFAULT_ASYNC_CLUNK 1
+#define DEFAULT_WINDOW_MIN 0
+#define DEFAULT_META_RESERVE 4
+#define DEFAULT_LOAN_SPARE 16
+#define DEFAULT_BW_LIMIT   0
+#define DEFAULT_IOPS_LIMIT 0
+#define DEFAULT_SPIN_US    0
+#define DEFAULT_BUSY_POLL  0
+// most requests a plugged thread holds back before sending them
+#define P9_PLUG_MAX        16
+// default fiber stack, only the pages touched are backed
+#define P9_FIBER_STACK     (256*1024)
+// fibers a wakeup goes through when the one woken cannot use it
+#define P9_FIBER_HOPS      2
+// rate limits let that much traffic through at once, ns
+#define P9_LIMIT_BURST     (50*1000*1000ULL)
+// adaptive window: a reply is slow past this many times its op's base rtt
+#define P9_WINDOW_SLACK    2
+// ... and base rtts are learnt again every that many window moves
+#define P9_WINDOW_REBASE   64
+// memory cache blocks in front of the disk cache when cache_mb isn't set
+#define P9_DCACHE_MEM_BLOCKS 16
 
 // max tag = recv_num for ganesha
 #define DEFAULT_MAX_TAG  100
@@ -42,6 +42,7 @@
 
 char *startpoint = DEFAULT_STARTPOINT;
 int verbose = 0;
+int fibmode = 0;
 
 struct nlist {
 	char name[MAXNAMLEN];
@@ -145,13 +146,102 @@ static void *walkthr(void* arg) {
 	if (rc)
 		printf("thread ended, rc=%d\n", rc);
 
+	while (cb_arg.tail != NULL) {
+		nlist = cb_arg.tail;
+		cb_arg.tail = cb_arg.tail->next;
+		bucket_put(buck, (void **)&nlist);
+	}
+	bucket_destroy(&buck);
+
 	pthread_exit(NULL);	
 }
 
+struct fibdir {
+	struct p9_handle *p9_handle;
+	struct p9_fibers *fibers;
+	char *path;
+};
+
+static void walkfib(void *arg);
+
+static int fibdir_spawn(struct p9_handle *p9_handle, struct p9_fibers *fibers, char *parent, char *name, uint16_t namelen) {
+	struct fibdir *dir;
+	size_t len = parent ? strlen(parent) + 1 : 0;
+	int rc;
+
+	dir = malloc(sizeof(struct fibdir) + len + namelen + 1);
+	if (dir == NULL)
+		return ENOMEM;
+
+	dir->p9_handle = p9_handle;
+	dir->fibers = fibers;
+	dir->path = (char *)(dir + 1);
+	if (parent)
+		sprintf(dir->path, "%s/", parent);
+	memcpy(dir->path + len, name, namelen);
+	dir->path[len + namelen] = '\0';
+
+	rc = p9_fiber_spawn(fibers, walkfib, dir);
+	if (rc)
+		free(dir);
+	return rc;
+}
+
+static int rd_fibcb(void *arg, struct p9_handle *p9_handle, struct p9_fid *dfid, struct p9_qid *qid, uint8_t type, uint16_t namelen, char *name) {
+	struct fibdir *dir = arg;
+
+	/* skip . and .. */
+	if (strncmp(name, ".", namelen) == 0 || strncmp(name, "..", namelen) == 0)
+		return 0;
+
+	if (verbose)
+		printf("%s/%.*s\n", dir->path, namelen, name);
+
+	if (qid->type == P9_QTDIR)
+		return fibdir_spawn(p9_handle, dir->fibers, dir->path, name, namelen);
+
+	return 0;
+}
+
+/* one fiber per directory, all of them walk and read at once */
+static void walkfib(void *arg) {
+	struct fibdir *dir = arg;
+	struct p9_handle *p9_handle = dir->p9_handle;
+	struct p9_fid *fid;
+	uint64_t offset;
+	int rc;
+
+	rc = p9p_walk(p9_handle, p9l_getcwd(p9_handle), dir->path, &fid);
+	if (rc) {
+		printf("walk %s failed, rc: %s (%d)\n", dir->path, strerror(rc), rc);
+		free(dir);
+		return;
+	}
+
+	rc = p9p_lopen(p9_handle, fid, O_RDONLY, NULL);
+	if (rc) {
+		printf("open %s failed, rc: %s (%d)\n", dir->path, strerror(rc), rc);
+	} else {
+		offset = 0LL;
+		do {
+			rc = p9p_readdir(p9_handle, fid, &offset, rd_fibcb, dir);
+		} while (rc > 0);
+
+		if (rc) {
+			rc = -rc;
+			printf("readdir %s failed, rc: %s (%d)\n", dir->path, strerror(rc), rc);
+		}
+	}
+
+	p9p_clunk(p9_handle, &fid);
+	free(dir);
+}
+
 void print_help(char **argv) {
-	printf("Usage: %s [-c conf] [-s startpoint] [-t thread-num]\n", argv[0]);
+	printf("Usage: %s [-c conf] [-s startpoint] [-t thread-num] [-f]\n", argv[0]);
 	printf(	"Optional arguments:\n"
 		"	-t, --threads num: number of operating threads\n"
+		"	-f, --fibers: one walk over the threads, a fiber per directory\n"
 		"	-c, --conf file: conf file to use\n"
 		"	-s, --start[point] dir: do the walk from there\n"
 		" 	-v, --verbose: print what's found\n");
@@ -172,13 +262,14 @@ int main(int argc, char **argv) {
 		{ "help",	no_argument,		0,		'h' },
 		{ "threads",	required_argument,	0,		't' },
 		{ "verbose",	no_argument,		0,		'v' },
+		{ "fibers",	no_argument,		0,		'f' },
 		{ 0,		0,			0,		 0  }
 	};
 
 	int option_index = 0;
 	int op;
 
-	while ((op = getopt_long(argc, argv, "@vc:s:ht:", long_options, &option_index)) != -1) {
+	while ((op = getopt_long(argc, argv, "@vfc:s:ht:", long_options, &option_index)) != -1) {
 		switch(op) {
 			case '@':
 				printf("%s compiled on %s at %s\n", argv[0], __DATE__, __TIME__);
@@ -206,6 +297,9 @@ int main(int argc, char **argv) {
 			case 'v':
 				verbose = 1;
 				break;
+			case 'f':
+				fibmode = 1;
+				break;
 			default:
 				ERROR_LOG("Failed to parse arguments");
 				print_help(argv);
@@ -234,6 +328,21 @@ int main(int argc, char **argv) {
 
         INFO_LOG(1, "Init success");
 
+	if (fibmode) {
+		struct p9_fibers *fibers = NULL;
+
+		rc = p9_fibers_init(&fibers, thrnum, 0);
+		if (rc == 0)
+			rc = fibdir_spawn(p9_handle, fibers, NULL, startpoint, strlen(startpoint));
+		if (rc)
+			ERROR_LOG("Fiber start failure: %s (%d)", strerror(rc), rc);
+		if (fibers)
+			p9_fibers_join(&fibers);
+		free(thrid);
+		p9_destroy(&p9_handle);
+		return rc;
+	}
+
 	for (i=0; i<thrnum; i++)
 		pthread_create(&thrid[i], NULL, walkthr, p9_handle);
 
@@ -0,0 +1,1587 @@
+/*
+ * Copyright CEA/DAM/DIF (2013)
+ * Contributor: Dominique Martinet <dominique.martinet@cea.fr>
+ *
+ * This file is part of the space9 9P userspace library.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with space9.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/**
+ * \file	memserver.c
+ * \brief	in-memory 9P2000.L server for local benchmarking
+ *
+ * Serves a ram filesystem over the tcp transport's server primitives.
+ * Every connection has its own receive thread which queues requests to a
+ * pool of workers; each worker can be told to spend a given amount of time
+ * per message type to emulate a real server.
+ *
+ * Errors are returned as Rerror with a 4 bytes errno, which is what the
+ * library parses.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <inttypes.h> //PRIu64
+#include <time.h>
+#include <getopt.h>
+#include <sys/sysmacros.h> // makedev
+#include <sys/xattr.h> // XATTR_CREATE
+
+#include "9p_internals.h"
+#include "9p_proto_internals.h"
+#include "9p_tcp.h"
+#include "utils.h"
+
+#define DEFAULT_ADDR "0.0.0.0"
+#define DEFAULT_PORT "5564"
+#define DEFAULT_MSIZE (1024*1024+24)
+#define DEFAULT_RECV_NUM 128
+#define DEFAULT_WORKERS 8
+#define DEFAULT_BACKLOG 10
+
+#define MEMSRV_HASH_SIZE 65536
+#define MEMSRV_IOUNIT 0
+#define MEMSRV_AT_REMOVEDIR 0x200
+
+static int verbose;
+static uint32_t srv_msize = DEFAULT_MSIZE;
+static uint32_t srv_recv_num = DEFAULT_RECV_NUM;
+/* artificial service time in usec, indexed by T-message type */
+static uint32_t service_time[256];
+
+/* filesystem */
+
+struct mem_xattr {
+	struct mem_xattr *next;
+	char *name;
+	uint8_t *value;
+	size_t size;
+};
+
+struct mem_dent;
+
+struct mem_inode {
+	struct p9_qid qid;
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint64_t nlink;
+	uint64_t rdev;
+	uint64_t size;
+	uint8_t *data;		/**< file content or symlink target */
+	size_t alloc;
+	struct timespec atime;
+	struct timespec mtime;
+	struct timespec ctime;
+	struct mem_inode *parent;	/**< directories only */
+	struct mem_dent **ents;		/**< directories only */
+	uint32_t nents;
+	uint32_t aents;
+	struct mem_xattr *xattrs;
+	uint32_t nfids;
+};
+
+struct mem_dent {
+	struct mem_dent *hnext;	/**< hash chain */
+	struct mem_inode *dir;
+	struct mem_inode *inode;
+	uint16_t namelen;
+	char name[0];
+};
+
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mem_dent *dent_hash[MEMSRV_HASH_SIZE];
+static struct mem_inode *root;
+static uint64_t next_path = 1;
+
+static uint32_t dent_hashval(struct mem_inode *dir, const char *name, uint16_t namelen) {
+	uint32_t h = (uint32_t)dir->qid.path * 2654435761U;
+	uint16_t i;
+
+	for (i = 0; i < namelen; i++)
+		h = h * 31 + (uint8_t)name[i];
+
+	return h % MEMSRV_HASH_SIZE;
+}
+
+static struct mem_dent *dent_lookup(struct mem_inode *dir, const char *name, uint16_t namelen) {
+	struct mem_dent *dent;
+
+	for (dent = dent_hash[dent_hashval(dir, name, namelen)]; dent; dent = dent->hnext)
+		if (dent->dir == dir && dent->namelen == namelen && memcmp(dent->name, name, namelen) == 0)
+			return dent;
+
+	return NULL;
+}
+
+static void inode_touch(struct timespec *ts) {
+	clock_gettime(CLOCK_REALTIME, ts);
+}
+
+static struct mem_inode *inode_new(uint32_t mode, uint32_t uid, uint32_t gid) {
+	struct mem_inode *inode;
+
+	inode = calloc(1, sizeof(struct mem_inode));
+	if (!inode)
+		return NULL;
+
+	inode->qid.path = next_path++;
+	inode->qid.version = 0;
+	if (S_ISDIR(mode))
+		inode->qid.type = P9_QTDIR;
+	else if (S_ISLNK(mode))
+		inode->qid.type = P9_QTSYMLINK;
+	else
+		inode->qid.type = P9_QTFILE;
+	inode->mode = mode;
+	inode->uid = uid;
+	inode->gid = gid;
+	inode->nlink = S_ISDIR(mode) ? 2 : 1;
+	inode_touch(&inode->mtime);
+	inode->atime = inode->ctime = inode->mtime;
+
+	return inode;
+}
+
+static void inode_put(struct mem_inode *inode) {
+	struct mem_xattr *xattr;
+
+	if (inode->nlink > 0 || inode->nfids > 0 || inode == root)
+		return;
+
+	while ((xattr = inode->xattrs) != NULL) {
+		inode->xattrs = xattr->next;
+		free(xattr->name);
+		free(xattr->value);
+		free(xattr);
+	}
+	free(inode->ents);
+	free(inode->data);
+	free(inode);
+}
+
+static int dent_add(struct mem_inode *dir, const char *name, uint16_t namelen, struct mem_inode *inode) {
+	struct mem_dent *dent, **ents;
+	uint32_t h;
+
+	if (dir->nents == dir->aents) {
+		ents = realloc(dir->ents, (dir->aents ? dir->aents * 2 : 16) * sizeof(struct mem_dent *));
+		if (!ents)
+			return ENOMEM;
+		dir->ents = ents;
+		dir->aents = dir->aents ? dir->aents * 2 : 16;
+	}
+
+	dent = malloc(sizeof(struct mem_dent) + namelen + 1);
+	if (!dent)
+		return ENOMEM;
+
+	dent->dir = dir;
+	dent->inode = inode;
+	dent->namelen = namelen;
+	memcpy(dent->name, name, namelen);
+	dent->name[namelen] = '\0';
+
+	h = dent_hashval(dir, name, namelen);
+	dent->hnext = dent_hash[h];
+	dent_hash[h] = dent;
+	dir->ents[dir->nents++] = dent;
+
+	if (S_ISDIR(inode->mode)) {
+		inode->parent = dir;
+		dir->nlink++;
+	}
+	inode_touch(&dir->mtime);
+	dir->ctime = dir->mtime;
+	dir->qid.version++;
+
+	return 0;
+}
+
+/* unhook dent from its directory, does not touch the inode */
+static void dent_del(struct mem_dent *dent) {
+	struct mem_dent **pdent;
+	struct mem_inode *dir = dent->dir;
+	uint32_t i;
+
+	for (pdent = &dent_hash[dent_hashval(dir, dent->name, dent->namelen)]; *pdent; pdent = &(*pdent)->hnext) {
+		if (*pdent == dent) {
+			*pdent = dent->hnext;
+			break;
+		}
+	}
+
+	for (i = 0; i < dir->nents; i++) {
+		if (dir->ents[i] == dent) {
+			memmove(&dir->ents[i], &dir->ents[i+1], (dir->nents - i - 1) * sizeof(struct mem_dent *));
+			dir->nents--;
+			break;
+		}
+	}
+
+	if (S_ISDIR(dent->inode->mode))
+		dir->nlink--;
+	inode_touch(&dir->mtime);
+	dir->ctime = dir->mtime;
+	dir->qid.version++;
+}
+
+static void dent_unlink(struct mem_dent *dent) {
+	struct mem_inode *inode = dent->inode;
+
+	dent_del(dent);
+	free(dent);
+
+	if (S_ISDIR(inode->mode))
+		inode->nlink = 0;
+	else
+		inode->nlink--;
+	inode_touch(&inode->ctime);
+	inode_put(inode);
+}
+
+static int inode_resize(struct mem_inode *inode, uint64_t size) {
+	uint8_t *data;
+	size_t alloc;
+
+	if (size > inode->alloc) {
+		alloc = inode->alloc ? inode->alloc : 4096;
+		while (alloc < size)
+			alloc *= 2;
+		data = realloc(inode->data, alloc);
+		if (!data)
+			return ENOMEM;
+		memset(data + inode->alloc, 0, alloc - inode->alloc);
+		inode->data = data;
+		inode->alloc = alloc;
+	}
+	if (size < inode->size)
+		memset(inode->data + size, 0, inode->size - size);
+	inode->size = size;
+
+	return 0;
+}
+
+static uint8_t inode_dtype(struct mem_inode *inode) {
+	if (S_ISDIR(inode->mode))
+		return DT_DIR;
+	if (S_ISLNK(inode->mode))
+		return DT_LNK;
+	if (S_ISCHR(inode->mode))
+		return DT_CHR;
+	if (S_ISBLK(inode->mode))
+		return DT_BLK;
+	if (S_ISFIFO(inode->mode))
+		return DT_FIFO;
+	if (S_ISSOCK(inode->mode))
+		return DT_SOCK;
+	return DT_REG;
+}
+
+/* connections and fids */
+
+enum mem_fid_kind {
+	MEM_FID_NORMAL = 0,
+	MEM_FID_XATTR_READ,
+	MEM_FID_XATTR_CREATE
+};
+
+struct mem_fid {
+	struct mem_inode *inode;
+	int opened;
+	enum mem_fid_kind kind;
+	uint8_t *xbuf;
+	uint64_t xsize;
+	char *xname;
+	uint32_t xflags;
+};
+
+struct mem_conn {
+	msk_trans_t *trans;
+	pthread_mutex_t lock;
+	int refcount;
+	struct mem_fid **fids;
+	uint32_t nfids;
+	uint8_t *rbuf;
+	msk_data_t *rdata;
+};
+
+struct mem_req {
+	struct mem_req *next;
+	struct mem_conn *conn;
+	msk_data_t *data;
+};
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct mem_req *queue_head, *queue_tail;
+
+static struct mem_fid *fid_get(struct mem_conn *conn, uint32_t fid) {
+	if (fid >= conn->nfids)
+		return NULL;
+	return conn->fids[fid];
+}
+
+static int fid_new(struct mem_conn *conn, uint32_t fid, struct mem_inode *inode, struct mem_fid **pfid) {
+	struct mem_fid **fids, *mfid;
+	uint32_t n;
+
+	if (fid == P9_NOFID)
+		return EBADF;
+
+	if (fid >= conn->nfids) {
+		n = conn->nfids ? conn->nfids : 1024;
+		while (n <= fid)
+			n *= 2;
+		fids = realloc(conn->fids, n * sizeof(struct mem_fid *));
+		if (!fids)
+			return ENOMEM;
+		memset(fids + conn->nfids, 0, (n - conn->nfids) * sizeof(struct mem_fid *));
+		conn->fids = fids;
+		conn->nfids = n;
+	}
+
+	if (conn->fids[fid])
+		return EBADF;
+
+	mfid = calloc(1, sizeof(struct mem_fid));
+	if (!mfid)
+		return ENOMEM;
+
+	mfid->inode = inode;
+	inode->nfids++;
+	conn->fids[fid] = mfid;
+	if (pfid)
+		*pfid = mfid;
+
+	return 0;
+}
+
+static int xattr_set(struct mem_inode *inode, char *name, uint8_t *value, size_t size, uint32_t flags) {
+	struct mem_xattr *xattr, **pxattr;
+
+	for (pxattr = &inode->xattrs; *pxattr; pxattr = &(*pxattr)->next)
+		if (strcmp((*pxattr)->name, name) == 0)
+			break;
+
+	xattr = *pxattr;
+	if (xattr && (flags & XATTR_CREATE))
+		return EEXIST;
+	if (!xattr && (flags & XATTR_REPLACE))
+		return ENODATA;
+
+	/* size 0 removes the attribute, like the linux client does */
+	if (size == 0 && value == NULL) {
+		if (!xattr)
+			return ENODATA;
+		*pxattr = xattr->next;
+		free(xattr->name);
+		free(xattr->value);
+		free(xattr);
+		return 0;
+	}
+
+	if (!xattr) {
+		xattr = calloc(1, sizeof(struct mem_xattr));
+		if (!xattr)
+			return ENOMEM;
+		xattr->name = strdup(name);
+		xattr->next = inode->xattrs;
+		inode->xattrs = xattr;
+	}
+	free(xattr->value);
+	xattr->value = value;
+	xattr->size = size;
+	inode_touch(&inode->ctime);
+
+	return 0;
+}
+
+static void fid_clunk(struct mem_conn *conn, uint32_t fid, int *prc) {
+	struct mem_fid *mfid = conn->fids[fid];
+	int rc = 0;
+
+	if (mfid->kind == MEM_FID_XATTR_CREATE) {
+		rc = xattr_set(mfid->inode, mfid->xname, mfid->xsize ? mfid->xbuf : NULL, mfid->xsize, mfid->xflags);
+		if (rc == 0)
+			mfid->xbuf = NULL;
+	}
+
+	conn->fids[fid] = NULL;
+	mfid->inode->nfids--;
+	inode_put(mfid->inode);
+	free(mfid->xbuf);
+	free(mfid->xname);
+	free(mfid);
+
+	if (prc)
+		*prc = rc;
+}
+
+/* message handling */
+
+#define memsrv_getname(__cursor, __end, __buf, __rc)			\
+do {									\
+	uint16_t __len;							\
+	char *__str;							\
+	if (__cursor + sizeof(uint16_t) > __end) {			\
+		__rc = EPROTO;						\
+		break;							\
+	}								\
+	p9_getstr(__cursor, __len, __str);				\
+	if (__cursor > __end) {						\
+		__rc = EPROTO;						\
+		break;							\
+	}								\
+	if (__len >= sizeof(__buf)) {					\
+		__rc = ENAMETOOLONG;					\
+		break;							\
+	}								\
+	memcpy(__buf, __str, __len);					\
+	__buf[__len] = '\0';						\
+} while (0)
+
+static int memsrv_checkname(char *name) {
+	if (name[0] == '\0' || strchr(name, '/') || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		return EINVAL;
+	return 0;
+}
+
+static void memsrv_setattr_times(struct mem_inode *inode, uint32_t valid, uint64_t atime_sec, uint64_t atime_nsec,
+                                 uint64_t mtime_sec, uint64_t mtime_nsec) {
+	if (valid & P9_SETATTR_ATIME) {
+		if (valid & P9_SETATTR_ATIME_SET) {
+			inode->atime.tv_sec = atime_sec;
+			inode->atime.tv_nsec = atime_nsec;
+		} else {
+			inode_touch(&inode->atime);
+		}
+	}
+	if (valid & P9_SETATTR_MTIME) {
+		if (valid & P9_SETATTR_MTIME_SET) {
+			inode->mtime.tv_sec = mtime_sec;
+			inode->mtime.tv_nsec = mtime_nsec;
+		} else {
+			inode_touch(&inode->mtime);
+		}
+	}
+}
+
+/**
+ * @brief handle one request
+ *
+ * @param[in]  conn:	connection the request came from
+ * @param[in]  req:	request buffer
+ * @param[out] reply:	reply buffer, msize long
+ */
+static void memsrv_handle(struct mem_conn *conn, msk_data_t *req, msk_data_t *reply) {
+	uint8_t *cursor, *end, *rcursor, *savepos;
+	uint8_t msgtype;
+	uint16_t tag, nwname, nwqid, i;
+	uint32_t fid, newfid, dfid, flags, mode, gid, count, major, minor, valid, uid;
+	uint64_t offset, size, atime_sec, atime_nsec, mtime_sec, mtime_nsec;
+	struct mem_fid *mfid, *mfid2;
+	struct mem_inode *inode, *dir, *newdir;
+	struct mem_dent *dent, *dent2;
+	struct mem_xattr *xattr;
+	struct p9_qid qids[P9_MAXWELEM];
+	char name[MAXNAMLEN+1], name2[MAXNAMLEN+1], target[MAXPATHLEN+1];
+	int rc = 0;
+
+	cursor = req->data;
+	end = req->data + req->size;
+	p9_getvalue(cursor, size, uint32_t);
+	p9_getvalue(cursor, msgtype, uint8_t);
+	p9_getvalue(cursor, tag, uint16_t);
+
+	INFO_LOG(verbose, "got msg type %u tag %u, size %"PRIu64, msgtype, tag, size);
+
+	p9_initcursor(rcursor, reply->data, msgtype + 1, tag);
+
+	pthread_mutex_lock(&fs_lock);
+	switch(msgtype) {
+	case P9_TVERSION:
+		p9_getvalue(cursor, count, uint32_t);
+		memsrv_getname(cursor, end, name, rc);
+		if (rc)
+			break;
+		p9_setvalue(rcursor, MIN(count, srv_msize), uint32_t);
+		if (strncmp(name, "9P2000.L", 8)) {
+			p9_setstr(rcursor, 7, "unknown");
+		} else {
+			p9_setstr(rcursor, 8, "9P2000.L");
+		}
+		/* version resets the session */
+		for (fid = 0; fid < conn->nfids; fid++)
+			if (conn->fids[fid])
+				fid_clunk(conn, fid, NULL);
+		break;
+
+	case P9_TAUTH:
+		rc = EOPNOTSUPP;
+		break;
+
+	case P9_TATTACH:
+		p9_getvalue(cursor, fid, uint32_t);
+		rc = fid_new(conn, fid, root, NULL);
+		if (rc)
+			break;
+		p9_setqid(rcursor, root->qid);
+		break;
+
+	case P9_TFLUSH:
+		/* requests are handled synchronously, nothing to flush */
+		break;
+
+	case P9_TWALK:
+		p9_getvalue(cursor, fid, uint32_t);
+		p9_getvalue(cursor, newfid, uint32_t);
+		p9_getvalue(cursor, nwname, uint16_t);
+		mfid = fid_get(conn, fid);
+		if (!mfid) {
+			rc = EBADF;
+			break;
+		}
+		if (nwname > P9_MAXWELEM) {
+			rc = E2BIG;
+			break;
+		}
+		if (newfid != fid && fid_get(conn, newfid)) {
+			rc = EBADF;
+			break;
+		}
+		inode = mfid->inode;
+		for (nwqid = 0; nwqid < nwname; nwqid++) {
+			memsrv_getname(cursor, end, name, rc);
+			if (rc)
+				break;
+			if (!S_ISDIR(inode->mode)) {
+				rc = ENOTDIR;
+				break;
+			}
+			if (strcmp(name, "..") == 0) {
+				if (inode->parent)
+					inode = inode->parent;
+			} else if (strcmp(name, ".") != 0) {
+				dent = dent_lookup(inode, name, strlen(name));
+				if (!dent) {
+					rc = ENOENT;
+					break;
+				}
+				inode = dent->inode;
+			}
+			qids[nwqid] = inode->qid;
+		}
+		/* partial walks are only an error on the first element */
+		if (rc && nwqid == 0)
+			break;
+		rc = 0;
+		if (nwqid == nwname) {
+			if (newfid == fid) {
+				mfid->inode->nfids--;
+				inode_put(mfid->inode);
+				mfid->inode = inode;
+				inode->nfids++;
+			} else {
+				rc = fid_new(conn, newfid, inode, NULL);
+				if (rc)
+					break;
+			}
+		}
+		p9_setvalue(rcursor, nwqid, uint16_t);
+		for (i = 0; i < nwqid; i++)
+			p9_setqid(rcursor, qids[i]);
+		break;
+
+	case P9_TCLUNK:
+	case P9_TREMOVE:
+		p9_getvalue(cursor, fid, uint32_t);
+		mfid = fid_get(conn, fid);
+		if (!mfid) {
+			rc = EBADF;
+			break;
+		}
+		if (msgtype == P9_TREMOVE) {
+			inode = mfid->inode;
+			if (inode == root) {
+				rc = EBUSY;
+			} else if (S_ISDIR(inode->mode) && inode->nents > 0) {
+				rc = ENOTEMPTY;
+			} else {
+				/* find any name pointing to it */
+				dent = NULL;
+				if (S_ISDIR(inode->mode) && inode->parent) {
+					for (i = 0; i < inode->parent->nents; i++)
+						if (inode->parent->ents[i]->inode == inode)
+							dent = inode->parent->ents[i];
+				}
+				if (!dent)
+					rc = EINVAL;
+				else
+					dent_unlink(dent);
+			}
+			/* fid is clunked even on error */
+			fid_clunk(conn, fid, NULL);
+		} else {
+			fid_clunk(conn, fid, &rc);
+		}
+		break;
+
+	case P9_TLOPEN:
+		p9_getvalue(cursor, fid, uint32_t);
+		p9_getvalue(cursor, flags, uint32_t);
+		mfid = fid_get(conn, fid);
+		if (!mfid) {
+			rc = EBADF;
+			break;
+		}
+		inode = mfid->inode;
+		if (S_ISDIR(inode->mode) && (flags & O_ACCMODE) != O_RDONLY) {
+			rc = EISDIR;
+			break;
+		}
+		if ((flags & O_TRUNC) && S_ISREG(inode->mode) && (flags & O_ACCMODE) != O_RDONLY) {
+			inode_resize(inode, 0);
+			inode_touch(&inode->mtime);
+			inode->qid.version++;
+		}
+		mfid->opened = 1;
+		p9_setqid(rcursor, inode->qid);
+		p9_setvalue(rcursor, MEMSRV_IOUNIT, uint32_t);
+		break;
+
+	case P9_TLCREATE:
+	case P9_TMKDIR:
+	case P9_TSYMLINK:
+	case P9_TMKNOD:
+		p9_getvalue(cursor, dfid, uint32_t);
+		memsrv_getname(cursor, end, name, rc);
+		if (rc)
+			break;
+		flags = mode = major = minor = 0;
+		switch (msgtype) {
+		case P9_TLCREATE:
+			p9_getvalue(cursor, flags, uint32_t);
+			p9_getvalue(cursor, mode, uint32_t);
+			mode = S_IFREG | (mode & 07777);
+			break;
+		case P9_TMKDIR:
+			p9_getvalue(cursor, mode, uint32_t);
+			mode = S_IFDIR | (mode & 07777);
+			break;
+		case P9_TSYMLINK:
+			memsrv_getname(cursor, end, target, rc);
+			mode = S_IFLNK | 0777;
+			break;
+		case P9_TMKNOD:
+			p9_getvalue(cursor, mode, uint32_t);
+			p9_getvalue(cursor, major, uint32_t);
+			p9_getvalue(cursor, minor, uint32_t);
+			break;
+		}
+		if (rc)
+			break;
+		p9_getvalue(cursor, gid, uint32_t);
+
+		mfid = fid_get(conn, dfid);
+		if (!mfid) {
+			rc = EBADF;
+			break;
+		}
+		dir = mfid->inode;
+		if (!S_ISDIR(dir->mode)) {
+			rc = ENOTDIR;
+			break;
+		}
+		rc = memsrv_checkname(name);
+		if (rc)
+			break;
+		if (dent_lookup(dir, name, strlen(name))) {
+			rc = EEXIST;
+			break;
+		}
+		inode = inode_new(mode, dir->uid, gid);
+		if (!inode) {
+			rc = ENOMEM;
+			break;
+		}
+		if (msgtype == P9_TSYMLINK) {
+			rc = inode_resize(inode, strlen(target));
+			if (rc == 0)
+				memcpy(inode->data, target, strlen(target));
+		} else if (msgtype == P9_TMKNOD) {
+			inode->rdev = makedev(major, minor);
+		}
+		if (rc == 0)
+			rc = dent_add(dir, name, strlen(name), inode);
+		if (rc) {
+			inode->nlink = 0;
+			inode_put(inode);
+			break;
+		}
+
+		if (msgtype == P9_TLCREATE) {
+			/* the fid now points to the new, open file */
+			dir->nfids--;
+			mfid->inode = inode;
+			inode->nfids++;
+			mfid->opened = 1;
+			p9_setqid(rcursor, inode->qid);
+			p9_setvalue(rcursor, MEMSRV_IOUNIT, uint32_t);
+		} else {
+			p9_setqid(rcursor, inode->qid);
+		}
+		break;
+
+	case P9_TRENAME:
+		p9_getvalue(cursor, fid, uint32_t);
+		p9_getvalue(cursor, dfid, uint32_t);
+		memsrv_getname(cursor, end, name, rc);
+		if (rc)
+			break;
+		mfid = fid_get(conn, fid);
+		mfid2 = fid_get(conn, dfid);
+		if (!mfid || !mfid2) {
+			rc = EBADF;
+			break;
+		}
+		inode = mfid->inode;
+		/* only directories remember their parent, look in all the others */
+		dent = NULL;
+		dir = inode->parent;
+		if (dir) {
+			for (i = 0; i < dir->nents && !dent; i++)
+				if (dir->ents[i]->inode == inode)
+					dent = dir->ents[i];
+		} else {
+			for (i = 0; i < MEMSRV_HASH_SIZE && !dent; i++)
+				for (dent2 = dent_hash[i]; dent2 && !dent; dent2 = dent2->hnext)
+					if (dent2->inode == inode)
+						dent = dent2;
+		}
+		if (!dent) {
+			rc = ENOENT;
+			break;
+		}
+		strcpy(name2, dent->name);
+		dir = dent->dir;
+		newdir = mfid2->inode;
+		goto do_rename;
+
+	case P9_TRENAMEAT:
+		p9_getvalue(cursor, dfid, uint32_t);
+		memsrv_getname(cursor, end, name2, rc);
+		if (rc)
+			break;
+		p9_getvalue(cursor, fid, uint32_t);
+		memsrv_getname(cursor, end, name, rc);
+		if (rc)
+			break;
+		mfid = fid_get(conn, dfid);
+		mfid2 = fid_get(conn, fid);
+		if (!mfid || !mfid2) {
+			rc = EBADF;
+			break;
+		}
+		dir = mfid->inode;
+		newdir = mfid2->inode;
+do_rename:
+		/* name2 in dir -> name in newdir */
+		if (!S_ISDIR(dir->mode) || !S_ISDIR(newdir->mode)) {
+			rc = ENOTDIR;
+			break;
+		}
+		rc = memsrv_checkname(name);
+		if (rc)
+			break;
+		dent = dent_lookup(dir, name2, strlen(name2));
+		if (!dent) {
+			rc = ENOENT;
+			break;
+		}
+		inode = dent->inode;
+		/* can't move a directory below itself */
+		for (dir = newdir; dir; dir = dir->parent) {
+			if (dir == inode) {
+				rc = EINVAL;
+				break;
+			}
+		}
+		if (rc)
+			break;
+		dent2 = dent_lookup(newdir, name, strlen(name));
+		if (dent2 == dent)
+			break;
+		if (dent2) {
+			if (S_ISDIR(dent2->inode->mode) && (!S_ISDIR(inode->mode) || dent2->inode->nents > 0)) {
+				rc = S_ISDIR(inode->mode) ? ENOTEMPTY : EISDIR;
+				break;
+			}
+			if (!S_ISDIR(dent2->inode->mode) && S_ISDIR(inode->mode)) {
+				rc = ENOTDIR;
+				break;
+			}
+			dent_unlink(dent2);
+		}
+		dent_del(dent);
+		free(dent);
+		rc = dent_add(newdir, name, strlen(name), inode);
+		inode_touch(&inode->ctime);
+		break;
+
+	case P9_TREADLINK:
+		p9_getvalue(cursor, fid, uint32_t);
+		mfid = fid_get(conn, fid);
+		if (!mfid) {
+			rc = EBADF;
+			break;
+		}
+		if (!S_ISLNK(mfid->inode->mode)) {
+			rc = EINVAL;
+			break;
+		}
+		p9_setstr(rcursor, mfid->inode->size, mfid->inode->data);
+		break;
+
+	case P9_TREADDIR:
+		p9_getvalue(cursor, fid, uint32_t);
+		p9_getvalue(cursor, offset, uint64_t);
+		p9_getvalue(cursor, count, uint32_t);
+		mfid = fid_get(conn, fid);
+		if (!mfid) {
+			rc = EBADF;
+			break;
+		}
+		dir = mfid->inode;
+		if (!S_ISDIR(dir->mode)) {
+			rc = ENOTDIR;
+			break;
+		}
+		count = MIN(count, reply->max_size - P9_ROOM_RREADDIR);
+		p9_savepos(rcursor, savepos, uint32_t);
+		/* offset 0 is '.', 1 '..', then entries */
+		for (; offset < dir->nents + 2; offset++) {
+			if (offset == 0) {
+				inode = dir;
+				strcpy(name, ".");
+			} else if (offset == 1) {
+				inode = dir->parent ? dir->parent : dir;
+				strcpy(name, "..");
+			} else {
+				inode = dir->ents[offset-2]->inode;
+				strcpy(name, dir->ents[offset-2]->name);
+			}
+			if (rcursor + 13 + 8 + 1 + 2 + strlen(name) > savepos + sizeof(uint32_t) + count)
+				break;
+			p9_setqid(rcursor, inode->qid);
+			p9_setvalue(rcursor, offset + 1, uint64_t);
+			p9_setvalue(rcursor, inode_dtype(inode), uint8_t);
+			p9_setstr(rcursor, strlen(name), name);
+		}
+		p9_setvalue(savepos, (uint32_t)(rcursor - savepos - sizeof(uint32_t)), uint32_t);
+		break;
+
+	case P9_TREAD:
+		p9_getvalue(cursor, fid, uint32_t);
+		p9_getvalue(cursor, offset, uint64_t);
+		p9_getvalue(cursor, count, uint32_t);
+		mfid = fid_get(conn, fid);
+		if (!mfid) {
+			rc = EBADF;
+			break;
+		}
+		count = MIN(count, reply->max_size - P9_ROOM_RREAD);
+		if (mfid->kind == MEM_FID_XATTR_READ) {
+			if (offset > mfid->xsize)
+				offset = mfid->xsize;
+			count = MIN(count, mfid->xsize - offset);
+			p9_setvalue(rcursor, count, uint32_t);
+			memcpy(rcursor, mfid->xbuf + offset, count);
+			rcursor += count;
+			break;
+		}
+		inode = mfid->inode;
+		if (S_ISDIR(inode->mode)) {
+			rc = EISDIR;
+			break;
+		}
+		if (offset > inode->size)
+			offset = inode->size;
+		count = MIN(count, inode->size - offset);
+		p9_setvalue(rcursor, count, uint32_t);
+		memcpy(rcursor, inode->data + offset, count);
+		rcursor += count;
+		break;
+
+	case P9_TWRITE:
+		p9_getvalue(cursor, fid, uint32_t);
+		p9_getvalue(cursor, offset, uint64_t);
+		p9_getvalue(cursor, count, uint32_t);
+		mfid = fid_get(conn, fid);
+		if (!mfid) {
+			rc = EBADF;
+			break;
+		}
+		if (cursor + count > end) {
+			rc = EPROTO;
+			break;
+		}
+		if (mfid->kind == MEM_FID_XATTR_CREATE) {
+			if (offset + count > mfid->xsize) {
+				rc = ERANGE;
+				break;
+			}
+			memcpy(mfid->xbuf + offset, cursor, count);
+			p9_setvalue(rcursor, count, uint32_t);
+			break;
+		}
+		inode = mfid->inode;
+		if (!S_ISREG(inode->mode)) {
+			rc = EINVAL;
+			break;
+		}
+		if (offset + count > inode->size) {
+			rc = inode_resize(inode, offset + count);
+			if (rc)
+				break;
+		}
+		memcpy(inode->data + offset, cursor, count);
+		inode_touch(&inode->mtime);
+		inode->qid.version++;
+		p9_setvalue(rcursor, count, uint32_t);
+		break;
+
+	case P9_TXATTRWALK:
+		p9_getvalue(cursor, fid, uint32_t);
+		p9_getvalue(cursor, newfid, uint32_t);
+		memsrv_getname(cursor, end, name, rc);
+		if (rc)
+			break;
+		mfid = fid_get(conn, fid);
+		if (!mfid) {
+			rc = EBADF;
+			break;
+		}
+		inode = mfid->inode;
+		size = 0;
+		if (name[0] == '\0') {
+			/* list */
+			for (xattr = inode->xattrs; xattr; xattr = xattr->next)
+				size += strlen(xattr->name) + 1;
+		} else {
+			for (xattr = inode->xattrs; xattr; xattr = xattr->next)
+				if (strcmp(xattr->name, name) == 0)
+					break;
+			if (!xattr) {
+				rc = ENODATA;
+				break;
+			}
+			size = xattr->size;
+		}
+		rc = fid_new(conn, newfid, inode, &mfid2);
+		if (rc)
+			break;
+		mfid2->kind = MEM_FID_XATTR_READ;
+		mfid2->xsize = size;
+		mfid2->xbuf = malloc(size ? size : 1);
+		if (name[0] == '\0') {
+			savepos = mfid2->xbuf;
+			for (xattr = inode->xattrs; xattr; xattr = xattr->next) {
+				memcpy(savepos, xattr->name, strlen(xattr->name) + 1);
+				savepos += strlen(xattr->name) + 1;
+			}
+		} else {
+			memcpy(mfid2->xbuf, xattr->value, size);
+		}
+		p9_setvalue(rcursor, size, uint64_t);
+		break;
+
+	case P9_TXATTRCREATE:
+		p9_getvalue(cursor, fid, uint32_t);
+		memsrv_getname(cursor, end, name, rc);
+		if (rc)
+			break;
+		p9_getvalue(cursor, size, uint64_t);
+		p9_getvalue(cursor, flags, uint32_t);
+		mfid = fid_get(conn, fid);
+		if (!mfid) {
+			rc = EBADF;
+			break;
+		}
+		if (size > 65536) {
+			rc = E2BIG;
+			break;
+		}
+		mfid->kind = MEM_FID_XATTR_CREATE;
+		mfid->xsize = size;
+		mfid->xflags = flags;
+		mfid->xbuf = calloc(1, size ? size : 1);
+		mfid->xname = strdup(name);
+		break;
+
+	case P9_TUNLINKAT:
+		p9_getvalue(cursor, dfid, uint32_t);
+		memsrv_getname(cursor, end, name, rc);
+		if (rc)
+			break;
+		p9_getvalue(cursor, flags, uint32_t);
+		mfid = fid_get(conn, dfid);
+		if (!mfid) {
+			rc = EBADF;
+			break;
+		}
+		dent = dent_lookup(mfid->inode, name, strlen(name));
+		if (!dent) {
+			rc = ENOENT;
+			break;
+		}
+		/* the library removes directories without AT_REMOVEDIR */
+		if (S_ISDIR(dent->inode->mode)) {
+			if (dent->inode->nents > 0)
+				rc = ENOTEMPTY;
+		} else if (flags & MEMSRV_AT_REMOVEDIR) {
+			rc = ENOTDIR;
+		}
+		if (rc)
+			break;
+		dent_unlink(dent);
+		break;
+
+	case P9_TGETATTR:
+		p9_getvalue(cursor, fid, uint32_t);
+		mfid = fid_get(conn, fid);
+		if (!mfid) {
+			rc = EBADF;
+			break;
+		}
+		inode = mfid->inode;
+		p9_setvalue(rcursor, P9_GETATTR_BASIC, uint64_t);
+		p9_setqid(rcursor, inode->qid);
+		p9_setvalue(rcursor, inode->mode, uint32_t);
+		p9_setvalue(rcursor, inode->uid, uint32_t);
+		p9_setvalue(rcursor, inode->gid, uint32_t);
+		p9_setvalue(rcursor, inode->nlink, uint64_t);
+		p9_setvalue(rcursor, inode->rdev, uint64_t);
+		p9_setvalue(rcursor, inode->size, uint64_t);
+		p9_setvalue(rcursor, 4096LL, uint64_t);
+		p9_setvalue(rcursor, (inode->size + 511) / 512, uint64_t);
+		p9_setvalue(rcursor, inode->atime.tv_sec, uint64_t);
+		p9_setvalue(rcursor, inode->atime.tv_nsec, uint64_t);
+		p9_setvalue(rcursor, inode->mtime.tv_sec, uint64_t);
+		p9_setvalue(rcursor, inode->mtime.tv_nsec, uint64_t);
+		p9_setvalue(rcursor, inode->ctime.tv_sec, uint64_t);
+		p9_setvalue(rcursor, inode->ctime.tv_nsec, uint64_t);
+		p9_setvalue(rcursor, 0LL, uint64_t); /* btime_sec */
+		p9_setvalue(rcursor, 0LL, uint64_t); /* btime_nsec */
+		p9_setvalue(rcursor, 0LL, uint64_t); /* gen */
+		p9_setvalue(rcursor, (uint64_t)inode->qid.version, uint64_t); /* data_version */
+		break;
+
+	case P9_TSETATTR:
+		p9_getvalue(cursor, fid, uint32_t);
+		p9_getvalue(cursor, valid, uint32_t);
+		p9_getvalue(cursor, mode, uint32_t);
+		p9_getvalue(cursor, uid, uint32_t);
+		p9_getvalue(cursor, gid, uint32_t);
+		p9_getvalue(cursor, size, uint64_t);
+		p9_getvalue(cursor, atime_sec, uint64_t);
+		p9_getvalue(cursor, atime_nsec, uint64_t);
+		p9_getvalue(cursor, mtime_sec, uint64_t);
+		p9_getvalue(cursor, mtime_nsec, uint64_t);
+		mfid = fid_get(conn, fid);
+		if (!mfid) {
+			rc = EBADF;
+			break;
+		}
+		inode = mfid->inode;
+		if (valid & P9_SETATTR_SIZE) {
+			if (!S_ISREG(inode->mode)) {
+				rc = S_ISDIR(inode->mode) ? EISDIR : EINVAL;
+				break;
+			}
+			rc = inode_resize(inode, size);
+			if (rc)
+				break;
+			inode_touch(&inode->mtime);
+			inode->qid.version++;
+		}
+		if (valid & P9_SETATTR_MODE)
+			inode->mode = (inode->mode & S_IFMT) | (mode & 07777);
+		if (valid & P9_SETATTR_UID)
+			inode->uid = uid;
+		if (valid & P9_SETATTR_GID)
+			inode->gid = gid;
+		memsrv_setattr_times(inode, valid, atime_sec, atime_nsec, mtime_sec, mtime_nsec);
+		inode_touch(&inode->ctime);
+		break;
+
+	case P9_TFSYNC:
+		p9_getvalue(cursor, fid, uint32_t);
+		if (!fid_get(conn, fid))
+			rc = EBADF;
+		break;
+
+	case P9_TLINK:
+		p9_getvalue(cursor, dfid, uint32_t);
+		p9_getvalue(cursor, fid, uint32_t);
+		memsrv_getname(cursor, end, name, rc);
+		if (rc)
+			break;
+		mfid = fid_get(conn, dfid);
+		mfid2 = fid_get(conn, fid);
+		if (!mfid || !mfid2) {
+			rc = EBADF;
+			break;
+		}
+		if (!S_ISDIR(mfid->inode->mode)) {
+			rc = ENOTDIR;
+			break;
+		}
+		if (S_ISDIR(mfid2->inode->mode)) {
+			rc = EPERM;
+			break;
+		}
+		rc = memsrv_checkname(name);
+		if (rc)
+			break;
+		if (dent_lookup(mfid->inode, name, strlen(name))) {
+			rc = EEXIST;
+			break;
+		}
+		rc = dent_add(mfid->inode, name, strlen(name), mfid2->inode);
+		if (rc == 0) {
+			mfid2->inode->nlink++;
+			inode_touch(&mfid2->inode->ctime);
+		}
+		break;
+
+	case P9_TLOCK:
+		p9_getvalue(cursor, fid, uint32_t);
+		if (!fid_get(conn, fid)) {
+			rc = EBADF;
+			break;
+		}
+		/* no conflicts in here */
+		p9_setvalue(rcursor, P9_LOCK_SUCCESS, uint8_t);
+		break;
+
+	case P9_TGETLOCK:
+		p9_getvalue(cursor, fid, uint32_t);
+		p9_skipvalue(cursor, uint8_t);
+		p9_getvalue(cursor, offset, uint64_t);
+		p9_getvalue(cursor, size, uint64_t);
+		p9_getvalue(cursor, count, uint32_t);
+		if (!fid_get(conn, fid)) {
+			rc = EBADF;
+			break;
+		}
+		p9_setvalue(rcursor, F_UNLCK, uint8_t);
+		p9_setvalue(rcursor, offset, uint64_t);
+		p9_setvalue(rcursor, size, uint64_t);
+		p9_setvalue(rcursor, count, uint32_t);
+		p9_setstr(rcursor, 0, "");
+		break;
+
+	case P9_TSTATFS:
+		p9_getvalue(cursor, fid, uint32_t);
+		if (!fid_get(conn, fid)) {
+			rc = EBADF;
+			break;
+		}
+		p9_setvalue(rcursor, 0x01021994, uint32_t); /* TMPFS_MAGIC */
+		p9_setvalue(rcursor, 4096, uint32_t);
+		p9_setvalue(rcursor, 1LL<<30, uint64_t);
+		p9_setvalue(rcursor, 1LL<<30, uint64_t);
+		p9_setvalue(rcursor, 1LL<<30, uint64_t);
+		p9_setvalue(rcursor, 1LL<<30, uint64_t);
+		p9_setvalue(rcursor, (1LL<<30) - next_path, uint64_t);
+		p9_setvalue(rcursor, 0x9c9c9c9cLL, uint64_t);
+		p9_setvalue(rcursor, MAXNAMLEN, uint32_t);
+		break;
+
+	default:
+		ERROR_LOG("unsupported message type %u", msgtype);
+		rc = EOPNOTSUPP;
+	}
+	pthread_mutex_unlock(&fs_lock);
+
+	if (rc) {
+		INFO_LOG(verbose, "msg type %u tag %u failed: %s (%d)", msgtype, tag, strerror(rc), rc);
+		p9_initcursor(rcursor, reply->data, P9_RERROR, tag);
+		p9_setvalue(rcursor, rc, uint32_t);
+	}
+	p9_setmsglen(rcursor, reply);
+}
+
+/* connection and worker plumbing */
+
+static void memsrv_conn_put(struct mem_conn *conn) {
+	uint32_t fid;
+	int refcount;
+
+	pthread_mutex_lock(&conn->lock);
+	refcount = --conn->refcount;
+	pthread_mutex_unlock(&conn->lock);
+
+	if (refcount > 0)
+		return;
+
+	INFO_LOG(verbose, "connection %p closed", conn);
+
+	pthread_mutex_lock(&fs_lock);
+	for (fid = 0; fid < conn->nfids; fid++)
+		if (conn->fids[fid])
+			fid_clunk(conn, fid, NULL);
+	pthread_mutex_unlock(&fs_lock);
+
+	msk_tcp_destroy_trans(&conn->trans);
+	pthread_mutex_destroy(&conn->lock);
+	free(conn->fids);
+	free(conn->rdata);
+	free(conn->rbuf);
+	free(conn);
+}
+
+static void memsrv_recv_err_cb(msk_trans_t *trans, msk_data_t *data, void *arg) {
+}
+
+static void memsrv_send_cb(msk_trans_t *trans, msk_data_t *data, void *arg) {
+}
+
+static void memsrv_recv_cb(msk_trans_t *trans, msk_data_t *data, void *arg) {
+	struct mem_conn *conn = arg;
+	struct mem_req *req;
+
+	req = malloc(sizeof(struct mem_req));
+	if (!req) {
+		ERROR_LOG("Out of memory, dropping request");
+		return;
+	}
+
+	req->next = NULL;
+	req->conn = conn;
+	req->data = data;
+
+	pthread_mutex_lock(&conn->lock);
+	conn->refcount++;
+	pthread_mutex_unlock(&conn->lock);
+
+	pthread_mutex_lock(&queue_lock);
+	if (queue_tail)
+		queue_tail->next = req;
+	else
+		queue_head = req;
+	queue_tail = req;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+static void memsrv_disconnect_cb(msk_trans_t *trans) {
+	memsrv_conn_put(trans->private_data);
+}
+
+static void *memsrv_worker(void *arg) {
+	struct mem_req *req;
+	msk_data_t reply;
+	struct timespec ts;
+	uint8_t msgtype;
+
+	memset(&reply, 0, sizeof(reply));
+	reply.max_size = srv_msize;
+	reply.data = malloc(srv_msize);
+	if (!reply.data) {
+		ERROR_LOG("Could not allocate reply buffer");
+		return NULL;
+	}
+
+	while (1) {
+		pthread_mutex_lock(&queue_lock);
+		while (queue_head == NULL)
+			pthread_cond_wait(&queue_cond, &queue_lock);
+		req = queue_head;
+		queue_head = req->next;
+		if (!queue_head)
+			queue_tail = NULL;
+		pthread_mutex_unlock(&queue_lock);
+
+		msgtype = req->data->data[P9_HDR_SIZE];
+		if (service_time[msgtype]) {
+			ts.tv_sec = service_time[msgtype] / 1000000;
+			ts.tv_nsec = (service_time[msgtype] % 1000000) * 1000;
+			nanosleep(&ts, NULL);
+		}
+
+		memsrv_handle(req->conn, req->data, &reply);
+
+		if (req->conn->trans->state == MSK_CONNECTED) {
+			msk_tcp_post_n_send(req->conn->trans, &reply, 1, memsrv_send_cb, memsrv_send_cb, NULL);
+			msk_tcp_post_n_recv(req->conn->trans, req->data, 1, memsrv_recv_cb, memsrv_recv_err_cb, req->conn);
+		}
+
+		memsrv_conn_put(req->conn);
+		free(req);
+	}
+
+	return NULL;
+}
+
+static int memsrv_accept(msk_trans_t *listen_trans) {
+	struct mem_conn *conn;
+	msk_trans_t *trans;
+	uint32_t i;
+	int rc;
+
+	trans = msk_tcp_accept_one_wait(listen_trans, 0);
+	if (!trans)
+		return errno ? errno : EIO;
+
+	conn = calloc(1, sizeof(struct mem_conn));
+	if (!conn) {
+		msk_tcp_destroy_trans(&trans);
+		return ENOMEM;
+	}
+
+	conn->trans = trans;
+	conn->refcount = 1; /* dropped on disconnect */
+	pthread_mutex_init(&conn->lock, NULL);
+	trans->private_data = conn;
+	trans->disconnect_callback = memsrv_disconnect_cb;
+
+	conn->rbuf = malloc((size_t)srv_recv_num * srv_msize);
+	conn->rdata = calloc(srv_recv_num, sizeof(msk_data_t));
+	if (!conn->rbuf || !conn->rdata) {
+		memsrv_conn_put(conn);
+		return ENOMEM;
+	}
+
+	for (i = 0; i < srv_recv_num; i++) {
+		conn->rdata[i].data = conn->rbuf + (size_t)i * srv_msize;
+		conn->rdata[i].max_size = srv_msize;
+		msk_tcp_post_n_recv(trans, &conn->rdata[i], 1, memsrv_recv_cb, memsrv_recv_err_cb, conn);
+	}
+
+	rc = msk_tcp_finalize_accept(trans);
+	if (rc) {
+		ERROR_LOG("finalize_accept failed: %s (%d)", strerror(rc), rc);
+		memsrv_conn_put(conn);
+		return rc;
+	}
+
+	INFO_LOG(verbose, "new connection %p", conn);
+
+	return 0;
+}
+
+static const struct {
+	char *name;
+	uint8_t type;
+} op_names[] = {
+	{ "statfs", P9_TSTATFS },
+	{ "lopen", P9_TLOPEN },
+	{ "lcreate", P9_TLCREATE },
+	{ "symlink", P9_TSYMLINK },
+	{ "mknod", P9_TMKNOD },
+	{ "rename", P9_TRENAME },
+	{ "readlink", P9_TREADLINK },
+	{ "getattr", P9_TGETATTR },
+	{ "setattr", P9_TSETATTR },
+	{ "xattrwalk", P9_TXATTRWALK },
+	{ "xattrcreate", P9_TXATTRCREATE },
+	{ "readdir", P9_TREADDIR },
+	{ "fsync", P9_TFSYNC },
+	{ "lock", P9_TLOCK },
+	{ "getlock", P9_TGETLOCK },
+	{ "link", P9_TLINK },
+	{ "mkdir", P9_TMKDIR },
+	{ "renameat", P9_TRENAMEAT },
+	{ "unlinkat", P9_TUNLINKAT },
+	{ "version", P9_TVERSION },
+	{ "auth", P9_TAUTH },
+	{ "attach", P9_TATTACH },
+	{ "flush", P9_TFLUSH },
+	{ "walk", P9_TWALK },
+	{ "read", P9_TREAD },
+	{ "write", P9_TWRITE },
+	{ "clunk", P9_TCLUNK },
+	{ "remove", P9_TREMOVE },
+	{ NULL, 0 }
+};
+
+static int set_service_time(char *arg) {
+	char *eq;
+	uint32_t usec;
+	int i;
+
+	eq = strchr(arg, '=');
+	if (!eq)
+		return EINVAL;
+
+	*eq = '\0';
+	usec = strtoul(eq+1, NULL, 10);
+
+	for (i = 0; op_names[i].name; i++) {
+		if (strcasecmp(op_names[i].name, arg) == 0) {
+			service_time[op_names[i].type] = usec;
+			return 0;
+		}
+	}
+
+	return EINVAL;
+}
+
+static void print_help(char **argv) {
+	printf("Usage: %s [-a addr] [-p port] [-m msize] [-r recv-num] [-t threads] [-l usec] [-L op=usec]\n", argv[0]);
+	printf(	"Optional arguments:\n"
+		"	-a, --addr addr: address to listen on (default " DEFAULT_ADDR ")\n"
+		"	-p, --port port: port to listen on (default " DEFAULT_PORT ")\n"
+		"	-m, --msize size: max message size\n"
+		"	-r, --recv-num num: receive buffers per connection, must be at least the clients' recv_num\n"
+		"	-t, --threads num: number of worker threads\n"
+		"	-l, --latency usec: service time added to every request\n"
+		"	-L, --op-latency op=usec: service time for a given operation (read, write, walk...)\n"
+		"	-v, --verbose: print every request\n");
+}
+
+int main(int argc, char **argv) {
+	msk_trans_t *trans;
+	msk_trans_attr_t attr;
+	pthread_t thrid;
+	char *addr = DEFAULT_ADDR, *port = DEFAULT_PORT;
+	int rc, i, workers = DEFAULT_WORKERS;
+	uint32_t latency;
+
+	static struct option long_options[] = {
+		{ "addr",	required_argument,	0,		'a' },
+		{ "port",	required_argument,	0,		'p' },
+		{ "msize",	required_argument,	0,		'm' },
+		{ "recv-num",	required_argument,	0,		'r' },
+		{ "threads",	required_argument,	0,		't' },
+		{ "latency",	required_argument,	0,		'l' },
+		{ "op-latency",	required_argument,	0,		'L' },
+		{ "verbose",	no_argument,		0,		'v' },
+		{ "help",	no_argument,		0,		'h' },
+		{ 0,		0,			0,		 0  }
+	};
+
+	int option_index = 0;
+	int op;
+
+	while ((op = getopt_long(argc, argv, "a:p:m:r:t:l:L:vh", long_options, &option_index)) != -1) {
+		switch(op) {
+			case 'h':
+				print_help(argv);
+				exit(0);
+			case 'a':
+				addr = optarg;
+				break;
+			case 'p':
+				port = optarg;
+				break;
+			case 'm':
+				srv_msize = strtoul(optarg, &optarg, 10);
+				if ((optarg[0] != '\0' && set_size(&srv_msize, optarg)) || srv_msize < 4096) {
+					printf("invalid msize, using default\n");
+					srv_msize = DEFAULT_MSIZE;
+				}
+				break;
+			case 'r':
+				srv_recv_num = atoi(optarg);
+				if (srv_recv_num == 0)
+					srv_recv_num = DEFAULT_RECV_NUM;
+				break;
+			case 't':
+				workers = atoi(optarg);
+				if (workers <= 0)
+					workers = DEFAULT_WORKERS;
+				break;
+			case 'l':
+				latency = strtoul(optarg, NULL, 10);
+				for (i = 0; i < 256; i++)
+					service_time[i] = latency;
+				break;
+			case 'L':
+				if (set_service_time(optarg)) {
+					printf("invalid op latency %s\n", optarg);
+					print_help(argv);
+					exit(EINVAL);
+				}
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			default:
+				ERROR_LOG("Failed to parse arguments");
+				print_help(argv);
+				exit(EINVAL);
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	root = inode_new(S_IFDIR | 0777, 0, 0);
+	if (!root) {
+		ERROR_LOG("Out of memory");
+		return ENOMEM;
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.server = DEFAULT_BACKLOG;
+	attr.node = addr;
+	attr.port = port;
+	attr.rq_depth = srv_recv_num;
+	attr.sq_depth = srv_recv_num;
+	attr.debug = verbose;
+
+	rc = msk_tcp_init(&trans, &attr);
+	if (rc) {
+		ERROR_LOG("init failed: %s (%d)", strerror(rc), rc);
+		return rc;
+	}
+
+	rc = msk_tcp_bind_server(trans);
+	if (rc) {
+		ERROR_LOG("could not listen on %s:%s: %s (%d)", addr, port, strerror(rc), rc);
+		return rc;
+	}
+
+	for (i = 0; i < workers; i++) {
+		rc = pthread_create(&thrid, NULL, memsrv_worker, NULL);
+		if (rc) {
+			ERROR_LOG("could not start worker: %s (%d)", strerror(rc), rc);
+			return rc;
+		}
+		pthread_detach(thrid);
+	}
+
+	printf("listening on %s:%s, msize %u, %d workers\n", addr, port, srv_msize, workers);
+	fflush(stdout);
+
+	while (1) {
+		rc = memsrv_accept(trans);
+		if (rc)
+			ERROR_LOG("accept failed: %s (%d)", strerror(rc), rc);
+	}
+
+	return 0;
+}
@@ -0,0 +1,333 @@
+/*
+ * Copyright CEA/DAM/DIF (2013)
+ * Contributor: Dominique Martinet <dominique.martinet@cea.fr>
+ *
+ * This file is part of the space9 9P userspace library.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with space9.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+/**
+ * \file	nullbench.c
+ * \brief	client cost of single operations over the null transport
+ *
+ * Each operation is run in a loop by 1 to 64 threads for a given time on a
+ * handle using net_type = null, which answers every request from within
+ * the client. What is left is the library's own cost: buffer and tag
+ * allocation, encoding, the completion thread handoff and decoding.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h> //PRIu64
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "space9.h"
+#include "utils.h" // logs
+
+#define DEFAULT_THREADS "1,2,4,8,16,32,64"
+#define DEFAULT_DURATION 1
+#define DEFAULT_IOSIZE 4096
+#define DEFAULT_CONFFILE "null.conf"
+/* fids walked before clunking them all, per thread */
+#define WALK_BATCH 8
+#define MAX_THREADS 1024
+
+enum bench_op {
+	OP_WALK,
+	OP_CLUNK,
+	OP_GETATTR,
+	OP_READ,
+	OP_WRITE,
+	OP_READDIR,
+	OP_NUM
+};
+
+static const char *op_names[OP_NUM] = { "walk", "clunk", "getattr", "read", "write", "readdir" };
+
+struct thrarg {
+	struct p9_handle *p9_handle;
+	pthread_barrier_t barrier;
+	pthread_mutex_t lock;
+	volatile int stop;
+	enum bench_op op;
+	uint32_t iosize;
+	uint64_t count[OP_NUM];
+	uint64_t ns[OP_NUM];
+	int rc;
+};
+
+static inline uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int rd_cb(void *arg, struct p9_handle *p9_handle, struct p9_fid *dfid, struct p9_qid *qid, uint8_t type, uint16_t namelen, char *name) {
+	return 0;
+}
+
+static void *benchthr(void *arg) {
+	struct thrarg *thrarg = arg;
+	struct p9_handle *p9_handle = thrarg->p9_handle;
+	struct p9_fid *fid = NULL, *fids[WALK_BATCH];
+	struct p9_getattr attr;
+	uint64_t count[OP_NUM], ns[OP_NUM], start, offset;
+	char *buffer;
+	ssize_t ret;
+	int rc = 0, i;
+
+	memset(count, 0, sizeof(count));
+	memset(ns, 0, sizeof(ns));
+	buffer = malloc(thrarg->iosize);
+
+	/* setup, not measured */
+	if (!buffer) {
+		rc = ENOMEM;
+	} else if (thrarg->op != OP_WALK) {
+		rc = p9p_walk(p9_handle, p9l_getcwd(p9_handle), thrarg->op == OP_READDIR ? "dir" : "file", &fid);
+		if (rc == 0 && thrarg->op != OP_GETATTR)
+			rc = p9p_lopen(p9_handle, fid, thrarg->op == OP_READDIR ? O_RDONLY : O_RDWR, NULL);
+	}
+	if (rc)
+		printf("setup failed: %s (%d)\n", strerror(rc), rc);
+
+	pthread_barrier_wait(&thrarg->barrier);
+
+	while (rc == 0 && !thrarg->stop) {
+		start = now_ns();
+		switch (thrarg->op) {
+		case OP_WALK:
+			for (i = 0; i < WALK_BATCH && rc == 0; i++)
+				rc = p9p_walk(p9_handle, p9l_getcwd(p9_handle), "file", &fids[i]);
+			ns[OP_WALK] += now_ns() - start;
+			count[OP_WALK] += i;
+			if (rc)
+				i--;
+			start = now_ns();
+			while (i-- > 0)
+				p9p_clunk(p9_handle, &fids[i]);
+			ns[OP_CLUNK] += now_ns() - start;
+			count[OP_CLUNK] += WALK_BATCH;
+			continue;
+		case OP_GETATTR:
+			attr.valid = P9_GETATTR_BASIC;
+			rc = p9p_getattr(p9_handle, fid, &attr);
+			break;
+		case OP_READ:
+			ret = p9p_read(p9_handle, fid, buffer, thrarg->iosize, 0);
+			rc = ret < 0 ? -ret : 0;
+			break;
+		case OP_WRITE:
+			ret = p9p_write(p9_handle, fid, buffer, thrarg->iosize, 0);
+			rc = ret < 0 ? -ret : 0;
+			break;
+		case OP_READDIR:
+			offset = 0;
+			ret = p9p_readdir(p9_handle, fid, &offset, rd_cb, NULL);
+			rc = ret < 0 ? -ret : 0;
+			break;
+		default:
+			rc = EINVAL;
+		}
+		ns[thrarg->op] += now_ns() - start;
+		count[thrarg->op]++;
+	}
+
+	if (rc && !thrarg->stop)
+		printf("%s failed: %s (%d)\n", op_names[thrarg->op], strerror(rc), rc);
+
+	if (fid)
+		p9p_clunk(p9_handle, &fid);
+	free(buffer);
+
+	pthread_mutex_lock(&thrarg->lock);
+	for (i = 0; i < OP_NUM; i++) {
+		thrarg->count[i] += count[i];
+		thrarg->ns[i] += ns[i];
+	}
+	if (rc)
+		thrarg->rc = rc;
+	pthread_mutex_unlock(&thrarg->lock);
+
+	pthread_exit(NULL);
+}
+
+static void print_result(struct thrarg *thrarg, int thrnum, enum bench_op op) {
+	if (thrarg->count[op] == 0)
+		return;
+
+	/* ns is summed over threads: per thread latency, and aggregate rate */
+	printf("%7d %-8s %12.0f %10.0f\n", thrnum, op_names[op],
+	       thrarg->count[op] * 1000000000.0 * thrnum / thrarg->ns[op],
+	       (double)thrarg->ns[op] / thrarg->count[op]);
+}
+
+static int run(struct thrarg *thrarg, int thrnum, enum bench_op op, int duration) {
+	pthread_t thrid[MAX_THREADS];
+	int i;
+
+	memset(thrarg->count, 0, sizeof(thrarg->count));
+	memset(thrarg->ns, 0, sizeof(thrarg->ns));
+	thrarg->rc = 0;
+	thrarg->stop = 0;
+	thrarg->op = op;
+	pthread_barrier_init(&thrarg->barrier, NULL, thrnum + 1);
+
+	for (i = 0; i < thrnum; i++)
+		pthread_create(&thrid[i], NULL, benchthr, thrarg);
+
+	pthread_barrier_wait(&thrarg->barrier);
+	sleep(duration);
+	thrarg->stop = 1;
+
+	for (i = 0; i < thrnum; i++)
+		pthread_join(thrid[i], NULL);
+
+	pthread_barrier_destroy(&thrarg->barrier);
+
+	print_result(thrarg, thrnum, op);
+	if (op == OP_WALK)
+		print_result(thrarg, thrnum, OP_CLUNK);
+
+	return thrarg->rc;
+}
+
+static void print_help(char **argv) {
+	printf("Usage: %s [-c conf] [-t threads] [-d seconds] [-s io-size] [-o op]\n", argv[0]);
+	printf(	"Optional arguments:\n"
+		"	-c, --conf file: conf file to use, must have net_type = null\n"
+		"	-t, --threads list: comma separated thread counts (default "DEFAULT_THREADS")\n"
+		"	-d, --duration seconds: time spent on each op and thread count\n"
+		"	-s, --size size: read/write size\n"
+		"	-o, --op op: only run this op (walk (and clunk), getattr, read, write, readdir)\n");
+}
+
+int main(int argc, char **argv) {
+	int rc, i, thrnum;
+	char *conffile, *threads, *cur, *only;
+	int duration;
+	struct thrarg thrarg;
+	enum bench_op op;
+
+	memset(&thrarg, 0, sizeof(struct thrarg));
+	thrarg.iosize = DEFAULT_IOSIZE;
+	duration = DEFAULT_DURATION;
+	conffile = DEFAULT_CONFFILE;
+	threads = DEFAULT_THREADS;
+	only = NULL;
+
+	static struct option long_options[] = {
+		{ "conf",	required_argument,	0,		'c' },
+		{ "threads",	required_argument,	0,		't' },
+		{ "duration",	required_argument,	0,		'd' },
+		{ "size",	required_argument,	0,		's' },
+		{ "op",		required_argument,	0,		'o' },
+		{ "help",	no_argument,		0,		'h' },
+		{ 0,		0,			0,		 0  }
+	};
+
+	int option_index = 0;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "@c:t:d:s:o:h", long_options, &option_index)) != -1) {
+		switch(opt) {
+			case '@':
+				printf("%s compiled on %s at %s\n", argv[0], __DATE__, __TIME__);
+				printf("Release = %s\n", VERSION);
+				printf("Release comment = %s\n", VERSION_COMMENT);
+				printf("Git HEAD = %s\n", _GIT_HEAD_COMMIT ) ;
+				printf("Git Describe = %s\n", _GIT_DESCRIBE ) ;
+				exit(0);
+			case 'h':
+				print_help(argv);
+				exit(0);
+			case 'c':
+				conffile = optarg;
+				break;
+			case 't':
+				threads = optarg;
+				break;
+			case 'd':
+				duration = atoi(optarg);
+				if (duration <= 0) {
+					printf("invalid duration %s, using default\n", optarg);
+					duration = DEFAULT_DURATION;
+				}
+				break;
+			case 's':
+				thrarg.iosize = strtol(optarg, &optarg, 10);
+				if ((optarg[0] && set_size(&thrarg.iosize, optarg)) || thrarg.iosize == 0) {
+					printf("invalid size, using default\n");
+					thrarg.iosize = DEFAULT_IOSIZE;
+				}
+				break;
+			case 'o':
+				only = optarg;
+				break;
+			default:
+				ERROR_LOG("Failed to parse arguments");
+				print_help(argv);
+				exit(EINVAL);
+		}
+	}
+
+	if (optind < argc) {
+		for (i = optind; i < argc; i++)
+			printf ("Leftover argument %s\n", argv[i]);
+		print_help(argv);
+		exit(EINVAL);
+	}
+
+	pthread_mutex_init(&thrarg.lock, NULL);
+
+	rc = p9_init(&thrarg.p9_handle, conffile);
+	if (rc) {
+		ERROR_LOG("Init failure: %s (%d)", strerror(rc), rc);
+		return rc;
+	}
+
+	printf("%7s %-8s %12s %10s\n", "threads", "op", "ops/s", "ns/op");
+
+	for (cur = threads; rc == 0 && cur && *cur; cur = strchr(cur, ',') ? strchr(cur, ',') + 1 : NULL) {
+		thrnum = atoi(cur);
+		if (thrnum <= 0 || thrnum > MAX_THREADS) {
+			printf("invalid thread number %d, skipping\n", thrnum);
+			continue;
+		}
+		for (op = 0; rc == 0 && op < OP_NUM; op++) {
+			if (op == OP_CLUNK)
+				continue;
+			if (only && strcmp(only, op_names[op]))
+				continue;
+			rc = run(&thrarg, thrnum, op, duration);
+		}
+	}
+
+	p9_destroy(&thrarg.p9_handle);
+
+	return rc;
+}
@@ -19,10 +19,13 @@
  *
  */
 
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <inttypes.h>
+#include <time.h>
 
 #include "../bitmap.h"
 
@@ -30,19 +33,162 @@ void print_map(bitmap_t *map, size_t size) {
 	int i;
 	printf("map:");
 	for (i=0; i < WORD_OFFSET(size); i++) {
-		printf(" %016"PRIx64, map[i]);
+		printf(" %016"PRIx64, map->map[i]);
 	}
 	if (BIT_OFFSET(size))
-		printf(" %016"PRIx64, map[i]);
+		printf(" %016"PRIx64, map->map[i]);
 
 	printf("\n");
 }
 
+/* previous flat implementation, used as reference */
+static uint32_t ref_get_and_set_first_bit(uint64_t *map, uint32_t max) {
+	uint32_t maxw, i;
+
+	maxw = max / BITS_PER_WORD;
+	i = 0;
+
+	while (i < maxw && map[i] == ~0LL)
+		i++;
+
+	if (i == maxw) {
+		if (BIT_OFFSET(max) != 0 && map[i] != ~0LL) {
+			i = maxw*BITS_PER_WORD + ffsll(~map[maxw]) - 1;
+			if (i < max)
+				map[WORD_OFFSET(i)] |= (1ULL << BIT_OFFSET(i));
+			else
+				i = max;
+		} else {
+			i = max;
+		}
+	} else {
+		i = i*BITS_PER_WORD + ffsll(~map[i]) - 1;
+		map[WORD_OFFSET(i)] |= (1ULL << BIT_OFFSET(i));
+	}
+
+	return i;
+}
+
+static int check_summary(bitmap_t *map) {
+	uint32_t i;
+
+	for (i = 0; i < map->words; i++) {
+		if (!!(map->summary[WORD_OFFSET(i)] & (1ULL << BIT_OFFSET(i))) == bitmap_word_full(map, i))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* random set/clear sequence, checked bit for bit against the reference */
+static int fuzz(uint32_t size, int iterations) {
+	bitmap_t *map;
+	uint64_t *ref;
+	uint32_t bit, refbit, count = 0;
+	int i;
+
+	map = bitmap_init(size);
+	ref = calloc(BITMAP_WORDS(size), sizeof(uint64_t));
+	if (!map || !ref)
+		return 1;
+
+	for (i = 0; i < iterations; i++) {
+		/* bias towards a mostly-full map */
+		if (rand() % 8 < 5 || count == 0) {
+			bit = get_and_set_first_bit(map, size);
+			if (bit == size) {
+				if (count != size) {
+					printf("fuzz %u: map full with %u/%u bits set\n", size, count, size);
+					return 1;
+				}
+				/* reference must agree it's full */
+				refbit = ref_get_and_set_first_bit(ref, size);
+				if (refbit != size) {
+					printf("fuzz %u: reference found bit %u in full map\n", size, refbit);
+					return 1;
+				}
+				continue;
+			}
+			if (bit > size || (ref[WORD_OFFSET(bit)] & (1ULL << BIT_OFFSET(bit)))) {
+				printf("fuzz %u: got bit %u which was not free\n", size, bit);
+				return 1;
+			}
+			ref[WORD_OFFSET(bit)] |= (1ULL << BIT_OFFSET(bit));
+			count++;
+		} else {
+			bit = rand() % size;
+			if (get_bit(map, bit))
+				count--;
+			clear_bit(map, bit);
+			ref[WORD_OFFSET(bit)] &= ~(1ULL << BIT_OFFSET(bit));
+		}
+
+		if (memcmp(map->map, ref, BITMAP_WORDS(size) * sizeof(uint64_t))
+		    || check_summary(map) || bitcount(map, size) != count) {
+			printf("fuzz %u: mismatch after %d operations\n", size, i);
+			return 1;
+		}
+	}
+
+	bitmap_destroy(&map);
+	free(ref);
+	printf("fuzz %u: %d operations ok\n", size, iterations);
+	return 0;
+}
+
+static double elapsed(struct timespec *start) {
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* fill the map then free/allocate one random bit at a time */
+static void bench(uint32_t size, int iterations) {
+	bitmap_t *map;
+	uint64_t *ref;
+	uint32_t *bits, bit;
+	struct timespec start;
+	int i;
+
+	map = bitmap_init(size);
+	ref = calloc(BITMAP_WORDS(size), sizeof(uint64_t));
+	bits = malloc(iterations * sizeof(uint32_t));
+	if (!map || !ref || !bits)
+		return;
+
+	for (i = 0; i < iterations; i++)
+		bits[i] = rand() % size;
+
+	while (ref_get_and_set_first_bit(ref, size) != size);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iterations; i++) {
+		ref[WORD_OFFSET(bits[i])] &= ~(1ULL << BIT_OFFSET(bits[i]));
+		bit = ref_get_and_set_first_bit(ref, size);
+	}
+	printf("bench %u: flat %.1f ns/alloc\n", size, elapsed(&start) * 1e9 / iterations);
+
+	while (get_and_set_first_bit(map, size) != size);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iterations; i++) {
+		clear_bit(map, bits[i]);
+		bit = get_and_set_first_bit(map, size);
+	}
+	printf("bench %u: summary %.1f ns/alloc\n", size, elapsed(&start) * 1e9 / iterations);
+
+	(void)bit;
+	bitmap_destroy(&map);
+	free(ref);
+	free(bits);
+}
+
 #define DEFAULT_SIZE 1024
+#define FUZZ_ITERATIONS 200000
+#define BENCH_ITERATIONS 200000
 
 int main(int argc, char **argv) {
 	bitmap_t *test_bitmap;
-	int i, j, size;
+	int i, j, size, rc;
 
 	size = 0;
 	if (argc > 1)
@@ -51,8 +197,7 @@ int main(int argc, char **argv) {
 	if (size == 0)
 		size = DEFAULT_SIZE;
 
-	test_bitmap=malloc(size/8 + ((size % 8 == 0) ? 0 : 1));
-	memset(test_bitmap, 0, size/8 + ((size % 8 == 0) ? 0 : 1));
+	test_bitmap = bitmap_init(size);
 
 	for (i=0; i< 4; i++) {
 		printf("%u\n", get_and_set_first_bit(test_bitmap, size));
@@ -80,5 +225,18 @@ int main(int argc, char **argv) {
 	print_map(test_bitmap, size);
 	printf("bitcount: %u\n", bitcount(test_bitmap, size));
 
-	return 0;
+	bitmap_destroy(&test_bitmap);
+
+	srand(time(NULL));
+	rc = 0;
+	rc |= fuzz(1, FUZZ_ITERATIONS / 100);
+	rc |= fuzz(63, FUZZ_ITERATIONS / 10);
+	rc |= fuzz(size, FUZZ_ITERATIONS);
+	rc |= fuzz(4096 + 17, FUZZ_ITERATIONS);
+	rc |= fuzz(65536, FUZZ_ITERATIONS / 10);
+
+	bench(size, BENCH_ITERATIONS);
+	bench(65536, BENCH_ITERATIONS);
+
+	return rc;
 }
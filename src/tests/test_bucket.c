@@ -0,0 +1,226 @@
+/*
+ * Copyright CEA/DAM/DIF (2013)
+ * Contributor: Dominique Martinet <dominique.martinet@cea.fr>
+ *
+ * This file is part of the space9 9P userspace library.
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or (at
+ * your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with space9.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+/* Microbenchmark for bucket.h: compares the magazine/depot allocator with
+ * the previous mutex-protected ring, and checks no item is handed out twice.
+ *
+ * Usage: test_bucket [threads [iterations [batch]]]
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../bucket.h"
+
+/* previous implementation, kept for comparison */
+typedef struct ring {
+	size_t size;
+	size_t first;
+	size_t last;
+	size_t count;
+	size_t alloc_size;
+	pthread_mutex_t lock;
+	void * array[0];
+} ring_t;
+
+static ring_t *ring_init(size_t max, size_t alloc_size) {
+	ring_t *ring;
+	ring = calloc(1, sizeof(ring_t)+max*sizeof(void*));
+	if (ring) {
+		ring->size = max;
+		ring->alloc_size = alloc_size;
+		pthread_mutex_init(&ring->lock, NULL);
+	}
+
+	return ring;
+}
+
+static void ring_destroy(ring_t **pring) {
+	ring_t *ring = *pring;
+
+	while (ring->count > 0) {
+		free(ring->array[ring->first]);
+		ring->first++;
+		ring->count--;
+		if (ring->first == ring->size)
+			ring->first = 0;
+	}
+	pthread_mutex_destroy(&ring->lock);
+	free(ring);
+	*pring = NULL;
+}
+
+static void ring_put(ring_t *ring, void **pitem) {
+	pthread_mutex_lock(&ring->lock);
+	if (ring->count >= ring->size) {
+		free(*pitem);
+	} else {
+		ring->array[ring->last] = *pitem;
+		ring->last++;
+		ring->count++;
+		if (ring->last == ring->size)
+			ring->last = 0;
+	}
+	pthread_mutex_unlock(&ring->lock);
+	*pitem = NULL;
+}
+
+static void *ring_get(ring_t *ring) {
+	void *item;
+	pthread_mutex_lock(&ring->lock);
+	if (ring->count == 0) {
+		item = malloc(ring->alloc_size);
+	} else {
+		item = ring->array[ring->first];
+		ring->first++;
+		ring->count--;
+		if (ring->first == ring->size)
+			ring->first = 0;
+	}
+	pthread_mutex_unlock(&ring->lock);
+
+	return item;
+}
+
+#define DEFAULT_THREADS 4
+#define DEFAULT_ITERATIONS 1000000
+#define DEFAULT_BATCH 8
+#define MAX_BATCH 1024
+#define BUCKET_MAX 128
+
+struct item {
+	pthread_t owner;
+	uint64_t pad[7];
+};
+
+struct thr_arg {
+	int use_ring;
+	int iterations;
+	int batch;
+	void *cache;
+	pthread_barrier_t *barrier;
+	int errors;
+};
+
+static void *bench_thr(void *arg) {
+	struct thr_arg *thr_arg = arg;
+	struct item *items[MAX_BATCH];
+	pthread_t self = pthread_self();
+	int i, j;
+
+	pthread_barrier_wait(thr_arg->barrier);
+
+	for (i = 0; i < thr_arg->iterations; i++) {
+		for (j = 0; j < thr_arg->batch; j++) {
+			if (thr_arg->use_ring)
+				items[j] = ring_get(thr_arg->cache);
+			else
+				items[j] = bucket_get(thr_arg->cache);
+			items[j]->owner = self;
+		}
+		for (j = 0; j < thr_arg->batch; j++) {
+			if (!pthread_equal(items[j]->owner, self))
+				thr_arg->errors++;
+			if (thr_arg->use_ring)
+				ring_put(thr_arg->cache, (void **)&items[j]);
+			else
+				bucket_put(thr_arg->cache, (void **)&items[j]);
+		}
+	}
+
+	return NULL;
+}
+
+static int run(const char *name, int use_ring, int threads, int iterations, int batch) {
+	pthread_t *thrid;
+	struct thr_arg *thr_arg;
+	pthread_barrier_t barrier;
+	struct timespec start, end;
+	void *cache;
+	double elapsed;
+	int i, errors = 0;
+
+	thrid = malloc(threads * sizeof(pthread_t));
+	thr_arg = malloc(threads * sizeof(struct thr_arg));
+	if (use_ring)
+		cache = ring_init(BUCKET_MAX, sizeof(struct item));
+	else
+		cache = bucket_init(BUCKET_MAX, sizeof(struct item));
+	pthread_barrier_init(&barrier, NULL, threads + 1);
+
+	for (i = 0; i < threads; i++) {
+		thr_arg[i].use_ring = use_ring;
+		thr_arg[i].iterations = iterations;
+		thr_arg[i].batch = batch;
+		thr_arg[i].cache = cache;
+		thr_arg[i].barrier = &barrier;
+		thr_arg[i].errors = 0;
+		pthread_create(&thrid[i], NULL, bench_thr, &thr_arg[i]);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_barrier_wait(&barrier);
+	for (i = 0; i < threads; i++) {
+		pthread_join(thrid[i], NULL);
+		errors += thr_arg[i].errors;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%-8s threads: %2d, ops: %"PRIu64", %.3fs, %.1f ns/op, errors: %d\n", name, threads,
+		(uint64_t)threads * iterations * batch * 2, elapsed,
+		elapsed * 1e9 / ((double)iterations * batch * 2), errors);
+
+	if (use_ring)
+		ring_destroy((ring_t **)&cache);
+	else
+		bucket_destroy((bucket_t **)&cache);
+	pthread_barrier_destroy(&barrier);
+	free(thr_arg);
+	free(thrid);
+
+	return errors;
+}
+
+int main(int argc, char **argv) {
+	int threads, iterations, batch, errors;
+
+	threads = argc > 1 ? atoi(argv[1]) : 0;
+	iterations = argc > 2 ? atoi(argv[2]) : 0;
+	batch = argc > 3 ? atoi(argv[3]) : 0;
+
+	if (threads <= 0)
+		threads = DEFAULT_THREADS;
+	if (iterations <= 0)
+		iterations = DEFAULT_ITERATIONS;
+	if (batch <= 0 || batch > MAX_BATCH)
+		batch = DEFAULT_BATCH;
+
+	errors = run("ring", 1, threads, iterations, batch);
+	errors += run("magazine", 0, threads, iterations, batch);
+
+	return errors ? 1 : 0;
+}
@@ -33,6 +33,15 @@
 #define atomic_dec(x) __sync_fetch_and_sub(&x, 1)
 #define atomic_postdec(x) __sync_sub_and_fetch(&x, 1)
 
+/* polling loop hint */
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
 
 static inline int set_size(uint32_t *val, char *unit) {
         switch(unit[0]) {